@@ -156,29 +156,22 @@ fn librosie_src_build() -> bool {
         // rpeg runtime
         rpeg_runtime_dir.join("buf.c"),
         rpeg_runtime_dir.join("capture.c"),
+        rpeg_runtime_dir.join("captree.c"),
+        rpeg_runtime_dir.join("columns.c"),
+        rpeg_runtime_dir.join("delimited.c"),
         rpeg_runtime_dir.join("file.c"),
         rpeg_runtime_dir.join("json.c"),
         rpeg_runtime_dir.join("ktable.c"),
+        rpeg_runtime_dir.join("profile.c"),
         rpeg_runtime_dir.join("rplx.c"),
+        rpeg_runtime_dir.join("text.c"),
+        rpeg_runtime_dir.join("arena.c"),
         rpeg_runtime_dir.join("vm.c"),
 
         // librosie
         librosie_src_dir.join("librosie.c"),
     ];
 
-    //Invoke the C compiler to perform the librosie build
-    let mut cfg = cc::Build::new();
-    cfg.static_flag(true);
-    cfg.include(lua_include_dir);
-    cfg.include(rpeg_src_dir.join("include"));
-    cfg.define("LPEG_DEBUG", None); // Needed by the rpeg compiler build
-    cfg.define("NDEBUG", None); // Needed by the rpeg compiler and librosie build
-    cfg.define("LUA_COMPAT_5_2", None); // Needed by the librosie build
-    cfg.define("_GNU_SOURCE", None); // Required to access libdl on Linux and harmless on Mac
-    cfg.files(compile_src_files.iter());
-    cfg.compile("rosie");
-    println!("cargo:rerun-if-changed=src");
-    
     //rosie_home files, to copy into the build output.  Currently these are just copies of the
     //files built by the main Rosie project's Makefile.  This is ok because they all have
     //platform-independent formats.
@@ -306,6 +299,30 @@ fn librosie_src_build() -> bool {
         PathBuf::from("rpl").join("rosie").join("rpl_1_3.rpl"),
     ];
 
+    //Invoke the C compiler to perform the librosie build
+    let mut cfg = cc::Build::new();
+    cfg.static_flag(true);
+    cfg.include(lua_include_dir);
+    cfg.include(rpeg_src_dir.join("include"));
+    cfg.define("LPEG_DEBUG", None); // Needed by the rpeg compiler build
+    cfg.define("NDEBUG", None); // Needed by the rpeg compiler and librosie build
+    cfg.define("LUA_COMPAT_5_2", None); // Needed by the librosie build
+    cfg.define("_GNU_SOURCE", None); // Required to access libdl on Linux and harmless on Mac
+    cfg.files(compile_src_files.iter());
+
+    //Link the rosie_home files into librosie, so it doesn't need to read them at runtime.  See homeimage.c
+    #[cfg(feature = "embed_rosie_home")]
+    {
+        let image_src_file = out_dir.join("rosie_home_image.c");
+        write_rosie_home_image(&rosie_home_src_dir, &rosie_home_files, &image_src_file).unwrap();
+        cfg.include(&librosie_src_dir);
+        cfg.define("ROSIE_HOME_IMAGE", None);
+        cfg.file(image_src_file);
+    }
+
+    cfg.compile("rosie");
+    println!("cargo:rerun-if-changed=src");
+    
     //Copy the rosie_home files to the build artifacts output dir
     create_empty_dir(&rosie_home_dir).unwrap();
     for file in &rosie_home_files {
@@ -333,6 +350,37 @@ fn librosie_src_build() -> bool {
     true
 }
 
+//Write a C source file that defines the contents of the rosie_home files, as declared in homeimage.h
+#[cfg(feature = "embed_rosie_home")]
+fn write_rosie_home_image(rosie_home_src_dir : &Path, rosie_home_files : &[PathBuf], image_src_file : &Path) -> Result<(), std::io::Error> {
+
+    //The C code looks files up by binary search, so they must be sorted by name
+    let mut names : Vec<String> = rosie_home_files.iter()
+        .map(|file| file.components().map(|c| c.as_os_str().to_string_lossy().into_owned()).collect::<Vec<String>>().join("/"))
+        .collect();
+    names.sort();
+
+    let mut src = String::from("/* Generated by build.rs from src/rosie_home.  Do not edit. */\n\n#include \"homeimage.h\"\n\n");
+    for (i, name) in names.iter().enumerate() {
+        let data = fs::read(rosie_home_src_dir.join(name))?;
+        src.push_str(&format!("static const unsigned char file_{}[] = {{", i));
+        for (j, byte) in data.iter().enumerate() {
+            if j % 16 == 0 {
+                src.push_str("\n  ");
+            }
+            src.push_str(&format!("{},", byte));
+        }
+        src.push_str("\n};\n\n");
+    }
+    src.push_str("const rosie_home_file rosie_home_image[] = {\n");
+    for (i, name) in names.iter().enumerate() {
+        src.push_str(&format!("  {{\"{}\", file_{}, sizeof(file_{})}},\n", name, i, i));
+    }
+    src.push_str("};\n\n");
+    src.push_str(&format!("const size_t rosie_home_image_count = {};\n", names.len()));
+    fs::write(image_src_file, src)
+}
+
 fn create_empty_dir<P: AsRef<Path>>(path: P) -> Result<(), std::io::Error> {
     if path.as_ref().exists() {
         fs::remove_dir_all(&path)?;
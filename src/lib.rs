@@ -321,6 +321,144 @@ impl <'a>RawMatchResult<'a> {
     }
 }
 
+/// Match statistics accumulated by librosie for one compiled pattern, after collection was enabled with [rosie_match_stats_enable]
+/// 
+/// All times are in nanoseconds, measured with a monotonic clock.
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct RawMatchStats {
+    /// The number of match calls that found a match
+    pub matches: u64,
+    /// The number of match calls that did not find a match
+    pub failures: u64,
+    /// The number of VM instructions executed, across all match calls
+    pub insts: u64,
+    /// The number of bytes written by the output encoder, across all match calls
+    pub encoder_bytes: u64,
+    /// The total time spent matching and encoding results
+    pub total_ns: u64,
+    /// The time spent in the matching VM, excluding the time spent encoding results
+    pub match_ns: u64,
+    /// The deepest the VM's backtrack stack has been
+    pub max_backtrack: u32,
+    /// The longest the VM's capture list has been
+    pub max_caplist: u32,
+    /// The deepest captures have been nested in a match
+    pub max_capdepth: u32,
+}
+
+/// A caller-supplied destination for the output of [rosie_match2], attached to a compiled pattern with [rosie_match2_sink]
+/// 
+/// All fields are optional (null).  See librosie.h for the meaning of each.
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct RawSink {
+    /// Storage to write the output into
+    pub region: *mut u8,
+    /// The size of `region`, in bytes
+    pub size: size_t,
+    /// An allocator with the same contract as `lua_Alloc`, used to grow the buffer
+    pub alloc: Option<unsafe extern "C" fn(ud : *mut c_void, ptr : *mut c_void, osize : size_t, nsize : size_t) -> *mut c_void>,
+    /// Called with the buffered output when the buffer is full.  Returns 0 on success
+    pub flush: Option<unsafe extern "C" fn(ud : *mut c_void, data : *const u8, len : size_t) -> i32>,
+    /// Passed to `alloc` and `flush`
+    pub ud: *mut c_void,
+}
+
+/// Column numbers for [rosie_columns_get].  See librosie.h
+pub const ROSIE_COLUMN_TYPE : i32 = 0;
+pub const ROSIE_COLUMN_START : i32 = 1;
+pub const ROSIE_COLUMN_END : i32 = 2;
+pub const ROSIE_COLUMN_DEPTH : i32 = 3;
+pub const ROSIE_COLUMN_RECORD : i32 = 4;
+
+/// One capture in the tree filled in by [rosie_match2_tree].  See librosie.h
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct RawCapNode {
+    /// The index of the enclosing capture, or -1 for the outermost
+    pub parent: i32,
+    /// The index of the first sub-capture, or -1 for none
+    pub child: i32,
+    /// The index of the next capture with the same parent, or -1 for none
+    pub sibling: i32,
+    /// The capture name, as an index for [rosie_capture_name]
+    pub type_index: i32,
+    /// The value of a constant capture, as an index for [rosie_capture_name], else 0
+    pub constant: i32,
+    /// The 1-based start position in the input
+    pub start: i32,
+    /// The 1-based end position in the input
+    pub end: i32,
+    /// The index of the pattern set member whose match this is, else 0.  See [rosie_compile_set]
+    pub member: i32,
+}
+
+/// An opaque capture tree, filled in by [rosie_match2_tree]
+#[repr(C)]
+pub struct RawCapTree {
+    _private: [u8; 0],
+}
+
+/// An opaque set of columns, filled in by [rosie_match2_columns]
+#[repr(C)]
+pub struct RawColumns {
+    _private: [u8; 0],
+}
+
+/// Row styles for [rosie_delimited_new].  See librosie.h
+pub const ROSIE_DELIMITED_TSV : i32 = 0;
+pub const ROSIE_DELIMITED_CSV : i32 = 1;
+
+/// An opaque row layout for [rosie_match2_delimited], made by [rosie_delimited_new]
+#[repr(C)]
+pub struct RawDelimited {
+    _private: [u8; 0],
+}
+
+/// An opaque arena for the transient memory of matches, made by [rosie_arena_new] and attached to a compiled pattern with [rosie_match2_arena]
+#[repr(C)]
+pub struct RawArena {
+    _private: [u8; 0],
+}
+
+/// An opaque pool of per-thread engines, made by [rosie_pool_new]
+#[repr(C)]
+pub struct RawPool {
+    _private: [u8; 0],
+}
+
+/// Severities of a [RawDiagnostic].  See librosie.h
+pub const ROSIE_DIAG_ERROR : i32 = 0;
+pub const ROSIE_DIAG_WARNING : i32 = 1;
+pub const ROSIE_DIAG_INFO : i32 = 2;
+
+/// One error or warning from the compiler, returned by [rosie_diagnostics_get]
+#[derive(Debug)]
+#[repr(C)]
+pub struct RawDiagnostic<'a> {
+    pub severity: i32,
+    pub who: RosieString<'a>,
+    pub message: RosieString<'a>,
+    pub start: i32,
+    pub end: i32,
+}
+
+/// Opaque compile diagnostics, made by [rosie_compile_diag]
+#[repr(C)]
+pub struct RawDiagnostics {
+    _private: [u8; 0],
+}
+
+/// Flags for [rosie_engine_alloc].  See librosie.h
+pub const ROSIE_ALLOC_POOL : i32 = 1;
+pub const ROSIE_ALLOC_HUGEPAGES : i32 = 2;
+
+/// Modes for [rosie_gc_config].  See librosie.h
+pub const ROSIE_GC_FULL : i32 = 0;
+pub const ROSIE_GC_INCREMENTAL : i32 = 1;
+pub const ROSIE_GC_MANUAL : i32 = 2;
+
 /// Returns the path to a rosie_home dir, that is valid at the time the rosie-sys crate is built
 /// 
 /// The purpose of this function is so that a high-level rosie crate can operate without needing to be configured on
@@ -350,6 +488,7 @@ extern "C" {
     /// 
     pub fn rosie_home_init(home : *const RosieString, messages : *mut RosieString); // void rosie_home_init(str *runtime, str *messages);
     pub fn rosie_new(messages : *mut RosieString) -> EnginePtr; // Engine *rosie_new(str *messages);
+    pub fn rosie_clone(e : EnginePtr, messages : *mut RosieString) -> EnginePtr; // Engine *rosie_clone(Engine *e, str *messages);
     pub fn rosie_finalize(e : EnginePtr); // void rosie_finalize(Engine *e);
     pub fn rosie_libpath(e : EnginePtr, newpath : *mut RosieString) -> i32;// int rosie_libpath(Engine *e, str *newpath);
     pub fn rosie_alloc_limit(e : EnginePtr, newlimit : *mut i32, usage : *mut i32) -> i32;// int rosie_alloc_limit(Engine *e, int *newlimit, int *usage);
@@ -358,11 +497,56 @@ extern "C" {
     pub fn rosie_free_rplx(e : EnginePtr, pat : i32) -> i32; // int rosie_free_rplx(Engine *e, int pat);
     pub fn rosie_match(e : EnginePtr, pat : i32, start : i32, encoder : *const u8, input : *const RosieString, match_result : *mut RawMatchResult) -> i32; // int rosie_match(Engine *e, int pat, int start, char *encoder, str *input, match *match);
     pub fn rosie_match2(e : EnginePtr, pat : i32, encoder_name : *const u8, input : *const RosieString, startpos : u32, endpos : u32, match_result : *mut RawMatchResult, collect_times : u8) -> i32; //int rosie_match2(Engine *e, uint32_t pat, char *encoder_name, str *input, uint32_t startpos, uint32_t endpos, struct rosie_matchresult *match, uint8_t collect_times);
+    pub fn rosie_match_stats_enable(e : EnginePtr, pat : u32, enable : i32) -> i32; //int rosie_match_stats_enable(Engine *e, uint32_t pat, int enable);
+    pub fn rosie_match_stats(e : EnginePtr, pat : u32, stats : *mut RawMatchStats, reset : i32) -> i32; //int rosie_match_stats(Engine *e, uint32_t pat, struct rosie_matchstats *stats, int reset);
+    pub fn rosie_match_profile_enable(e : EnginePtr, pat : u32, enable : i32) -> i32; //int rosie_match_profile_enable(Engine *e, uint32_t pat, int enable);
+    pub fn rosie_match_profile(e : EnginePtr, pat : u32, report : *mut RosieString, reset : i32) -> i32; //int rosie_match_profile(Engine *e, uint32_t pat, str *report, int reset);
+    pub fn rosie_match2_all(e : EnginePtr, pat : u32, encoder_name : *const u8, input : *const RosieString, startpos : u32, endpos : u32, count : *mut u32, match_result : *mut RawMatchResult) -> i32; //int rosie_match2_all(Engine *e, uint32_t pat, char *encoder_name, str *input, uint32_t startpos, uint32_t endpos, uint32_t *count, struct rosie_matchresult *match);
+    pub fn rosie_match2_sink(e : EnginePtr, pat : u32, sink : *const RawSink) -> i32; //int rosie_match2_sink(Engine *e, uint32_t pat, struct rosie_sink *sink);
+    pub fn rosie_match2_flush(e : EnginePtr, pat : u32) -> i32; //int rosie_match2_flush(Engine *e, uint32_t pat);
+    pub fn rosie_columns_new() -> *mut RawColumns; //struct rosie_columns *rosie_columns_new(void);
+    pub fn rosie_columns_reset(cols : *mut RawColumns); //void rosie_columns_reset(struct rosie_columns *cols);
+    pub fn rosie_columns_free(cols : *mut RawColumns); //void rosie_columns_free(struct rosie_columns *cols);
+    pub fn rosie_columns_get(cols : *mut RawColumns, column : i32, data : *mut *const i32) -> u32; //uint32_t rosie_columns_get(struct rosie_columns *cols, int column, const int32_t **data);
+    pub fn rosie_match2_columns(e : EnginePtr, pat : u32, input : *const RosieString, startpos : u32, endpos : u32, record : i32, cols : *mut RawColumns, match_result : *mut RawMatchResult) -> i32; //int rosie_match2_columns(Engine *e, uint32_t pat, str *input, uint32_t startpos, uint32_t endpos, int32_t record, struct rosie_columns *cols, struct rosie_matchresult *match);
+    pub fn rosie_captree_new() -> *mut RawCapTree; //struct rosie_captree *rosie_captree_new(void);
+    pub fn rosie_captree_free(tree : *mut RawCapTree); //void rosie_captree_free(struct rosie_captree *tree);
+    pub fn rosie_captree_nodes(tree : *mut RawCapTree, nodes : *mut *const RawCapNode) -> u32; //uint32_t rosie_captree_nodes(struct rosie_captree *tree, const struct rosie_capnode **nodes);
+    pub fn rosie_match2_tree(e : EnginePtr, pat : u32, input : *const RosieString, startpos : u32, endpos : u32, tree : *mut RawCapTree, match_result : *mut RawMatchResult) -> i32; //int rosie_match2_tree(Engine *e, uint32_t pat, str *input, uint32_t startpos, uint32_t endpos, struct rosie_captree *tree, struct rosie_matchresult *match);
+    pub fn rosie_delimited_new(e : EnginePtr, pat : u32, style : i32, names : *const RosieString, nnames : i32, delimited : *mut *mut RawDelimited) -> i32; //int rosie_delimited_new(Engine *e, uint32_t pat, int style, str *names, int nnames, struct rosie_delimited **delimited);
+    pub fn rosie_delimited_free(delimited : *mut RawDelimited); //void rosie_delimited_free(struct rosie_delimited *delimited);
+    pub fn rosie_match2_delimited(e : EnginePtr, pat : u32, input : *const RosieString, startpos : u32, endpos : u32, delimited : *mut RawDelimited, match_result : *mut RawMatchResult) -> i32; //int rosie_match2_delimited(Engine *e, uint32_t pat, str *input, uint32_t startpos, uint32_t endpos, struct rosie_delimited *delimited, struct rosie_matchresult *match);
+    pub fn rosie_capture_name(e : EnginePtr, pat : u32, index : i32, name : *mut RosieString) -> i32; //int rosie_capture_name(Engine *e, uint32_t pat, int32_t index, str *name);
+    pub fn rosie_sink_fd(ud : *mut c_void, data : *const u8, len : size_t) -> i32; //int rosie_sink_fd(void *ud, const char *data, size_t len);
+    pub fn rosie_arena_new(blocksize : size_t) -> *mut RawArena; //struct rosie_arena *rosie_arena_new(size_t blocksize);
+    pub fn rosie_arena_reset(arena : *mut RawArena); //void rosie_arena_reset(struct rosie_arena *arena);
+    pub fn rosie_arena_free(arena : *mut RawArena); //void rosie_arena_free(struct rosie_arena *arena);
+    pub fn rosie_arena_alloc(ud : *mut c_void, ptr : *mut c_void, osize : size_t, nsize : size_t) -> *mut c_void; //void *rosie_arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+    pub fn rosie_match2_arena(e : EnginePtr, pat : u32, arena : *mut RawArena) -> i32; //int rosie_match2_arena(Engine *e, uint32_t pat, struct rosie_arena *arena);
+    pub fn rosie_pool_new(e : EnginePtr, messages : *mut RosieString) -> *mut RawPool; //struct rosie_pool *rosie_pool_new(Engine *e, str *messages);
+    pub fn rosie_pool_free(pool : *mut RawPool); //void rosie_pool_free(struct rosie_pool *pool);
+    pub fn rosie_pool_engine(pool : *mut RawPool, messages : *mut RosieString) -> EnginePtr; //Engine *rosie_pool_engine(struct rosie_pool *pool, str *messages);
+    pub fn rosie_pool_compile(pool : *mut RawPool, expression : *const RosieString, pat : *mut i32, messages : *mut RosieString) -> i32; //int rosie_pool_compile(struct rosie_pool *pool, str *expression, int *pat, str *messages);
+    pub fn rosie_pool_pattern(pool : *mut RawPool, pat : i32, e : *mut EnginePtr, epat : *mut i32) -> i32; //int rosie_pool_pattern(struct rosie_pool *pool, int pat, Engine **e, int *epat);
+    pub fn rosie_pool_match2(pool : *mut RawPool, pat : u32, encoder_name : *const u8, input : *const RosieString, startpos : u32, endpos : u32, match_result : *mut RawMatchResult, collect_times : u8) -> i32; //int rosie_pool_match2(struct rosie_pool *pool, uint32_t pat, char *encoder_name, str *input, uint32_t startpos, uint32_t endpos, struct rosie_matchresult *match, uint8_t collect_times);
     //pub fn rosie_matchfile(e : EnginePtr, pat : i32, encoder : *const u8, wholefileflag : i32, infilename : *const u8, outfilename : *const u8, errfilename : *const u8, cin : *mut i32, cout : *mut i32, cerr : *mut i32, err : *mut RosieString); // int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag, char *infilename, char *outfilename, char *errfilename, int *cin, int *cout, int *cerr, str *err);
     pub fn rosie_trace(e : EnginePtr, pat : i32, start : i32, trace_style : *const u8, input : *const RosieString, matched : &mut i32, trace : *mut RosieString) -> i32; // int rosie_trace(Engine *e, int pat, int start, char *trace_style, str *input, int *matched, str *trace);
     pub fn rosie_load(e : EnginePtr, ok : *mut i32, rpl_text : *const RosieString, pkgname : *mut RosieString, messages : *mut RosieString) -> i32; // int rosie_load(Engine *e, int *ok, str *src, str *pkgname, str *messages);
     pub fn rosie_loadfile(e : EnginePtr, ok : *mut i32, file_name : *const RosieString, pkgname : *mut RosieString, messages : *mut RosieString) -> i32; // int rosie_loadfile(Engine *e, int *ok, str *fn, str *pkgname, str *messages);
     pub fn rosie_import(e : EnginePtr, ok : *mut i32, pkgname : *const RosieString, as_name : *const RosieString, actual_pkgname : *mut RosieString, messages : *mut RosieString) -> i32; // int rosie_import(Engine *e, int *ok, str *pkgname, str *as, str *actual_pkgname, str *messages);
+    pub fn rosie_import_lazy(e : EnginePtr, pkgname : *const RosieString, as_name : *const RosieString) -> i32; // int rosie_import_lazy(Engine *e, str *pkgname, str *as);
+    pub fn rosie_save_rplx(e : EnginePtr, pat : u32, filename : *const u8) -> i32; // int rosie_save_rplx(Engine *e, uint32_t pat, const char *filename);
+    pub fn rosie_load_rplx(e : EnginePtr, filename : *const u8, pat : *mut i32, msgs : *mut RosieString) -> i32; // int rosie_load_rplx(Engine *e, const char *filename, int *pat, str *messages);
+    pub fn rosie_compile_diag(e : EnginePtr, expression : *const RosieString, pat : *mut i32, diags : *mut *mut RawDiagnostics) -> i32; // int rosie_compile_diag(Engine *e, str *expression, int *pat, struct rosie_diagnostics **diags);
+    pub fn rosie_diagnostics_count(diags : *mut RawDiagnostics) -> i32; // int rosie_diagnostics_count(struct rosie_diagnostics *diags);
+    pub fn rosie_diagnostics_get(diags : *mut RawDiagnostics, i : i32) -> *const RawDiagnostic<'static>; // const struct rosie_diagnostic *rosie_diagnostics_get(struct rosie_diagnostics *diags, int i);
+    pub fn rosie_diagnostics_json(diags : *mut RawDiagnostics, json : *mut RosieString) -> i32; // int rosie_diagnostics_json(struct rosie_diagnostics *diags, str *json);
+    pub fn rosie_diagnostics_free(diags : *mut RawDiagnostics); // void rosie_diagnostics_free(struct rosie_diagnostics *diags);
+    pub fn rosie_compile_set(e : EnginePtr, expressions : *const RosieString, n : i32, pat : *mut i32, msgs : *mut RosieString) -> i32; // int rosie_compile_set(Engine *e, str *expressions, int n, int *pat, str *messages);
+    pub fn rosie_match2_set(e : EnginePtr, pat : u32, input : *const RosieString, startpos : u32, endpos : u32, tree : *mut RawCapTree, members : *mut i32, size : i32, count : *mut i32, match_result : *mut RawMatchResult) -> i32; // int rosie_match2_set(Engine *e, uint32_t pat, str *input, uint32_t startpos, uint32_t endpos, struct rosie_captree *tree, int32_t *members, int size, int *count, struct rosie_matchresult *match);
+    pub fn rosie_engine_alloc(flags : i32); // void rosie_engine_alloc(int flags);
+    pub fn rosie_gc_config(e : EnginePtr, mode : i32, pause : i32, stepmul : i32) -> i32; // int rosie_gc_config(Engine *e, int mode, int pause, int stepmul);
+    pub fn rosie_gc_step(e : EnginePtr, kbytes : i32, done : *mut i32, usage : *mut i32) -> i32; // int rosie_gc_step(Engine *e, int kbytes, int *done, int *usage);
     // int rosie_read_rcfile(Engine *e, str *filename, int *file_exists, str *options, str *messages);
     // int rosie_execute_rcfile(Engine *e, str *filename, int *file_exists, int *no_errors, str *messages);
 
@@ -470,3 +654,1117 @@ fn librosie() {
     //Clean up the engine with rosie_finalize
     unsafe{ rosie_finalize(engine); }
 }
+
+#[cfg(test)]
+/// Creates an engine for a test, with the Rosie home directory set if we have the rosie_home_default()
+fn test_engine() -> EnginePtr {
+    let mut message_buf = RosieString::empty();
+    if let Some(rosie_home_dir) = rosie_home_default() {
+        unsafe{ rosie_home_init(&RosieString::from_bytes(&rosie_home_dir), &mut message_buf) };
+    }
+    message_buf.manual_drop();
+
+    let mut message_buf = RosieString::empty();
+    let engine = unsafe { rosie_new(&mut message_buf) };
+    message_buf.manual_drop();
+    assert!(!engine.e.is_null());
+    engine
+}
+
+#[cfg(test)]
+/// Loads rpl source into an engine, and asserts that it loaded
+fn test_load(engine : EnginePtr, rpl : &str) {
+    let mut ok : i32 = 0;
+    let mut pkgname = RosieString::empty();
+    let mut message_buf = RosieString::empty();
+    let result_code = unsafe { rosie_load(engine, &mut ok, &RosieString::from_str(rpl), &mut pkgname, &mut message_buf) };
+    assert_eq!(result_code, 0);
+    assert_eq!(ok, 1, "{}", message_buf.as_str());
+    pkgname.manual_drop();
+    message_buf.manual_drop();
+}
+
+#[cfg(test)]
+/// Compiles an expression, and asserts that it compiled
+fn test_compile(engine : EnginePtr, expression : &str) -> i32 {
+    let mut pat_idx : i32 = 0;
+    let mut message_buf = RosieString::empty();
+    let result_code = unsafe { rosie_compile(engine, &RosieString::from_str(expression), &mut pat_idx, &mut message_buf) };
+    assert_eq!(result_code, 0);
+    assert!(pat_idx > 0, "{}", message_buf.as_str());
+    message_buf.manual_drop();
+    pat_idx
+}
+
+#[cfg(test)]
+/// Matches a whole input with the status encoder
+fn test_matches(engine : EnginePtr, pat_idx : i32, input : &str) -> bool {
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, MatchEncoder::Status.as_bytes().as_ptr(), &RosieString::from_str(input), 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    raw_match_result.did_match() && raw_match_result.leftover == 0
+}
+
+#[test]
+/// Pins down which capture a backreference refers to.  See "Backreferences" in rpeg/runtime/vm.c
+fn backrefs() {
+
+    let engine = test_engine();
+
+    //A backreference matches the text of the prior capture
+    test_load(engine, "word = [a-z]+");
+    let pat_idx = test_compile(engine, "{word \" \" backref:word}");
+    assert_eq!(test_matches(engine, pat_idx, "abc abc"), true);
+    assert_eq!(test_matches(engine, pat_idx, "abc abd"), false);
+    assert_eq!(test_matches(engine, pat_idx, "abc ab"), false);
+
+    //The latest capture with the name, when there are several
+    let pat_idx = test_compile(engine, "{word {\" \" word}* \":\" backref:word}");
+    assert_eq!(test_matches(engine, pat_idx, "abc def:def"), true);
+    assert_eq!(test_matches(engine, pat_idx, "abc def:abc"), false);
+
+    //Many backreferences in one match, as measured by rosiebench -b
+    let pat_idx = test_compile(engine, "{word {\" \" backref:word}*}");
+    let input = vec!["abc"; 20001].join(" ");
+    assert_eq!(test_matches(engine, pat_idx, input.as_str()), true);
+    let input = format!("{} abd", input);
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, MatchEncoder::Status.as_bytes().as_ptr(), &RosieString::from_str(input.as_str()), 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.leftover, 4);
+
+    //In a recursive pattern, the reference is to the capture in its own instance, and not to one
+    // in a nested instance (which is inside a nested capture with the name of the outer one), or
+    // in a closed sibling instance
+    test_load(engine, "grammar
+                         tag = [a-z]+
+                       in
+                         element = { \"<\" tag \">\" element* \"</\" backref:tag \">\" }
+                       end");
+    let pat_idx = test_compile(engine, "element");
+    assert_eq!(test_matches(engine, pat_idx, "<a></a>"), true);
+    assert_eq!(test_matches(engine, pat_idx, "<a></b>"), false);
+    assert_eq!(test_matches(engine, pat_idx, "<a><b></b></a>"), true);
+    assert_eq!(test_matches(engine, pat_idx, "<a><b></b></b>"), false);
+    assert_eq!(test_matches(engine, pat_idx, "<a><b></a></b>"), false);
+    assert_eq!(test_matches(engine, pat_idx, "<a><b></b><c></c></a>"), true);
+    assert_eq!(test_matches(engine, pat_idx, "<a><b></b><c></c></c>"), false);
+    assert_eq!(test_matches(engine, pat_idx, "<a><b><c></c></b><d></d></a>"), true);
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests the per-pattern match statistics
+fn match_stats() {
+
+    let engine = test_engine();
+    let pat_idx = test_compile(engine, "{[a-z]+ \" \" [0-9]+}");
+    let mut stats = RawMatchStats::default();
+
+    //Collection is off until it is enabled
+    let result_code = unsafe { rosie_match_stats(engine, pat_idx as u32, &mut stats, 0) };
+    assert!(result_code != 0);
+    assert_eq!(unsafe { rosie_match_stats_enable(engine, pat_idx as u32, 1) }, 0);
+
+    //One match and one failure
+    assert_eq!(test_matches(engine, pat_idx, "abc 123"), true);
+    assert_eq!(test_matches(engine, pat_idx, "abc def"), false);
+    let result_code = unsafe { rosie_match_stats(engine, pat_idx as u32, &mut stats, 1) };
+    assert_eq!(result_code, 0);
+    assert_eq!(stats.matches, 1);
+    assert_eq!(stats.failures, 1);
+    assert!(stats.insts > 0);
+    assert!(stats.match_ns <= stats.total_ns);
+    assert!(stats.max_caplist > 0);
+
+    //Reset zeroes the counters
+    let result_code = unsafe { rosie_match_stats(engine, pat_idx as u32, &mut stats, 0) };
+    assert_eq!(result_code, 0);
+    assert_eq!(stats.matches, 0);
+    assert_eq!(stats.failures, 0);
+    assert_eq!(stats.insts, 0);
+
+    //Disabling discards them
+    assert_eq!(unsafe { rosie_match_stats_enable(engine, pat_idx as u32, 0) }, 0);
+    let result_code = unsafe { rosie_match_stats(engine, pat_idx as u32, &mut stats, 0) };
+    assert!(result_code != 0);
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests the per-instruction profiler and its report by capture name
+fn match_profile() {
+
+    let engine = test_engine();
+    test_load(engine, "word = [a-z]+");
+    let pat_idx = test_compile(engine, "{word \" \" word}");
+    let mut report = RosieString::empty();
+
+    //Profiling is off until it is enabled
+    let result_code = unsafe { rosie_match_profile(engine, pat_idx as u32, &mut report, 0) };
+    assert!(result_code != 0);
+    assert_eq!(unsafe { rosie_match_profile_enable(engine, pat_idx as u32, 1) }, 0);
+
+    assert_eq!(test_matches(engine, pat_idx, "abc def"), true);
+    let result_code = unsafe { rosie_match_profile(engine, pat_idx as u32, &mut report, 1) };
+    assert_eq!(result_code, 0);
+    assert!(report.as_str().contains("# flat profile by capture (self)"));
+    assert!(report.as_str().contains("# instructions"));
+    assert!(report.as_str().contains("word"));
+    report.manual_drop();
+
+    assert_eq!(unsafe { rosie_match_profile_enable(engine, pat_idx as u32, 0) }, 0);
+    let mut report = RosieString::empty();
+    let result_code = unsafe { rosie_match_profile(engine, pat_idx as u32, &mut report, 0) };
+    assert!(result_code != 0);
+    assert_eq!(report.is_valid(), false);
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests that the necessary literal prefilter rejects only input that cannot match
+fn necessary_literals() {
+
+    let engine = test_engine();
+
+    //A literal in a sequence
+    let pat_idx = test_compile(engine, "{[a-z]+ \"HTTP/\" [0-9]}");
+    assert_eq!(test_matches(engine, pat_idx, "abcHTTP/1"), true);
+    assert_eq!(test_matches(engine, pat_idx, "abcHTTX/1"), false);
+
+    //Only the input from startpos is searched for the literal
+    let input = "HTTP/ abc";
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, MatchEncoder::Status.as_bytes().as_ptr(), &RosieString::from_str(input), 2, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.did_match(), false);
+
+    //A literal after a search loop
+    let pat_idx = test_compile(engine, "find:\"ERROR\"");
+    assert_eq!(test_matches(engine, pat_idx, "at 12:00 ERROR"), true);
+    assert_eq!(test_matches(engine, pat_idx, "at 12:00 ERRO"), false);
+
+    //Literals in choices, negations and case-insensitive strings are not necessary
+    let pat_idx = test_compile(engine, "{\"GET\" / \"PUT\"}");
+    assert_eq!(test_matches(engine, pat_idx, "PUT"), true);
+    let pat_idx = test_compile(engine, "{!\"x\" [a-z]+}");
+    assert_eq!(test_matches(engine, pat_idx, "abc"), true);
+    let pat_idx = test_compile(engine, "ci:\"error\"");
+    assert_eq!(test_matches(engine, pat_idx, "ERROR"), true);
+
+    //A literal in a positive predicate is necessary
+    let pat_idx = test_compile(engine, "{>\"ab\" [a-z]+}");
+    assert_eq!(test_matches(engine, pat_idx, "abc"), true);
+    assert_eq!(test_matches(engine, pat_idx, "acb"), false);
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[cfg(test)]
+/// Matches an input with the status encoder, and returns the leftover if it matched
+fn test_leftover(engine : EnginePtr, pat_idx : i32, input : &str) -> Option<i32> {
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, MatchEncoder::Status.as_bytes().as_ptr(), &RosieString::from_str(input), 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    if raw_match_result.did_match() { Some(raw_match_result.leftover) } else { None }
+}
+
+#[test]
+/// Tests that a multi-way choice keeps the semantics of ordered choice when it is coded as a first-byte dispatch
+fn choice_dispatch() {
+
+    let engine = test_engine();
+
+    //Alternatives with disjoint first bytes
+    let pat_idx = test_compile(engine, "{\"apple\" / \"banana\" / \"cherry\" / [0-9]+ / \"elder\"}");
+    assert_eq!(test_leftover(engine, pat_idx, "apple"), Some(0));
+    assert_eq!(test_leftover(engine, pat_idx, "banana"), Some(0));
+    assert_eq!(test_leftover(engine, pat_idx, "cherry"), Some(0));
+    assert_eq!(test_leftover(engine, pat_idx, "2021"), Some(0));
+    assert_eq!(test_leftover(engine, pat_idx, "elder"), Some(0));
+    assert_eq!(test_leftover(engine, pat_idx, "bandana"), None);
+    assert_eq!(test_leftover(engine, pat_idx, "fig"), None);
+    assert_eq!(test_leftover(engine, pat_idx, ""), None);
+
+    //Alternatives that share first bytes are still tried in order
+    let pat_idx = test_compile(engine, "{\"ax\" / \"b\" / \"c\" / \"a\" / \"abc\"}");
+    assert_eq!(test_leftover(engine, pat_idx, "ax"), Some(0));
+    assert_eq!(test_leftover(engine, pat_idx, "a"), Some(0));
+    assert_eq!(test_leftover(engine, pat_idx, "abc"), Some(2));
+    assert_eq!(test_leftover(engine, pat_idx, "c"), Some(0));
+
+    //An alternative that can match the empty string
+    let pat_idx = test_compile(engine, "{\"a\" / \"b\" / \"c\"?}");
+    assert_eq!(test_leftover(engine, pat_idx, "b"), Some(0));
+    assert_eq!(test_leftover(engine, pat_idx, "z"), Some(1));
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[cfg(test)]
+/// A flush function for [RawSink] that appends the output to the `Vec<u8>` that `ud` points to
+unsafe extern "C" fn test_collect(ud : *mut c_void, data : *const u8, len : size_t) -> i32 {
+    let collected = &mut *(ud as *mut Vec<u8>);
+    collected.extend_from_slice(slice::from_raw_parts(data, len));
+    0
+}
+
+#[test]
+/// Tests caller-supplied output sinks for rosie_match2
+fn match_sinks() {
+
+    let engine = test_engine();
+    let pat_idx = test_compile(engine, "{[a-z]+}");
+    let input = RosieString::from_str("abcdef");
+    let encoder = "line\0".as_ptr();
+
+    //The default output buffer
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, encoder, &input, 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    let expected = raw_match_result.as_bytes().to_vec();
+    assert!(expected.len() > 0);
+
+    //Output written into a caller's region
+    let mut region = [0u8; 64];
+    let sink = RawSink { region: region.as_mut_ptr(), size: region.len(), alloc: None, flush: None, ud: ptr::null_mut() };
+    assert_eq!(unsafe { rosie_match2_sink(engine, pat_idx as u32, &sink) }, 0);
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, encoder, &input, 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.as_bytes().as_ptr(), region.as_ptr());
+    assert_eq!(raw_match_result.as_bytes(), expected.as_slice());
+
+    //A region that is too small, with no way to grow or flush it
+    let mut small_region = [0u8; 2];
+    let sink = RawSink { region: small_region.as_mut_ptr(), size: small_region.len(), alloc: None, flush: None, ud: ptr::null_mut() };
+    assert_eq!(unsafe { rosie_match2_sink(engine, pat_idx as u32, &sink) }, 0);
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, encoder, &input, 1, 0, &mut raw_match_result, 0) };
+    assert!(result_code != 0);
+
+    //With a flush function, the output of successive matches accumulates, and reaches it in order
+    let mut collected : Vec<u8> = Vec::new();
+    let mut region = [0u8; 16];
+    let sink = RawSink { region: region.as_mut_ptr(), size: region.len(), alloc: None, flush: Some(test_collect), ud: &mut collected as *mut Vec<u8> as *mut c_void };
+    assert_eq!(unsafe { rosie_match2_sink(engine, pat_idx as u32, &sink) }, 0);
+    for _ in 0..10 {
+        let mut raw_match_result = RawMatchResult::empty();
+        let result_code = unsafe { rosie_match2(engine, pat_idx, encoder, &input, 1, 0, &mut raw_match_result, 0) };
+        assert_eq!(result_code, 0);
+    }
+    assert_eq!(unsafe { rosie_match2_flush(engine, pat_idx as u32) }, 0);
+    assert_eq!(collected, expected.repeat(10));
+
+    //A Lua encoder cannot write to a sink that flushes
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, MatchEncoder::JSONPretty.as_bytes().as_ptr(), &input, 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.data().is_valid(), false);
+    assert_eq!(raw_match_result.data().len(), 8); //ERR_SINK_ENCODER
+
+    //Restoring the default sink
+    assert_eq!(unsafe { rosie_match2_sink(engine, pat_idx as u32, ptr::null()) }, 0);
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, encoder, &input, 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.as_bytes(), expected.as_slice());
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[cfg(test)]
+/// Returns the capture name for a type index of a compiled pattern
+fn test_capture_name(engine : EnginePtr, pat_idx : i32, index : i32) -> String {
+    let mut name = RosieString::empty();
+    let result_code = unsafe { rosie_capture_name(engine, pat_idx as u32, index, &mut name) };
+    assert_eq!(result_code, 0);
+    String::from(name.as_str())
+}
+
+#[test]
+/// Tests the columnar capture encoder
+fn match_columns() {
+
+    let engine = test_engine();
+    test_load(engine, "word = [a-z]+\nnum = [0-9]+");
+    let pat_idx = test_compile(engine, "{word \" \" num}");
+    let cols = unsafe { rosie_columns_new() };
+    assert!(!cols.is_null());
+
+    let column = |id : i32| -> Vec<i32> {
+        let mut data : *const i32 = ptr::null();
+        let n = unsafe { rosie_columns_get(cols, id, &mut data) };
+        if n == 0 { return Vec::new(); }
+        unsafe { slice::from_raw_parts(data, n as usize) }.to_vec()
+    };
+
+    //One row per capture, in pre-order
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2_columns(engine, pat_idx as u32, &RosieString::from_str("abc 12"), 1, 0, 7, cols, &mut raw_match_result) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.did_match(), true);
+    assert_eq!(column(ROSIE_COLUMN_START), vec![1, 1, 5]);
+    assert_eq!(column(ROSIE_COLUMN_END), vec![7, 4, 7]);
+    assert_eq!(column(ROSIE_COLUMN_DEPTH), vec![0, 1, 1]);
+    assert_eq!(column(ROSIE_COLUMN_RECORD), vec![7, 7, 7]);
+    let types = column(ROSIE_COLUMN_TYPE);
+    assert_eq!(test_capture_name(engine, pat_idx, types[1]), "word");
+    assert_eq!(test_capture_name(engine, pat_idx, types[2]), "num");
+
+    //A failed match adds no rows, and rows accumulate until a reset
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2_columns(engine, pat_idx as u32, &RosieString::from_str("abc xy"), 1, 0, 8, cols, &mut raw_match_result) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.did_match(), false);
+    assert_eq!(column(ROSIE_COLUMN_RECORD), vec![7, 7, 7]);
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2_columns(engine, pat_idx as u32, &RosieString::from_str("xy 3"), 1, 0, 9, cols, &mut raw_match_result) };
+    assert_eq!(result_code, 0);
+    assert_eq!(column(ROSIE_COLUMN_RECORD), vec![7, 7, 7, 9, 9, 9]);
+    assert_eq!(column(ROSIE_COLUMN_END), vec![7, 4, 7, 5, 3, 5]);
+
+    unsafe { rosie_columns_reset(cols) };
+    assert_eq!(column(ROSIE_COLUMN_START), Vec::<i32>::new());
+
+    unsafe { rosie_columns_free(cols) };
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests the capture tree of a match
+fn match_captree() {
+
+    let engine = test_engine();
+    test_load(engine, "word = [a-z]+\nnum = [0-9]+");
+    let pat_idx = test_compile(engine, "{word \" \" {num \",\"}+}");
+    let tree = unsafe { rosie_captree_new() };
+    assert!(!tree.is_null());
+
+    let nodes = || -> Vec<RawCapNode> {
+        let mut nodes : *const RawCapNode = ptr::null();
+        let n = unsafe { rosie_captree_nodes(tree, &mut nodes) };
+        if n == 0 { return Vec::new(); }
+        unsafe { slice::from_raw_parts(nodes, n as usize) }.to_vec()
+    };
+
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2_tree(engine, pat_idx as u32, &RosieString::from_str("abc 1,23,"), 1, 0, tree, &mut raw_match_result) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.did_match(), true);
+    let n = nodes();
+    assert_eq!(n.len(), 4);
+    assert_eq!((n[0].parent, n[0].child, n[0].sibling, n[0].start, n[0].end), (-1, 1, -1, 1, 10));
+    assert_eq!((n[1].parent, n[1].child, n[1].sibling, n[1].start, n[1].end), (0, -1, 2, 1, 4));
+    assert_eq!((n[2].parent, n[2].child, n[2].sibling, n[2].start, n[2].end), (0, -1, 3, 5, 6));
+    assert_eq!((n[3].parent, n[3].child, n[3].sibling, n[3].start, n[3].end), (0, -1, -1, 7, 9));
+    assert_eq!(test_capture_name(engine, pat_idx, n[1].type_index), "word");
+    assert_eq!(test_capture_name(engine, pat_idx, n[2].type_index), "num");
+    assert_eq!(n[2].type_index, n[3].type_index);
+    assert_eq!(n[1].constant, 0);
+
+    //A failed match empties the tree
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2_tree(engine, pat_idx as u32, &RosieString::from_str("abc def"), 1, 0, tree, &mut raw_match_result) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.did_match(), false);
+    assert_eq!(nodes().len(), 0);
+
+    unsafe { rosie_captree_free(tree) };
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[cfg(test)]
+/// Matches an input with the json encoder, and returns the output
+fn test_json(engine : EnginePtr, pat_idx : i32, input : &str) -> String {
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, MatchEncoder::JSON.as_bytes().as_ptr(), &RosieString::from_str(input), 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    String::from(raw_match_result.as_str())
+}
+
+#[test]
+/// Tests the capture names and escaping in json output, which come from the ktable and its json cache
+fn json_names() {
+
+    let engine = test_engine();
+
+    //Many capture names, each of which must be found in the ktable
+    let rpl : Vec<String> = (1..=40).map(|i| format!("w{} = \"{}\"", i, (b'a' + (i % 26) as u8) as char)).collect();
+    test_load(engine, rpl.join("\n").as_str());
+    let expression : Vec<String> = (1..=40).map(|i| format!("w{}", i)).collect();
+    let pat_idx = test_compile(engine, format!("{{{}}}", expression.join(" ")).as_str());
+    let input : String = (1..=40).map(|i| (b'a' + (i % 26) as u8) as char).collect();
+    let json = test_json(engine, pat_idx, input.as_str());
+    for i in 1..=40 {
+        let sub = format!("{{\"type\":\"w{}\",\"s\":{},\"e\":{},\"data\":\"{}\"}}", i, i, i + 1, (b'a' + (i % 26) as u8) as char);
+        assert!(json.contains(sub.as_str()), "{} not in {}", sub, json);
+    }
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests that constant capture values are escaped in json output, like matched text
+fn json_escapes() {
+
+    let engine = test_engine();
+
+    //Matched text
+    test_load(engine, "quoted = {[\"] [a-z]+ [\"]}");
+    let pat_idx = test_compile(engine, "{quoted}");
+    let json = test_json(engine, pat_idx, "\"abc\"");
+    assert!(json.contains("{\"type\":\"quoted\",\"s\":1,\"e\":6,\"data\":\"\\\"abc\\\"\"}"), "{}", json);
+    let pat_idx = test_compile(engine, "{[a-z]+ [:space:] [a-z]+}");
+    let json = test_json(engine, pat_idx, "ab\tcd");
+    assert!(json.contains("\"data\":\"ab\\tcd\""), "{}", json);
+
+    //Constant values with a quote or a backslash, which were written raw before
+    let pat_idx = test_compile(engine, "{quoted message:\"say \\\"hi\\\"\"}");
+    let json = test_json(engine, pat_idx, "\"abc\"");
+    assert!(json.contains("\"data\":\"say \\\"hi\\\"\""), "{}", json);
+    let pat_idx = test_compile(engine, "message:\"a\\\\b\"");
+    let json = test_json(engine, pat_idx, "");
+    assert!(json.contains("\"data\":\"a\\\\b\""), "{}", json);
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests the positions in json output across changes in their number of digits
+fn json_positions() {
+
+    let engine = test_engine();
+    let pat_idx = test_compile(engine, "{[a-z]+}");
+    for &start in [1u32, 8, 9, 10, 97, 98, 99, 100, 998, 999, 9999].iter() {
+        let input = format!("{}abc", " ".repeat(start as usize - 1));
+        let mut raw_match_result = RawMatchResult::empty();
+        let result_code = unsafe { rosie_match2(engine, pat_idx, MatchEncoder::JSON.as_bytes().as_ptr(), &RosieString::from_str(input.as_str()), start, 0, &mut raw_match_result, 0) };
+        assert_eq!(result_code, 0);
+        let expected = format!("\"s\":{},\"e\":{},\"data\":\"abc\"}}", start, start + 3);
+        assert!(raw_match_result.as_str().ends_with(expected.as_str()), "{}", raw_match_result.as_str());
+    }
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[cfg(test)]
+/// Makes a row layout for rosie_match2_delimited, returning null if it could not be made
+fn test_delimited(engine : EnginePtr, pat_idx : i32, style : i32, names : &[&str]) -> *mut RawDelimited {
+    let names : Vec<RosieString> = names.iter().map(|name| RosieString::from_str(name)).collect();
+    let mut delimited : *mut RawDelimited = ptr::null_mut();
+    let result_code = unsafe { rosie_delimited_new(engine, pat_idx as u32, style, names.as_ptr(), names.len() as i32, &mut delimited) };
+    assert_eq!(result_code == 0, !delimited.is_null());
+    delimited
+}
+
+#[cfg(test)]
+/// Matches an input with a delimited row layout, and returns the row if it matched
+fn test_row(engine : EnginePtr, pat_idx : i32, delimited : *mut RawDelimited, input : &str) -> Option<String> {
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2_delimited(engine, pat_idx as u32, &RosieString::from_str(input), 1, 0, delimited, &mut raw_match_result) };
+    assert_eq!(result_code, 0);
+    if raw_match_result.did_match() { Some(String::from(raw_match_result.as_str())) } else { None }
+}
+
+#[test]
+/// Tests delimited (TSV and CSV) field extraction
+fn match_delimited() {
+
+    let engine = test_engine();
+    test_load(engine, "field = [^|]*\nnum = [0-9]+");
+    let pat_idx = test_compile(engine, "{field \"|\" num? {\"|\" field}?}");
+
+    //Names must be captures of the pattern, and appear once
+    assert!(test_delimited(engine, pat_idx, ROSIE_DELIMITED_TSV, &["field", "nope"]).is_null());
+    assert!(test_delimited(engine, pat_idx, ROSIE_DELIMITED_TSV, &["num", "num"]).is_null());
+
+    //The first capture of each name, in the order given, with empty fields for missing captures
+    let tsv = test_delimited(engine, pat_idx, ROSIE_DELIMITED_TSV, &["num", "field"]);
+    assert!(!tsv.is_null());
+    assert_eq!(test_row(engine, pat_idx, tsv, "abc|12|def").as_deref(), Some("12\tabc"));
+    assert_eq!(test_row(engine, pat_idx, tsv, "abc|").as_deref(), Some("\tabc"));
+    assert_eq!(test_row(engine, pat_idx, tsv, "abc"), None);
+
+    //TSV escapes
+    assert_eq!(test_row(engine, pat_idx, tsv, "a\tb\\c\nd|1").as_deref(), Some("1\ta\\tb\\\\c\\nd"));
+
+    //CSV quotes fields that need it
+    let csv = test_delimited(engine, pat_idx, ROSIE_DELIMITED_CSV, &["field", "num"]);
+    assert!(!csv.is_null());
+    assert_eq!(test_row(engine, pat_idx, csv, "abc|12").as_deref(), Some("abc,12"));
+    assert_eq!(test_row(engine, pat_idx, csv, "a,\"b\"|12").as_deref(), Some("\"a,\"\"b\"\"\",12"));
+    assert_eq!(test_row(engine, pat_idx, csv, "a\r\nb|").as_deref(), Some("\"a\r\nb\","));
+
+    unsafe { rosie_delimited_free(tsv) };
+    unsafe { rosie_delimited_free(csv) };
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[cfg(test)]
+/// Matches an input with the given encoder, and returns the output if it matched
+fn test_encode(engine : EnginePtr, pat_idx : i32, encoder : MatchEncoder, input : &str) -> Option<String> {
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(engine, pat_idx, encoder.as_bytes().as_ptr(), &RosieString::from_str(input), 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    if raw_match_result.did_match() { Some(String::from(raw_match_result.as_str())) } else { None }
+}
+
+#[test]
+/// Tests the data, subs and color encoders
+fn text_encoders() {
+
+    let engine = test_engine();
+    test_load(engine, "word = [a-z]+\nnum = [0-9]+");
+    let pat_idx = test_compile(engine, "{word \" \" num}");
+
+    assert_eq!(test_encode(engine, pat_idx, MatchEncoder::Matches, "abc 12 xyz").as_deref(), Some("abc 12"));
+    assert_eq!(test_encode(engine, pat_idx, MatchEncoder::Subs, "abc 12 xyz").as_deref(), Some("abc\n12"));
+    assert_eq!(test_encode(engine, pat_idx, MatchEncoder::Matches, "abc xyz"), None);
+
+    //Color writes the whole input, with the matched parts colored
+    let colored = test_encode(engine, pat_idx, MatchEncoder::Color, "abc 12 xyz").unwrap();
+    assert!(colored.starts_with("\x1b["), "{:?}", colored);
+    assert!(colored.ends_with("\x1b[0m xyz"), "{:?}", colored);
+    assert_eq!(colored.replace("\x1b[39;1m", "").replace("\x1b[0m", ""), "abc 12 xyz");
+
+    //The same output through the "data" name
+    let pat_idx = test_compile(engine, "{word}");
+    assert_eq!(test_encode(engine, pat_idx, MatchEncoder::custom("data"), "abc 12").as_deref(), Some("abc"));
+
+    //Colors set in an rcfile are used instead of the defaults
+    extern "C" {
+        fn rosie_execute_rcfile(e : EnginePtr, filename : *const RosieString, file_exists : *mut i32, no_errors : *mut i32, messages : *mut RosieString) -> i32;
+    }
+    let path = std::env::temp_dir().join(format!("rosie_sys_test_{}.rc", std::process::id()));
+    std::fs::write(&path, "colors = \"word=red\"\n").unwrap();
+    let mut file_exists : i32 = 0;
+    let mut no_errors : i32 = 0;
+    let mut message_buf = RosieString::empty();
+    let result_code = unsafe { rosie_execute_rcfile(engine, &RosieString::from_str(path.to_str().unwrap()), &mut file_exists, &mut no_errors, &mut message_buf) };
+    std::fs::remove_file(&path).unwrap();
+    assert_eq!(result_code, 0);
+    assert_eq!(file_exists, 1);
+    assert_eq!(no_errors, 1);
+    let pat_idx = test_compile(engine, "{word \" \" num}");
+    let colored = test_encode(engine, pat_idx, MatchEncoder::Color, "abc 12 xyz").unwrap();
+    assert!(colored.starts_with("\x1b[31mabc\x1b[0m"), "{:?}", colored);
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests that matches give the same results when their transient memory comes from an arena
+fn match_arena() {
+
+    let engine = test_engine();
+    test_load(engine, "word = [a-z]+");
+    let pat_idx = test_compile(engine, "{word {\" \" word}*}");
+    let input = vec!["abc"; 5000].join(" ");
+    let expected = test_json(engine, pat_idx, input.as_str());
+    let expected_short = test_json(engine, pat_idx, "abc");
+
+    let arena = unsafe { rosie_arena_new(0) };
+    assert!(!arena.is_null());
+    assert_eq!(unsafe { rosie_match2_arena(engine, pat_idx as u32, arena) }, 0);
+    for _ in 0..3 {
+        //The output buffer grows in the arena too, so it is attached again after each reset
+        let sink = RawSink { region: ptr::null_mut(), size: 0, alloc: Some(rosie_arena_alloc), flush: None, ud: arena as *mut c_void };
+        assert_eq!(unsafe { rosie_match2_sink(engine, pat_idx as u32, &sink) }, 0);
+        assert_eq!(test_json(engine, pat_idx, input.as_str()), expected);
+        assert_eq!(test_json(engine, pat_idx, "abc"), expected_short);
+        unsafe { rosie_arena_reset(arena) };
+    }
+
+    //Back to malloc, before the arena is freed
+    assert_eq!(unsafe { rosie_match2_sink(engine, pat_idx as u32, ptr::null()) }, 0);
+    assert_eq!(unsafe { rosie_match2_arena(engine, pat_idx as u32, ptr::null_mut()) }, 0);
+    unsafe { rosie_arena_free(arena) };
+    assert_eq!(test_json(engine, pat_idx, input.as_str()), expected);
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests capture positions far into a long input, now that captures hold 32-bit offsets
+fn long_input_positions() {
+
+    let engine = test_engine();
+    test_load(engine, "word = [a-z]+\nnum = [0-9]+");
+    let pat_idx = test_compile(engine, "{word \" \" num}");
+    let tree = unsafe { rosie_captree_new() };
+
+    for &offset in [65_536usize, 16_777_216].iter() {
+        let input = format!("{}abc 12", " ".repeat(offset));
+        let start = (offset + 1) as i32;
+        let mut raw_match_result = RawMatchResult::empty();
+        let result_code = unsafe { rosie_match2_tree(engine, pat_idx as u32, &RosieString::from_str(input.as_str()), start as u32, 0, tree, &mut raw_match_result) };
+        assert_eq!(result_code, 0);
+        let mut nodes : *const RawCapNode = ptr::null();
+        let n = unsafe { rosie_captree_nodes(tree, &mut nodes) };
+        assert_eq!(n, 3);
+        let nodes = unsafe { slice::from_raw_parts(nodes, n as usize) };
+        assert_eq!((nodes[0].start, nodes[0].end), (start, start + 6));
+        assert_eq!((nodes[1].start, nodes[1].end), (start, start + 3));
+        assert_eq!((nodes[2].start, nodes[2].end), (start + 4, start + 6));
+
+        let mut raw_match_result = RawMatchResult::empty();
+        let result_code = unsafe { rosie_match2(engine, pat_idx, MatchEncoder::Subs.as_bytes().as_ptr(), &RosieString::from_str(input.as_str()), start as u32, 0, &mut raw_match_result, 0) };
+        assert_eq!(result_code, 0);
+        assert_eq!(raw_match_result.as_str(), "abc\n12");
+    }
+
+    unsafe { rosie_captree_free(tree) };
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests that rosie_clone replays the setup of an engine, and that repeated setup calls do not keep its log from being replayed
+fn engine_clone() {
+
+    let engine = test_engine();
+    let mut libpath = RosieString::empty();
+    assert_eq!(unsafe { rosie_libpath(engine, &mut libpath) }, 0);
+    let date = RosieString::from_str("date");
+
+    //Repeated settings and imports are compacted in the setup log
+    test_load(engine, "word = [a-z]+");
+    for _ in 0..5000 {
+        let mut newpath = RosieString::from_bytes(libpath.as_bytes());
+        assert_eq!(unsafe { rosie_libpath(engine, &mut newpath) }, 0);
+    }
+    for _ in 0..5000 {
+        assert_eq!(unsafe { rosie_import_lazy(engine, &date, ptr::null()) }, 0);
+    }
+
+    //The clone has the binding from the load, and the lazy import
+    let mut message_buf = RosieString::empty();
+    let clone = unsafe { rosie_clone(engine, &mut message_buf) };
+    assert!(!clone.e.is_null(), "{}", message_buf.as_str());
+    message_buf.manual_drop();
+    let pat_idx = test_compile(clone, "{word \" \" date.any}");
+    assert_eq!(test_leftover(clone, pat_idx, "abc 2021-10-18"), Some(0));
+    unsafe{ rosie_finalize(clone); }
+
+    //Setting the same libpath between imports fills the log until it is rebuilt
+    for _ in 0..2100 {
+        let mut newpath = RosieString::from_bytes(libpath.as_bytes());
+        assert_eq!(unsafe { rosie_libpath(engine, &mut newpath) }, 0);
+        assert_eq!(unsafe { rosie_import_lazy(engine, &date, ptr::null()) }, 0);
+    }
+    let mut message_buf = RosieString::empty();
+    let clone = unsafe { rosie_clone(engine, &mut message_buf) };
+    assert!(!clone.e.is_null(), "{}", message_buf.as_str());
+    message_buf.manual_drop();
+    unsafe{ rosie_finalize(clone); }
+
+    //A setup log that is too long to replay, even when rebuilt
+    for i in 0..4100 {
+        test_load(engine, format!("w{} = \"{}\"", i, i).as_str());
+    }
+    let mut message_buf = RosieString::empty();
+    let clone = unsafe { rosie_clone(engine, &mut message_buf) };
+    assert!(clone.e.is_null());
+    assert!(message_buf.len() > 0);
+    message_buf.manual_drop();
+
+    libpath.manual_drop();
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests engine pools, with each thread matching a pool pattern on its own engine
+fn engine_pools() {
+
+    let engine = test_engine();
+    test_load(engine, "word = [a-z]+");
+    let mut message_buf = RosieString::empty();
+    let pool = unsafe { rosie_pool_new(engine, &mut message_buf) };
+    assert!(!pool.is_null(), "{}", message_buf.as_str());
+    message_buf.manual_drop();
+
+    let mut pat : i32 = 0;
+    let mut message_buf = RosieString::empty();
+    let result_code = unsafe { rosie_pool_compile(pool, &RosieString::from_str("{word \" \" [0-9]+}"), &mut pat, &mut message_buf) };
+    assert_eq!(result_code, 0);
+    assert!(pat > 0, "{}", message_buf.as_str());
+    message_buf.manual_drop();
+
+    //Pointers are not Send, so the threads get the pool as an address
+    let pool_addr = pool as usize;
+    let threads : Vec<std::thread::JoinHandle<()>> = (0..4).map(|_| std::thread::spawn(move || {
+        let pool = pool_addr as *mut RawPool;
+        let mut message_buf = RosieString::empty();
+        let engine = unsafe { rosie_pool_engine(pool, &mut message_buf) };
+        assert!(!engine.e.is_null());
+        message_buf.manual_drop();
+
+        for i in 0..100 {
+            let input = format!("abc {}", i);
+            let mut raw_match_result = RawMatchResult::empty();
+            let result_code = unsafe { rosie_pool_match2(pool, pat as u32, MatchEncoder::Matches.as_bytes().as_ptr(), &RosieString::from_str(input.as_str()), 1, 0, &mut raw_match_result, 0) };
+            assert_eq!(result_code, 0);
+            assert_eq!(raw_match_result.as_str(), input);
+        }
+
+        //The thread's own engine and its handle for the pool pattern
+        let mut pattern_engine = EnginePtr{ e: ptr::null_mut() };
+        let mut epat : i32 = 0;
+        assert_eq!(unsafe { rosie_pool_pattern(pool, pat, &mut pattern_engine, &mut epat) }, 0);
+        assert_eq!(pattern_engine.e, engine.e);
+        assert_eq!(test_leftover(pattern_engine, epat, "abc 12"), Some(0));
+    })).collect();
+    for t in threads {
+        t.join().unwrap();
+    }
+
+    //An invalid pool pattern is reported in the match result
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_pool_match2(pool, (pat + 100) as u32, MatchEncoder::Status.as_bytes().as_ptr(), &RosieString::from_str("abc 12"), 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.data().is_valid(), false);
+    assert_eq!(raw_match_result.data().len(), 4); //ERR_NO_PATTERN
+
+    unsafe { rosie_pool_free(pool) };
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests lazy package imports, which happen when RPL first refers to the package
+fn lazy_imports() {
+
+    let engine = test_engine();
+
+    //A lazy import is done by the first compile that refers to it
+    let pkgname = RosieString::from_str("num");
+    let as_name = RosieString::from_str("n");
+    assert_eq!(unsafe { rosie_import_lazy(engine, &pkgname, &as_name) }, 0);
+    let pat_idx = test_compile(engine, "{n.any \" \" n.any}");
+    assert_eq!(test_leftover(engine, pat_idx, "12 0x1F"), Some(0));
+
+    //And by a load that refers to it
+    let pkgname = RosieString::from_str("time");
+    assert_eq!(unsafe { rosie_import_lazy(engine, &pkgname, ptr::null()) }, 0);
+    test_load(engine, "clock = time.any");
+    let pat_idx = test_compile(engine, "clock");
+    assert_eq!(test_leftover(engine, pat_idx, "12:30:00"), Some(0));
+
+    //And by rosie_import_expression_deps
+    let pkgname = RosieString::from_str("date");
+    assert_eq!(unsafe { rosie_import_lazy(engine, &pkgname, ptr::null()) }, 0);
+    let mut pkgs = RosieString::empty();
+    let mut err : i32 = 0;
+    let mut message_buf = RosieString::empty();
+    let result_code = unsafe { rosie_import_expression_deps(engine, &RosieString::from_str("date.any"), &mut pkgs, &mut err, &mut message_buf) };
+    assert_eq!(result_code, 0);
+    assert_eq!(err, 0, "{}", message_buf.as_str());
+    pkgs.manual_drop();
+    message_buf.manual_drop();
+
+    //A lazy import that fails is reported like a compile error, and stays pending
+    let pkgname = RosieString::from_str("no_such_package");
+    let as_name = RosieString::from_str("nsp");
+    assert_eq!(unsafe { rosie_import_lazy(engine, &pkgname, &as_name) }, 0);
+    for _ in 0..2 {
+        let mut pat_idx : i32 = 1;
+        let mut message_buf = RosieString::empty();
+        let result_code = unsafe { rosie_compile(engine, &RosieString::from_str("nsp.x"), &mut pat_idx, &mut message_buf) };
+        assert_eq!(result_code, 0);
+        assert_eq!(pat_idx, 0);
+        assert!(message_buf.len() > 0);
+        message_buf.manual_drop();
+    }
+
+    //Expressions that do not refer to it are not affected
+    let pat_idx = test_compile(engine, "{n.any}");
+    assert_eq!(test_leftover(engine, pat_idx, "12"), Some(0));
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests saving a compiled pattern to an RPLX file, and loading it into another engine
+fn rplx_files() {
+
+    let engine = test_engine();
+    test_load(engine, "word = [a-z]+\nnum = [0-9]+");
+    let pat_idx = test_compile(engine, "{word \" \" num}");
+    let expected = test_json(engine, pat_idx, "abc 12");
+
+    let path = std::env::temp_dir().join(format!("rosie_sys_test_{}.rplx", std::process::id()));
+    let filename = CString::new(path.to_str().unwrap()).unwrap();
+    assert_eq!(unsafe { rosie_save_rplx(engine, pat_idx as u32, filename.as_ptr() as *const u8) }, 0);
+
+    //The loaded pattern matches the same, in an engine that has never seen its RPL
+    let other = test_engine();
+    let mut loaded : i32 = 0;
+    let mut message_buf = RosieString::empty();
+    let result_code = unsafe { rosie_load_rplx(other, filename.as_ptr() as *const u8, &mut loaded, &mut message_buf) };
+    assert_eq!(result_code, 0);
+    assert!(loaded > 0);
+    assert_eq!(message_buf.len(), 0);
+    assert_eq!(test_json(other, loaded, "abc 12"), expected);
+    assert_eq!(test_leftover(other, loaded, "abc def"), None);
+
+    //Only the encoders implemented in C can be used with it
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2(other, loaded, MatchEncoder::JSONPretty.as_bytes().as_ptr(), &RosieString::from_str("abc 12"), 1, 0, &mut raw_match_result, 0) };
+    assert_eq!(result_code, 0);
+    assert_eq!(raw_match_result.data().is_valid(), false);
+    assert_eq!(raw_match_result.data().len(), 2); //ERR_NO_ENCODER
+    std::fs::remove_file(&path).unwrap();
+
+    //A file that cannot be read
+    let mut loaded : i32 = 1;
+    let mut message_buf = RosieString::empty();
+    let result_code = unsafe { rosie_load_rplx(other, filename.as_ptr() as *const u8, &mut loaded, &mut message_buf) };
+    assert!(result_code != 0);
+    assert_eq!(loaded, 0);
+    assert!(message_buf.len() > 0);
+    message_buf.manual_drop();
+
+    unsafe{ rosie_finalize(other); }
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests compile diagnostics returned as structs
+fn compile_diagnostics() {
+
+    let engine = test_engine();
+
+    let compile = |expression : &str| -> (i32, *mut RawDiagnostics) {
+        let mut pat_idx : i32 = 0;
+        let mut diags : *mut RawDiagnostics = ptr::null_mut();
+        let result_code = unsafe { rosie_compile_diag(engine, &RosieString::from_str(expression), &mut pat_idx, &mut diags) };
+        assert_eq!(result_code, 0);
+        (pat_idx, diags)
+    };
+
+    //No diagnostics, and nothing to free, for an expression that compiles cleanly
+    let (pat_idx, diags) = compile("{[a-z]+ [0-9]+}");
+    assert!(pat_idx > 0);
+    assert!(diags.is_null());
+
+    //A syntax error
+    let (pat_idx, diags) = compile("{[a-z]+ [0-9]+");
+    assert_eq!(pat_idx, 0);
+    assert!(!diags.is_null());
+    let count = unsafe { rosie_diagnostics_count(diags) };
+    assert!(count > 0);
+    let diag = unsafe { &*rosie_diagnostics_get(diags, 0) };
+    assert_eq!(diag.severity, ROSIE_DIAG_ERROR);
+    assert!(diag.who.len() > 0);
+    assert!(diag.message.len() > 0);
+    assert!(unsafe { rosie_diagnostics_get(diags, count) }.is_null());
+    let mut json = RosieString::empty();
+    assert_eq!(unsafe { rosie_diagnostics_json(diags, &mut json) }, 0);
+    assert!(json.as_str().starts_with("[{\"severity\":\"error\",\"who\":"), "{}", json.as_str());
+    unsafe { rosie_diagnostics_free(diags) };
+
+    //An undefined name
+    let (pat_idx, diags) = compile("no_such_name");
+    assert_eq!(pat_idx, 0);
+    assert!(!diags.is_null());
+    let diag = unsafe { &*rosie_diagnostics_get(diags, 0) };
+    assert_eq!(diag.severity, ROSIE_DIAG_ERROR);
+    assert!(diag.message.as_str().contains("no_such_name"), "{}", diag.message.as_str());
+    unsafe { rosie_diagnostics_free(diags) };
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests the GC modes and explicit GC steps, on an engine that uses the pooled allocator
+fn gc_modes() {
+
+    unsafe { rosie_engine_alloc(ROSIE_ALLOC_POOL) };
+    let engine = test_engine();
+    unsafe { rosie_engine_alloc(0) };
+
+    let mut limit : i32 = 8192;
+    assert_eq!(unsafe { rosie_alloc_limit(engine, &mut limit, ptr::null_mut()) }, 0);
+    assert!(unsafe { rosie_gc_config(engine, ROSIE_GC_MANUAL + 1, 0, 0) } != 0);
+
+    for &mode in [ROSIE_GC_FULL, ROSIE_GC_INCREMENTAL, ROSIE_GC_MANUAL].iter() {
+        assert_eq!(unsafe { rosie_gc_config(engine, mode, 200, 200) }, 0);
+        for i in 0..20 {
+            let pat_idx = test_compile(engine, format!("{{[a-z]+ \"{}\"}}", i).as_str());
+            assert_eq!(test_leftover(engine, pat_idx, format!("abc{}", i).as_str()), Some(0));
+            assert_eq!(unsafe { rosie_free_rplx(engine, pat_idx) }, 0);
+        }
+
+        //A full collection, and incremental steps until a cycle finishes
+        let mut done : i32 = 0;
+        let mut usage : i32 = 0;
+        assert_eq!(unsafe { rosie_gc_step(engine, -1, &mut done, &mut usage) }, 0);
+        assert_eq!(done, 1);
+        assert!(usage > 0);
+        let mut steps = 0;
+        done = 0;
+        while done == 0 && steps < 100_000 {
+            assert_eq!(unsafe { rosie_gc_step(engine, 0, &mut done, ptr::null_mut()) }, 0);
+            steps += 1;
+        }
+        assert_eq!(done, 1);
+    }
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests pattern sets, which match many expressions in one run of the vm
+fn pattern_sets() {
+
+    let engine = test_engine();
+    test_load(engine, "word = [a-z]+\nnum = [0-9]+");
+    let expressions = [RosieString::from_str("{word \" \"}"), RosieString::from_str("num"), RosieString::from_str("{word \" \" num}")];
+    let mut pat_idx : i32 = 0;
+    let mut message_buf = RosieString::empty();
+    let result_code = unsafe { rosie_compile_set(engine, expressions.as_ptr(), 3, &mut pat_idx, &mut message_buf) };
+    assert_eq!(result_code, 0);
+    assert!(pat_idx > 0, "{}", message_buf.as_str());
+    assert_eq!(message_buf.len(), 0);
+
+    let tree = unsafe { rosie_captree_new() };
+    let match_set = |input : &str, size : usize| -> (bool, Vec<i32>, Vec<RawCapNode>) {
+        let mut members = vec![0i32; size];
+        let mut count : i32 = 0;
+        let mut raw_match_result = RawMatchResult::empty();
+        let result_code = unsafe { rosie_match2_set(engine, pat_idx as u32, &RosieString::from_str(input), 1, 0, tree, members.as_mut_ptr(), size as i32, &mut count, &mut raw_match_result) };
+        assert_eq!(result_code, 0);
+        let mut nodes : *const RawCapNode = ptr::null();
+        let n = unsafe { rosie_captree_nodes(tree, &mut nodes) };
+        let nodes = if n == 0 { Vec::new() } else { unsafe { slice::from_raw_parts(nodes, n as usize) }.to_vec() };
+        members.truncate(count as usize);
+        (raw_match_result.did_match(), members, nodes)
+    };
+
+    //Members 1 and 3 match, each as a sub-capture named by its index
+    let (matched, members, nodes) = match_set("abc 12", 3);
+    assert_eq!(matched, true);
+    assert_eq!(members, vec![1, 3]);
+    assert_eq!(test_capture_name(engine, pat_idx, nodes[0].type_index), "set");
+    let first = nodes[0].child as usize;
+    let second = nodes[first].sibling as usize;
+    assert_eq!(test_capture_name(engine, pat_idx, nodes[first].type_index), "1");
+    assert_eq!(test_capture_name(engine, pat_idx, nodes[second].type_index), "3");
+    assert_eq!((nodes[0].member, nodes[first].member, nodes[second].member), (0, 1, 3));
+    assert_eq!(nodes[nodes[first].child as usize].member, 0);
+    assert_eq!(nodes[second].sibling, -1);
+    assert_eq!((nodes[second].start, nodes[second].end), (1, 7));
+    let (matched, members, _) = match_set("12", 3);
+    assert_eq!((matched, members), (true, vec![2]));
+
+    //No member matches
+    let (matched, members, nodes) = match_set("ABC", 3);
+    assert_eq!((matched, members.len(), nodes.len()), (false, 0, 0));
+
+    //The count is of all the members that matched, even when fewer are stored
+    let mut members = [0i32; 1];
+    let mut count : i32 = 0;
+    let mut raw_match_result = RawMatchResult::empty();
+    let result_code = unsafe { rosie_match2_set(engine, pat_idx as u32, &RosieString::from_str("abc 12"), 1, 0, tree, members.as_mut_ptr(), 1, &mut count, &mut raw_match_result) };
+    assert_eq!(result_code, 0);
+    assert_eq!((members, count), ([1], 2));
+
+    //A member that does not compile is named in the messages
+    let expressions = [RosieString::from_str("word"), RosieString::from_str("{word"), RosieString::from_str("num")];
+    let mut pat_idx : i32 = 1;
+    let mut message_buf = RosieString::empty();
+    let result_code = unsafe { rosie_compile_set(engine, expressions.as_ptr(), 3, &mut pat_idx, &mut message_buf) };
+    assert_eq!(result_code, 0);
+    assert_eq!(pat_idx, 0);
+    assert!(message_buf.as_str().starts_with("{\"member\":2,\"messages\":"), "{}", message_buf.as_str());
+    message_buf.manual_drop();
+
+    unsafe { rosie_captree_free(tree) };
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests the global search of rosie_match2_all
+fn match_all() {
+
+    let engine = test_engine();
+    let pat_idx = test_compile(engine, "{[0-9]+}");
+
+    let search = |pat_idx : i32, encoder : MatchEncoder, input : &str| -> (u32, RawMatchResult<'static>) {
+        let mut count : u32 = 99;
+        let mut raw_match_result = RawMatchResult::empty();
+        let result_code = unsafe { rosie_match2_all(engine, pat_idx as u32, encoder.as_bytes().as_ptr(), &RosieString::from_str(input), 1, 0, &mut count, &mut raw_match_result) };
+        assert_eq!(result_code, 0);
+        (count, raw_match_result)
+    };
+
+    //Every non-overlapping match, each followed by a newline
+    let (count, result) = search(pat_idx, MatchEncoder::Matches, "12 ab 3 45x");
+    assert_eq!(count, 3);
+    assert_eq!(result.as_str(), "12\n3\n45\n");
+    assert_eq!(result.leftover, 1);
+    assert_eq!(result.abend, 0);
+
+    let (count, result) = search(pat_idx, MatchEncoder::JSON, "a1b22");
+    assert_eq!(count, 2);
+    let lines : Vec<&str> = result.as_str().lines().collect();
+    assert_eq!(lines.len(), 2);
+    assert!(lines[0].ends_with("\"s\":2,\"e\":3,\"data\":\"1\"}"), "{}", lines[0]);
+    assert!(lines[1].ends_with("\"s\":4,\"e\":6,\"data\":\"22\"}"), "{}", lines[1]);
+    assert_eq!(result.leftover, 0);
+
+    //No matches
+    let (count, result) = search(pat_idx, MatchEncoder::Matches, "abc");
+    assert_eq!(count, 0);
+    assert_eq!(result.did_match(), false);
+
+    //Each search is counted as one call, whatever the number of matches
+    let mut stats = RawMatchStats::default();
+    assert_eq!(unsafe { rosie_match_stats_enable(engine, pat_idx as u32, 1) }, 0);
+    let (count, _) = search(pat_idx, MatchEncoder::Matches, "1 2 3 4");
+    assert_eq!(count, 4);
+    let (count, _) = search(pat_idx, MatchEncoder::Matches, "abc");
+    assert_eq!(count, 0);
+    let result_code = unsafe { rosie_match_stats(engine, pat_idx as u32, &mut stats, 1) };
+    assert_eq!(result_code, 0);
+    assert_eq!(stats.matches, 1);
+    assert_eq!(stats.failures, 1);
+    assert!(stats.insts > 0);
+    assert_eq!(unsafe { rosie_match_stats_enable(engine, pat_idx as u32, 0) }, 0);
+
+    //Encoders that make one output per input cannot be used
+    let (_, result) = search(pat_idx, MatchEncoder::Line, "12 3");
+    assert_eq!(result.data().is_valid(), false);
+    assert_eq!(result.data().len(), 2); //ERR_NO_ENCODER
+
+    //The search stops after a match that halts
+    let pat_idx = test_compile(engine, "{[0-9]+ / {\"x\" error:\"stop\"}}");
+    let (count, result) = search(pat_idx, MatchEncoder::Matches, "1 x 2");
+    assert_eq!(count, 2);
+    assert!(result.as_str().starts_with("1\n"), "{}", result.as_str());
+    assert_eq!(result.leftover, 2);
+    assert_eq!(result.abend, 1);
+
+    unsafe{ rosie_finalize(engine); }
+}
+
+#[test]
+/// Tests that a Lua encoder sees each input in turn, now that the input wrapper is reused
+fn lua_encoder_inputs() {
+
+    let engine = test_engine();
+    let pat_idx = test_compile(engine, "{[a-z]+}");
+    for word in ["abc", "de", "fghij", "k"].iter() {
+        let pretty = test_encode(engine, pat_idx, MatchEncoder::JSONPretty, word).unwrap();
+        assert!(pretty.contains(format!("\"{}\"", word).as_str()), "{}", pretty);
+        let input = format!("{} zz", word);
+        let pretty = test_encode(engine, pat_idx, MatchEncoder::JSONPretty, input.as_str()).unwrap();
+        assert!(pretty.contains(format!("\"{}\"", word).as_str()), "{}", pretty);
+        assert!(!pretty.contains("zz"), "{}", pretty);
+    }
+    assert_eq!(test_encode(engine, pat_idx, MatchEncoder::JSONPretty, "123"), None);
+
+    unsafe{ rosie_finalize(engine); }
+}
@@ -0,0 +1,190 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  diagnostics.c  Part of librosie.c                                        */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * Compile diagnostics as C structures, for rosie_compile_diag().  The
+ * strings in each diagnostic are copied out of the Lua violation
+ * objects, so a diagnostics object does not refer to the engine, and
+ * may outlive it.  The JSON view is written in C the first time it is
+ * asked for, and kept until the diagnostics are freed.
+ */
+
+struct rosie_diagnostics {
+  int n;
+  int size;
+  struct rosie_diagnostic *items;
+  str json;			/* ptr is NULL until made */
+};
+
+static struct rosie_diagnostics *diagnostics_new (int size) {
+  struct rosie_diagnostics *d = calloc(1, sizeof(struct rosie_diagnostics));
+  if (!d) return NULL;
+  d->items = calloc(size > 0 ? size : 1, sizeof(struct rosie_diagnostic));
+  if (!d->items) {
+    free(d);
+    return NULL;
+  }
+  d->size = size;
+  return d;
+}
+
+/* An empty string is left with a NULL ptr, like the messages of other
+   librosie functions */
+static str diagnostics_string (const char *s, size_t len) {
+  if (!s || !len) return rosie_string_from(NULL, 0);
+  return rosie_new_string((byte_ptr) s, len);
+}
+
+/* Copy the strings; returns FALSE when out of memory */
+static int diagnostics_add (struct rosie_diagnostics *d, int severity,
+			    const char *who, size_t wholen,
+			    const char *message, size_t messagelen,
+			    int32_t start, int32_t end) {
+  struct rosie_diagnostic *item;
+  assert(d->n < d->size);
+  item = &d->items[d->n];
+  item->severity = severity;
+  item->who = diagnostics_string(who, wholen);
+  item->message = diagnostics_string(message, messagelen);
+  item->start = start;
+  item->end = end;
+  if ((!item->who.ptr && who && wholen) || (!item->message.ptr && message && messagelen)) {
+    rosie_free_string(item->who);
+    rosie_free_string(item->message);
+    return FALSE;
+  }
+  d->n++;
+  return TRUE;
+}
+
+EXPORT
+void rosie_diagnostics_free (struct rosie_diagnostics *d) {
+  if (!d) return;
+  for (int i = 0; i < d->n; i++) {
+    rosie_free_string(d->items[i].who);
+    rosie_free_string(d->items[i].message);
+  }
+  free(d->items);
+  if (d->json.ptr) rosie_free_string(d->json);
+  free(d);
+}
+
+EXPORT
+int rosie_diagnostics_count (struct rosie_diagnostics *d) {
+  return d ? d->n : 0;
+}
+
+EXPORT
+const struct rosie_diagnostic *rosie_diagnostics_get (struct rosie_diagnostics *d, int i) {
+  if (!d || (i < 0) || (i >= d->n)) return NULL;
+  return &d->items[i];
+}
+
+/* ----------------------------------------------------------------------------- */
+/* JSON view                                                                     */
+/* ----------------------------------------------------------------------------- */
+
+static const char *severity_names[] = {"error", "warning", "info"};
+
+typedef struct JsonOut {
+  char *ptr;
+  size_t len;
+  size_t size;
+  int failed;
+} JsonOut;
+
+static void json_add (JsonOut *out, const char *s, size_t len) {
+  char *newptr;
+  size_t newsize;
+  if (out->failed || !len) return;
+  if (out->len + len > out->size) {
+    newsize = out->size ? out->size : 256;
+    while (out->len + len > newsize) newsize *= 2;
+    newptr = realloc(out->ptr, newsize);
+    if (!newptr) {
+      out->failed = TRUE;
+      return;
+    }
+    out->ptr = newptr;
+    out->size = newsize;
+  }
+  memcpy(out->ptr + out->len, s, len);
+  out->len += len;
+}
+
+#define json_add_literal(out, s) json_add((out), (s), sizeof(s) - 1)
+
+static void json_add_string (JsonOut *out, const str *s) {
+  static const char hex[] = "0123456789abcdef";
+  char esc[6] = {'\\', 'u', '0', '0', 0, 0};
+  size_t i, run = 0;
+  const char *p = (const char *) s->ptr;
+  json_add_literal(out, "\"");
+  for (i = 0; i < s->len; i++) {
+    unsigned char c = (unsigned char) p[i];
+    if ((c >= 0x20) && (c != '"') && (c != '\\')) continue;
+    json_add(out, p + run, i - run);
+    run = i + 1;
+    switch (c) {
+    case '"': json_add_literal(out, "\\\""); break;
+    case '\\': json_add_literal(out, "\\\\"); break;
+    case '\n': json_add_literal(out, "\\n"); break;
+    case '\t': json_add_literal(out, "\\t"); break;
+    case '\r': json_add_literal(out, "\\r"); break;
+    default:
+      esc[4] = hex[c >> 4];
+      esc[5] = hex[c & 0xF];
+      json_add(out, esc, sizeof(esc));
+    }
+  }
+  json_add(out, p + run, i - run);
+  json_add_literal(out, "\"");
+}
+
+static void json_add_int (JsonOut *out, int32_t n) {
+  char num[16];
+  int len = snprintf(num, sizeof(num), "%d", (int) n);
+  json_add(out, num, (size_t) len);
+}
+
+/* N.B. The json string belongs to d, and is freed by rosie_diagnostics_free() */
+EXPORT
+int rosie_diagnostics_json (struct rosie_diagnostics *d, str *json) {
+  JsonOut out = {NULL, 0, 0, FALSE};
+  const struct rosie_diagnostic *item;
+  if (!d) {
+    *json = rosie_string_from(NULL, 0);
+    return SUCCESS;
+  }
+  if (!d->json.ptr) {
+    json_add_literal(&out, "[");
+    for (int i = 0; i < d->n; i++) {
+      item = &d->items[i];
+      if (i) json_add_literal(&out, ",");
+      json_add_literal(&out, "{\"severity\":\"");
+      json_add(&out, severity_names[item->severity], strlen(severity_names[item->severity]));
+      json_add_literal(&out, "\",\"who\":");
+      json_add_string(&out, &item->who);
+      json_add_literal(&out, ",\"message\":");
+      json_add_string(&out, &item->message);
+      json_add_literal(&out, ",\"start\":");
+      json_add_int(&out, item->start);
+      json_add_literal(&out, ",\"end\":");
+      json_add_int(&out, item->end);
+      json_add_literal(&out, "}");
+    }
+    json_add_literal(&out, "]");
+    if (out.failed) {
+      free(out.ptr);
+      return ERR_OUT_OF_MEMORY;
+    }
+    d->json = rosie_string_from((byte_ptr) out.ptr, out.len);
+  }
+  *json = d->json;
+  return SUCCESS;
+}
@@ -0,0 +1,208 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  homeimage.c  Part of librosie.c                                          */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * Reading the rosie_home files from an image linked into librosie,
+ * so that booting an engine and importing the standard RPL packages
+ * do not open and read dozens of small files.
+ *
+ * The Lua code reads files only through loadfile(), io.open(),
+ * io.lines() and package.searchpath().  When there is an image,
+ * newstate() replaces these with versions that look for the file in
+ * the image first, when its name is in the rosie_home directory.  All
+ * other files (e.g. user RPL files) are read from the file system as
+ * usual.  An image file is read through a FILE* made by fmemopen(),
+ * so it behaves like any other Lua file handle.
+ *
+ * The image files appear under rosie_home, which need not exist in
+ * the file system.
+ */
+
+#include "homeimage.h"
+
+#if defined(ROSIE_HOME_IMAGE)
+#define image_files rosie_home_image
+#define image_count rosie_home_image_count
+#else
+static const rosie_home_file *const image_files = NULL;
+static const size_t image_count = 0;
+#endif
+
+static const rosie_home_file *image_lookup (const char *path) {
+  size_t homelen, lo, hi, mid;
+  int c;
+  if (!image_count || !rosie_home) return NULL;
+  homelen = strlen(rosie_home);
+  if ((strncmp(path, rosie_home, homelen) != 0) || (path[homelen] != '/')) return NULL;
+  path += homelen + 1;
+  lo = 0;
+  hi = image_count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    c = strcmp(path, image_files[mid].name);
+    if (c == 0) return &image_files[mid];
+    if (c < 0) hi = mid;
+    else lo = mid + 1;
+  }
+  return NULL;
+}
+
+/* Call the function that the wrapper replaced, with the same args */
+static int image_call_original (lua_State *L) {
+  int n = lua_gettop(L);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  lua_call(L, n, LUA_MULTRET);
+  return lua_gettop(L);
+}
+
+static int image_fclose (lua_State *L) {
+  luaL_Stream *p = (luaL_Stream *) luaL_checkudata(L, 1, LUA_FILEHANDLE);
+  int res = fclose(p->f);
+  return luaL_fileresult(L, (res == 0), NULL);
+}
+
+/* Push a Lua file handle for reading 'file', or nil and a message */
+static int image_push_file (lua_State *L, const rosie_home_file *file) {
+  luaL_Stream *p = (luaL_Stream *) lua_newuserdata(L, sizeof(luaL_Stream));
+  p->closef = NULL;		/* closed until the FILE* is made */
+  luaL_setmetatable(L, LUA_FILEHANDLE);
+  p->f = fmemopen((void *) file->data, file->len, "r");
+  if (!p->f) return luaL_fileresult(L, 0, file->name);
+  p->closef = &image_fclose;
+  return 1;
+}
+
+/* loadfile([filename [, mode [, env]]]) */
+static int image_loadfile (lua_State *L) {
+  const char *fname = luaL_optstring(L, 1, NULL);
+  const char *mode = luaL_optstring(L, 2, NULL);
+  int env = lua_isnone(L, 3) ? 0 : 3;
+  const rosie_home_file *file = fname ? image_lookup(fname) : NULL;
+  if (!file) return image_call_original(L);
+  /* Same chunkname that luaL_loadfile() would use */
+  const char *chunkname = lua_pushfstring(L, "@%s", fname);
+  if (luaL_loadbufferx(L, (const char *) file->data, file->len, chunkname, mode) != LUA_OK) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;			/* nil, message */
+  }
+  if (env) {
+    lua_pushvalue(L, env);
+    if (!lua_setupvalue(L, -2, 1)) lua_pop(L, 1);
+  }
+  return 1;
+}
+
+/* io.open(filename [, mode]) */
+static int image_io_open (lua_State *L) {
+  const char *fname = luaL_checkstring(L, 1);
+  const char *mode = luaL_optstring(L, 2, "r");
+  const rosie_home_file *file;
+  if ((mode[0] == 'r') && !strchr(mode, '+') && (file = image_lookup(fname)))
+    return image_push_file(L, file);
+  return image_call_original(L);
+}
+
+/* The iterator returned by image_io_lines().  Upvalues are the file
+   handle and the iterator from its lines() method.  Like the iterator
+   of io.lines(), it closes the file when it reaches the end. */
+static int image_lines_next (lua_State *L) {
+  lua_settop(L, 0);
+  lua_pushvalue(L, lua_upvalueindex(2));
+  lua_call(L, 0, LUA_MULTRET);
+  if (lua_isnil(L, 1) && !lua_isnil(L, lua_upvalueindex(1))) {
+    lua_getfield(L, lua_upvalueindex(1), "close");
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_call(L, 1, 0);
+    lua_pushnil(L);
+    lua_replace(L, lua_upvalueindex(1)); /* closed */
+  }
+  return lua_gettop(L);
+}
+
+/* io.lines([filename, ...]) */
+static int image_io_lines (lua_State *L) {
+  const rosie_home_file *file;
+  int n = lua_gettop(L);
+  if ((lua_type(L, 1) != LUA_TSTRING) || !(file = image_lookup(lua_tostring(L, 1))))
+    return image_call_original(L);
+  if (image_push_file(L, file) != 1) return luaL_error(L, "%s", lua_tostring(L, -2));
+  lua_replace(L, 1);		/* file handle replaces filename */
+  lua_getfield(L, 1, "lines");
+  lua_insert(L, 1);
+  lua_pushvalue(L, 2);
+  lua_insert(L, 1);
+  /* Stack: file, lines method, file, formats... */
+  lua_call(L, n, 1);
+  lua_pushcclosure(L, image_lines_next, 2);
+  return 1;
+}
+
+/* package.searchpath(name, path [, sep [, rep]]), as in loadlib.c,
+   except that a file in the image does not have to exist */
+static const char *image_nexttemplate (lua_State *L, const char *path) {
+  const char *l;
+  while (*path == *LUA_PATH_SEP) path++;
+  if (*path == '\0') return NULL;
+  l = strchr(path, *LUA_PATH_SEP);
+  if (l == NULL) l = path + strlen(path);
+  lua_pushlstring(L, path, l - path);
+  return l;
+}
+
+static int image_readable (const char *filename) {
+  FILE *f;
+  if (image_lookup(filename)) return TRUE;
+  f = fopen(filename, "r");
+  if (f == NULL) return FALSE;
+  fclose(f);
+  return TRUE;
+}
+
+static int image_searchpath (lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  const char *sep = luaL_optstring(L, 3, ".");
+  const char *rep = luaL_optstring(L, 4, LUA_DIRSEP);
+  const char *filename;
+  luaL_Buffer msg;
+  luaL_buffinit(L, &msg);
+  if (*sep != '\0') name = luaL_gsub(L, name, sep, rep);
+  while ((path = image_nexttemplate(L, path)) != NULL) {
+    filename = luaL_gsub(L, lua_tostring(L, -1), LUA_PATH_MARK, name);
+    lua_remove(L, -2);
+    if (image_readable(filename)) return 1;
+    lua_pushfstring(L, "\n\tno file '%s'", filename);
+    lua_remove(L, -2);
+    luaL_addvalue(&msg);
+  }
+  luaL_pushresult(&msg);
+  lua_pushnil(L);
+  lua_insert(L, -2);
+  return 2;			/* nil, message */
+}
+
+static void image_install (lua_State *L) {
+  if (!image_count) return;
+  lua_getglobal(L, "loadfile");
+  lua_pushcclosure(L, image_loadfile, 1);
+  lua_setglobal(L, "loadfile");
+  lua_getglobal(L, "io");
+  lua_getfield(L, -1, "open");
+  lua_pushcclosure(L, image_io_open, 1);
+  lua_setfield(L, -2, "open");
+  lua_getfield(L, -1, "lines");
+  lua_pushcclosure(L, image_io_lines, 1);
+  lua_setfield(L, -2, "lines");
+  lua_pop(L, 1);
+  lua_getglobal(L, "package");
+  lua_pushcfunction(L, image_searchpath);
+  lua_setfield(L, -2, "searchpath");
+  lua_pop(L, 1);
+}
@@ -0,0 +1,29 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  homeimage.h  The rosie_home files, when linked into librosie             */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(homeimage_h)
+#define homeimage_h
+
+#include <stddef.h>
+
+/*
+ * When librosie is built with ROSIE_HOME_IMAGE defined, a generated
+ * source file (see build.rs) defines the contents of the rosie_home
+ * files as an array sorted by name, where a name is a path relative
+ * to rosie_home, e.g. "lib/boot.luac" or "rpl/net.rpl".
+ */
+typedef struct rosie_home_file {
+  const char *name;
+  const unsigned char *data;
+  size_t len;
+} rosie_home_file;
+
+extern const rosie_home_file rosie_home_image[];
+extern const size_t rosie_home_image_count;
+
+#endif
@@ -32,10 +32,21 @@
  * rosie_match() and rosie_trace() perform matching against a supplied
  * input string using a compiled pattern.  The compiled pattern is
  * represented by a handle earlier returned by rosie_compile().
+ *
+ * rosie_save_rplx() and rosie_load_rplx() write and read compiled
+ * patterns as RPLX files, so that an application can skip compiling
+ * the same expression again in a later run.
+ *
+ * rosie_compile_set() compiles several expressions into one pattern
+ * set, and rosie_match2_set() reports which of them matched.
  * 
  * rosie_config(), rosie_libpath(), rosie_alloc_limit() allow
  * configuration at the engine level.
  *
+ * rosie_clone() creates a new engine set up like an existing one,
+ * i.e. with the same configuration and the same RPL loaded, by
+ * replaying the calls that set up the existing one.
+ *
  * rosie_finalize() destroys an engine and frees its memory.
  *
  * Most functions have an argument 'str *messages':
@@ -103,6 +114,9 @@ static char *bootscript;
 #include "logging.c"
 #include "registry.c"
 #include "rosiestring.c"
+#include "homeimage.c"
+#include "diagnostics.c"
+#include "luaalloc.c"
 
 /* Symbol visibility in the final library */
 #define EXPORT __attribute__ ((visibility("default")))
@@ -208,6 +222,11 @@ static int set_bootscript(str *rosie_home_arg) {
 
   /* get absolute, resolved path (dynamically allocated) */
   rosie_home = realpath(tmp, NULL);
+  if (!rosie_home && image_count) {
+    /* The directory need not exist, since its files are in the image */
+    LOG("rosie_home not found, using the linked-in rosie_home image\n");
+    rosie_home = strndup(tmp, MAXPATHLEN);
+  }
   rosie_home_len = rosie_home ? strnlen(rosie_home, MAXPATHLEN) : 0;
   if (rosie_home_len >= (MAXPATHLEN - 1)) return 0; /* ERR */
 
@@ -243,6 +262,28 @@ static int encoder_name_to_code (const char *name) {
   return 0;
 }
 
+/*
+   The color encoder in C knows only the default color assignments, so
+   an engine whose colors have been changed (by an rcfile, or through
+   its encoder parameters) must use the color encoder in Lua.  Returns
+   TRUE if the engine's colors are the defaults.
+*/
+static int engine_has_default_colors (lua_State *L) {
+  size_t len;
+  const char *colors;
+  int top = lua_gettop(L);
+  int result = FALSE;
+  get_registry(engine_key);
+  if ((lua_getfield(L, -1, "encoder_parms") == LUA_TTABLE) &&
+      (lua_getfield(L, -1, "colors") == LUA_TSTRING)) {
+    colors = lua_tolstring(L, -1, &len);
+    result = (len == sizeof(DEFAULT_COLORS) - 1) &&
+      (memcmp(colors, DEFAULT_COLORS, len) == 0);
+  }
+  lua_settop(L, top);
+  return result;
+}
+
 static pthread_once_t initialized = PTHREAD_ONCE_INIT;
 static int all_is_lost = TRUE;
 static _Atomic(str *) temp_rosie_home; //This ptr is only valid during the call to rosie_home_init(), used to pass the arg into initialize()
@@ -262,8 +303,45 @@ static void initialize () {
 
 static pthread_mutex_t booting = PTHREAD_MUTEX_INITIALIZER;
 
+/* The boot code is read from the bootscript file (or the rosie_home
+   image) when the first engine is created, and kept (for the life of
+   the process) so that later engines do not have to read it again.
+   Protected by the booting lock.
+*/
+static const char *bootcode = NULL;
+static size_t bootcode_len = 0;
+
+static int read_bootcode (void) {
+  long len;
+  char *code;
+  const rosie_home_file *file = image_lookup(bootscript);
+  if (file) {
+    bootcode = (const char *) file->data;
+    bootcode_len = file->len;
+    return TRUE;
+  }
+  FILE *f = fopen(bootscript, "rb");
+  if (!f) return FALSE;
+  if ((fseek(f, 0, SEEK_END) != 0) || ((len = ftell(f)) <= 0) || (fseek(f, 0, SEEK_SET) != 0))
+    goto fail;
+  code = (char *) malloc((size_t) len);
+  if (!code) goto fail;
+  if (fread(code, 1, (size_t) len, f) != (size_t) len) {
+    free(code);
+    goto fail;
+  }
+  bootcode = code;
+  bootcode_len = (size_t) len;
+  fclose(f);
+  return TRUE;
+ fail:
+  fclose(f);
+  return FALSE;
+}
+
 static int boot (lua_State *L, str *messages) {
   char *msg = NULL;
+  int status;
   if (!*bootscript) {
     *messages = rosie_new_string_from_const(NO_INSTALLATION_MSG);
     return FALSE;
@@ -271,10 +349,17 @@ static int boot (lua_State *L, str *messages) {
   LOGf("Booting rosie from %s\n", bootscript);
   ACQUIRE_LOCK(booting);
 
-  int status = luaL_loadfile(L, bootscript);
+  if (!bootcode && !read_bootcode()) {
+    status = LUA_ERRFILE;
+  } else {
+    /* Same chunkname that luaL_loadfile() would use */
+    const char *chunkname = lua_pushfstring(L, "@%s", bootscript);
+    status = luaL_loadbuffer(L, bootcode, bootcode_len, chunkname);
+    lua_remove(L, -2);
+  }
   if (status != LUA_OK) {
     RELEASE_LOCK(booting);
-    LOG("Failed to read rosie boot code (using loadfile)\n");
+    LOG("Failed to read rosie boot code\n");
     if (asprintf(&msg, "no rosie installation in directory '%s'", rosie_home)) {
       *messages = rosie_string_from((byte_ptr) msg, strlen(msg));
     } else {
@@ -282,7 +367,7 @@ static int boot (lua_State *L, str *messages) {
     }
     return FALSE;
   }
-  LOG("Reading of boot code succeeded (using loadfile)\n");
+  LOG("Reading of boot code succeeded\n");
   status = lua_pcall(L, 0, LUA_MULTRET, 0);
   if (status != LUA_OK) {
     RELEASE_LOCK(booting);
@@ -378,6 +463,15 @@ static int format_violation_messages (lua_State *L) {
 
 static int violations_to_json_string (lua_State *L, str *json_string) {
   CHECK_TYPE("violation messages", lua_type(L, -1), LUA_TTABLE);
+  /* Most calls succeed with no messages, so skip the Lua calls */
+  if (lua_rawlen(L, -1) == 0) {
+    lua_pushnil(L);
+    if (!lua_next(L, -2)) {
+      *json_string = rosie_string_from(NULL, 0);
+      return LUA_OK;
+    }
+    lua_pop(L, 2);
+  }
   int t = format_violation_messages(L);
   if (t == LUA_OK) {
     t = to_json_string(L, -1, json_string);
@@ -391,14 +485,214 @@ static int violations_to_json_string (lua_State *L, str *json_string) {
 int luaopen_lpeg (lua_State *L);
 int luaopen_cjson_safe (lua_State *l);
 
+static _Atomic int engine_alloc_flags;
+
+/* rosie_engine_alloc: Sets the allocator for the Lua state of each
+ * engine created afterwards (by rosie_new, rosie_clone, or an engine
+ * pool).  With ROSIE_ALLOC_POOL, small allocations come from size
+ * class pools (see luaalloc.c) instead of malloc, and
+ * ROSIE_ALLOC_HUGEPAGES puts the pools in huge pages if possible.
+ * Existing engines keep the allocator they were created with.
+ */
+EXPORT
+void rosie_engine_alloc (int flags) {
+  atomic_store(&engine_alloc_flags, flags);
+}
+
 static lua_State *newstate () {
-  lua_State *newL = luaL_newstate();
+  lua_State *newL;
+  LuaPool *pool;
+  int flags = atomic_load(&engine_alloc_flags);
+  if (flags & ROSIE_ALLOC_POOL) {
+    if (!(pool = pool_new(flags))) return NULL;
+    if (!(newL = lua_newstate(pool_lalloc, pool))) {
+      pool_free(pool);
+      return NULL;
+    }
+    lua_atpanic(newL, &engine_panic);
+  } else {
+    newL = luaL_newstate();
+    if (!newL) return NULL;
+  }
   luaL_checkversion(newL); /* Ensures several critical things needed to use Lua */
   luaL_openlibs(newL);     /* Open lua's standard libraries */
   luaL_requiref(newL, "lpeg", luaopen_lpeg, 0);
   luaL_requiref(newL, "cjson.safe", luaopen_cjson_safe, 0);
+  image_install(newL);
   return newL;
 }
+
+static void closestate (lua_State *L) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  lua_close(L);
+  if (f == pool_lalloc) pool_free((LuaPool *) ud);
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Setup log
+ * ----------------------------------------------------------------------------------------
+ *
+ * Each engine keeps a list of the successful calls that configured it
+ * or loaded RPL into it, so that rosie_clone() can replay them on a
+ * new engine.  Each entry is a table {op, arg1, arg2}, where the args
+ * are strings, integers, or nil.
+ *
+ * The log is kept short: a libpath or alloc_limit entry replaces one
+ * for the same op just before it, and an import (of any kind) that
+ * repeats one made since the last libpath, load, loadfile or rcfile
+ * entry is dropped, since replaying it would have no effect.  When
+ * the log reaches SETUP_LOG_MAX entries, and each time after that
+ * when it has doubled, it is rebuilt more thoroughly (see
+ * rebuild_setup_log()).  While the rebuilt log is still longer than
+ * SETUP_LOG_MAX, it is marked as overflowed, and the engine cannot be
+ * cloned.  A later rebuild that brings it under SETUP_LOG_MAX clears
+ * the mark.
+ */
+
+#define SETUP_LOG_MAX 4096
+
+static int setup_is_setting (const char *op) {
+  return (strcmp(op, "libpath") == 0) || (strcmp(op, "alloc_limit") == 0);
+}
+
+static int setup_is_import (const char *op) {
+  return (strcmp(op, "import") == 0) || (strcmp(op, "import_lazy") == 0) ||
+    (strcmp(op, "import_deps") == 0);
+}
+
+/* Push the part of a dedup key for the arg at idx */
+static void push_setup_key_part (lua_State *L, int idx) {
+  if (lua_type(L, idx) == LUA_TSTRING) {
+    lua_pushliteral(L, "=");
+    lua_pushvalue(L, idx);
+    lua_concat(L, 2);
+  } else {
+    lua_pushliteral(L, "");
+  }
+}
+
+/* Compact the log at index 'log'.  Beyond what log_setup() does as it
+   goes, this drops a libpath entry that sets the libpath already in
+   effect, a setting that a later one of the same op replaces before
+   any entry other than a setting, and an import that repeats one made
+   since the last load, loadfile, rcfile or change of libpath. */
+static void rebuild_setup_log (lua_State *L, int log) {
+  lua_Integer n = (lua_Integer) lua_rawlen(L, log), kept = 0, i, j;
+  int top = lua_gettop(L), seen, libpath, entry;
+  const char *op;
+  lua_newtable(L);
+  seen = lua_gettop(L);
+  lua_pushnil(L);		/* libpath in effect, nil if not known */
+  libpath = lua_gettop(L);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, log, i);
+    entry = lua_gettop(L);
+    lua_rawgeti(L, entry, 1);
+    op = lua_tostring(L, -1);
+    if (setup_is_import(op)) {
+      lua_rawgeti(L, entry, 2);
+      lua_rawgeti(L, entry, 3);
+      lua_pushvalue(L, entry + 1);
+      push_setup_key_part(L, entry + 2);
+      push_setup_key_part(L, entry + 3);
+      lua_concat(L, 3);
+      lua_pushvalue(L, -1);
+      if (lua_rawget(L, seen) != LUA_TNIL) goto drop;
+      lua_pop(L, 1);
+      lua_pushboolean(L, TRUE);
+      lua_rawset(L, seen);
+    } else if (setup_is_setting(op)) {
+      if (strcmp(op, "libpath") == 0) {
+	lua_rawgeti(L, entry, 2);
+	if (lua_rawequal(L, -1, libpath)) goto drop;
+	lua_replace(L, libpath);
+	lua_newtable(L);
+	lua_replace(L, seen);
+      }
+      /* Among the settings at the end of the kept entries, remove one
+	 for the same op, which this one replaces */
+      for (j = kept; j > 0; j--) {
+	lua_rawgeti(L, log, j);
+	lua_rawgeti(L, -1, 1);
+	if (!setup_is_setting(lua_tostring(L, -1))) break;
+	if (lua_rawequal(L, -1, entry + 1)) {
+	  for (; j < kept; j++) {
+	    lua_rawgeti(L, log, j + 1);
+	    lua_rawseti(L, log, j);
+	  }
+	  kept--;
+	  break;
+	}
+	lua_pop(L, 2);
+      }
+    } else {
+      /* load, loadfile or rcfile (which may change the libpath) */
+      lua_newtable(L);
+      lua_replace(L, seen);
+      lua_pushnil(L);
+      lua_replace(L, libpath);
+    }
+    lua_pushvalue(L, entry);
+    lua_rawseti(L, log, ++kept);
+  drop:
+    lua_settop(L, entry - 1);
+  }
+  for (i = n; i > kept; i--) {
+    lua_pushnil(L);
+    lua_rawseti(L, log, i);
+  }
+  if (kept < SETUP_LOG_MAX) lua_pushnil(L);
+  else lua_pushboolean(L, TRUE);
+  lua_setfield(L, log, "overflow");
+  lua_pushinteger(L, (kept < SETUP_LOG_MAX / 2) ? SETUP_LOG_MAX : 2 * kept);
+  lua_setfield(L, log, "rebuild_at");
+  lua_settop(L, top);
+  LOGf("Setup log rebuilt: %d entries kept of %d\n", (int) kept, (int) n);
+}
+
+/* Append an entry made from the 3 values on top of the stack, and pop them */
+static void log_setup (lua_State *L) {
+  int op = lua_gettop(L) - 2, log = op + 3, seen = op + 4;
+  const char *opname = lua_tostring(L, op);
+  lua_Integer n, limit = SETUP_LOG_MAX;
+  get_registry(setup_log_key);
+  n = (lua_Integer) lua_rawlen(L, log);
+  if (setup_is_import(opname)) {
+    get_registry(setup_seen_key);
+    lua_pushvalue(L, op);
+    push_setup_key_part(L, op + 1);
+    push_setup_key_part(L, op + 2);
+    lua_concat(L, 3);
+    lua_pushvalue(L, -1);
+    if (lua_rawget(L, seen) != LUA_TNIL) goto done; /* a repeat */
+    lua_pop(L, 1);
+    lua_pushboolean(L, TRUE);
+    lua_rawset(L, seen);
+  } else {
+    /* Imports after this entry may not repeat the ones before it */
+    lua_newtable(L);
+    set_registry(setup_seen_key);
+    lua_pop(L, 1);
+    if (setup_is_setting(opname) && (n > 0)) {
+      lua_rawgeti(L, log, n);
+      lua_rawgeti(L, -1, 1);
+      if (lua_rawequal(L, -1, op)) n--; /* replace that entry */
+      lua_pop(L, 2);
+    }
+  }
+  lua_createtable(L, 3, 0);
+  for (int i = 1; i <= 3; i++) {
+    lua_pushvalue(L, op + i - 1);
+    lua_rawseti(L, -2, i);
+  }
+  lua_rawseti(L, log, n + 1);
+  if (lua_getfield(L, log, "rebuild_at") == LUA_TNUMBER)
+    limit = lua_tointeger(L, -1);
+  if (n + 1 >= limit) rebuild_setup_log(L, log);
+ done:
+  lua_settop(L, op - 1);
+}
   
 
 /* ----------------------------------------------------------------------------------------
@@ -412,8 +706,9 @@ static lua_State *newstate () {
  * have no effect.
  * 
  * Currently the only supported format for `home` is a path to a rosie home directory.
- * In the future it may make sense to support a self-contained format, for example, a zlib-
- * encoded directory structure within a block of static memory compiled into the library.
+ * When librosie is built with the rosie_home files linked in (ROSIE_HOME_IMAGE, see
+ * homeimage.c), those files are read from memory instead, and `home` is only the path
+ * under which they appear.  It need not exist.
  *
  * If `home` is NULL, the code will default to "../lib/rosie", relative to librosie location
  */
@@ -501,6 +796,15 @@ Engine *rosie_new(str *messages) {
   lua_pushinteger(L, 0);
   set_registry(alloc_set_limit_key);
 
+  lua_newtable(L);
+  set_registry(setup_log_key);
+
+  lua_newtable(L);
+  set_registry(setup_seen_key);
+
+  lua_newtable(L);
+  set_registry(lazy_imports_key);
+
   pthread_mutex_init(&(e->lock), NULL);
   e->L = L;
 
@@ -509,23 +813,165 @@ Engine *rosie_new(str *messages) {
   return e;
 
 fail_state:
-  lua_close(L);
+  closestate(L);
 fail_engine:
   free(e);
   return NULL;
 }
+
+/* Push onto 'to' a copy of the setup log of the engine whose state is
+   L, and return TRUE, or return FALSE if the log has overflowed */
+static int copy_setup_log (lua_State *L, lua_State *to) {
+  size_t len;
+  const char *s;
+  get_registry(setup_log_key);
+  if (lua_getfield(L, -1, "overflow") != LUA_TNIL) {
+    lua_pop(L, 2);
+    return FALSE;
+  }
+  lua_pop(L, 1);
+  lua_Integer n = (lua_Integer) lua_rawlen(L, -1);
+  lua_createtable(to, (int) n, 0);
+  for (lua_Integer i = 1; i <= n; i++) {
+    lua_rawgeti(L, -1, i);
+    lua_createtable(to, 3, 0);
+    for (int j = 1; j <= 3; j++) {
+      switch (lua_rawgeti(L, -1, j)) {
+      case LUA_TSTRING:
+	s = lua_tolstring(L, -1, &len);
+	lua_pushlstring(to, s, len);
+	break;
+      case LUA_TNUMBER:
+	lua_pushinteger(to, lua_tointeger(L, -1));
+	break;
+      default:
+	lua_pushnil(to);
+      }
+      lua_pop(L, 1);
+      lua_rawseti(to, -2, j);
+    }
+    lua_pop(L, 1);
+    lua_rawseti(to, -2, i);
+  }
+  lua_pop(L, 1);
+  return TRUE;
+}
+
+/* Repeat one setup log entry on engine e, using the public API */
+static int replay_setup (Engine *e, const char *op, str *arg1, str *arg2, int limit, str *messages) {
+  int status = ERR_ENGINE_CALL_FAILED;
+  int ok = TRUE, file_exists, err;
+  str out, msgs;
+  out.ptr = msgs.ptr = NULL;
+  out.len = msgs.len = 0;
+  LOGf("Replaying %s on engine %p\n", op, e);
+  if (strcmp(op, "libpath") == 0) {
+    status = rosie_libpath(e, arg1);
+  } else if (strcmp(op, "alloc_limit") == 0) {
+    status = rosie_alloc_limit(e, &limit, NULL);
+  } else if (strcmp(op, "load") == 0) {
+    status = rosie_load(e, &ok, arg1, &out, &msgs);
+  } else if (strcmp(op, "loadfile") == 0) {
+    status = rosie_loadfile(e, &ok, arg1, &out, &msgs);
+  } else if (strcmp(op, "import") == 0) {
+    status = rosie_import(e, &ok, arg1, arg2->ptr ? arg2 : NULL, &out, &msgs);
+  } else if (strcmp(op, "rcfile") == 0) {
+    status = rosie_execute_rcfile(e, arg1, &file_exists, &ok, &msgs);
+  } else if (strcmp(op, "import_lazy") == 0) {
+    status = rosie_import_lazy(e, arg1, arg2->ptr ? arg2 : NULL);
+  } else if (strcmp(op, "import_deps") == 0) {
+    status = rosie_import_expression_deps(e, arg1, &out, &err, &msgs);
+  }
+  if (out.ptr) rosie_free_string(out);
+  if ((status != SUCCESS) || !ok) {
+    LOGf("Replay of %s failed\n", op);
+    if (msgs.ptr) *messages = msgs;
+    else *messages = rosie_new_string_from_const("failed to set up the cloned engine");
+    return FALSE;
+  }
+  if (msgs.ptr) rosie_free_string(msgs);
+  return TRUE;
+}
+
+/* rosie_clone: Creates a new engine that is set up like engine e, by
+ * replaying e's setup on a new engine.
+ *
+ * A Lua state cannot be copied, so nothing that was built in e is
+ * reused.  The clone is booted, and then the successful calls that
+ * configured e (rosie_libpath, rosie_alloc_limit, rosie_execute_rcfile)
+ * and loaded RPL into it (rosie_load, rosie_loadfile, rosie_import,
+ * rosie_import_lazy, rosie_import_expression_deps) are repeated in
+ * order, from the setup log.  So a clone costs about as much as
+ * setting up e did, except that the boot code is not read again,
+ * since it is kept in memory after the first engine is created.
+ *
+ * The clone is independent of e.  Compiled patterns are not copied,
+ * and must be compiled again in the clone.  An engine whose setup log
+ * is marked as overflowed (see SETUP_LOG_MAX) cannot be cloned.
+ */
+EXPORT
+Engine *rosie_clone(Engine *e, str *messages) {
+  lua_Integer n;
+  int log, limit;
+  str arg1, arg2;
+  const char *op;
+  size_t len;
+  
+  Engine *clone = rosie_new(messages);
+  if (!clone) return NULL;
+  lua_State *L = clone->L;
+
+  ACQUIRE_ENGINE_LOCK(e);
+  if (!copy_setup_log(e->L, L)) {
+    RELEASE_ENGINE_LOCK(e);
+    LOG("rosie_clone(): the setup log has overflowed\n");
+    rosie_finalize(clone);
+    *messages = rosie_new_string_from_const("engine setup is too long to be replayed by rosie_clone");
+    return NULL;
+  }
+  RELEASE_ENGINE_LOCK(e);
+  n = (lua_Integer) lua_rawlen(L, -1);
+  /* Keep the copy in the registry, since each replayed call clears the stack */
+  log = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  for (lua_Integer i = 1; i <= n; i++) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, log);
+    lua_rawgeti(L, -1, i);
+    lua_rawgeti(L, -1, 1);
+    op = lua_tostring(L, -1);
+    lua_rawgeti(L, -2, 2);
+    limit = (int) lua_tointeger(L, -1);
+    arg1.ptr = (byte_ptr) lua_tolstring(L, -1, &len);
+    arg1.len = (uint32_t) len;
+    lua_rawgeti(L, -3, 3);
+    arg2.ptr = (byte_ptr) lua_tolstring(L, -1, &len);
+    arg2.len = (uint32_t) len;
+    /* The strings stay alive in the copy of the log */
+    lua_settop(L, 0);
+    if (!op || !replay_setup(clone, op, &arg1, &arg2, limit, messages)) {
+      rosie_finalize(clone);
+      return NULL;
+    }
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, log);
+  LOGf("Engine %p cloned from %p\n", clone, e);
+  return clone;
+}
      
 /* newlimit of -1 means query for current limit */
 EXPORT
 int rosie_alloc_limit (Engine *e, int *newlimit, int *usage) {
-  int memusg, actual_limit;
+  int memusg = 0, actual_limit;
   lua_State *L = e->L;
   LOGf ("rosie_alloc_limit() called with int pointers %p, %p\n", newlimit, usage);
   ACQUIRE_ENGINE_LOCK(e);
-  lua_gc(L, LUA_GCCOLLECT, 0);
-  lua_gc(L, LUA_GCCOLLECT, 0);        /* second time to free resources marked for finalization */
-  memusg = lua_gc(L, LUA_GCCOUNT, 0); /* KB */
-  if (usage) *usage = memusg;
+  /* Only the usage and a new limit need an accurate heap size */
+  if (usage || (newlimit && (*newlimit != -1))) {
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    lua_gc(L, LUA_GCCOLLECT, 0);        /* second time to free resources marked for finalization */
+    memusg = lua_gc(L, LUA_GCCOUNT, 0); /* KB */
+    if (usage) *usage = memusg;
+  }
   if (newlimit) {
     int limit = *newlimit;
     if ((limit != -1) && (limit != 0) && (limit < MIN_ALLOC_LIMIT_MB)) {
@@ -543,6 +989,10 @@ int rosie_alloc_limit (Engine *e, int *newlimit, int *usage) {
       actual_limit = memusg + limit;
       lua_pushinteger(L, (limit == 0) ? 0 : actual_limit);
       set_registry(alloc_actual_limit_key);
+      lua_pushliteral(L, "alloc_limit");
+      lua_pushinteger(L, limit);
+      lua_pushnil(L);
+      log_setup(L);
       if (limit == 0) {
 	LOGf("set alloc limit to UNLIMITED above current usage level of %0.1f MB\n", memusg/1024.0);
       } else {
@@ -633,6 +1083,11 @@ int rosie_libpath (Engine *e, str *newpath) {
     str tmpstr = rosie_new_string((byte_ptr)tmpptr, tmplen);
     (*newpath).ptr = tmpstr.ptr;
     (*newpath).len = tmpstr.len;
+  } else {
+    lua_pushliteral(L, "libpath");
+    lua_pushlstring(L, (const char *)newpath->ptr, newpath->len);
+    lua_pushnil(L);
+    log_setup(L);
   }
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
@@ -659,37 +1114,176 @@ int rosie_free_rplx (Engine *e, int pat) {
   return SUCCESS;
 }
 
-/* N.B. Client must free messages */
-EXPORT
-int rosie_compile (Engine *e, str *expression, int *pat, str *messages) {
-  int t;
-  str temp_rs;
-  lua_State *L;
-  
-  if (!expression) {
-    LOG("null pointer passed to compile for expression argument\n");
-    return ERR_ENGINE_CALL_FAILED;
-  }  
+/* ----------------------------------------------------------------------------------------
+ * Lazy imports
+ * ----------------------------------------------------------------------------------------
+ *
+ * rosie_import_lazy() records a package to import, keyed by the
+ * prefix that RPL code will use to refer to it.  The package is
+ * imported (by rosie_import) just before rosie_compile() or
+ * rosie_load() is given RPL text that contains a reference of the
+ * form "prefix.name".  The test is lexical, so e.g. a string literal
+ * that looks like a reference may cause an unneeded import, which is
+ * harmless.
+ */
 
-  if (!expression) {
-    LOG("null pointer passed to compile for expression argument\n");
-    return ERR_ENGINE_CALL_FAILED;
-  }  
+/* The prefix is 'as' if given, else the last component of the import path */
+static void push_import_prefix (lua_State *L, str *pkgname, str *as) {
+  if (as && as->ptr) {
+    lua_pushlstring(L, (const char *)as->ptr, as->len);
+  } else {
+    const char *name = (const char *)pkgname->ptr;
+    const char *start = name + pkgname->len;
+    while ((start > name) && (start[-1] != '/')) start--;
+    lua_pushlstring(L, start, pkgname->len - (size_t) (start - name));
+  }
+}
 
-  if (!expression->ptr) {
-    LOG("null pointer inside expression passed to compile\n");
-    return ERR_ENGINE_CALL_FAILED;
-  }  
+static int is_id_char (char c) {
+  return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) ||
+    ((c >= '0') && (c <= '9')) || (c == '_');
+}
 
-  L = e->L;
-  LOGf("compile(): L = %p, expression = %*s\n", L, expression->len, expression->ptr);
+/* Does 'input' contain "prefix." where prefix is not the end of a longer identifier? */
+static int refers_to_prefix (str *input, const char *prefix, size_t len) {
+  const char *s = (const char *)input->ptr;
+  const char *end = s + input->len;
+  const char *p = s;
+  while ((p = memmem(p, (size_t) (end - p), prefix, len)) != NULL) {
+    if (((p + len) < end) && (p[len] == '.') && ((p == s) || !is_id_char(p[-1])))
+      return TRUE;
+    p++;
+  }
+  return FALSE;
+}
+
+/* Import the lazily imported packages that 'input' refers to.
+   Returns TRUE if every import succeeded.  Otherwise, the remaining
+   imports are not attempted, and if 'messages' is not NULL, it is set
+   to the messages of the import that failed (client must free).  A
+   package stays pending until it has been imported successfully,
+   which removes it (see rosie_import), so a failed import is
+   attempted again the next time it is referenced.
+*/
+static int import_referenced (Engine *e, str *input, str *messages) {
+  int ok = TRUE, status, n = 0, i;
+  str *pending = NULL, *p, actual_pkgname, import_messages;
+  size_t len;
+  const char *prefix;
+  lua_State *L = e->L;
+
+  if (!input || !input->ptr) return TRUE;
   ACQUIRE_ENGINE_LOCK(e);
-  if (!pat) {
-    LOG("null pointer passed to compile for pattern argument\n");
-    lua_settop(L, 0);
-    RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED;
+  get_registry(lazy_imports_key);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    prefix = lua_tolstring(L, -2, &len);
+    if (refers_to_prefix(input, prefix, len)) {
+      /* Two strings per package: pkgname and as (which may be NULL) */
+      p = (str *) realloc(pending, 2 * (n + 1) * sizeof(str));
+      if (!p) {
+	lua_pop(L, 2);
+	break;
+      }
+      pending = p;
+      lua_rawgeti(L, -1, 1);
+      pending[2*n] = rosie_new_string((byte_ptr) lua_tostring(L, -1), lua_rawlen(L, -1));
+      lua_pop(L, 1);
+      if (lua_rawgeti(L, -1, 2) == LUA_TSTRING)
+	pending[2*n + 1] = rosie_new_string((byte_ptr) lua_tostring(L, -1), lua_rawlen(L, -1));
+      else
+	pending[2*n + 1].ptr = NULL;
+      lua_pop(L, 1);
+      n++;
+    }
+    lua_pop(L, 1);
+  }
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+
+  /* rosie_import() takes the engine lock */
+  for (i = 0; i < n; i++) {
+    if (ok) {
+      LOGf("lazy import of %.*s\n", (int) pending[2*i].len, pending[2*i].ptr);
+      actual_pkgname.ptr = import_messages.ptr = NULL;
+      status = rosie_import(e, &ok, &pending[2*i], pending[2*i + 1].ptr ? &pending[2*i + 1] : NULL,
+			    &actual_pkgname, &import_messages);
+      if (status != SUCCESS) ok = FALSE;
+      if (!ok) {
+	LOG("lazy import failed\n");
+	if (messages && !import_messages.ptr)
+	  import_messages = rosie_new_string_from_const("[\"lazy import failed\"]");
+	if (messages) *messages = import_messages;
+	else if (import_messages.ptr) rosie_free_string(import_messages);
+      } else if (import_messages.ptr) {
+	rosie_free_string(import_messages);
+      }
+      if (actual_pkgname.ptr) rosie_free_string(actual_pkgname);
+    }
+    rosie_free_string(pending[2*i]);
+    if (pending[2*i + 1].ptr) rosie_free_string(pending[2*i + 1]);
+  }
+  free(pending);
+  return ok;
+}
+
+/* As import_referenced(), for the contents of the file 'fn'.  A file
+   that cannot be read is left for engine.loadfile() to report. */
+static int import_referenced_file (Engine *e, str *fn, str *messages) {
+  long len;
+  int ok = TRUE;
+  str contents;
+  FILE *f;
+  char *name = (char *) malloc(fn->len + 1);
+  if (!name) return TRUE;
+  memcpy(name, fn->ptr, fn->len);
+  name[fn->len] = '\0';
+  f = fopen(name, "rb");
+  free(name);
+  if (!f) return TRUE;
+  if ((fseek(f, 0, SEEK_END) == 0) && ((len = ftell(f)) > 0) && (fseek(f, 0, SEEK_SET) == 0)) {
+    contents.ptr = (byte_ptr) malloc((size_t) len);
+    contents.len = (uint32_t) len;
+    if (contents.ptr && (fread((void *) contents.ptr, 1, (size_t) len, f) == (size_t) len))
+      ok = import_referenced(e, &contents, messages);
+    free((void *) contents.ptr);
+  }
+  fclose(f);
+  return ok;
+}
+
+EXPORT
+int rosie_import_lazy (Engine *e, str *pkgname, str *as) {
+  lua_State *L = e->L;
+  if (!pkgname || !pkgname->ptr) return ERR_ENGINE_CALL_FAILED;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(lazy_imports_key);
+  push_import_prefix(L, pkgname, as);
+  lua_createtable(L, 2, 0);
+  lua_pushlstring(L, (const char *)pkgname->ptr, pkgname->len);
+  lua_rawseti(L, -2, 1);
+  if (as && as->ptr) {
+    lua_pushlstring(L, (const char *)as->ptr, as->len);
+    lua_rawseti(L, -2, 2);
   }
+  lua_settable(L, -3);
+  lua_pushliteral(L, "import_lazy");
+  lua_pushlstring(L, (const char *)pkgname->ptr, pkgname->len);
+  if (as && as->ptr) lua_pushlstring(L, (const char *)as->ptr, as->len);
+  else lua_pushnil(L);
+  log_setup(L);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* Compile an expression, with the engine lock held.  On success, the
+   violations table is on top of the stack.  It holds the errors when
+   *pat is 0, else any warnings.
+*/
+static int compile_expression (Engine *e, str *expression, int *pat) {
+  int t;
+  lua_State *L = e->L;
 
   *pat = 0;			/* Indicate compilation error */
 
@@ -711,12 +1305,65 @@ int rosie_compile (Engine *e, str *expression, int *pat, str *messages) {
 
   if (t != LUA_OK) {
     LOG("compile() failed\n");
+    return ERR_ENGINE_CALL_FAILED;
+  }
+
+  if ( !lua_toboolean(L, -2) ) return SUCCESS;
+  
+  lua_pushvalue(L, -2);
+  CHECK_TYPE("new rplx object", lua_type(L, -1), LUA_TTABLE);
+  *pat = luaL_ref(L, 1);
+  assert( *pat != 0 );		/* Implementation of luaL_ref() ensures this. */
+  if (*pat == LUA_REFNIL) {
+    LOG("error storing rplx object\n");
+    *pat = 0;
+    return ERR_ENGINE_CALL_FAILED;
+  }
+
+  LOGf("storing rplx object at index %d\n", *pat);
+  return SUCCESS;
+}
+
+/* N.B. Client must free messages */
+EXPORT
+int rosie_compile (Engine *e, str *expression, int *pat, str *messages) {
+  int t;
+  str temp_rs;
+  lua_State *L;
+  
+  if (!expression) {
+    LOG("null pointer passed to compile for expression argument\n");
+    return ERR_ENGINE_CALL_FAILED;
+  }  
+
+  if (!expression->ptr) {
+    LOG("null pointer inside expression passed to compile\n");
+    return ERR_ENGINE_CALL_FAILED;
+  }  
+
+  L = e->L;
+  LOGf("compile(): L = %p, expression = %*s\n", L, expression->len, expression->ptr);
+  if (!import_referenced(e, expression, messages)) {
+    /* Reported like a compile error, with the import's messages */
+    if (pat) *pat = 0;
+    return SUCCESS;
+  }
+  ACQUIRE_ENGINE_LOCK(e);
+  if (!pat) {
+    LOG("null pointer passed to compile for pattern argument\n");
     lua_settop(L, 0);
     RELEASE_ENGINE_LOCK(e);
     return ERR_ENGINE_CALL_FAILED;
   }
 
-  if ( !lua_toboolean(L, -2) ) {
+  t = compile_expression(e, expression, pat);
+  if (t != SUCCESS) {
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return t;
+  }
+
+  if (!*pat) {
     t = violations_to_json_string(L, &temp_rs);
     if (t != LUA_OK) {
       lua_settop(L, 0);
@@ -731,19 +1378,6 @@ int rosie_compile (Engine *e, str *expression, int *pat, str *messages) {
     return SUCCESS;
   }
   
-  lua_pushvalue(L, -2);
-  CHECK_TYPE("new rplx object", lua_type(L, -1), LUA_TTABLE);
-  *pat = luaL_ref(L, 1);
-  assert( *pat != 0 );		/* Implementation of luaL_ref() ensures this. */
-  if (*pat == LUA_REFNIL) {
-    LOG("error storing rplx object\n");
-    lua_settop(L, 0);
-    RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED;
-  }
-
-  LOGf("storing rplx object at index %d\n", *pat);
-
   t = violations_to_json_string(L, &temp_rs);
   if (t != LUA_OK) {
     LOG("in compile(), could not convert warning information to json\n");
@@ -760,31 +1394,219 @@ int rosie_compile (Engine *e, str *expression, int *pat, str *messages) {
   return SUCCESS;
 }
 
-static inline void collect_if_needed (lua_State *L) {
-  int limit, memusg;
-  get_registry(alloc_actual_limit_key);
-  limit = lua_tointeger(L, -1);	/* nil will convert to zero */
-  lua_pop(L, 1);
-  if (limit) {
-    memusg = lua_gc(L, LUA_GCCOUNT, 0);
-    if (memusg > limit) {
-      LOGf("invoking collection of %0.1f MB heap\n", memusg/1024.0);
-      lua_gc(L, LUA_GCCOLLECT, 0);
-#if (LOGGING)
-      memusg = lua_gc(L, LUA_GCCOUNT, 0);
-      LOGf("post-collection heap has %0.1f MB\n", memusg/1024.0);
-#endif
+/* ----------------------------------------------------------------------------- */
+/* Compile diagnostics                                                           */
+/* ----------------------------------------------------------------------------- */
+
+/*
+ * rosie_compile_diag() returns the violations from the compiler as C
+ * structures (see diagnostics.c), instead of formatting them in Lua
+ * and encoding them as JSON.  A compile with no violations allocates
+ * nothing.
+ */
+
+static const struct {
+  const char *kind;		/* field of rosie.env.violation */
+  int severity;
+} violation_kinds[] = {
+  {"syntax",  ROSIE_DIAG_ERROR},	/* has a sourceref */
+  {"compile", ROSIE_DIAG_ERROR},	/* the rest have an ast */
+  {"warning", ROSIE_DIAG_WARNING},
+  {"info",    ROSIE_DIAG_INFO},
+  {NULL, 0}
+};
+
+/* Index into violation_kinds of the violation at 'v', or -1 */
+static int violation_kind (lua_State *L, int violation, int v) {
+  int found;
+  for (int i = 0; violation_kinds[i].kind; i++) {
+    if (lua_getfield(L, violation, violation_kinds[i].kind) == LUA_TTABLE) {
+      if (lua_getfield(L, -1, "is") == LUA_TFUNCTION) {
+	lua_pushvalue(L, v);
+	lua_call(L, 1, 1);
+	found = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	if (found) return i;
+	continue;
+      }
+      lua_pop(L, 1);
     }
+    lua_pop(L, 1);
   }
+  return -1;
 }
 
-/*
- * Get the initial position for the match, interpreting negative
- * values from the end of the input string, using Lua convention,
- * including 1-based indexing.
- */
-static uint32_t initposition (int pos, size_t len) {
-  if (pos == 0) return 1;	/* 0 means "default to first char" */
+/* Get the position field 'name' of the source ref on top of the stack */
+static int32_t sourceref_pos (lua_State *L, const char *name) {
+  int32_t pos = -1;
+  if (lua_getfield(L, -1, name) == LUA_TNUMBER) pos = (int32_t) lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return pos;
+}
+
+/* Called in protected mode, with the violations table and a pointer
+   to where the new diagnostics go.  Accessing the fields of a
+   violation (a recordtype) raises an error if the field is invalid. */
+static int extract_diagnostics (lua_State *L) {
+  int kind, n;
+  int32_t start, end;
+  size_t wholen, messagelen;
+  const char *who, *message;
+  struct rosie_diagnostics **dp = (struct rosie_diagnostics **) lua_touserdata(L, 2);
+  n = (int) lua_rawlen(L, 1);
+  if (!(*dp = diagnostics_new(n))) return luaL_error(L, "out of memory");
+  lua_getglobal(L, "rosie");
+  lua_getfield(L, -1, "env");
+  lua_getfield(L, -1, "violation");
+  lua_replace(L, 3);
+  lua_settop(L, 3);
+  for (int i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);	/* index 4 */
+    kind = violation_kind(L, 3, 4);
+    lua_getfield(L, 4, "who");
+    who = (lua_type(L, -1) == LUA_TSTRING) ? lua_tolstring(L, -1, &wholen) : NULL;
+    lua_getfield(L, 4, "message");
+    message = (lua_type(L, -1) == LUA_TSTRING) ? lua_tolstring(L, -1, &messagelen) : NULL;
+    start = end = -1;
+    if (kind >= 0) {
+      if (kind == 0) lua_getfield(L, 4, "sourceref");
+      else if (lua_getfield(L, 4, "ast") == LUA_TTABLE) lua_getfield(L, -1, "sourceref");
+      if (lua_type(L, -1) == LUA_TTABLE) {
+	start = sourceref_pos(L, "s");
+	end = sourceref_pos(L, "e");
+      }
+    }
+    if (!diagnostics_add(*dp, (kind >= 0) ? violation_kinds[kind].severity : ROSIE_DIAG_ERROR,
+			 who, wholen, message, messagelen, start, end))
+      return luaL_error(L, "out of memory");
+    lua_settop(L, 3);
+  }
+  return 0;
+}
+
+/* N.B. Client must free diags with rosie_diagnostics_free() */
+EXPORT
+int rosie_compile_diag (Engine *e, str *expression, int *pat, struct rosie_diagnostics **diags) {
+  int t;
+  lua_State *L = e->L;
+  *diags = NULL;
+  if (!expression || !expression->ptr || !pat) {
+    LOG("null pointer passed to compile_diag\n");
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  /* A failed import shows up in the diagnostics of the compile */
+  import_referenced(e, expression, NULL);
+  ACQUIRE_ENGINE_LOCK(e);
+  t = compile_expression(e, expression, pat);
+  if (t != SUCCESS) goto done;
+  CHECK_TYPE("violation messages", lua_type(L, -1), LUA_TTABLE);
+  if (lua_rawlen(L, -1) == 0) goto done;
+  lua_pushcfunction(L, extract_diagnostics);
+  lua_insert(L, -2);
+  lua_pushlightuserdata(L, diags);
+  if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+    LOGf("could not extract compile diagnostics: %s\n", lua_tostring(L, -1));
+    rosie_diagnostics_free(*diags);
+    *diags = NULL;
+    if (*pat) {
+      luaL_unref(L, 1, *pat);	/* rplx table is at 1 */
+      *pat = 0;
+    }
+    t = ERR_ENGINE_CALL_FAILED;
+  }
+ done:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return t;
+}
+
+static inline void collect_if_needed (lua_State *L) {
+  int limit, memusg, mode;
+  get_registry(alloc_actual_limit_key);
+  limit = lua_tointeger(L, -1);	/* nil will convert to zero */
+  lua_pop(L, 1);
+  if (limit) {
+    get_registry(gc_mode_key);
+    mode = lua_tointeger(L, -1);	/* nil is ROSIE_GC_FULL */
+    lua_pop(L, 1);
+    if (mode == ROSIE_GC_MANUAL) return;
+    memusg = lua_gc(L, LUA_GCCOUNT, 0);
+    if (memusg > limit) {
+      if (mode == ROSIE_GC_INCREMENTAL) {
+	lua_gc(L, LUA_GCSTEP, 0);
+	return;
+      }
+      LOGf("invoking collection of %0.1f MB heap\n", memusg/1024.0);
+      lua_gc(L, LUA_GCCOLLECT, 0);
+#if (LOGGING)
+      memusg = lua_gc(L, LUA_GCCOUNT, 0);
+      LOGf("post-collection heap has %0.1f MB\n", memusg/1024.0);
+#endif
+    }
+  }
+}
+
+/* rosie_gc_config: Sets how the engine collects garbage.
+ *
+ * ROSIE_GC_FULL (the default) does a full collection before a match
+ * when the heap has grown past the alloc limit (see
+ * rosie_alloc_limit).  ROSIE_GC_INCREMENTAL does one incremental step
+ * instead, so that no single match pays for a whole collection.
+ * ROSIE_GC_MANUAL stops the Lua collector altogether, and the client
+ * calls rosie_gc_step() when convenient, e.g. between requests.
+ *
+ * A pause or stepmul greater than zero sets the corresponding
+ * parameter of the Lua incremental collector (LUA_GCSETPAUSE,
+ * LUA_GCSETSTEPMUL).  The settings are not copied by rosie_clone().
+ */
+EXPORT
+int rosie_gc_config (Engine *e, int mode, int pause, int stepmul) {
+  lua_State *L = e->L;
+  if ((mode < ROSIE_GC_FULL) || (mode > ROSIE_GC_MANUAL)) return ERR_ENGINE_CALL_FAILED;
+  ACQUIRE_ENGINE_LOCK(e);
+  lua_pushinteger(L, mode);
+  set_registry(gc_mode_key);
+  if (mode == ROSIE_GC_MANUAL) lua_gc(L, LUA_GCSTOP, 0);
+  else lua_gc(L, LUA_GCRESTART, 0);
+  if (pause > 0) lua_gc(L, LUA_GCSETPAUSE, pause);
+  if (stepmul > 0) lua_gc(L, LUA_GCSETSTEPMUL, stepmul);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* rosie_gc_step: Does some garbage collection now.  When kbytes is
+ * negative, that is a full collection.  Otherwise, it is an
+ * incremental step that does about as much work as allocating kbytes
+ * would cause (or one basic step when kbytes is zero), and *done is
+ * set when the step finished a collection cycle.  The heap size in
+ * KB after the step is returned in *usage.  Either pointer may be
+ * NULL.
+ */
+EXPORT
+int rosie_gc_step (Engine *e, int kbytes, int *done, int *usage) {
+  int finished;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  if (kbytes < 0) {
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    finished = TRUE;
+  } else {
+    finished = lua_gc(L, LUA_GCSTEP, kbytes);
+  }
+  if (done) *done = finished;
+  if (usage) *usage = lua_gc(L, LUA_GCCOUNT, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/*
+ * Get the initial position for the match, interpreting negative
+ * values from the end of the input string, using Lua convention,
+ * including 1-based indexing.
+ */
+static uint32_t initposition (int pos, size_t len) {
+  if (pos == 0) return 1;	/* 0 means "default to first char" */
   if (pos > 0) {		/* positive index? */
     if ((size_t)pos <= len)	/* inside the string? */
       return (size_t)pos;	/* retain 1-based indexing */
@@ -831,139 +1653,928 @@ int rosie_match (Engine *e, int pat, int start, char *encoder_name, str *input,
 		      match, collect_times);
 }
 
-#define set_match2_error(match, errno) \
-  do { match->data.ptr = NULL;         \
-       match->data.len = (errno);      \
-  } while (0);
+/*
+ * The input wrapper of an rplx, which is what its Lua encoders read
+ * the input from.  It is made on first use and then pointed at each
+ * new input, instead of making a buffer userdata (and Buffer) for
+ * every match.  Between matches it points at nothing, so an encoder
+ * that keeps it cannot read an input after the call has returned.
+ * The wrapper is a field of the rplx (at index 'rplx'), which is set
+ * and read with raw access in case the rplx has a metatable.
+ */
+#define INPUT_WRAPPER "inputbuf"
+
+static void push_input_wrapper (lua_State *L, int rplx, str *input) {
+  RBuffer *rb;
+  lua_pushliteral(L, INPUT_WRAPPER);
+  if (lua_rawget(L, rplx) == LUA_TUSERDATA) {
+    rb = (RBuffer *) luaL_testudata(L, -1, ROSIE_BUFFER);
+    if (rb && buf_rewrap(*rb, (const char *) input->ptr, input->len)) return;
+  }
+  lua_pop(L, 1);
+  r_newbuffer_wrap(L, (char *) input->ptr, input->len);
+  lua_pushliteral(L, INPUT_WRAPPER);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, rplx);
+}
+
+static void clear_input_wrapper (lua_State *L, int rplx) {
+  RBuffer *rb;
+  lua_pushliteral(L, INPUT_WRAPPER);
+  lua_rawget(L, rplx);
+  rb = (RBuffer *) luaL_testudata(L, -1, ROSIE_BUFFER);
+  if (rb) buf_rewrap(*rb, NULL, 0);
+  lua_pop(L, 1);
+}
+
+#define set_match2_error(match, errno) \
+  do { match->data.ptr = NULL;         \
+       match->data.len = (errno);      \
+  } while (0);
+
+EXPORT
+int rosie_match2 (Engine *e, uint32_t pat, char *encoder_name,
+		  str *input, uint32_t startpos, uint32_t endpos,
+		  struct rosie_matchresult *match,
+		  uint8_t collect_times) {
+  int err, t, encoder, rmatch_encoder;
+  lua_State *L = e->L;
+  LOG("rosie_match2 called\n");
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(L);
+
+  if (pat <= 0) {
+  no_pattern:
+    LOGf("rosie_match2() called with invalid compiled pattern reference: %d\n", pat);
+    set_match2_error(match, ERR_NO_PATTERN);
+    goto call_succeeded;    /* API completed ok, no internal errors */
+  }
+
+  get_registry(rplx_table_key);
+  /* Stack from top: rplx table */
+  t = lua_rawgeti(L, -1, pat);
+  if (t != LUA_TTABLE) goto no_pattern;
+  /* Stack from top: rplx object, rplx table */
+
+  encoder = encoder_name_to_code(encoder_name);
+  /* A pattern loaded from a file has no Lua encoders to fall back on */
+  if ((encoder == ENCODE_COLOR) && !engine_has_default_colors(L)) {
+    t = lua_getfield(L, -1, "lookup_encoder");
+    lua_pop(L, 1);
+    if (t != LUA_TNIL) encoder = 0;
+  }
+
+  if (encoder == 0) {
+    /* This encoder is implemented Lua */
+    t = lua_getfield(L, -1, "lookup_encoder");
+    if (t == LUA_TNIL) {
+      LOG("rosie_match2() called with a lua encoder for an rplx loaded from a file\n");
+      set_match2_error(match, ERR_NO_ENCODER);
+      goto call_succeeded;
+    }
+    CHECK_TYPE("rplx.lookup_encoder()", t, LUA_TFUNCTION);
+    /* Stack from top: lookup_encoder function, rplx object, rplx table */
+    lua_pushstring(L, encoder_name);
+    /* Stack from top: encoder_name, lookup_encoder function, rplx object, rplx table */
+    if (lua_pcall(L, 1, 2, 0) != LUA_OK){ /* 1 arg, 2 return values */
+      LOG("lookup_encoder() failed\n");
+      set_match2_error(match, ERR_INTERNAL);
+      goto call_failed;
+    }
+    /* Stack from top: rmatch encoder number, encoder function, rplx object, rplx table */
+    CHECK_TYPE("rmatch encoder number", lua_type(L, -1), LUA_TNUMBER);
+    rmatch_encoder = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    /* Stack from top: lua encoder function, rplx object, rplx table */
+    CHECK_TYPE("lua encoder function", lua_type(L, -1), LUA_TFUNCTION);
+  } else {
+    /* This encoder is implemented in C, not Lua  */
+    rmatch_encoder = encoder;
+    lua_pushnil(L); /* dummy, to keep stack index numbers consistent below */
+    /* Stack from top: nil, rplx object, rplx table */
+  }
+
+  t = lua_getfield(L, 2, "pattern");
+  CHECK_TYPE("rplx pattern slot", t, LUA_TTABLE);
+  /* Stack from top: pattern object, MAYBE lua encoder, rplx object, rplx table */
+  t = lua_getfield(L, -1, "peg");
+  CHECK_TYPE("rplx pattern peg slot", t, LUA_TUSERDATA);
+  /* Stack from top: peg userdata, pattern object, MAYBE lua encoder, rplx object, rplx table */
+  void *pattern = extract_pattern(L, -1);
+  t = lua_getfield(L, 2, "buf");
+  CHECK_TYPE("rplx.buf", t, LUA_TUSERDATA);
+  /* Stack from top: output, peg, pattern object, MAYBE lua encoder, rplx object, rplx table */
+  RBuffer *output = luaL_checkudata(L, -1, ROSIE_BUFFER);
+
+  if ((encoder == 0) && (*output)->sink.flush) {
+    LOG("rosie_match2() called with a lua encoder for an output sink that flushes\n");
+    set_match2_error(match, ERR_SINK_ENCODER);
+    goto call_succeeded;
+  }
+
+  err = r_match_C2(pattern, input, startpos, endpos,
+		   rmatch_encoder, collect_times,
+		   *output, match);
+
+  if (err != 0) {  
+    LOG("rosie_match2() failed\n");  
+    set_match2_error(match, err);
+    goto call_failed;
+  }
+
+  if ((encoder == 0) && (match->data.ptr != NULL)) {
+    /* Found a match, and the output encoder is written in Lua */
+    /* Stack from top: output, peg, pattern object, lua encoder, rplx object, rplx table */
+    lua_remove(L, -2);		/* remove peg */
+    /* Stack from top: output, pattern object, lua encoder, rplx object, rplx table */
+    lua_remove(L, -2);		/* remove pattern object */
+    /* Stack from top: output, lua encoder, rplx object, rplx table */
+    CHECK_TYPE("lua encoder function", lua_type(L, -1), LUA_TUSERDATA);
+    CHECK_TYPE("lua encoder function", lua_type(L, -2), LUA_TFUNCTION);
+    /* Don't make a copy of the input.  Point the input wrapper at it. */
+    push_input_wrapper(L, 2, input);
+    /* Stack from top: input (as buffer), output, lua encoder, rplx object, rplx table */
+    lua_pushinteger(L, startpos);
+    /* Stack from top: startpos, input, output, lua encoder, rplx object, rplx table */
+    t = lua_getfield(L, 2, "engine");
+    CHECK_TYPE("engine", t, LUA_TTABLE);
+    /* Stack from top: engine, startpos, input, output, lua encoder, rplx object, rplx table */
+    t = lua_getfield(L, -1, "encoder_parms");
+    CHECK_TYPE("engine", t, LUA_TTABLE);
+    /* Stack from top: encoder parms, engine, startpos, input, output, lua encoder, rplx object, rplx table */
+    lua_remove(L, -2);		/* remove engine object */
+    /* Stack from top: encoder parms, startpos, input, output, lua encoder, rplx object, rplx table */
+    t = lua_pcall(L, 4, 1, 0);
+    clear_input_wrapper(L, 2);
+    if (t != LUA_OK) goto call_failed;
+    /* Stack from top: encoder result, rplx object, rplx table */
+    t = lua_type(L, -1);
+    if (t != LUA_TSTRING) {
+      if (t != LUA_TNUMBER) {
+	LOGf("unexpected return type from output encoder: %d\n", t);
+	goto call_failed;
+      }
+      assert(lua_tointeger(L, -1) == ERR_NO_ENCODER);
+      set_match2_error(match, ERR_NO_ENCODER);
+      goto call_succeeded;
+    }
+    size_t temp_len;
+    const char *temp_str = lua_tolstring(L, -1, &temp_len);
+    assert(output);
+    /* The encoded match that the Lua encoder read is no longer needed,
+       so its result replaces it in the output buffer.  Then match->data
+       points into the rplx buffer, as it does for the C encoders, and
+       not into a string that Lua may collect. */
+    buf_reset(*output);
+    if (!buf_addlstring(*output, temp_str, temp_len)) {
+      set_match2_error(match, ERR_INTERNAL);
+      goto call_failed;
+    }
+    match->data.ptr = (byte_ptr) (*output)->data;
+    match->data.len = temp_len;
+  } /* end of lua-implemented encoder invocation */
+
+ call_succeeded:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+
+ call_failed:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return ERR_ENGINE_CALL_FAILED;  
+
+}   /* end rosie_match2() */
+
+/* Find the compiled peg for the rplx with handle 'pat', leaving some
+   values on the Lua stack.  Returns NULL if 'pat' is not valid.
+*/
+static void *rplx_pattern (lua_State *L, uint32_t pat) {
+  int t;
+  if (pat <= 0) return NULL;
+  get_registry(rplx_table_key);
+  t = lua_rawgeti(L, -1, pat);
+  if (t != LUA_TTABLE) return NULL;
+  t = lua_getfield(L, -1, "pattern");
+  CHECK_TYPE("rplx pattern slot", t, LUA_TTABLE);
+  t = lua_getfield(L, -1, "peg");
+  CHECK_TYPE("rplx pattern peg slot", t, LUA_TUSERDATA);
+  return extract_pattern(L, -1);
+}
+
+/* Global search.  See r_match_all() for the format of the output. */
+EXPORT
+int rosie_match2_all (Engine *e, uint32_t pat, char *encoder_name,
+		      str *input, uint32_t startpos, uint32_t endpos,
+		      uint32_t *count,
+		      struct rosie_matchresult *match) {
+  int err, encoder;
+  lua_State *L = e->L;
+  LOG("rosie_match2_all called\n");
+  *count = 0;
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(L);
+  void *pattern = rplx_pattern(L, pat);
+  if (!pattern) {
+    LOGf("rosie_match2_all() called with invalid compiled pattern reference: %d\n", pat);
+    set_match2_error(match, ERR_NO_PATTERN);
+    goto done;
+  }
+  encoder = encoder_name_to_code(encoder_name);
+  if ((encoder == 0) || (encoder == ENCODE_LINE) || (encoder == ENCODE_COLOR) || (encoder == ENCODE_STATUS)) {
+    LOGf("rosie_match2_all() called with encoder %s, which cannot be used for global search\n", encoder_name);
+    set_match2_error(match, ERR_NO_ENCODER);
+    goto done;
+  }
+  /* Stack from top: peg, pattern object, rplx object, rplx table */
+  lua_getfield(L, lua_absindex(L, -3), "buf");
+  RBuffer *output = luaL_checkudata(L, -1, ROSIE_BUFFER);
+  err = r_match_all(pattern, input, startpos, endpos,
+		    encoder, *output, count, match);
+  if (err != 0) {
+    LOG("rosie_match2_all() failed\n");
+    set_match2_error(match, err);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+ done:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+EXPORT
+int rosie_match_stats_enable (Engine *e, uint32_t pat, int enable) {
+  int ok;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  void *pattern = rplx_pattern(L, pat);
+  if (!pattern) {
+    LOGf("rosie_match_stats_enable() called with invalid compiled pattern reference: %d\n", pat);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  ok = r_pattern_collect_stats(pattern, enable);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return ok ? SUCCESS : ERR_OUT_OF_MEMORY;
+}
+
+EXPORT
+int rosie_match_stats (Engine *e, uint32_t pat, struct rosie_matchstats *stats, int reset) {
+  lua_State *L = e->L;
+  if (!stats) {
+    LOG("null pointer passed to match_stats for stats argument\n");
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  ACQUIRE_ENGINE_LOCK(e);
+  void *pattern = rplx_pattern(L, pat);
+  struct rosie_matchstats *current = pattern ? r_pattern_stats(pattern) : NULL;
+  if (!current) {
+    LOGf("rosie_match_stats() called for pattern %d, which is not collecting stats\n", pat);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  *stats = *current;
+  if (reset) memset(current, 0, sizeof(struct rosie_matchstats));
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+EXPORT
+int rosie_match_profile_enable (Engine *e, uint32_t pat, int enable) {
+  int ok;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  void *pattern = rplx_pattern(L, pat);
+  if (!pattern) {
+    LOGf("rosie_match_profile_enable() called with invalid compiled pattern reference: %d\n", pat);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  ok = r_pattern_collect_profile(pattern, enable);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return ok ? SUCCESS : ERR_OUT_OF_MEMORY;
+}
+
+/* N.B. Client must free report */
+EXPORT
+int rosie_match_profile (Engine *e, uint32_t pat, str *report, int reset) {
+  int err;
+  lua_State *L = e->L;
+  if (!report) {
+    LOG("null pointer passed to match_profile for report argument\n");
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  ACQUIRE_ENGINE_LOCK(e);
+  void *pattern = rplx_pattern(L, pat);
+  Buffer *buf = pattern ? buf_new(0) : NULL;
+  if (!buf) {
+    LOGf("rosie_match_profile() called with invalid compiled pattern reference: %d\n", pat);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return pattern ? ERR_OUT_OF_MEMORY : ERR_ENGINE_CALL_FAILED;
+  }
+  err = r_pattern_profile_report(pattern, buf, reset);
+  if (err == 0) {
+    *report = rosie_new_string((byte_ptr) buf->data, buf->n);
+  } else {
+    LOGf("rosie_match_profile() failed with code %d (is profiling enabled?)\n", err);
+  }
+  buf_free(buf);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return (err == 0) ? SUCCESS : ERR_ENGINE_CALL_FAILED;
+}
+
+/* Find the output buffer for the rplx with handle 'pat', leaving some
+   values on the Lua stack.  Returns NULL if 'pat' is not valid.
+*/
+static Buffer *rplx_buffer (lua_State *L, uint32_t pat) {
+  int t;
+  if (pat <= 0) return NULL;
+  get_registry(rplx_table_key);
+  t = lua_rawgeti(L, -1, pat);
+  if (t != LUA_TTABLE) return NULL;
+  t = lua_getfield(L, -1, "buf");
+  CHECK_TYPE("rplx.buf", t, LUA_TUSERDATA);
+  return *(RBuffer *) luaL_checkudata(L, -1, ROSIE_BUFFER);
+}
+
+EXPORT
+int rosie_match2_sink (Engine *e, uint32_t pat, struct rosie_sink *sink) {
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  Buffer *buf = rplx_buffer(L, pat);
+  if (!buf) {
+    LOGf("rosie_match2_sink() called with invalid compiled pattern reference: %d\n", pat);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  if (sink) {
+    BufSink s = {sink->region, sink->size, sink->alloc, sink->flush, sink->ud};
+    buf_set_sink(buf, &s);
+  } else {
+    buf_set_sink(buf, NULL);
+  }
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+EXPORT
+int rosie_match2_flush (Engine *e, uint32_t pat) {
+  int err;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  Buffer *buf = rplx_buffer(L, pat);
+  if (!buf) {
+    LOGf("rosie_match2_flush() called with invalid compiled pattern reference: %d\n", pat);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  err = buf_flush(buf);
+  if (err) {
+    LOGf("rosie_match2_flush(): flush function returned %d\n", err);
+  }
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return err ? ERR_ENGINE_CALL_FAILED : SUCCESS;
+}
+
+EXPORT
+int rosie_sink_fd (void *ud, const char *data, size_t len) {
+  return buf_write_fd(ud, data, len);
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Arenas for transient match memory                                             */
+/* ----------------------------------------------------------------------------- */
+
+EXPORT
+struct rosie_arena *rosie_arena_new (size_t blocksize) {
+  return (struct rosie_arena *) arena_new(blocksize);
+}
+
+EXPORT
+void rosie_arena_reset (struct rosie_arena *arena) {
+  arena_reset((struct Arena *) arena);
+}
+
+EXPORT
+void rosie_arena_free (struct rosie_arena *arena) {
+  arena_free((struct Arena *) arena);
+}
+
+EXPORT
+void *rosie_arena_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  return arena_lalloc(ud, ptr, osize, nsize);
+}
+
+EXPORT
+int rosie_match2_arena (Engine *e, uint32_t pat, struct rosie_arena *arena) {
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  void *pattern = rplx_pattern(L, pat);
+  if (!pattern) {
+    LOGf("rosie_match2_arena() called with invalid compiled pattern reference: %d\n", pat);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  r_pattern_set_arena(pattern, (struct Arena *) arena);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Columnar output                                                               */
+/* ----------------------------------------------------------------------------- */
+
+EXPORT
+struct rosie_columns *rosie_columns_new (void) {
+  return (struct rosie_columns *) columns_new();
+}
+
+EXPORT
+void rosie_columns_reset (struct rosie_columns *cols) {
+  columns_reset((struct Columns *) cols);
+}
+
+EXPORT
+void rosie_columns_free (struct rosie_columns *cols) {
+  columns_free((struct Columns *) cols);
+}
+
+EXPORT
+uint32_t rosie_columns_get (struct rosie_columns *cols, int column, const int32_t **data) {
+  return columns_get((struct Columns *) cols, column, data);
+}
+
+EXPORT
+int rosie_match2_columns (Engine *e, uint32_t pat,
+			  str *input, uint32_t startpos, uint32_t endpos,
+			  int32_t record, struct rosie_columns *cols,
+			  struct rosie_matchresult *match) {
+  int err;
+  lua_State *L = e->L;
+  LOG("rosie_match2_columns called\n");
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(L);
+  void *pattern = rplx_pattern(L, pat);
+  if (!pattern) {
+    LOGf("rosie_match2_columns() called with invalid compiled pattern reference: %d\n", pat);
+    set_match2_error(match, ERR_NO_PATTERN);
+    goto done;
+  }
+  /* Stack from top: peg, pattern object, rplx object, rplx table */
+  lua_getfield(L, lua_absindex(L, -3), "buf");
+  RBuffer *output = luaL_checkudata(L, -1, ROSIE_BUFFER);
+  err = r_match_columns(pattern, input, startpos, endpos,
+			(struct Columns *) cols, record, *output, match);
+  if (err != 0) {
+    LOG("rosie_match2_columns() failed\n");
+    set_match2_error(match, err);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+ done:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Capture trees                                                                 */
+/* ----------------------------------------------------------------------------- */
+
+EXPORT
+struct rosie_captree *rosie_captree_new (void) {
+  return (struct rosie_captree *) captree_new();
+}
+
+EXPORT
+void rosie_captree_free (struct rosie_captree *tree) {
+  captree_free((struct CapTree *) tree);
+}
+
+EXPORT
+uint32_t rosie_captree_nodes (struct rosie_captree *tree, const struct rosie_capnode **nodes) {
+  return captree_nodes((struct CapTree *) tree, (const struct CapNode **) nodes);
+}
+
+EXPORT
+int rosie_match2_tree (Engine *e, uint32_t pat,
+		       str *input, uint32_t startpos, uint32_t endpos,
+		       struct rosie_captree *tree,
+		       struct rosie_matchresult *match) {
+  int err;
+  lua_State *L = e->L;
+  LOG("rosie_match2_tree called\n");
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(L);
+  void *pattern = rplx_pattern(L, pat);
+  if (!pattern) {
+    LOGf("rosie_match2_tree() called with invalid compiled pattern reference: %d\n", pat);
+    set_match2_error(match, ERR_NO_PATTERN);
+    goto done;
+  }
+  /* Stack from top: peg, pattern object, rplx object, rplx table */
+  lua_getfield(L, lua_absindex(L, -3), "buf");
+  RBuffer *output = luaL_checkudata(L, -1, ROSIE_BUFFER);
+  err = r_match_tree(pattern, input, startpos, endpos,
+		     (struct CapTree *) tree, *output, match);
+  if (err != 0) {
+    LOG("rosie_match2_tree() failed\n");
+    set_match2_error(match, err);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+ done:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Delimited (TSV/CSV) output                                                    */
+/* ----------------------------------------------------------------------------- */
+
+EXPORT
+int rosie_delimited_new (Engine *e, uint32_t pat, int style,
+			 str *names, int nnames,
+			 struct rosie_delimited **delimited) {
+  lua_State *L = e->L;
+  struct Delimited *d = NULL;
+  LOG("rosie_delimited_new called\n");
+  *delimited = NULL;
+  ACQUIRE_ENGINE_LOCK(e);
+  void *pattern = rplx_pattern(L, pat);
+  if (!pattern) {
+    LOGf("rosie_delimited_new() called with invalid compiled pattern reference: %d\n", pat);
+    goto fail;
+  }
+  d = delimited_new(style);
+  if (!d) {
+    LOGf("rosie_delimited_new() called with invalid style %d (or out of memory)\n", style);
+    goto fail;
+  }
+  for (int i = 0; i < nnames; i++) {
+    if (r_delimited_add(pattern, d, (const char *) names[i].ptr, names[i].len) <= 0) {
+      LOGf("rosie_delimited_new(): %.*s is not a capture of pattern %d, or is repeated\n",
+	   (int) names[i].len, (char *) names[i].ptr, pat);
+      goto fail;
+    }
+  }
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  *delimited = (struct rosie_delimited *) d;
+  return SUCCESS;
+ fail:
+  delimited_free(d);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return ERR_ENGINE_CALL_FAILED;
+}
+
+EXPORT
+void rosie_delimited_free (struct rosie_delimited *delimited) {
+  delimited_free((struct Delimited *) delimited);
+}
+
+EXPORT
+int rosie_match2_delimited (Engine *e, uint32_t pat,
+			    str *input, uint32_t startpos, uint32_t endpos,
+			    struct rosie_delimited *delimited,
+			    struct rosie_matchresult *match) {
+  int err;
+  lua_State *L = e->L;
+  LOG("rosie_match2_delimited called\n");
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(L);
+  void *pattern = rplx_pattern(L, pat);
+  if (!pattern) {
+    LOGf("rosie_match2_delimited() called with invalid compiled pattern reference: %d\n", pat);
+    set_match2_error(match, ERR_NO_PATTERN);
+    goto done;
+  }
+  /* Stack from top: peg, pattern object, rplx object, rplx table */
+  lua_getfield(L, lua_absindex(L, -3), "buf");
+  RBuffer *output = luaL_checkudata(L, -1, ROSIE_BUFFER);
+  err = r_match_delimited(pattern, input, startpos, endpos,
+			  (struct Delimited *) delimited, *output, match);
+  if (err != 0) {
+    LOG("rosie_match2_delimited() failed\n");
+    set_match2_error(match, err);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+ done:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+EXPORT
+int rosie_capture_name (Engine *e, uint32_t pat, int32_t index, str *name) {
+  size_t len = 0;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  void *pattern = rplx_pattern(L, pat);
+  const char *s = pattern ? r_pattern_capture_name(pattern, index, &len) : NULL;
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  if (!s) {
+    LOGf("rosie_capture_name() called with invalid pattern %d or index %d\n", pat, index);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  *name = rosie_string_from((byte_ptr) s, len);
+  return SUCCESS;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Compiled pattern (RPLX) files                                                 */
+/* ----------------------------------------------------------------------------- */
+
+/*
+ * An rplx loaded from a file has only the fields that rosie_match2()
+ * and its C-encoder variants need: pattern.peg and buf.  Without the
+ * rest (engine, lookup_encoder, etc.), it cannot be used with an
+ * encoder written in Lua, or with rosie_match() or rosie_trace().
+ */
+
+/* Push the lpeg function 'name' */
+static void push_lpeg_function (lua_State *L, const char *name) {
+  int t __attribute__((unused)); /* unused when DEBUG not set */
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  t = lua_getfield(L, -1, "lpeg");
+  CHECK_TYPE("lpeg", t, LUA_TTABLE);
+  t = lua_getfield(L, -1, name);
+  CHECK_TYPE(name, t, LUA_TFUNCTION);
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+}
 
 EXPORT
-int rosie_match2 (Engine *e, uint32_t pat, char *encoder_name,
-		  str *input, uint32_t startpos, uint32_t endpos,
-		  struct rosie_matchresult *match,
-		  uint8_t collect_times) {
-  int err, t, encoder, rmatch_encoder;
+int rosie_save_rplx (Engine *e, uint32_t pat, const char *filename) {
   lua_State *L = e->L;
-  LOG("rosie_match2 called\n");
   ACQUIRE_ENGINE_LOCK(e);
-  collect_if_needed(L);
-
-  if (pat <= 0) {
-  no_pattern:
-    LOGf("rosie_match2() called with invalid compiled pattern reference: %d\n", pat);
-    set_match2_error(match, ERR_NO_PATTERN);
-    goto call_succeeded;    /* API completed ok, no internal errors */
+  if (!rplx_pattern(L, pat)) {
+    LOGf("rosie_save_rplx() called with invalid compiled pattern reference: %d\n", pat);
+    goto fail;
+  }
+  /* Stack from top: peg */
+  push_lpeg_function(L, "saveRPLX");
+  lua_insert(L, -2);
+  lua_pushstring(L, filename);
+  if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+    LOGf("saveRPLX failed: %s\n", lua_tostring(L, -1));
+    goto fail;
   }
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+ fail:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return ERR_ENGINE_CALL_FAILED;
+}
 
+/* N.B. Client must free messages */
+EXPORT
+int rosie_load_rplx (Engine *e, const char *filename, int *pat, str *messages) {
+  size_t len;
+  const char *msg;
+  lua_State *L = e->L;
+  *pat = 0;
+  *messages = rosie_string_from(NULL, 0);
+  ACQUIRE_ENGINE_LOCK(e);
   get_registry(rplx_table_key);
-  /* Stack from top: rplx table */
-  t = lua_rawgeti(L, -1, pat);
-  if (t != LUA_TTABLE) goto no_pattern;
-  /* Stack from top: rplx object, rplx table */
+  lua_createtable(L, 0, 2);	/* the new rplx */
+  lua_createtable(L, 0, 1);	/* its pattern slot */
+  push_lpeg_function(L, "loadRPLX");
+  lua_pushstring(L, filename);
+  if (lua_pcall(L, 1, 1, 0) != LUA_OK) goto fail;
+  lua_setfield(L, -2, "peg");
+  lua_setfield(L, -2, "pattern");
+  push_lpeg_function(L, "newbuffer");
+  if (lua_pcall(L, 0, 1, 0) != LUA_OK) goto fail;
+  lua_setfield(L, -2, "buf");
+  *pat = luaL_ref(L, -2);
+  if (*pat == LUA_REFNIL) {
+    *pat = 0;
+    lua_pushliteral(L, "error storing rplx object");
+    goto fail;
+  }
+  LOGf("storing rplx object loaded from %s at index %d\n", filename, *pat);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+ fail:
+  msg = lua_tolstring(L, -1, &len);
+  LOGf("rosie_load_rplx() failed: %s\n", msg ? msg : "(no message)");
+  if (msg) *messages = rosie_new_string((byte_ptr) msg, len);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return ERR_ENGINE_CALL_FAILED;
+}
 
-  encoder = encoder_name_to_code(encoder_name);
+/* ----------------------------------------------------------------------------- */
+/* Pattern sets                                                                  */
+/* ----------------------------------------------------------------------------- */
 
-  if (encoder == 0) {
-    /* This encoder is implemented Lua */
-    t = lua_getfield(L, -1, "lookup_encoder");
-    CHECK_TYPE("rplx.lookup_encoder()", t, LUA_TFUNCTION);
-    /* Stack from top: lookup_encoder function, rplx object, rplx table */
-    lua_pushstring(L, encoder_name);
-    /* Stack from top: encoder_name, lookup_encoder function, rplx object, rplx table */
-    if (lua_pcall(L, 1, 2, 0) != LUA_OK){ /* 1 arg, 2 return values */
-      LOG("lookup_encoder() failed\n");
-      set_match2_error(match, ERR_INTERNAL);
-      goto call_failed;
-    }
-    /* Stack from top: rmatch encoder number, encoder function, rplx object, rplx table */
-    CHECK_TYPE("rmatch encoder number", lua_type(L, -1), LUA_TNUMBER);
-    rmatch_encoder = lua_tointeger(L, -1);
-    lua_pop(L, 1);
-    /* Stack from top: lua encoder function, rplx object, rplx table */
-    CHECK_TYPE("lua encoder function", lua_type(L, -1), LUA_TFUNCTION);
-  } else {
-    /* This encoder is implemented in C, not Lua  */
-    rmatch_encoder = encoder;
-    lua_pushnil(L); /* dummy, to keep stack index numbers consistent below */
-    /* Stack from top: nil, rplx object, rplx table */
-  }
+/*
+ * A pattern set is one compiled program that tries each of several
+ * expressions at the same input position (see r_set in lptree.c), so
+ * that an application matching the same input against many patterns
+ * runs the vm once instead of once per pattern.  A prefix shared by
+ * the members is not factored out of them.  Only the existing choice
+ * and dispatch optimizations apply within each member.
+ *
+ * The set is stored like a loaded rplx (see rosie_load_rplx), so it
+ * works with rosie_match2() and the C encoders, but not with the Lua
+ * encoders.  The top-level capture of a match is named SET_NAME, and
+ * each of its sub-captures is named by the (1-based) index of the
+ * member that matched, and contains the match of that member.
+ */
 
-  t = lua_getfield(L, 2, "pattern");
-  CHECK_TYPE("rplx pattern slot", t, LUA_TTABLE);
-  /* Stack from top: pattern object, MAYBE lua encoder, rplx object, rplx table */
-  t = lua_getfield(L, -1, "peg");
-  CHECK_TYPE("rplx pattern peg slot", t, LUA_TUSERDATA);
-  /* Stack from top: peg userdata, pattern object, MAYBE lua encoder, rplx object, rplx table */
-  void *pattern = extract_pattern(L, -1);
-  t = lua_getfield(L, 2, "buf");
-  CHECK_TYPE("rplx.buf", t, LUA_TUSERDATA);
-  /* Stack from top: output, peg, pattern object, MAYBE lua encoder, rplx object, rplx table */
-  RBuffer *output = luaL_checkudata(L, -1, ROSIE_BUFFER);
+#define SET_NAME "set"
+
+/* Wrap the json compile messages of set member 'member' (1-based) in
+   an object that says which member they are for, freeing 'json'. */
+static str member_messages (int member, str json) {
+  static const char *format = "{\"member\":%d,\"messages\":%.*s}";
+  if (!json.ptr) json = rosie_new_string_from_const("[]");
+  int len = snprintf(NULL, 0, format, member, (int) json.len, (char *) json.ptr);
+  char *wrapped = malloc(len + 1);
+  if (!wrapped) {
+    rosie_free_string(json);
+    return rosie_new_string_from_const("out of memory");
+  }
+  snprintf(wrapped, len + 1, format, member, (int) json.len, (char *) json.ptr);
+  rosie_free_string(json);
+  return rosie_string_from((byte_ptr) wrapped, len);
+}
 
-  err = r_match_C2(pattern, input, startpos, endpos,
-		   rmatch_encoder, collect_times,
-		   *output, match);
+/* N.B. Client must free messages */
+EXPORT
+int rosie_compile_set (Engine *e, str *expressions, int n, int *pat, str *messages) {
+  int t, i, compiled = 0;
+  int *pats;
+  str temp_rs;
+  size_t len;
+  const char *msg;
+  lua_State *L = e->L;
 
-  if (err != 0) {  
-    LOG("rosie_match2() failed\n");  
-    set_match2_error(match, err);
-    goto call_failed;
+  *pat = 0;			/* Indicate compilation error */
+  *messages = rosie_string_from(NULL, 0);
+  if (!expressions || (n < 1)) {
+    LOG("rosie_compile_set() called with no expressions\n");
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  for (i = 0; i < n; i++) {
+    if (!expressions[i].ptr) {
+      LOGf("rosie_compile_set(): null pointer inside expression %d\n", i);
+      return ERR_ENGINE_CALL_FAILED;
+    }
+    if (!import_referenced(e, &expressions[i], messages)) {
+      *messages = member_messages(i + 1, *messages);
+      return SUCCESS;
+    }
   }
+  pats = (int *) calloc(n, sizeof(int));
+  if (!pats) return ERR_OUT_OF_MEMORY;
 
-  if ((encoder == 0) && (match->data.ptr != NULL)) {
-    /* Found a match, and the output encoder is written in Lua */
-    /* Stack from top: output, peg, pattern object, lua encoder, rplx object, rplx table */
-    lua_remove(L, -2);		/* remove peg */
-    /* Stack from top: output, pattern object, lua encoder, rplx object, rplx table */
-    lua_remove(L, -2);		/* remove pattern object */
-    /* Stack from top: output, lua encoder, rplx object, rplx table */
-    CHECK_TYPE("lua encoder function", lua_type(L, -1), LUA_TUSERDATA);
-    CHECK_TYPE("lua encoder function", lua_type(L, -2), LUA_TFUNCTION);
-    /* Don't make a copy of the input.  Wrap it in a Buffer, which will
-       be gc'd later (but will not free the original source data). */
-    r_newbuffer_wrap(L, (char *)input->ptr, input->len); 
-    /* Stack from top: input (as buffer), output, lua encoder, rplx object, rplx table */
-    lua_pushinteger(L, startpos);
-    /* Stack from top: startpos, input, output, lua encoder, rplx object, rplx table */
-    t = lua_getfield(L, 2, "engine");
-    CHECK_TYPE("engine", t, LUA_TTABLE);
-    /* Stack from top: engine, startpos, input, output, lua encoder, rplx object, rplx table */
-    t = lua_getfield(L, -1, "encoder_parms");
-    CHECK_TYPE("engine", t, LUA_TTABLE);
-    /* Stack from top: encoder parms, engine, startpos, input, output, lua encoder, rplx object, rplx table */
-    lua_remove(L, -2);		/* remove engine object */
-    /* Stack from top: encoder parms, startpos, input, output, lua encoder, rplx object, rplx table */
-    if (lua_pcall(L, 4, 1, 0) != LUA_OK) goto call_failed;
-    /* Stack from top: encoder result, rplx object, rplx table */
-    t = lua_type(L, -1);
-    if (t != LUA_TSTRING) {
-      if (t != LUA_TNUMBER) {
-	LOGf("unexpected return type from output encoder: %d\n", t);
-	goto call_failed;
+  ACQUIRE_ENGINE_LOCK(e);
+  for (compiled = 0; compiled < n; compiled++) {
+    t = compile_expression(e, &expressions[compiled], &pats[compiled]);
+    if (t != SUCCESS) goto done;
+    if (!pats[compiled]) {
+      LOGf("rosie_compile_set(): expression %d did not compile\n", compiled);
+      t = violations_to_json_string(L, &temp_rs);
+      if (t != LUA_OK) {
+	*messages = rosie_new_string_from_const("could not convert compile messages to json");
+	t = ERR_ENGINE_CALL_FAILED;
+	goto done;
       }
-      assert(lua_tointeger(L, -1) == ERR_NO_ENCODER);
-      set_match2_error(match, ERR_NO_ENCODER);
-      goto call_succeeded;
+      *messages = member_messages(compiled + 1, temp_rs);
+      t = SUCCESS;
+      goto done;
     }
-    /* Copy lua string to output buffer, and return it */
-    size_t temp_len;
-    const char *temp_str = lua_tolstring(L, -1, &temp_len);
-    assert(output);
-    buf_reset(*output);		/* Reset the buffer for reuse */
-    buf_addlstring(*output, temp_str, temp_len);
-    match->data.len = temp_len;
-  } /* end of lua-implemented encoder invocation */
+    lua_settop(L, 0);
+  }
 
- call_succeeded:
+  /* Stack: rplx table, the new rplx, its pattern slot, rset, members */
+  get_registry(rplx_table_key);
+  lua_createtable(L, 0, 2);
+  lua_createtable(L, 0, 1);
+  push_lpeg_function(L, "rset");
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, pats[i]);
+    lua_getfield(L, -1, "pattern");
+    t = lua_getfield(L, -1, "peg");
+    CHECK_TYPE("rplx pattern peg slot", t, LUA_TUSERDATA);
+    lua_rawseti(L, -4, i + 1);
+    lua_pop(L, 2);
+  }
+  lua_pushliteral(L, SET_NAME);
+  if (lua_pcall(L, 2, 1, 0) != LUA_OK) goto fail;
+  lua_setfield(L, -2, "peg");
+  lua_setfield(L, -2, "pattern");
+  push_lpeg_function(L, "newbuffer");
+  if (lua_pcall(L, 0, 1, 0) != LUA_OK) goto fail;
+  lua_setfield(L, -2, "buf");
+  *pat = luaL_ref(L, 1);
+  if (*pat == LUA_REFNIL) {
+    *pat = 0;
+    lua_pushliteral(L, "error storing rplx object");
+    goto fail;
+  }
+  LOGf("storing pattern set of %d expressions at index %d\n", n, *pat);
+  t = SUCCESS;
+  goto done;
+
+ fail:
+  msg = lua_tolstring(L, -1, &len);
+  LOGf("rosie_compile_set() failed: %s\n", msg ? msg : "(no message)");
+  if (msg) *messages = rosie_new_string((byte_ptr) msg, len);
+  t = ERR_ENGINE_CALL_FAILED;
+
+ done:
+  /* The set has copies of the members, which are no longer needed */
+  lua_settop(L, 0);
+  get_registry(rplx_table_key);
+  for (i = 0; i < compiled; i++) luaL_unref(L, 1, pats[i]);
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
-  return SUCCESS;
+  free(pats);
+  return t;
+}
 
- call_failed:
+/* Match like rosie_match2_tree(), and also set 'members' to the
+   indices of the members of the set that matched, in order, and
+   'count' to how many there are.  At most 'size' indices are stored.
+*/
+EXPORT
+int rosie_match2_set (Engine *e, uint32_t pat,
+		      str *input, uint32_t startpos, uint32_t endpos,
+		      struct rosie_captree *tree,
+		      int32_t *members, int size, int *count,
+		      struct rosie_matchresult *match) {
+  int err;
+  int32_t i;
+  const struct rosie_capnode *nodes;
+  lua_State *L = e->L;
+  LOG("rosie_match2_set called\n");
+  *count = 0;
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(L);
+  void *pattern = rplx_pattern(L, pat);
+  if (!pattern) {
+    LOGf("rosie_match2_set() called with invalid compiled pattern reference: %d\n", pat);
+    set_match2_error(match, ERR_NO_PATTERN);
+    goto done;
+  }
+  /* Stack from top: peg, pattern object, rplx object, rplx table */
+  lua_getfield(L, lua_absindex(L, -3), "buf");
+  RBuffer *output = luaL_checkudata(L, -1, ROSIE_BUFFER);
+  err = r_match_tree(pattern, input, startpos, endpos,
+		     (struct CapTree *) tree, *output, match);
+  if (err != 0) {
+    LOG("rosie_match2_set() failed\n");
+    set_match2_error(match, err);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  if (captree_nodes((struct CapTree *) tree, (const struct CapNode **) &nodes) == 0) goto done;
+  for (i = nodes[0].child; i >= 0; i = nodes[i].sibling) {
+    if (nodes[i].member <= 0) {
+      LOGf("rosie_match2_set(): pattern %d is not a pattern set\n", pat);
+      *count = 0;
+      goto done;
+    }
+    if (*count < size) members[*count] = nodes[i].member;
+    (*count)++;
+  }
+ done:
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
-  return ERR_ENGINE_CALL_FAILED;  
-
-}   /* end rosie_match2() */
+  return SUCCESS;
+}
 
 /* N.B. Client must free trace */
 EXPORT
@@ -1066,6 +2677,12 @@ int rosie_load (Engine *e, int *ok, str *src, str *pkgname, str *messages) {
   unsigned char *temp_str;
   str temp_rs;
   lua_State *L = e->L;
+  if (!import_referenced(e, src, messages)) {
+    *ok = FALSE;
+    pkgname->ptr = NULL;
+    pkgname->len = 0;
+    return SUCCESS;
+  }
   ACQUIRE_ENGINE_LOCK(e);
   get_registry(engine_key);
   t = lua_getfield(L, -1, "load");
@@ -1106,6 +2723,12 @@ int rosie_load (Engine *e, int *ok, str *src, str *pkgname, str *messages) {
   (*messages).ptr = temp_rs.ptr;
   (*messages).len = temp_rs.len;
 
+  if (*ok) {
+    lua_pushliteral(L, "load");
+    lua_pushlstring(L, (const char *)src->ptr, src->len);
+    lua_pushnil(L);
+    log_setup(L);
+  }
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
   return SUCCESS;
@@ -1119,6 +2742,12 @@ int rosie_loadfile (Engine *e, int *ok, str *fn, str *pkgname, str *messages) {
   unsigned char *temp_str;
   str temp_rs;
   lua_State *L = e->L;
+  if (!import_referenced_file(e, fn, messages)) {
+    *ok = FALSE;
+    pkgname->ptr = NULL;
+    pkgname->len = 0;
+    return SUCCESS;
+  }
   ACQUIRE_ENGINE_LOCK(e);
   get_registry(engine_key);
   t = lua_getfield(L, -1, "loadfile");
@@ -1160,6 +2789,12 @@ int rosie_loadfile (Engine *e, int *ok, str *fn, str *pkgname, str *messages) {
   (*messages).ptr = temp_rs.ptr;
   (*messages).len = temp_rs.len;
 
+  if (*ok) {
+    lua_pushliteral(L, "loadfile");
+    lua_pushlstring(L, (const char *)fn->ptr, fn->len);
+    lua_pushnil(L);
+    log_setup(L);
+  }
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
   return SUCCESS;
@@ -1218,6 +2853,19 @@ int rosie_import (Engine *e, int *ok, str *pkgname, str *as, str *actual_pkgname
   (*messages).ptr = temp_rs.ptr;
   (*messages).len = temp_rs.len;
 
+  if (*ok) {
+    /* No longer a lazy import, if it was one */
+    get_registry(lazy_imports_key);
+    push_import_prefix(L, pkgname, as);
+    lua_pushnil(L);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+    lua_pushliteral(L, "import");
+    lua_pushlstring(L, (const char *)pkgname->ptr, pkgname->len);
+    if (as) lua_pushlstring(L, (const char *)as->ptr, as->len);
+    else lua_pushnil(L);
+    log_setup(L);
+  }
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
   return SUCCESS;
@@ -1412,7 +3060,21 @@ int rosie_parse_block (Engine *e, str *input, str *parsetree, str *messages) {
 
 EXPORT
 int rosie_import_expression_deps (Engine *e, str *expression, str *pkgs, int *err, str *messages) {
-  return rosie_syntax_op("import_expression_deps", e, expression, pkgs, err, messages);
+  /* Lazy imports first, so that their packages are the ones used.
+     One that fails is then reported by import_expression_deps. */
+  import_referenced(e, expression, NULL);
+  int status = rosie_syntax_op("import_expression_deps", e, expression, pkgs, err, messages);
+  if (status == SUCCESS) {
+    lua_State *L = e->L;
+    ACQUIRE_ENGINE_LOCK(e);
+    lua_pushliteral(L, "import_deps");
+    lua_pushlstring(L, (const char *)expression->ptr, expression->len);
+    lua_pushnil(L);
+    log_setup(L);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+  }
+  return status;
 }
 
 static int push_rcfile_args (Engine *e, str *filename) {
@@ -1570,6 +3232,13 @@ int rosie_execute_rcfile (Engine *e, str *filename, int *file_exists, int *no_er
   } else {
     LOG("there were no messages\n");
   }
+  if (*no_errors) {
+    lua_pushliteral(L, "rcfile");
+    if (filename->ptr) lua_pushlstring(L, (const char *)filename->ptr, filename->len);
+    else lua_pushnil(L);
+    lua_pushnil(L);
+    log_setup(L);
+  }
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
   return SUCCESS;
@@ -1586,7 +3255,7 @@ void rosie_finalize (Engine *e) {
     lua_pop(L, 1); 
   } 
   LOGf("Finalizing engine %p\n", L);
-  lua_close(L);
+  closestate(L);
   /*
    * We do not RELEASE_ENGINE_LOCK(e) here because a waiting thread
    * would then have access to an engine which we have closed, and
@@ -1599,16 +3268,264 @@ void rosie_finalize (Engine *e) {
    * creating and destroying its own engines.  In that scenario, a
    * thread's engine should be private to that thread.
    * 
-   * Alternatively, an engine pool could be created (in the client
-   * code).  The pool manager would be responsible for calling
-   * rosie_finalize() when there is no danger of any thread attempting
-   * to use the engine being destroyed.
+   * Alternatively, use an engine pool (see rosie_pool_new), which
+   * gives each thread its own engine, and destroys them all in
+   * rosie_pool_free().
    *
    */
   free(e);
 }
 
 
+/* ----------------------------------------------------------------------------------------
+ * Engine pools
+ * ----------------------------------------------------------------------------------------
+ *
+ * A pool gives each thread that uses it an engine of its own, so
+ * that threads do not contend for an engine lock.  The engines are
+ * clones (see rosie_clone) of a prototype engine that the pool keeps,
+ * and are made only when a thread first needs one.  When a thread
+ * exits, its engine goes back to the pool for the next new thread.
+ *
+ * A pool pattern is an expression that compiled successfully.  Each
+ * engine compiles it the first time that the engine's thread uses it,
+ * and remembers the engine's own handle for it.  (A compiled pattern
+ * holds per-match state, such as its output buffer and statistics,
+ * so it cannot be shared by engines in different threads.)
+ */
+
+typedef struct PoolSlot {
+  struct rosie_pool *pool;
+  Engine *engine;
+  int *pats;			/* engine's handles for pool patterns, or 0 */
+  int npats;			/* size of pats */
+  int in_use;			/* TRUE while a thread has this slot */
+  struct PoolSlot *next;
+} PoolSlot;
+
+struct rosie_pool {
+  pthread_mutex_t lock;		/* protects all of the fields below */
+  pthread_key_t key;		/* each thread's PoolSlot */
+  Engine *proto;		/* never used for matching */
+  str *exprs;			/* pool pattern n is exprs[n-1] */
+  int nexprs;
+  int exprsize;
+  PoolSlot *slots;
+};
+
+/* Called when a thread that has a slot exits */
+static void pool_release_slot (void *ptr) {
+  PoolSlot *slot = (PoolSlot *) ptr;
+  ACQUIRE_LOCK(slot->pool->lock);
+  slot->in_use = FALSE;
+  RELEASE_LOCK(slot->pool->lock);
+}
+
+static PoolSlot *pool_slot (struct rosie_pool *pool, str *messages) {
+  PoolSlot *slot = (PoolSlot *) pthread_getspecific(pool->key);
+  if (slot) return slot;
+  ACQUIRE_LOCK(pool->lock);
+  for (slot = pool->slots; slot; slot = slot->next)
+    if (!slot->in_use) break;
+  if (slot) {
+    slot->in_use = TRUE;
+    RELEASE_LOCK(pool->lock);
+  } else {
+    RELEASE_LOCK(pool->lock);
+    /* Clone without holding the pool lock, since booting is slow */
+    slot = (PoolSlot *) calloc(1, sizeof(PoolSlot));
+    if (!slot) {
+      *messages = rosie_new_string_from_const("not enough memory for engine pool");
+      return NULL;
+    }
+    slot->engine = rosie_clone(pool->proto, messages);
+    if (!slot->engine) {
+      free(slot);
+      return NULL;
+    }
+    slot->pool = pool;
+    slot->in_use = TRUE;
+    ACQUIRE_LOCK(pool->lock);
+    slot->next = pool->slots;
+    pool->slots = slot;
+    RELEASE_LOCK(pool->lock);
+    LOGf("Pool %p: new engine %p\n", pool, slot->engine);
+  }
+  if (pthread_setspecific(pool->key, slot)) {
+    pool_release_slot(slot);
+    *messages = rosie_new_string_from_const("pthread_setspecific failed");
+    return NULL;
+  }
+  return slot;
+}
+
+/* Ensure room in slot for the handle of pool pattern 'pat' */
+static int pool_slot_reserve (PoolSlot *slot, int pat) {
+  if (pat > slot->npats) {
+    int n = (pat > 2 * slot->npats) ? pat : 2 * slot->npats;
+    int *pats = (int *) realloc(slot->pats, n * sizeof(int));
+    if (!pats) return FALSE;
+    memset(pats + slot->npats, 0, (n - slot->npats) * sizeof(int));
+    slot->pats = pats;
+    slot->npats = n;
+  }
+  return TRUE;
+}
+
+EXPORT
+struct rosie_pool *rosie_pool_new (Engine *e, str *messages) {
+  struct rosie_pool *pool = (struct rosie_pool *) calloc(1, sizeof(struct rosie_pool));
+  if (!pool) {
+    *messages = rosie_new_string_from_const("not enough memory for engine pool");
+    return NULL;
+  }
+  if (pthread_key_create(&pool->key, pool_release_slot)) {
+    *messages = rosie_new_string_from_const("pthread_key_create failed");
+    free(pool);
+    return NULL;
+  }
+  /* The prototype is a clone, so that later changes to e do not
+     affect the engines of the pool */
+  pool->proto = rosie_clone(e, messages);
+  if (!pool->proto) {
+    pthread_key_delete(pool->key);
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  LOGf("Pool %p created from engine %p\n", pool, e);
+  return pool;
+}
+
+EXPORT
+void rosie_pool_free (struct rosie_pool *pool) {
+  PoolSlot *slot, *next;
+  if (!pool) return;
+  pthread_key_delete(pool->key);
+  for (slot = pool->slots; slot; slot = next) {
+    next = slot->next;
+    rosie_finalize(slot->engine);
+    free(slot->pats);
+    free(slot);
+  }
+  for (int i = 0; i < pool->nexprs; i++) rosie_free_string(pool->exprs[i]);
+  free(pool->exprs);
+  rosie_finalize(pool->proto);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+EXPORT
+Engine *rosie_pool_engine (struct rosie_pool *pool, str *messages) {
+  PoolSlot *slot = pool_slot(pool, messages);
+  return slot ? slot->engine : NULL;
+}
+
+/* N.B. Client must free messages */
+EXPORT
+int rosie_pool_compile (struct rosie_pool *pool, str *expression, int *pat, str *messages) {
+  int status, local = 0;
+  str expr;
+  PoolSlot *slot = pool_slot(pool, messages);
+  if (!slot) return ERR_ENGINE_CALL_FAILED;
+  *pat = 0;			/* Indicate compilation error */
+  status = rosie_compile(slot->engine, expression, &local, messages);
+  if ((status != SUCCESS) || !local) return status;
+  expr = rosie_new_string(expression->ptr, expression->len);
+  ACQUIRE_LOCK(pool->lock);
+  if (pool->nexprs == pool->exprsize) {
+    int n = pool->exprsize ? 2 * pool->exprsize : INITIAL_RPLX_SLOTS;
+    str *exprs = (str *) realloc(pool->exprs, n * sizeof(str));
+    if (!exprs) {
+      RELEASE_LOCK(pool->lock);
+      rosie_free_string(expr);
+      rosie_free_rplx(slot->engine, local);
+      return ERR_OUT_OF_MEMORY;
+    }
+    pool->exprs = exprs;
+    pool->exprsize = n;
+  }
+  pool->exprs[pool->nexprs++] = expr;
+  *pat = pool->nexprs;
+  RELEASE_LOCK(pool->lock);
+  if (!pool_slot_reserve(slot, *pat)) {
+    rosie_free_rplx(slot->engine, local);
+    return ERR_OUT_OF_MEMORY;
+  }
+  slot->pats[*pat - 1] = local;
+  return SUCCESS;
+}
+
+/* Set 'epat' to the handle in the engine of 'slot' for pool pattern
+   'pat', compiling it there the first time.  Returns SUCCESS, or
+   ERR_NO_PATTERN if 'pat' is not valid, or ERR_ENGINE_CALL_FAILED.
+*/
+static int pool_slot_pattern (struct rosie_pool *pool, PoolSlot *slot, int pat, int *epat) {
+  int status, local = 0;
+  str expr, messages;
+  messages.ptr = NULL;
+  messages.len = 0;
+  *epat = 0;
+  ACQUIRE_LOCK(pool->lock);
+  if ((pat <= 0) || (pat > pool->nexprs)) {
+    RELEASE_LOCK(pool->lock);
+    LOGf("invalid pool pattern reference: %d\n", pat);
+    return ERR_NO_PATTERN;
+  }
+  /* The pattern's expression never changes, but exprs may be reallocated */
+  expr = pool->exprs[pat - 1];
+  RELEASE_LOCK(pool->lock);
+  if (!pool_slot_reserve(slot, pat)) return ERR_ENGINE_CALL_FAILED;
+  if (!slot->pats[pat - 1]) {
+    status = rosie_compile(slot->engine, &expr, &local, &messages);
+    if (messages.ptr) rosie_free_string(messages);
+    if ((status != SUCCESS) || !local) return ERR_ENGINE_CALL_FAILED;
+    slot->pats[pat - 1] = local;
+  }
+  *epat = slot->pats[pat - 1];
+  return SUCCESS;
+}
+
+EXPORT
+int rosie_pool_pattern (struct rosie_pool *pool, int pat, Engine **e, int *epat) {
+  str messages;
+  messages.ptr = NULL;
+  messages.len = 0;
+  PoolSlot *slot = pool_slot(pool, &messages);
+  if (slot && (pool_slot_pattern(pool, slot, pat, epat) == SUCCESS)) {
+    *e = slot->engine;
+    return SUCCESS;
+  }
+  if (messages.ptr) rosie_free_string(messages);
+  *e = NULL;
+  *epat = 0;
+  return ERR_ENGINE_CALL_FAILED;
+}
+
+EXPORT
+int rosie_pool_match2 (struct rosie_pool *pool, uint32_t pat, char *encoder_name,
+		       str *input, uint32_t startpos, uint32_t endpos,
+		       struct rosie_matchresult *match,
+		       uint8_t collect_times) {
+  int epat, status;
+  str messages;
+  messages.ptr = NULL;
+  messages.len = 0;
+  PoolSlot *slot = pool_slot(pool, &messages);
+  if (!slot) {
+    if (messages.ptr) rosie_free_string(messages);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  status = pool_slot_pattern(pool, slot, (int) pat, &epat);
+  if (status == ERR_NO_PATTERN) {
+    /* As in rosie_match2(), an invalid pattern is reported in 'match' */
+    set_match2_error(match, ERR_NO_PATTERN);
+    return SUCCESS;
+  }
+  if (status != SUCCESS) return status;
+  return rosie_match2(slot->engine, (uint32_t) epat, encoder_name, input, startpos, endpos, match, collect_times);
+}
+
 /* ----------------------------------------------------------------------------------------
  * Functions to support the Lua implementation of the CLI
  * ----------------------------------------------------------------------------------------
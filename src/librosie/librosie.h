@@ -41,8 +41,8 @@ typedef struct rosie_engine {
 /*
    IMPORTANT: 
 
-   byte_ptr, rosie_string/str, and rosie_matchresult/match must be
-   kept in sync with str.h.  We do not include str.h here because we
+   byte_ptr, rosie_string/str, rosie_matchresult/match, and
+   rosie_matchstats must be kept in sync with str.h.  We do not include str.h here because we
    want librosie.h to be a single self-contained header file that can
    be copied to (e.g.) /usr/local/include during installation.
 */
@@ -68,6 +68,38 @@ typedef struct rosie_matchresult {
      int tmatch;
 } match;
 
+struct rosie_sink {
+     char *region;
+     size_t size;
+     void *(*alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
+     int (*flush) (void *ud, const char *data, size_t len);
+     void *ud;
+};
+
+/* Must be kept in sync with CapNode in captree.h */
+struct rosie_capnode {
+     int32_t parent;
+     int32_t child;
+     int32_t sibling;
+     int32_t type;
+     int32_t constant;
+     int32_t start;
+     int32_t end;
+     int32_t member;
+};
+
+struct rosie_matchstats {
+     uint64_t matches;
+     uint64_t failures;
+     uint64_t insts;
+     uint64_t encoder_bytes;
+     uint64_t total_ns;
+     uint64_t match_ns;
+     uint32_t max_backtrack;
+     uint32_t max_caplist;
+     uint32_t max_capdepth;
+};
+
 // -----------------------------------------------------------------------------
 
 str  rosie_new_string (byte_ptr msg, size_t len);
@@ -80,6 +112,7 @@ void rosie_free_string_ptr (str *s);
 void rosie_home_init(str *runtime, str *messages);
 
 Engine *rosie_new (str *messages);
+Engine *rosie_clone (Engine *e, str *messages);
 void    rosie_finalize (Engine *e);
 
 int rosie_libpath (Engine *e, str *newpath);
@@ -129,7 +162,11 @@ int rosie_matchfile (Engine *e, int pat, char *encoder, int wholefileflag,
    rosie_match().  The new one, below, is implemented in a way that
    bypasses Lua when possible, and goes through Lua in a limited way
    when necessary (which is when the caller requests an encoder that
-   is implemented in Lua).
+   is implemented in Lua).  The encoders byte, json, line, status,
+   data (or matches), subs and color are implemented in C.  The color
+   encoder in Lua is used instead when the engine's colors differ from
+   the defaults, except for patterns read by rosie_load_rplx(), which
+   are always colored with the defaults.
 */
 
 int rosie_match2 (Engine *e, uint32_t pat, char *encoder_name,
@@ -137,6 +174,373 @@ int rosie_match2 (Engine *e, uint32_t pat, char *encoder_name,
 		  struct rosie_matchresult *match,
 		  uint8_t collect_times);
 
+/*
+   Global search.  rosie_match2_all() finds every non-overlapping match
+   of 'pat' in the input, from left to right, and sets 'count' to how
+   many there are.  match->data holds all of them, encoded, each
+   followed by a newline (except with the byte encoder), and
+   match->leftover is the number of bytes after the last match.  If a
+   match ends abnormally (halt), the search stops after it and
+   match->abend is 1.  The encoders byte, json, data (or matches), subs
+   and debug can be used.
+   For others, the result is ERR_NO_ENCODER.
+*/
+int rosie_match2_all (Engine *e, uint32_t pat, char *encoder_name,
+		      str *input, uint32_t startpos, uint32_t endpos,
+		      uint32_t *count,
+		      struct rosie_matchresult *match);
+
+/*
+   Per-pattern match statistics, for finding the expensive patterns in
+   a running system without a debug build.  Collection is off by
+   default.  rosie_match_stats_enable() turns it on (enable != 0) with
+   all counters at zero, or off (enable == 0), discarding the counters.
+   rosie_match_stats() copies the current counters into 'stats', and
+   then zeroes them if 'reset' is non-zero.  It returns
+   ERR_ENGINE_CALL_FAILED if collection is not enabled for 'pat'.
+
+   Note that rosie_compile() may return handles that share a pattern
+   (e.g. when the same name is compiled twice), and such handles will
+   also share statistics.
+*/
+int rosie_match_stats_enable (Engine *e, uint32_t pat, int enable);
+int rosie_match_stats (Engine *e, uint32_t pat, struct rosie_matchstats *stats, int reset);
+
+/*
+   Per-instruction profiling, which counts how many times each vm
+   instruction of a pattern executes and fails.  Enabling works like
+   rosie_match_stats_enable(), above.  rosie_match_profile() returns
+   (in 'report', which the caller must free) a human-readable flat
+   profile that attributes instructions to the innermost enclosing
+   capture, i.e. to RPL pattern names, followed by the counts for each
+   instruction executed.  The counters are zeroed afterwards if
+   'reset' is non-zero.  Profiling is more costly than collecting
+   match statistics.
+*/
+int rosie_match_profile_enable (Engine *e, uint32_t pat, int enable);
+int rosie_match_profile (Engine *e, uint32_t pat, str *report, int reset);
+
+/*
+   Output sinks, so that the output of rosie_match2() can be written
+   directly where the caller needs it, e.g. into a network send buffer
+   or a column builder, instead of being copied out of a librosie
+   buffer.  Each rplx has its own output buffer, and by default
+   match->data points into it.  rosie_match2_sink() attaches 'sink' to
+   that buffer (or restores the default if 'sink' is NULL), discarding
+   its contents.  The fields of 'sink' are all optional:
+
+     region  storage for the output.  Without 'alloc' or 'flush', an
+             output that does not fit causes rosie_match2() to fail.
+     alloc   an allocator with the same contract as lua_Alloc, used to
+             grow the buffer beyond 'region' (or beyond the default
+             initial buffer), and to free what it allocated.
+     flush   called with the buffered output whenever the buffer is
+             full, after which the buffer is empty.  Must return 0 on
+             success.  With a flush function, the output of successive
+             matches accumulates in the buffer, and match->data covers
+             only the part of the latest output that has not been
+             flushed.  Only the C output encoders can be used; with
+             a Lua encoder, the result is ERR_SINK_ENCODER.
+     ud      passed to 'alloc' and 'flush'.
+
+   rosie_sink_fd() is a flush function that writes to a file
+   descriptor, for which 'ud' must point to an int holding the fd.
+   rosie_match2_flush() passes any buffered output to the flush
+   function; call it before detaching a sink or freeing the rplx.
+*/
+int rosie_match2_sink (Engine *e, uint32_t pat, struct rosie_sink *sink);
+int rosie_match2_flush (Engine *e, uint32_t pat);
+int rosie_sink_fd (void *ud, const char *data, size_t len);
+
+/*
+   Arenas, so that the transient memory of a batch of matches comes
+   from one region that is recycled in O(1), instead of from malloc.
+   This helps when many threads (each with its own engine) match at
+   once, and contend for the allocator.
+
+   rosie_match2_arena() makes the matches of 'pat' use 'arena' for the
+   capture list and vm stacks whenever they outgrow their initial
+   storage (or restores malloc if 'arena' is NULL).  An arena may be
+   shared by the patterns of one engine, but not across threads.
+   rosie_arena_alloc() is an allocator for a struct rosie_sink (with
+   the arena as 'ud'), so that the output buffer grows in the arena
+   too.  'blocksize' is the minimum size of each block that the arena
+   mallocs, or 0 for the default.
+
+   rosie_arena_reset() makes all of the arena's memory available again
+   without freeing it, e.g. after each batch.  Nothing allocated from
+   an arena survives a reset, so if an output buffer was using it, call
+   rosie_match2_sink() again before the next match.  Detach an arena
+   from every pattern before freeing it.
+*/
+struct rosie_arena;
+
+struct rosie_arena *rosie_arena_new (size_t blocksize);
+void rosie_arena_reset (struct rosie_arena *arena);
+void rosie_arena_free (struct rosie_arena *arena);
+void *rosie_arena_alloc (void *ud, void *ptr, size_t osize, size_t nsize);
+int rosie_match2_arena (Engine *e, uint32_t pat, struct rosie_arena *arena);
+
+/*
+   Columnar output, for loading the captures of many matches into a
+   column store without formatting and parsing JSON.
+   rosie_match2_columns() matches like rosie_match2(), and appends one
+   row per capture (in pre-order) to 'cols', in which every column is
+   an array of int32_t in native byte order:
+
+     ROSIE_COLUMN_TYPE    capture name, as an index for rosie_capture_name()
+     ROSIE_COLUMN_START   1-based start position in the input
+     ROSIE_COLUMN_END     1-based end position in the input
+     ROSIE_COLUMN_DEPTH   nesting depth, 0 for the outermost capture
+     ROSIE_COLUMN_RECORD  the 'record' argument, e.g. a line number
+
+   match->data is (non-NULL, 0) when there is a match, and otherwise
+   as for rosie_match2().  rosie_columns_get() sets 'data' to point to
+   a column, which stays valid until the next call that changes
+   'cols', and returns the number of rows.  Rows accumulate until
+   rosie_columns_reset().  rosie_capture_name() sets 'name' to point
+   into the compiled pattern (the caller must not free it).
+*/
+/* Must be kept in sync with ColumnId in columns.h */
+#define ROSIE_COLUMN_TYPE   0
+#define ROSIE_COLUMN_START  1
+#define ROSIE_COLUMN_END    2
+#define ROSIE_COLUMN_DEPTH  3
+#define ROSIE_COLUMN_RECORD 4
+
+struct rosie_columns;
+
+struct rosie_columns *rosie_columns_new (void);
+void rosie_columns_reset (struct rosie_columns *cols);
+void rosie_columns_free (struct rosie_columns *cols);
+uint32_t rosie_columns_get (struct rosie_columns *cols, int column, const int32_t **data);
+int rosie_match2_columns (Engine *e, uint32_t pat,
+			  str *input, uint32_t startpos, uint32_t endpos,
+			  int32_t record, struct rosie_columns *cols,
+			  struct rosie_matchresult *match);
+int rosie_capture_name (Engine *e, uint32_t pat, int32_t index, str *name);
+
+/*
+   The captures of a match as a tree, for callers that look at only a
+   few of them and so should not pay for encoding and decoding the
+   whole match.  rosie_match2_tree() matches like rosie_match2(), and
+   replaces the contents of 'tree' with one node per capture.
+   rosie_captree_nodes() sets 'nodes' to point to them, and returns
+   how many there are (0 when there was no match).  The nodes stay
+   valid until the next call that changes 'tree'.
+
+   Node 0 is the outermost capture, and the nodes are in pre-order.
+   'parent', 'child' (first child) and 'sibling' (next sibling) are
+   node indices, or -1 for none.  'type' is the capture name and
+   'constant' is the value of a constant capture (else 0), both as
+   indices for rosie_capture_name().  'start' and 'end' are 1-based
+   positions in the input.  'member' is the index of the member of a
+   pattern set (see rosie_compile_set()) whose match the capture is,
+   else 0.
+*/
+struct rosie_captree;
+
+struct rosie_captree *rosie_captree_new (void);
+void rosie_captree_free (struct rosie_captree *tree);
+uint32_t rosie_captree_nodes (struct rosie_captree *tree, const struct rosie_capnode **nodes);
+int rosie_match2_tree (Engine *e, uint32_t pat,
+		       str *input, uint32_t startpos, uint32_t endpos,
+		       struct rosie_captree *tree,
+		       struct rosie_matchresult *match);
+
+/*
+   Delimited output, for extracting a few fields from each match as
+   one row of TSV or CSV text.  rosie_delimited_new() makes a row
+   layout for pattern 'pat' with one field per name in 'names' (capture
+   names as in the ktable, e.g. "net.ipv4").  It fails if a name is not
+   a capture of the pattern, or appears twice.  rosie_match2_delimited()
+   matches like rosie_match2(), and match->data is the row: the text of
+   the first capture of each name (empty if there was none), escaped
+   for the style and separated by tabs or commas, with no newline.
+
+     ROSIE_DELIMITED_TSV  tab, newline, carriage return and backslash
+                          are written as \t, \n, \r and \\
+     ROSIE_DELIMITED_CSV  fields with a comma, double quote, newline or
+                          carriage return are quoted as in RFC 4180
+
+   A layout must only be used with the pattern it was made for.
+*/
+/* Must be kept in sync with DelimitedStyle in delimited.h */
+#define ROSIE_DELIMITED_TSV 0
+#define ROSIE_DELIMITED_CSV 1
+
+struct rosie_delimited;
+
+int rosie_delimited_new (Engine *e, uint32_t pat, int style,
+			 str *names, int nnames,
+			 struct rosie_delimited **delimited);
+void rosie_delimited_free (struct rosie_delimited *delimited);
+int rosie_match2_delimited (Engine *e, uint32_t pat,
+			    str *input, uint32_t startpos, uint32_t endpos,
+			    struct rosie_delimited *delimited,
+			    struct rosie_matchresult *match);
+
+/*
+   Lazy imports.  rosie_import_lazy() is like rosie_import(), except
+   that the package is imported only when it is first needed, i.e.
+   just before rosie_compile(), rosie_load(), rosie_loadfile() or
+   rosie_import_expression_deps() is given RPL that refers to it by
+   its prefix ('as', or by default the last component of 'pkgname').
+   If the import fails, the compile or load fails with the import's
+   messages, and the package stays pending, to be tried again the next
+   time it is referenced.  This saves the time
+   and memory of importing large packages (e.g. Unicode/Script) that
+   an application may or may not use.
+*/
+int rosie_import_lazy (Engine *e, str *pkgname, str *as);
+
+/*
+   Compiled pattern files.  rosie_save_rplx() writes a compiled pattern
+   to a file in the RPLX format, and rosie_load_rplx() reads one into
+   an engine, without using the RPL compiler.  A loaded pattern can be
+   used only with rosie_match2() (and its variants) and the encoders
+   implemented in C; with a Lua encoder, the result is ERR_NO_ENCODER.
+   'messages' is empty unless rosie_load_rplx() fails.
+
+   An RPLX file holds the compiled code, not the RPL it came from, so
+   it is up to the application to save it again when the expression
+   or the RPL libraries that it uses change.
+
+   NOTE: This is not a precompiled standard library.  Imports still
+   compile packages from their RPL source, because a loaded pattern
+   has no parse tree, so it cannot be referenced by another
+   expression, and an RPLX file holds one pattern, not the bindings of
+   a package.
+*/
+int rosie_save_rplx (Engine *e, uint32_t pat, const char *filename);
+int rosie_load_rplx (Engine *e, const char *filename, int *pat, str *messages);
+
+/*
+   Compile diagnostics.  rosie_compile_diag() is like rosie_compile(),
+   except that the errors and warnings from the compiler are returned
+   as an array of struct rosie_diagnostic instead of a JSON string.
+   When there are none (the usual case), *diags is NULL, and no
+   allocation or formatting is done.  Otherwise, the caller must free
+   *diags with rosie_diagnostics_free().
+
+   A diagnostic's span (start, end) is its position in the source
+   text, as reported by the RPL parser, or -1 when not known.  The
+   source is the expression, unless the diagnostic came from an
+   imported package.
+
+   rosie_diagnostics_json() renders the diagnostics as a JSON array of
+   objects with the fields of struct rosie_diagnostic, e.g.
+   [{"severity":"error","who":"parser","message":"...","start":1,"end":5}].
+   It is made on the first call, and belongs to diags.
+*/
+#define ROSIE_DIAG_ERROR 0
+#define ROSIE_DIAG_WARNING 1
+#define ROSIE_DIAG_INFO 2
+
+struct rosie_diagnostic {
+  int32_t severity;		/* ROSIE_DIAG_ERROR, etc. */
+  str who;
+  str message;
+  int32_t start;
+  int32_t end;
+};
+
+struct rosie_diagnostics;
+
+int rosie_compile_diag (Engine *e, str *expression, int *pat, struct rosie_diagnostics **diags);
+int rosie_diagnostics_count (struct rosie_diagnostics *diags);
+const struct rosie_diagnostic *rosie_diagnostics_get (struct rosie_diagnostics *diags, int i);
+int rosie_diagnostics_json (struct rosie_diagnostics *diags, str *json);
+void rosie_diagnostics_free (struct rosie_diagnostics *diags);
+
+/*
+   Pattern sets.  rosie_compile_set() compiles 'n' expressions into one
+   pattern that tries all of them at the same position, in one run of
+   the matching vm.  When an expression does not compile, *pat is 0
+   and 'messages' is a json object whose "member" is the index (1..n)
+   of that expression and whose "messages" are its errors, as from
+   rosie_compile().  Otherwise 'messages' is empty.  A set is
+   used like a pattern from rosie_load_rplx(), i.e. only with the
+   encoders implemented in C.
+
+   A match of a set consumes no input, and a set fails to match when
+   none of its members match.  The captures of a match are a capture
+   named "set", with one sub-capture for each member that matched,
+   whose name is the member's index (1..n), and whose sub-capture is
+   the match of the member.  rosie_match2_set() is rosie_match2_tree()
+   on a set, and also stores up to 'size' of the indices of the members
+   that matched in 'members', and how many matched in 'count'.
+
+   The members are tried one after another.  Prefixes that they have in
+   common are not factored out, so a set costs about as much to match
+   as its members do separately, less the setup of each match.
+*/
+int rosie_compile_set (Engine *e, str *expressions, int n, int *pat, str *messages);
+int rosie_match2_set (Engine *e, uint32_t pat,
+		      str *input, uint32_t startpos, uint32_t endpos,
+		      struct rosie_captree *tree,
+		      int32_t *members, int size, int *count,
+		      struct rosie_matchresult *match);
+
+/*
+   Memory management.  rosie_engine_alloc() chooses the allocator for
+   the Lua state of engines created afterwards.  The default (0) is
+   malloc.  ROSIE_ALLOC_POOL serves small allocations from size class
+   pools, and ROSIE_ALLOC_HUGEPAGES (with ROSIE_ALLOC_POOL) puts the
+   pools in huge pages when the system has them.
+
+   rosie_gc_config() sets how garbage is collected when the heap grows
+   past the alloc limit: a full collection (ROSIE_GC_FULL, the
+   default), an incremental step (ROSIE_GC_INCREMENTAL), or not at all
+   (ROSIE_GC_MANUAL), in which case the client calls rosie_gc_step()
+   between requests.  A pause or stepmul greater than zero tunes the
+   Lua incremental collector.  rosie_gc_step() does a full collection
+   when kbytes is negative, else one incremental step.
+*/
+#define ROSIE_ALLOC_POOL 1
+#define ROSIE_ALLOC_HUGEPAGES 2
+
+#define ROSIE_GC_FULL 0
+#define ROSIE_GC_INCREMENTAL 1
+#define ROSIE_GC_MANUAL 2
+
+void rosie_engine_alloc (int flags);
+int rosie_gc_config (Engine *e, int mode, int pause, int stepmul);
+int rosie_gc_step (Engine *e, int kbytes, int *done, int *usage);
+
+/*
+   Engine pools, for multi-threaded clients.  rosie_pool_new() makes a
+   pool of engines set up like 'e' (see rosie_clone), and
+   rosie_pool_engine() returns the calling thread's engine, making one
+   if needed.  An engine is used only by its thread, so the threads do
+   not contend for engine locks.  When a thread exits, its engine is
+   kept for the next new thread that uses the pool.
+
+   rosie_pool_compile() compiles 'expression' in the calling thread's
+   engine, and sets 'pat' to a pool pattern handle (or 0 if the
+   expression did not compile), which is valid in every thread.
+   rosie_pool_pattern() sets 'e' and 'epat' to the calling thread's
+   engine and its handle for pool pattern 'pat', compiling it in that
+   engine the first time, for use with any of the functions above
+   that take an engine and a pattern.  rosie_pool_match2() is
+   rosie_match2() on the calling thread's engine.
+
+   Pool patterns are freed by rosie_pool_free(), which destroys all of
+   the pool's engines.  Call it only when no thread will use the pool
+   again.
+*/
+struct rosie_pool;
+
+struct rosie_pool *rosie_pool_new (Engine *e, str *messages);
+void rosie_pool_free (struct rosie_pool *pool);
+Engine *rosie_pool_engine (struct rosie_pool *pool, str *messages);
+int rosie_pool_compile (struct rosie_pool *pool, str *expression, int *pat, str *messages);
+int rosie_pool_pattern (struct rosie_pool *pool, int pat, Engine **e, int *epat);
+int rosie_pool_match2 (struct rosie_pool *pool, uint32_t pat, char *encoder_name,
+		       str *input, uint32_t startpos, uint32_t endpos,
+		       struct rosie_matchresult *match,
+		       uint8_t collect_times);
+
 /* LP: Jamie to Review.
    New (Oct, 2021) interface to provice C-API access to the CLI functionality
    to automatically parse an expression and load its dependencies.  This
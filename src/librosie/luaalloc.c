@@ -0,0 +1,157 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  luaalloc.c  Part of librosie.c                                           */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * An allocator for the Lua state of an engine (see
+ * rosie_engine_alloc).  Most of what Lua allocates is small (strings,
+ * tables, closures), so blocks of up to POOL_MAX_BLOCK bytes come
+ * from free lists, one per size class, that are filled from large
+ * chunks.  Larger blocks come from malloc.  A Lua state is only used
+ * while holding the engine lock, so the pool needs no lock of its own.
+ *
+ * Freed small blocks go back on their free list, and the chunks are
+ * released only when the state is closed.  With ROSIE_ALLOC_HUGEPAGES,
+ * the chunks are mapped with huge pages when the system has them.
+ */
+
+#include <sys/mman.h>
+
+#define POOL_CLASS_SIZE 16
+#define POOL_CLASSES 16
+#define POOL_MAX_BLOCK (POOL_CLASS_SIZE * POOL_CLASSES)
+#define POOL_CHUNK_SIZE (256 * 1024)
+#define POOL_HUGE_CHUNK_SIZE (2 * 1024 * 1024)
+
+#define pool_class(size) (((size) - 1) / POOL_CLASS_SIZE)
+#define is_small(size) (((size) > 0) && ((size) <= POOL_MAX_BLOCK))
+
+typedef struct PoolChunk {
+  struct PoolChunk *next;
+  size_t size;			/* including this header */
+  int mapped;
+} PoolChunk;
+
+typedef struct PoolBlock {
+  struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct LuaPool {
+  PoolBlock *free[POOL_CLASSES];
+  PoolChunk *chunks;
+  char *next;			/* unused part of the newest chunk */
+  char *end;
+  int flags;
+} LuaPool;
+
+static PoolChunk *pool_new_chunk (LuaPool *pool) {
+  PoolChunk *c = NULL;
+  size_t size = POOL_CHUNK_SIZE;
+#if defined(MAP_HUGETLB)
+  if (pool->flags & ROSIE_ALLOC_HUGEPAGES) {
+    size = POOL_HUGE_CHUNK_SIZE;
+    c = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (c == MAP_FAILED) {
+      c = NULL;
+      size = POOL_CHUNK_SIZE;
+    } else {
+      c->mapped = TRUE;
+    }
+  }
+#endif
+  if (!c) {
+    c = malloc(size);
+    if (!c) return NULL;
+    c->mapped = FALSE;
+  }
+  c->size = size;
+  c->next = pool->chunks;
+  pool->chunks = c;
+  /* Keep the blocks aligned like malloc's */
+  pool->next = (char *) c + ((sizeof(PoolChunk) + POOL_CLASS_SIZE - 1) & ~((size_t) POOL_CLASS_SIZE - 1));
+  pool->end = (char *) c + size;
+  return c;
+}
+
+static void *pool_alloc_small (LuaPool *pool, size_t size) {
+  int class = pool_class(size);
+  size_t blocksize = (size_t) (class + 1) * POOL_CLASS_SIZE;
+  PoolBlock *b = pool->free[class];
+  if (b) {
+    pool->free[class] = b->next;
+    return b;
+  }
+  if ((size_t) (pool->end - pool->next) < blocksize) {
+    /* The rest of the current chunk is too small, and is wasted */
+    if (!pool_new_chunk(pool)) return NULL;
+  }
+  b = (PoolBlock *) pool->next;
+  pool->next += blocksize;
+  return b;
+}
+
+static void pool_free_small (LuaPool *pool, void *ptr, size_t size) {
+  int class = pool_class(size);
+  PoolBlock *b = (PoolBlock *) ptr;
+  b->next = pool->free[class];
+  pool->free[class] = b;
+}
+
+/* The lua_Alloc contract: osize is the size of the block when ptr is
+   not NULL, and a shrinking realloc must not fail. */
+static void *pool_lalloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  LuaPool *pool = (LuaPool *) ud;
+  void *newptr;
+  if (!ptr) osize = 0;		/* else osize is a type code */
+  if (nsize == 0) {
+    if (ptr) {
+      if (is_small(osize)) pool_free_small(pool, ptr, osize);
+      else free(ptr);
+    }
+    return NULL;
+  }
+  if (!is_small(nsize) && (!ptr || !is_small(osize))) return realloc(ptr, nsize);
+  if (ptr && is_small(osize) && (pool_class(osize) == pool_class(nsize))) return ptr;
+  newptr = is_small(nsize) ? pool_alloc_small(pool, nsize) : malloc(nsize);
+  if (!newptr) {
+    /* A block that is too big is fine for Lua, but a malloc'd block
+       that goes on a free list is never returned to the system. */
+    if (ptr && (nsize <= osize)) return ptr;
+    return NULL;
+  }
+  if (ptr) {
+    memcpy(newptr, ptr, (osize < nsize) ? osize : nsize);
+    if (is_small(osize)) pool_free_small(pool, ptr, osize);
+    else free(ptr);
+  }
+  return newptr;
+}
+
+static LuaPool *pool_new (int flags) {
+  LuaPool *pool = calloc(1, sizeof(LuaPool));
+  if (pool) pool->flags = flags;
+  return pool;
+}
+
+/* Call after lua_close() */
+static void pool_free (LuaPool *pool) {
+  PoolChunk *c, *next;
+  for (c = pool->chunks; c; c = next) {
+    next = c->next;
+    if (c->mapped) munmap(c, c->size);
+    else free(c);
+  }
+  free(pool);
+}
+
+/* Like the panic function of luaL_newstate() */
+static int engine_panic (lua_State *L) {
+  lua_writestringerror("PANIC: unprotected error in call to Lua API (%s)\n",
+		       lua_tostring(L, -1));
+  return 0;			/* return to Lua to abort */
+}
@@ -21,6 +21,10 @@ enum KEYS {
   alloc_actual_limit_key,
   prev_string_result_key,
   violation_format_key,
+  setup_log_key,
+  setup_seen_key,
+  lazy_imports_key,
+  gc_mode_key,
   KEY_ARRAY_SIZE
 };
 
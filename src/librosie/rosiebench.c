@@ -0,0 +1,322 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  rosiebench.c  Benchmark pattern compilation and matching via librosie    */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * Usage: rosiebench [-n passes] [-e encoders] [-f corpus] [-b count] [-o file] [expression ...]
+ *
+ *   -n passes    number of times to compile each expression, and to match
+ *                every line of the corpus (default 5)
+ *   -e encoders  comma-separated list of output encoders (default:
+ *                byte,json,line,status)
+ *   -f corpus    file to match line by line; may be repeated.  Without
+ *                a corpus, only compilation is measured.
+ *   -b count     add a generated corpus of one line holding 'count'
+ *                backreferences, and bind 'word' in the engine.  The
+ *                default expression is then BACKREF_EXPRESSION (below),
+ *                which matches that line with one capture and one
+ *                backreference per word.
+ *   -o file      save the compiled pattern of the first expression to
+ *                'file' in the RPLX format, as input for rplxbench.
+ *
+ * If ROSIE_HOME is set in the environment, it is the rosie home
+ * directory (e.g. src/rosie_home in a source tree).  Otherwise it is
+ * found relative to the program, as for any librosie client.
+ *
+ * The default expressions exercise the shipped libraries all.rpl,
+ * net.rpl, date.rpl and json.rpl.  The packages an expression needs
+ * are imported first (reported as "import_seconds"), and then the
+ * expression is compiled 'passes' times.
+ *
+ * Output is one JSON object per line, in the same form as the
+ * rpeg/runtime/rplxbench program, which measures the vm and encoders
+ * without librosie and Lua.
+ *
+ * "make bench-smoke" in src/librosie runs both programs briefly, to
+ * check that they still build and run.  Its timings mean nothing.
+ */
+
+#if defined(__GNUC__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* clock_gettime() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpeg.h"		/* MATCH_WITHOUT_DATA */
+#include "librosie.h"
+
+#define DEFAULT_PASSES 5
+#define DEFAULT_ENCODERS "byte,json,line,status"
+#define MAX_CORPORA 32
+
+static const char *default_expressions[] = {
+  "all.things", "net.any", "date.any", "json.value", NULL
+};
+
+#define BACKREF_BINDING "word = [a-z]+"
+#define BACKREF_EXPRESSION "{word {\" \" backref:word}*}"
+
+static const char *backref_expressions[] = {
+  BACKREF_EXPRESSION, NULL
+};
+
+static const char *progname = "rosiebench";
+
+static double now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void print_json_string (const char *s, size_t len) {
+  putchar('"');
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char) s[i];
+    if ((c == '"') || (c == '\\')) printf("\\%c", c);
+    else if (c < 0x20) printf("\\u%04x", c);
+    else putchar(c);
+  }
+  putchar('"');
+}
+
+static void print_messages (str *messages) {
+  if (messages->ptr) {
+    fprintf(stderr, "%s: %.*s\n", progname, (int) messages->len, (char *) messages->ptr);
+    rosie_free_string(*messages);
+    messages->ptr = NULL;
+  }
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Corpus                                                                        */
+/* ----------------------------------------------------------------------------- */
+
+typedef struct Corpus {
+  const char *name;
+  char *data;
+  size_t size;
+} Corpus;
+
+static int read_corpus (const char *filename, Corpus *c) {
+  FILE *in = fopen(filename, "rb");
+  if (!in) return 0;
+  fseek(in, 0, SEEK_END);
+  long size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  c->name = filename;
+  c->data = (char *) malloc(size > 0 ? (size_t) size : 1);
+  c->size = (c->data && (size > 0)) ? fread(c->data, 1, (size_t) size, in) : 0;
+  fclose(in);
+  return (c->data != NULL);
+}
+
+/* One line: "abc abc abc ...", with 'count' words after the first */
+static int make_backref_corpus (int count, Corpus *c) {
+  static const char word[] = "abc ";
+  size_t wordlen = sizeof(word) - 1;
+  c->name = "backrefs";
+  c->size = (size_t) (count + 1) * wordlen - 1;
+  c->data = (char *) malloc(c->size + 1);
+  if (!c->data) return 0;
+  for (int i = 0; i <= count; i++)
+    memcpy(c->data + (size_t) i * wordlen, word, wordlen);
+  c->data[c->size] = '\0';
+  return 1;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Benchmarks                                                                    */
+/* ----------------------------------------------------------------------------- */
+
+static int bench_compile (Engine *e, const char *expression, int passes, int *pat) {
+  str messages = {0, NULL};
+  str exp = rosie_string_from((byte_ptr) expression, strlen(expression));
+  int err, errs = 0;
+  double t0, import_seconds, compile_seconds;
+
+  t0 = now();
+  err = rosie_import_expression_deps(e, &exp, NULL, &errs, &messages);
+  import_seconds = now() - t0;
+  if (err || errs) {
+    fprintf(stderr, "%s: cannot import packages for %s\n", progname, expression);
+    print_messages(&messages);
+    return 0;
+  }
+  print_messages(&messages);
+
+  t0 = now();
+  for (int pass = 0; pass < passes; pass++) {
+    if (pass > 0) rosie_free_rplx(e, *pat);
+    err = rosie_compile(e, &exp, pat, &messages);
+    if (err || !*pat) {
+      fprintf(stderr, "%s: cannot compile %s\n", progname, expression);
+      print_messages(&messages);
+      return 0;
+    }
+    print_messages(&messages);
+  }
+  compile_seconds = now() - t0;
+
+  printf("{\"bench\":\"compile\",\"expression\":");
+  print_json_string(expression, strlen(expression));
+  printf(",\"passes\":%d,\"import_seconds\":%.6f,\"seconds\":%.6f,\"ms_per_compile\":%.3f}\n",
+	 passes, import_seconds, compile_seconds, 1000.0 * compile_seconds / passes);
+  return 1;
+}
+
+static int bench_match (Engine *e, const char *expression, int pat,
+			Corpus *c, const char *encoder, int passes) {
+  struct rosie_matchresult m;
+  uint64_t lines = 0, matches = 0, output_bytes = 0;
+  double t0, elapsed;
+  int err;
+  t0 = now();
+  for (int pass = 0; pass < passes; pass++) {
+    size_t start = 0;
+    for (size_t i = 0; i <= c->size; i++) {
+      if ((i < c->size) && (c->data[i] != '\n')) continue;
+      if ((i == c->size) && (i == start)) break;
+      str line = rosie_string_from((byte_ptr) c->data + start, i - start);
+      start = i + 1;
+      err = rosie_match2(e, (uint32_t) pat, (char *) encoder, &line, 1, 0, &m, 0);
+      if (err) {
+	fprintf(stderr, "%s: match failed with %s encoder (error %d)\n", progname, encoder, err);
+	return 0;
+      }
+      lines++;
+      if (m.data.ptr || (m.data.len == MATCH_WITHOUT_DATA)) {
+	matches++;
+	if (m.data.ptr) output_bytes += m.data.len;
+      }
+    }
+  }
+  elapsed = now() - t0;
+  printf("{\"bench\":\"match\",\"expression\":");
+  print_json_string(expression, strlen(expression));
+  printf(",\"corpus\":");
+  print_json_string(c->name, strlen(c->name));
+  printf(",\"encoder\":\"%s\",\"passes\":%d,\"lines\":%llu,\"bytes\":%zu,\"matches\":%llu,"
+	 "\"output_bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.3f,\"lines_per_s\":%.1f,"
+	 "\"matches_per_s\":%.1f}\n",
+	 encoder, passes, (unsigned long long) (lines / passes), c->size,
+	 (unsigned long long) matches, (unsigned long long) output_bytes,
+	 elapsed,
+	 elapsed > 0 ? ((double) c->size * passes / (1024.0 * 1024.0)) / elapsed : 0.0,
+	 elapsed > 0 ? (double) lines / elapsed : 0.0,
+	 elapsed > 0 ? (double) matches / elapsed : 0.0);
+  return 1;
+}
+
+static int load_backref_binding (Engine *e) {
+  str messages = {0, NULL}, pkgname = {0, NULL};
+  str src = rosie_string_from((byte_ptr) BACKREF_BINDING, strlen(BACKREF_BINDING));
+  int ok = 0;
+  int err = rosie_load(e, &ok, &src, &pkgname, &messages);
+  if (pkgname.ptr) rosie_free_string(pkgname);
+  if (err || !ok) {
+    fprintf(stderr, "%s: cannot load %s\n", progname, BACKREF_BINDING);
+    print_messages(&messages);
+    return 0;
+  }
+  print_messages(&messages);
+  return 1;
+}
+
+static int save_pattern (Engine *e, int pat, const char *filename) {
+  if (rosie_save_rplx(e, (uint32_t) pat, filename) != SUCCESS) {
+    fprintf(stderr, "%s: cannot save compiled pattern to %s\n", progname, filename);
+    return 0;
+  }
+  return 1;
+}
+
+static void usage (void) {
+  fprintf(stderr, "Usage: %s [-n passes] [-e encoders] [-f corpus] [-b count] [-o file] [expression ...]\n", progname);
+  exit(1);
+}
+
+int main (int argc, char **argv) {
+  str messages;
+  int opt, ncorpora = 0, status = 0;
+  int passes = DEFAULT_PASSES, backrefs = 0;
+  char *encoders = NULL, *rplx_file = NULL, *home;
+  Corpus corpora[MAX_CORPORA];
+
+  if (argv[0] && argv[0][0]) progname = argv[0];
+
+  while ((opt = getopt(argc, argv, "n:e:f:b:o:")) != -1) {
+    switch (opt) {
+    case 'n': passes = atoi(optarg); break;
+    case 'e': encoders = optarg; break;
+    case 'f':
+      if (ncorpora == MAX_CORPORA) usage();
+      if (!read_corpus(optarg, &corpora[ncorpora])) {
+	fprintf(stderr, "%s: cannot read corpus %s\n", progname, optarg);
+	return 1;
+      }
+      ncorpora++;
+      break;
+    case 'b':
+      if (ncorpora == MAX_CORPORA) usage();
+      backrefs = atoi(optarg);
+      if (backrefs < 1) usage();
+      if (!make_backref_corpus(backrefs, &corpora[ncorpora])) {
+	fprintf(stderr, "%s: cannot allocate backreference corpus\n", progname);
+	return 1;
+      }
+      ncorpora++;
+      break;
+    case 'o': rplx_file = optarg; break;
+    default: usage();
+    }
+  }
+  if (passes < 1) usage();
+
+  encoders = strdup(encoders ? encoders : DEFAULT_ENCODERS);
+
+  if ((home = getenv("ROSIE_HOME")) != NULL) {
+    str home_str = rosie_string_from((byte_ptr) home, strlen(home));
+    messages.ptr = NULL;
+    rosie_home_init(&home_str, &messages);
+    print_messages(&messages);
+  }
+  Engine *e = rosie_new(&messages);
+  if (!e) {
+    fprintf(stderr, "%s: %.*s\n", progname, (int) messages.len, (char *) messages.ptr);
+    return 1;
+  }
+  if (backrefs && !load_backref_binding(e)) {
+    rosie_finalize(e);
+    return 1;
+  }
+
+  const char **expressions = (optind < argc) ? (const char **) &argv[optind]
+    : (backrefs ? backref_expressions : default_expressions);
+  int nexpressions = (optind < argc) ? (argc - optind) : -1;
+
+  for (int i = 0; (nexpressions < 0) ? (expressions[i] != NULL) : (i < nexpressions); i++) {
+    int pat = 0;
+    if (!bench_compile(e, expressions[i], passes, &pat)) { status = 1; continue; }
+    if (rplx_file && (i == 0) && !save_pattern(e, pat, rplx_file)) status = 1;
+    for (int j = 0; j < ncorpora; j++) {
+      char *list = strdup(encoders), *saveptr = NULL;
+      for (char *enc = strtok_r(list, ",", &saveptr); enc; enc = strtok_r(NULL, ",", &saveptr))
+	if (!bench_match(e, expressions[i], pat, &corpora[j], enc, passes)) status = 1;
+      free(list);
+    }
+    rosie_free_rplx(e, pat);
+  }
+
+  for (int j = 0; j < ncorpora; j++) free(corpora[j].data);
+  free(encoders);
+  rosie_finalize(e);
+  return status;
+}
@@ -4,7 +4,8 @@
 */
 
 #include <limits.h>
-
+#include <stdlib.h>
+#include <string.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -180,8 +181,9 @@ int checkaux (TTree *tree, int pred) {
     case TFalse: case TOpenCall: 
       return 0;  /* not nullable */
     case TRep: case TTrue: case THalt: /* rosie adds THalt */
+    case TSetMember:		       /* and pattern sets */
       return 1;  /* no fail */
-    case TNot: case TBehind:  /* can match empty, but can fail */
+    case TNot: case TBehind: case TSetEnd:  /* can match empty, but can fail */
       if (pred == PEnofail) return 0;
       else return 1;  /* PEnullable */
     case TAnd:  /* can match empty; fail iff body does */
@@ -225,6 +227,7 @@ int fixedlenx (TTree *tree, int count, int len) {
     case TChar: case TSet: case TAny:
       return len + 1;
     case TFalse: case TTrue: case TNot: case TAnd: case TBehind: case THalt: /* rosie adds THalt */
+    case TSetMember: case TSetEnd:
       return len;
     case TRep: case TRunTime: case TOpenCall: case TBackref:
       return -1;
@@ -348,12 +351,17 @@ static int getfirst (TTree *tree, const Charset *follow, Charset *firstset) {
         return 1;
       }
     } /* fallthrough */
-    case TBehind: {  /* instruction gives no new information */
+    case TBehind:  /* instruction gives no new information */
+    case TSetMember: {  /* rosie: neither does a member of a set */
       /* call 'getfirst' only to check for math-time captures */
       int e = getfirst(sib1(tree), follow, firstset);
       loopset(i, firstset->cs[i] = follow->cs[i]);  /* uses follow */
       return e | 1;  /* always can accept the empty string */
     }
+    case TSetEnd: {  /* rosie: depends on the captures, so do not bypass */
+      loopset(i, firstset->cs[i] = follow->cs[i]);
+      return 3;
+    }
     default: assert(0); return 0;
   }
 }
@@ -370,6 +378,7 @@ static int headfail (TTree *tree) {
     return 1;
   case TTrue: case TRep: case TRunTime: case TNot:
   case TBehind:  case THalt:	/* rosie adds THalt */
+  case TSetMember: case TSetEnd:
     return 0;
   case TCapture: case TGrammar: case TRule: case TAnd:
     tree = sib1(tree); goto tailcall;  /* return headfail(sib1(tree)); */
@@ -403,6 +412,7 @@ static int needfollow (TTree *tree) {
     case TChar: case TSet: case TAny:
     case TFalse: case TTrue: case TAnd: case TNot: case THalt: /* rosie adds THalt */
     case TRunTime: case TBackref: case TGrammar: case TCall: case TBehind:
+    case TSetMember: case TSetEnd:
       return 0;
     case TChoice: case TRep:
       return 1;
@@ -417,6 +427,228 @@ static int needfollow (TTree *tree) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Necessary literals
+** =======================================================
+*/
+
+/*
+** What is known about the strings matched by a tree: every match
+** starts with 'prefix' and ends with 'suffix', and contains each of
+** the literals in 'inner'.  When 'exact' is set, the tree matches
+** exactly the string in 'prefix' (and 'suffix').  Strings longer than
+** MAXLITERALLEN are truncated, which is safe because every part of a
+** necessary literal is also necessary.
+**
+** Only sequences and captures are analyzed.  Nothing is assumed about
+** choices, repetitions, grammars, or back references.  Predicates
+** consume nothing, but a literal required by an '&' predicate must
+** still be present in the input.
+*/
+typedef struct LitInfo {
+  int exact;
+  Literal prefix;
+  Literal suffix;
+  Prefilter inner;
+} LitInfo;
+
+static void lit_unknown (LitInfo *info) {
+  info->exact = 0;
+  info->prefix.len = info->suffix.len = 0;
+  info->inner.n = 0;
+}
+
+static void lit_empty (LitInfo *info) {
+  lit_unknown(info);
+  info->exact = 1;
+}
+
+static int lit_contains (const Literal *big, const Literal *small) {
+  int i;
+  for (i = 0; i + small->len <= big->len; i++)
+    if (memcmp(big->s + i, small->s, small->len) == 0) return 1;
+  return 0;
+}
+
+/*
+** Add 'lit' to the set 'pf', which is kept sorted by decreasing length
+** and holds no literal that is contained in another.  When the set is
+** full, the shortest literal is dropped.
+*/
+static void lit_add (Prefilter *pf, const Literal *lit) {
+  int i, j;
+  if (lit->len == 0) return;
+  for (i = 0; i < pf->n; i++)
+    if (lit_contains(&pf->lit[i], lit)) return;
+  for (i = j = 0; i < pf->n; i++)
+    if (!lit_contains(lit, &pf->lit[i])) pf->lit[j++] = pf->lit[i];
+  pf->n = j;
+  for (i = pf->n; (i > 0) && (pf->lit[i-1].len < lit->len); i--)
+    if (i < MAXLITERALS) pf->lit[i] = pf->lit[i-1];
+  if (i < MAXLITERALS) {
+    pf->lit[i] = *lit;
+    if (pf->n < MAXLITERALS) pf->n++;
+  }
+}
+
+static void lit_addall (Prefilter *pf, const Prefilter *from) {
+  int i;
+  for (i = 0; i < from->n; i++) lit_add(pf, &from->lit[i]);
+}
+
+/*
+** Concatenate 'a' and 'b' into 'out', keeping at most MAXLITERALLEN
+** bytes from the front (keep_front) or from the back of the result.
+** Returns 0 if anything was dropped.
+*/
+static int lit_concat (Literal *out, const Literal *a, const Literal *b, int keep_front) {
+  Literal tmp;
+  int total = a->len + b->len;
+  int skip = (total > MAXLITERALLEN) ? total - MAXLITERALLEN : 0;
+  int i, n = 0;
+  for (i = 0; i < total; i++) {
+    if (keep_front ? (i >= MAXLITERALLEN) : (i < skip)) continue;
+    tmp.s[n++] = (i < a->len) ? a->s[i] : b->s[i - a->len];
+  }
+  tmp.len = n;
+  *out = tmp;
+  return (skip == 0);
+}
+
+/*
+** The literal spanning the boundary between a match that ends with
+** 'suffix' and a match that starts with 'prefix', taking up to half
+** of MAXLITERALLEN from each side when both are long.
+*/
+static void lit_junction (Literal *out, const Literal *suffix, const Literal *prefix) {
+  Literal left, right = *prefix;
+  int half = MAXLITERALLEN / 2;
+  int nleft = suffix->len;
+  if (nleft + right.len > MAXLITERALLEN) {
+    if (nleft < half) right.len = MAXLITERALLEN - nleft;
+    else if (right.len < half) nleft = MAXLITERALLEN - right.len;
+    else { nleft = half; right.len = MAXLITERALLEN - half; }
+  }
+  left.len = nleft;
+  memcpy(left.s, suffix->s + (suffix->len - nleft), nleft);
+  lit_concat(out, &left, &right, 1);
+}
+
+/*
+** Update 'a' to describe a match of 'a' followed by a match of 'b'.
+** When either side is exact, the string across the boundary is kept
+** in the new prefix or suffix, so only a boundary between two inexact
+** matches adds a literal to 'inner'.
+*/
+static void lit_seq (LitInfo *a, const LitInfo *b) {
+  int exact = a->exact && b->exact;
+  lit_addall(&a->inner, &b->inner);
+  if (!a->exact && !b->exact) {
+    Literal junction;
+    lit_junction(&junction, &a->suffix, &b->prefix);
+    lit_add(&a->inner, &junction);
+  }
+  if (a->exact && !lit_concat(&a->prefix, &a->prefix, &b->prefix, 1)) exact = 0;
+  if (!b->exact) a->suffix = b->suffix;
+  else if (!lit_concat(&a->suffix, &a->suffix, &b->suffix, 0)) exact = 0;
+  a->exact = exact;
+}
+
+static void literals (TTree *tree, LitInfo *info) {
+  LitInfo next;
+ tailcall:
+  switch (tree->tag) {
+    case TChar:
+      lit_empty(info);
+      info->prefix.s[0] = info->suffix.s[0] = (byte) tree->u.n;
+      info->prefix.len = info->suffix.len = 1;
+      return;
+    case TTrue: case TNot: case TBehind:
+      lit_empty(info);		/* consumes nothing */
+      return;
+    case TAnd:
+      literals(sib1(tree), &next);
+      lit_empty(info);		/* consumes nothing, but needs 'next' */
+      info->inner = next.inner;
+      lit_add(&info->inner, &next.prefix);
+      lit_add(&info->inner, &next.suffix);
+      return;
+    case TCapture:
+      tree = sib1(tree); goto tailcall;
+    case TSeq:
+      /* sequences nest to the right, e.g. for strings, so iterate */
+      literals(sib1(tree), info);
+      for (tree = sib2(tree); tree->tag == TSeq; tree = sib2(tree)) {
+	literals(sib1(tree), &next);
+	lit_seq(info, &next);
+      }
+      literals(tree, &next);
+      lit_seq(info, &next);
+      return;
+    default:
+      lit_unknown(info);
+      return;
+  }
+}
+
+/*
+** A halt ends a match successfully wherever it occurs, so nothing
+** that follows a halt is necessary.
+*/
+static int canhalt (TTree *tree) {
+ tailcall:
+  if ((tree->tag == THalt) || (tree->tag == TNoTree)) return 1;
+  switch (numsiblings[tree->tag]) {
+    case 1:
+      tree = sib1(tree); goto tailcall;
+    case 2:
+      if (canhalt(sib1(tree))) return 1;
+      tree = sib2(tree); goto tailcall;
+    default:
+      return 0;
+  }
+}
+
+/*
+** Return the literals that every match of 'tree' contains, in a new
+** Prefilter for the caller to free, or NULL if none are known (or if
+** out of memory).
+*/
+Prefilter *necessary_literals (TTree *tree) {
+  LitInfo info;
+  Prefilter *pf;
+  if (canhalt(tree)) return NULL;
+  literals(tree, &info);
+  lit_add(&info.inner, &info.prefix);
+  lit_add(&info.inner, &info.suffix);
+  if (info.inner.n == 0) return NULL;
+  pf = (Prefilter *) malloc(sizeof(Prefilter));
+  if (pf) *pf = info.inner;
+  return pf;
+}
+
+/*
+** Return the characters that can start a match of 'tree', in a new
+** Charset for the caller to free, or NULL when that is not useful to a
+** search: when a match can be empty (or can halt), when the tree has
+** a match-time capture, when any character can start a match, or when
+** out of memory.
+*/
+Charset *first_set (TTree *tree) {
+  Charset cs, *first;
+  int any = 1;
+  if (canhalt(tree) || getfirst(tree, fullset, &cs)) return NULL;
+  loopset(i, if (cs.cs[i] != 0xFF) any = 0);
+  if (any) return NULL;
+  first = (Charset *) malloc(sizeof(Charset));
+  if (first) *first = cs;
+  return first;
+}
+
+/* }====================================================== */
+
+
 
 /*
 ** {======================================================
@@ -431,6 +663,7 @@ typedef struct CompileState {
   Pattern *p;  /* pattern being compiled */
   int ncode;  /* next position in p->code to be filled */
   lua_State *L;
+  struct DispatchState *ds;  /* scratch space for codedispatch, or NULL */
 } CompileState;
 
 /*
@@ -662,6 +895,102 @@ static int codebehind (CompileState *compst, TTree *tree) {
 }
 
 
+/*
+** Add an IDispatch instruction with 'n' targets and the given map.
+** The default offset and the target offsets are patched later.
+*/
+static int addinstruction_dispatch (CompileState *compst, int n, const byte *map) {
+  int i = addinstruction1(compst, IDispatch);
+  int j;
+  setindex(&getinstr(compst, i), n);
+  for (j = 1; j < DISPATCHSIZE(n); j++)
+    nextinstruction(compst);	/* space for offset, map, and targets */
+  setaddr(&getinstr(compst, i), 0);
+  memcpy(dispatchmap(&getinstr(compst, i)), map, UCHAR_MAX + 1);
+  assert(sizei(&getinstr(compst, i)) == DISPATCHSIZE(n));
+  return i;
+}
+
+/*
+** Multi-way choice as a jump table:
+** When the leading alternatives p1, ..., pn of <p1 / p2 / ... / rest>
+** do not accept the empty string, and their first sets are pairwise
+** disjoint and disjoint from first(rest), then the next character
+** selects the only alternative that can match, as in the disjoint
+** case of codechoice() below, but with one instruction instead of a
+** chain of n tests.
+**   <p1 / ... / pn / rest> == dispatch [first(p1) -> L1, ...] else L;
+**                             L1: p1; jmp E; ...; Ln: pn; jmp E; L: rest; E:
+** Returns 1 when it has generated the code (with any error in 'err'),
+** or 0 when the choice is not suitable.
+*/
+#define MINDISPATCH 4
+
+/* Shared by all calls in one compile, and so not used across codegen */
+typedef struct DispatchState {
+  TTree *rest[MAXDISPATCH];	/* what follows alternative k */
+  Charset first[MAXDISPATCH];	/* first set of alternative k */
+  Charset seen[MAXDISPATCH + 1]; /* union of first[0], ..., first[k-1] */
+} DispatchState;
+
+static int codedispatch (CompileState *compst, TTree *p1, TTree *p2, int opt,
+			 const Charset *fl, int *err) {
+  DispatchState *ds = compst->ds;
+  Charset cs;
+  byte map[UCHAR_MAX + 1];
+  int n = 0, k, c, inst;
+  int jmps[MAXDISPATCH];
+  TTree *alt = p1, *rest = p2;
+  if (!ds) {
+    ds = compst->ds = (DispatchState *) malloc(sizeof(DispatchState));
+    if (!ds) return 0;
+  }
+  loopset(i, ds->seen[0].cs[i] = 0);
+  /* Collect the leading alternatives with disjoint first sets */
+  while (n < MAXDISPATCH) {
+    if (getfirst(alt, fullset, &ds->first[n]) ||
+	!cs_disjoint(&ds->first[n], &ds->seen[n]))
+      break;
+    loopset(i, ds->seen[n+1].cs[i] = ds->seen[n].cs[i] | ds->first[n].cs[i]);
+    ds->rest[n] = rest;
+    n++;
+    if (rest->tag != TChoice) break;
+    alt = sib1(rest);
+    rest = sib2(rest);
+  }
+  /* Use as many as possible, such that what follows is disjoint too */
+  for (; n >= MINDISPATCH; n--) {
+    rest = ds->rest[n-1];
+    if (rest->tag == THalt) continue;
+    if (getfirst(rest, fl, &cs) || !cs_disjoint(&cs, &ds->seen[n])) continue;
+    break;
+  }
+  if (n < MINDISPATCH) return 0;
+  memset(map, 0, sizeof(map));
+  for (k = 0; k < n; k++)
+    for (c = 0; c <= UCHAR_MAX; c++)
+      if (testchar(ds->first[k].cs, c)) map[c] = (byte) (k + 1);
+  inst = addinstruction_dispatch(compst, n, map);
+  /* Nested dispatches reuse ds, so walk the alternatives again */
+  *err = 0;
+  alt = p1;
+  for (k = 0; (k < n) && !*err; k++) {
+    dispatchaddr(&getinstr(compst, inst), k + 1) = gethere(compst) - inst;
+    *err = codegen(compst, alt, 0, NOINST, fl);
+    jmps[k] = addinstruction_offset(compst, IJmp, 0);
+    if (k + 1 < n) {
+      alt = sib1(p2);
+      p2 = sib2(p2);
+    }
+  }
+  if (!*err) {
+    jumptohere(compst, inst);
+    *err = codegen(compst, rest, opt, NOINST, fl);
+    for (k = 0; k < n; k++) jumptohere(compst, jmps[k]);
+  }
+  return 1;
+}
+
 /*
 ** Choice; optimizations:
 ** - when p1 is headfail or
@@ -679,7 +1008,9 @@ static int codechoice (CompileState *compst, TTree *p1, TTree *p2, int opt,
   int haltp2 = (p2->tag == THalt);
   int emptyp2 = (p2->tag == TTrue);
   Charset cs1, cs2;
-  int e1 = getfirst(p1, fullset, &cs1);
+  int e1;
+  if (codedispatch(compst, p1, p2, opt, fl, &err)) return err;
+  e1 = getfirst(p1, fullset, &cs1);
   if (!haltp2 && (headfail(p1) ||
 		  (!e1 && (getfirst(p2, fl, &cs2), cs_disjoint(&cs1, &cs2))))) {
     /* <p1 / p2> == test (fail(p1)) -> L1 ; p1 ; jmp L2; L1: p2; L2: */
@@ -761,6 +1092,24 @@ static int codecapture (CompileState *compst, TTree *tree, int tt,
     return 0;			/* Success */
 }
 
+/*
+** Member of a pattern set (rosie): like an and predicate, except that
+** the captures of a match are kept, and a failure is ignored.  The
+** index of the member is the operand of its setcommit.
+**   choice L1; <p>; setcommit L1 (index); L1:
+*/
+static int codesetmember (CompileState *compst, TTree *tree) {
+  int pcommit;
+  int pchoice = addinstruction_offset(compst, IChoice, 0);
+  int err = codegen(compst, sib1(tree), 0, NOINST, fullset);
+  if (err) return err;
+  pcommit = addinstruction_offset(compst, ISetCommit, 0);
+  setindex(&getinstr(compst, pcommit), tree->u.n);
+  jumptohere(compst, pchoice);
+  jumptohere(compst, pcommit);
+  return 0;			/* Success */
+}
+
 static void codebackref (CompileState *compst, TTree *tree) { 
   addinstruction_aux(compst, IBackref, tree->key);
 }
@@ -963,6 +1312,8 @@ static int codegen (CompileState *compst, TTree *tree, int opt, int tt,
   case TBackref: codebackref(compst, tree); break;
   case TGrammar: return codegrammar(compst, tree); break;
   case TCall: codecall(compst, tree); break;
+  case TSetMember: return codesetmember(compst, tree); break; /* rosie */
+  case TSetEnd: addinstruction(compst, ISetEnd); break;		  /* rosie */
   case TSeq: {
     err = codeseq1(compst, sib1(tree), sib2(tree), &tt, fl);  /* code 'p1' */
     if (err) return err;
@@ -997,12 +1348,19 @@ static void peephole (CompileState *compst) {
       /* instructions with labels */
     case IPartialCommit: case ITestAny:
     case ICall: case IChoice:
-    case ICommit: case IBackCommit: 
+    case ICommit: case IBackCommit: case ISetCommit:
     case ITestChar: case ITestSet: {
       int final = finallabel(code, i);
       jumptothere(compst, i, final);  /* optimize label */
       break;
     }
+    case IDispatch: {
+      int k;
+      for (k = 1; k <= (int) index(inst); k++)
+	dispatchaddr(inst, k) = finaltarget(code, i + dispatchaddr(inst, k)) - i;
+      jumptothere(compst, i, finallabel(code, i));
+      break;
+    }
     case IJmp: {
       int ft = finaltarget(code, i);
       assert( ft < compst->ncode );
@@ -1017,7 +1375,7 @@ static void peephole (CompileState *compst) {
 	break;
       }
       case ICommit: case IPartialCommit:
-      case IBackCommit: { /* inst. with unconditional explicit jumps */
+      case IBackCommit: case ISetCommit: { /* inst. with unconditional explicit jumps */
 	int fft = finallabel(code, ft);
 	assert( fft < compst->ncode );
 	code[i] = code[ft];  /* jump becomes that instruction... */
@@ -1047,12 +1405,19 @@ static void peephole (CompileState *compst) {
 */
 Instruction *compile (lua_State *L, Pattern *p) {
   CompileState compst;
-  compst.p = p;  compst.ncode = 0;  compst.L = L;
+  int err;
+  compst.p = p;  compst.ncode = 0;  compst.L = L;  compst.ds = NULL;
   realloccode(L, p, 2);  /* minimum initial size */
-  if (codegen(&compst, p->tree, 0, NOINST, fullset)) return NULL;
+  err = codegen(&compst, p->tree, 0, NOINST, fullset);
+  free(compst.ds);
+  if (err) return NULL;
   addinstruction(&compst, IEnd);
   realloccode(L, p, compst.ncode);  /* set final size */
   peephole(&compst);    
+  free(p->prefilter);
+  p->prefilter = necessary_literals(p->tree);
+  free(p->firstset);
+  p->firstset = first_set(p->tree);
   return p->code;
 }
 
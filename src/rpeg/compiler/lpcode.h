@@ -15,6 +15,8 @@ int tocharset (TTree *tree, Charset *cs);
 int checkaux (TTree *tree, int pred);
 int fixedlenx (TTree *tree, int count, int len);
 int hascaptures (TTree *tree);
+Prefilter *necessary_literals (TTree *tree);
+Charset *first_set (TTree *tree);
 int lp_gc (lua_State *L);
 Instruction *compile (lua_State *L, Pattern *p);
 void realloccode (lua_State *L, Pattern *p, int nsize);
@@ -93,8 +93,20 @@ void printinst (const Instruction *op, const Instruction *p) {
       printf("%d", addr(p));
       break;
     }
+    case IDispatch: {
+      for (int k = 1; k <= (int) index(p); k++) {
+	byte cs[CHARSETSIZE] = {0};
+	for (int c = 0; c <= UCHAR_MAX; c++)
+	  if (dispatchmap(p)[c] == k) setchar(cs, c);
+	printcharset(cs);
+	printf("-> %d ", (int)(p + dispatchaddr(p, k) - op));
+      }
+      printf("else "); printjmp(op, p);
+      break;
+    }
     case IJmp: case ICall: case ICommit: case IChoice:
-    case IPartialCommit: case IBackCommit: case ITestAny: {
+    case IPartialCommit: case IBackCommit: case ITestAny:
+    case ISetCommit: {
       printjmp(op, p);
       break;
     }
@@ -126,14 +138,20 @@ void printcode (Instruction *p) {
 static void printcap (Capture *cap) {
   printcapkind(capkind(cap));
   /* the cast below is to suppress warning */
-  printf(" (idx: %d) -> %p\n", capidx(cap), (const void *) cap->s);
+  printf(" (idx: %d) -> %u\n", capidx(cap), cap->pos);
 }
 
 
+/* Without a limit, print until the outermost capture closes */
 void printcaplist (Capture *cap, Capture *limit) {
+  int depth = 0;
   printf(">======\n");
-  for (; cap->s && (limit == NULL || cap < limit); cap++)
+  for (; limit == NULL || cap < limit; cap++) {
     printcap(cap);
+    if (isfinalcap(cap)) break;
+    depth += isopencap(cap) ? 1 : -1;
+    if ((limit == NULL) && (depth <= 0)) break;
+  }
   printf("=======\n");
 }
 #endif
@@ -156,7 +174,8 @@ static const char *tagnames[] = {
   "call", "opencall", "rule", "grammar",
   "behind",
   "capture", "run-time",
-  "halt"
+  "backref", "halt", "notree",
+  "setmember", "setend"
 };
 
 
@@ -31,6 +31,10 @@
 #include "ktable.h" 
 #include "ktable-macros.h"
 #include "json.h"
+#include "columns.h"
+#include "captree.h"
+#include "delimited.h"
+#include "text.h"
 
 #if !defined(DEBUG)
 #define DEBUG 0
@@ -250,7 +254,7 @@ static int addtoktable (lua_State *L, int idx) {
     size_t len;
     const char *s = lua_tolstring(L, idx, &len); /* element to be added */ 
     assert (s);
-    if (!ktable_add(kt, (const char *)s, len))
+    if (ktable_add(kt, (const char *)s, len) < 0)
       luaL_error(L, "(add) out of memory");
     return n+1;			/* index of newly added item */
   } 
@@ -446,6 +450,11 @@ static TTree *newtree (lua_State *L, int len) {
   lua_setmetatable(L, -2);			    /* stack: pattern */
   p->code = NULL;  p->codesize = 0;
   p->kt = ktable_new(0, 0);
+  p->stats = NULL;
+  p->profile = NULL;
+  p->prefilter = NULL;
+  p->firstset = NULL;
+  p->arena = NULL;
   return p->tree;
 }
 
@@ -873,6 +882,67 @@ static int r_capture (lua_State *L) {
   return result;
 }
 
+/*
+** Rosie pattern set: rset({p1, ..., pn}, name) tries every pi at the
+** same position, in one run of the vm.  A match has a capture called
+** 'name' containing, for each pi that matched, a capture named by the
+** index i whose sub-capture is the match of pi.  The index itself is
+** kept in the member's tree node (u.n), from which the code generator
+** passes it to the vm, which marks the Close of the member's capture
+** with it (see ISetCommit).  The set consumes no input, and fails when
+** no pi matches.  The members are joined as a balanced tree of
+** sequences, so that building a set of n patterns copies each of them
+** about log2(n) times, not n times.
+**   <set> == <opencap name; member p1; ...; member pn; setend; closecap>
+*/
+static int r_setmember (lua_State *L) {
+  lua_Integer i = luaL_checkinteger(L, 3);
+  lua_settop(L, 2);
+  r_capture(L);			/* stack: capture, name, pattern */
+  lua_replace(L, 1);
+  lua_settop(L, 1);
+  TTree *tree = newroot1sib(L, TSetMember);
+  tree->u.n = (int) i;
+  return 1;
+}
+
+/* Push the sequence of the members lo..hi of the table at index 1 */
+static void set_members (lua_State *L, int lo, int hi) {
+  luaL_checkstack(L, 5, "pattern set too large");
+  if (lo == hi) {
+    lua_pushcfunction(L, r_setmember);
+    lua_rawgeti(L, 1, lo);
+    lua_pushfstring(L, "%d", lo);
+    lua_pushinteger(L, lo);
+    lua_call(L, 3, 1);
+  }
+  else {
+    int mid = lo + (hi - lo) / 2;
+    lua_pushcfunction(L, lp_seq);
+    set_members(L, lo, mid);
+    set_members(L, mid + 1, hi);
+    lua_call(L, 2, 1);
+  }
+}
+
+static int r_set (lua_State *L) {
+  lua_Integer n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checkstring(L, 2);	/* set name */
+  lua_settop(L, 2);
+  n = luaL_len(L, 1);
+  if (n < 1) luaL_error(L, "pattern set is empty");
+  if (n > MAX_SET_MEMBERS) luaL_error(L, "pattern set too large");
+  lua_pushcfunction(L, r_capture);
+  lua_pushcfunction(L, lp_seq);
+  set_members(L, 1, (int) n);
+  newleaf(L, TSetEnd);
+  lua_call(L, 2, 1);		/* members * setend */
+  lua_pushvalue(L, 2);
+  lua_call(L, 2, 1);		/* rcap(members * setend, name) */
+  return 1;
+}
+
 /* Rosie constant capture */
 static int r_constcapture (lua_State *L) { 
   size_t len;
@@ -1047,10 +1117,10 @@ static int verifyrule (lua_State *L, TTree *tree, int *passed, int npassed,
     case TChar: case TSet: case TAny:
     case TFalse: case THalt:	/* rosie adds THalt */
       return nb;  /* cannot pass from here */
-    case TTrue:
+    case TTrue: case TSetEnd:
     case TBehind:  /* look-behind cannot have calls */
       return 1;
-    case TNot: case TAnd: case TRep:
+    case TNot: case TAnd: case TRep: case TSetMember:
       /* return verifyrule(L, sib1(tree), passed, npassed, 1); */
       tree = sib1(tree); nb = 1; goto tailcall;
     case TCapture: case TRunTime:
@@ -1123,7 +1193,7 @@ static void initialrulename (lua_State *L, TTree *grammar, int frule) {
     size_t name_len;
     const char *name = lua_tolstring(L, -1, &name_len); 
     int actualpos = ktable_add(kt, name, name_len);
-    if (!actualpos)
+    if (actualpos < 0)
       luaL_error(L, "(initial rule) out of memory");
     lua_pop(L, 1);		/* remove rule name (string) */
     assert( actualpos == n );
@@ -1223,9 +1293,18 @@ static void update_capture_keys(TTree *tree, int *mapping, int keymax) {
 }
 
 static void compact_ktable(lua_State *L, Pattern *p) {
-  int idx, newidx;
-  Ktable *ckt = ktable_compact(p->kt);
-  if (!ckt) luaL_error(L, "%s:%d: could not compact ktable\n", __FILE__, __LINE__);
+  /* 
+     Mapping from old to new.  Note: alloca fails in an odd way (not
+     returning NULL!), when ktable_len is large, so using calloc
+     instead.
+   */
+  int *mapping = (int *)calloc(ktable_len(p->kt)+1, sizeof(int));
+  if (!mapping) luaL_error(L, "%s:%d: out of memory (while compacting ktable)\n", __FILE__, __LINE__);
+  Ktable *ckt = ktable_compact(p->kt, mapping);
+  if (!ckt) {
+    free(mapping);
+    luaL_error(L, "%s:%d: could not compact ktable\n", __FILE__, __LINE__);
+  }
 
 #if 0
   /* DEBUGGING */
@@ -1235,26 +1314,7 @@ static void compact_ktable(lua_State *L, Pattern *p) {
   ktable_dump(ckt);
   printf("---\n");
 #endif
-  /* 
-     Create mapping from old to new.  Note: alloca fails in an odd way
-     (not returning NULL!), when ktable_len is large, so using calloc
-     instead.
-   */
-  int *mapping = (int *)calloc(ktable_len(p->kt)+1, sizeof(int));
-  if (!mapping) luaL_error(L, "%s:%d: out of memory (while compacting ktable)\n", __FILE__, __LINE__);
-  mapping[0] = 0;
-  for (idx = 1; idx <= ktable_len(p->kt); idx++) { /* 0 is an unused index */
-    size_t len;
-    const char *name = ktable_element_name(p->kt, idx, &len);
-    newidx = ktable_compact_search(ckt, name, len); 
-    if (newidx == 0) {
-      free(mapping);
-      luaL_error(L, "%s:%d: incomplete compacted ktable, missing %.*s\n",
-		 __FILE__, __LINE__, (int) len, name);
-    }
-    mapping[idx] = newidx;
-  } 
-  update_capture_keys(p->tree, mapping, idx);
+  update_capture_keys(p->tree, mapping, ktable_len(p->kt) + 1);
   ktable_free(p->kt);
   p->kt = ckt;
   free(mapping);
@@ -1267,6 +1327,7 @@ static Instruction *prepcompile (lua_State *L, Pattern *p) {
   if (!code)
     /* Other errors will be caught in finalfix() */
     luaL_error(L, "cannot compile expression containing a precompiled pattern");
+  json_prepare_ktable(p->kt);	/* optional, so failure is ok */
   return code;
 }
 
@@ -1303,6 +1364,12 @@ static int lp_make_compiled_pattern (lua_State *L, int nsize, Instruction *code,
   p->codesize = nsize;
   p->tree->tag = TNoTree;
   p->kt = kt;
+  p->stats = NULL;
+  p->profile = NULL;
+  p->prefilter = NULL;	/* no tree from which to compute it */
+  p->firstset = NULL;	/* nor this */
+  p->arena = NULL;
+  json_prepare_ktable(kt);	/* optional, so failure is ok */
 
   luaL_getmetatable(L, PATTERN_T); /* stack: mt, pat */
   lua_setmetatable(L, -2);	   /* stack: pat */       
@@ -1362,13 +1429,27 @@ static int lp_saveRPLX (lua_State *L) {
  *
  */
 
-static Encoder debug_encoder = { debug_Open, debug_Close };
-static Encoder byte_encoder = { byte_Open, byte_Close };
-static Encoder json_encoder = { json_Open, json_Close };
-static Encoder status_encoder = { NULL, NULL };
-
-static int set_encoder (Encoder *encoder, int etype) {
+static Encoder debug_encoder = { debug_Open, debug_Close, NULL };
+static Encoder byte_encoder = { byte_Open, byte_Close, NULL };
+static Encoder json_encoder = { json_Open, json_Close, NULL };
+static Encoder status_encoder = { NULL, NULL, NULL };
+static Encoder data_encoder = { data_Open, data_Close, NULL };
+static Encoder subs_encoder = { subs_Open, subs_Close, NULL };
+static Encoder color_encoder = { color_Open, color_Close, NULL };
+
+/* The text encoders keep their state in 'ts', which the caller must
+   have initialized with text_state_init() */
+static int set_encoder (Encoder *encoder, int etype, TextState *ts) {
   switch (etype) {
+  case ENCODE_DATA: {
+    *encoder = data_encoder; encoder->state = ts; break;
+  }
+  case ENCODE_SUBS: {
+    *encoder = subs_encoder; encoder->state = ts; break;
+  }
+  case ENCODE_COLOR: {
+    *encoder = color_encoder; encoder->state = ts; break;
+  }
   case ENCODE_BYTE: {
     *encoder = byte_encoder; break;
   }
@@ -1470,7 +1551,9 @@ int r_match_lua (lua_State *L) {
   Stats stats = {duration0, duration1, 0, 0, 0, 0};
 
   Encoder encoder;
-  if (!set_encoder(&encoder, etype))
+  TextState ts;
+  text_state_init(&ts, input_ptr + input_len);
+  if (!set_encoder(&encoder, etype, &ts))
     luaL_error(L, "bad encoder value");
 
   buf_reset(*output);		 /* Reset the buffer for reuse */
@@ -1487,7 +1570,8 @@ int r_match_lua (lua_State *L) {
 		      &input, startpos, 0,
 		      encoder, timeflag,
 		      *output,
-		      &match_result);
+		      &match_result,
+		      NULL, NULL, NULL);
 
   if (err) {
     const char *msg = STRERROR(err, MATCH_MESSAGES);
@@ -1535,13 +1619,36 @@ int r_match_lua (lua_State *L) {
    one via compile().
 */
 
-int r_match_C2 (void *pattern_as_void_ptr,
-		struct rosie_string *input, uint32_t startpos, uint32_t endpos,
-		uint8_t etype, uint8_t collect_times,
-		Buffer *output, struct rosie_matchresult *match_result) {
-  int err;
+/*
+   When the pattern has necessary literals (see necessary_literals() in
+   lpcode.c), look for them in the part of the input that the vm would
+   see.  If one is missing, the pattern cannot match, so fill in
+   'match_result' as vm_match2() does for no match and return 1.
+   Positions that vm_match2() would reject are left for it to report.
+*/
+static int prefilter_rejects (Prefilter *pf, struct rosie_string *input,
+			      uint32_t startpos, uint32_t endpos,
+			      struct rosie_matchresult *match_result) {
+  size_t start = (startpos != 0) ? startpos - 1 : 0;
+  size_t end = (endpos != 0) ? endpos - 1 : input->len;
+  if ((start > input->len) || (end < start) || (end > input->len)) return 0;
+  for (int i = 0; i < pf->n; i++) {
+    if (!memmem(input->ptr + start, end - start, pf->lit[i].s, pf->lit[i].len)) {
+      match_result->data.ptr = NULL;
+      match_result->data.len = 0;
+      match_result->leftover = end - start;
+      match_result->abend = 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int match_encoded (void *pattern_as_void_ptr,
+			  struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+			  Encoder encoder, uint8_t collect_times,
+			  Buffer *output, struct rosie_matchresult *match_result) {
   Chunk chunk;
-  Encoder encoder;
 
   if (!pattern_as_void_ptr) return MATCH_ERR_NULL_PATTERN;
   if (!input) return MATCH_ERR_NULL_INPUT;
@@ -1558,18 +1665,38 @@ int r_match_C2 (void *pattern_as_void_ptr,
   chunk.codesize = p->codesize;
   chunk.ktable = p->kt;
   chunk.filename = NULL;
-    
-  if (!set_encoder(&encoder, etype))
-    return MATCH_INVALID_ENCODER;
 
-  buf_reset(output);		/* Reset the buffer for reuse */
+  buf_start(output);		/* Reset the buffer for reuse */
 
-  err = vm_match2(&chunk,
-		  input, startpos, endpos,
-		  encoder,
-		  collect_times,
-		  output,
-		  match_result);
+  if (p->prefilter &&
+      prefilter_rejects(p->prefilter, input, startpos, endpos, match_result)) {
+    if (p->stats) p->stats->failures++;
+    return MATCH_OK;
+  }
+
+  return vm_match2(&chunk,
+		   input, startpos, endpos,
+		   encoder,
+		   collect_times,
+		   output,
+		   match_result,
+		   p->stats, p->profile, p->arena);
+}
+
+int r_match_C2 (void *pattern_as_void_ptr,
+		struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+		uint8_t etype, uint8_t collect_times,
+		Buffer *output, struct rosie_matchresult *match_result) {
+  int err;
+  Encoder encoder;
+  TextState ts;
+
+  text_state_init(&ts, input ? (const char *) input->ptr + input->len : NULL);
+  if (!set_encoder(&encoder, etype, &ts))
+    return MATCH_INVALID_ENCODER;
+
+  err = match_encoded(pattern_as_void_ptr, input, startpos, endpos,
+		      encoder, collect_times, output, match_result);
 
   if (err != 0) return err;
 
@@ -1582,20 +1709,279 @@ int r_match_C2 (void *pattern_as_void_ptr,
     /* When ptr is NULL, the info we need is in the len field. */
     if (match_result->data.len == MATCH_WITHOUT_DATA) {
       /* Found a match */
-      /* Verify that 'status' encoder generates no output */
-      assert( output->n == 0 );
-      /* Expand output buffer if necessary */
-      if (!buf_prepsize(output, (size_t) input->len)) return MATCH_OUT_OF_MEM;
+      /* Expand output buffer if necessary (which may flush it) */
+      if (!buf_prepsize(output, (size_t) input->len)) return MATCH_ERR_OUTPUT_MEM;
       /* Copy input into output buffer */
+      match_result->data.ptr = output->data + output->n;
+      match_result->data.len = input->len;
       buf_addlstring_UNSAFE(output, input->ptr, (size_t) input->len);
-      match_result->data.ptr = output->data;
-      match_result->data.len = output->n;
     }
   }
 
   return MATCH_OK;
 }
 
+/* Add the counters of the vm runs made during one call into 'total',
+   as a single call that either found matches or did not */
+static void merge_matchstats (struct rosie_matchstats *total,
+			      struct rosie_matchstats *runs, int matched) {
+  if (matched) total->matches++;
+  else total->failures++;
+  total->insts += runs->insts;
+  total->encoder_bytes += runs->encoder_bytes;
+  total->total_ns += runs->total_ns;
+  total->match_ns += runs->match_ns;
+  if (runs->max_backtrack > total->max_backtrack) total->max_backtrack = runs->max_backtrack;
+  if (runs->max_caplist > total->max_caplist) total->max_caplist = runs->max_caplist;
+  if (runs->max_capdepth > total->max_capdepth) total->max_capdepth = runs->max_capdepth;
+}
+
+/*
+   Global search: encode every non-overlapping match in the input,
+   leftmost first, into 'output', and set 'count' to how many there
+   are.  Each encoded match is followed by a newline, except with the
+   byte encoder, whose output delimits itself.  After a match that
+   consumed nothing, the search continues at the next position.
+
+   The search loops here rather than in the caller, so the setup of a
+   match is done once.  It gives up without running the vm when a
+   necessary literal is missing from the input, and it skips the
+   positions at which no match can start (see first_set() in lpcode.c).
+
+   On return, match_result->data is all of the output (with a NULL ptr
+   when there were no matches), and leftover is the number of input
+   bytes after the last match.  When a match ends abnormally (halt),
+   the search stops there, and match_result->abend is set.  Encoders
+   that need the whole input, i.e. line and color, or that produce no
+   output, i.e. status, are not valid here.
+
+   When statistics are being collected, the whole search counts as one
+   call, which found a match if *count is not zero.
+*/
+int r_match_all (void *pattern_as_void_ptr,
+		 struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+		 uint8_t etype, Buffer *output, uint32_t *count,
+		 struct rosie_matchresult *match_result) {
+  static const char newline = '\n';
+  Chunk chunk;
+  Encoder encoder;
+  TextState ts;
+  struct rosie_matchresult one;
+  struct rosie_matchstats runs;
+  size_t pos, end, last;
+  int err, abend = 0;
+
+  if (!pattern_as_void_ptr) return MATCH_ERR_NULL_PATTERN;
+  if (!input) return MATCH_ERR_NULL_INPUT;
+  if (!output) return MATCH_ERR_NULL_OUTPUT;
+  if (!match_result || !count) return MATCH_ERR_NULL_MATCHRESULT;
+  if ((etype == ENCODE_LINE) || (etype == ENCODE_COLOR) || (etype == ENCODE_STATUS))
+    return MATCH_INVALID_ENCODER;
+  text_state_init(&ts, (const char *) input->ptr + input->len);
+  if (!set_encoder(&encoder, etype, &ts)) return MATCH_INVALID_ENCODER;
+
+  Pattern *p = (Pattern *) pattern_as_void_ptr;
+  if (p->code == NULL) {
+    LOG("internal error: code generator has not run?\n"); 
+    return MATCH_IMPL_ERROR;
+  }
+  chunk.code = p->code;
+  chunk.codesize = p->codesize;
+  chunk.ktable = p->kt;
+  chunk.filename = NULL;
+
+  /* 0-based, with 'end' exclusive, as in vm_match2() */
+  pos = (startpos != 0) ? startpos - 1 : 0;
+  end = (endpos != 0) ? endpos - 1 : input->len;
+  if (pos > input->len) return MATCH_ERR_STARTPOS;
+  if ((end < pos) || (end > input->len)) return MATCH_ERR_ENDPOS;
+
+  buf_start(output);		/* Reset the buffer for reuse */
+  *count = 0;
+  last = pos;
+  memset(&runs, 0, sizeof(runs));
+  if (p->prefilter &&
+      prefilter_rejects(p->prefilter, input, startpos, endpos, match_result)) {
+    if (p->stats) p->stats->failures++;
+    return MATCH_OK;
+  }
+
+  while (pos <= end) {
+    if (p->firstset) {
+      /* A match must consume a character in the first set */
+      while ((pos < end) && !testchar(p->firstset->cs, input->ptr[pos])) pos++;
+      if (pos == end) break;
+    }
+    memset(&one, 0, sizeof(one));
+    err = vm_match2(&chunk,
+		    input, pos + 1, end + 1,
+		    encoder, 0,
+		    output,
+		    &one,
+		    (p->stats ? &runs : NULL), p->profile, p->arena);
+    if (err) return err;
+    if (!one.data.ptr && !one.data.len) {
+      pos++;			/* no match here */
+      continue;
+    }
+    (*count)++;
+    if ((etype != ENCODE_BYTE) && !buf_addchar(output, newline)) return MATCH_ERR_OUTPUT_MEM;
+    last = end - one.leftover;
+    /* A pattern that halted asked for the search to stop */
+    if (one.abend) {
+      abend = 1;
+      break;
+    }
+    pos = (last > pos) ? last : pos + 1;
+  }
+
+  if (p->stats) merge_matchstats(p->stats, &runs, (*count != 0));
+  match_result->data.ptr = *count ? (byte_ptr) output->data : NULL;
+  match_result->data.len = *count ? output->n : 0;
+  match_result->leftover = end - last;
+  match_result->abend = abend;
+  return MATCH_OK;
+}
+
+/*
+   Like r_match_C2() with the 'columns' encoder, which appends the
+   captures of a match to 'cols' (see columns.h), and leaves 'output'
+   empty.  The rows added have 'record' in the record column.  If
+   there is an error, the rows of the partly walked match are removed.
+*/
+int r_match_columns (void *pattern_as_void_ptr,
+		     struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+		     Columns *cols, int32_t record,
+		     Buffer *output, struct rosie_matchresult *match_result) {
+  Encoder encoder;
+  uint32_t nrows;
+  int err;
+  if (!cols) return MATCH_ERR_NULL_OUTPUT;
+  cols->record = record;
+  nrows = cols->nrows;
+  columns_encoder(cols, &encoder);
+  err = match_encoded(pattern_as_void_ptr, input, startpos, endpos,
+		      encoder, 0, output, match_result);
+  if (err != MATCH_OK) columns_truncate(cols, nrows);
+  return err;
+}
+
+/*
+   Like r_match_C2(), but instead of encoding the captures, link them
+   into 'tree' (see captree.h), which holds only the latest match.
+   'output' is left empty.
+*/
+int r_match_tree (void *pattern_as_void_ptr,
+		  struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+		  CapTree *tree,
+		  Buffer *output, struct rosie_matchresult *match_result) {
+  Encoder encoder;
+  if (!tree) return MATCH_ERR_NULL_OUTPUT;
+  captree_reset(tree);
+  captree_encoder(tree, &encoder);
+  return match_encoded(pattern_as_void_ptr, input, startpos, endpos,
+		       encoder, 0, output, match_result);
+}
+
+/*
+   Like r_match_C2() with the 'delimited' encoder, which writes one
+   row of the fields configured in 'd' (see delimited.h) to 'output'.
+*/
+int r_match_delimited (void *pattern_as_void_ptr,
+		       struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+		       Delimited *d,
+		       Buffer *output, struct rosie_matchresult *match_result) {
+  Encoder encoder;
+  if (!d) return MATCH_ERR_NULL_OUTPUT;
+  delimited_encoder(d, &encoder);
+  return match_encoded(pattern_as_void_ptr, input, startpos, endpos,
+		       encoder, 0, output, match_result);
+}
+
+/* Add a field to 'd' for the capture called 'name' in the pattern.
+   See delimited_add() for the return value. */
+int r_delimited_add (void *pattern_as_void_ptr, Delimited *d, const char *name, size_t len) {
+  Pattern *p = (Pattern *) pattern_as_void_ptr;
+  if (!p->kt) return 0;
+  return delimited_add(d, p->kt, name, len);
+}
+
+/* The name (or constant) at index 'idx' of the pattern's ktable, e.g.
+   from the type column of the 'columns' encoder, or NULL if none. */
+const char *r_pattern_capture_name (void *pattern_as_void_ptr, int idx, size_t *len) {
+  Pattern *p = (Pattern *) pattern_as_void_ptr;
+  if (!p->kt || (idx < 1) || (idx > ktable_len(p->kt))) return NULL;
+  return ktable_element_name(p->kt, idx, len);
+}
+
+/* 
+   Match statistics for a pattern are off until enabled here.
+   Enabling (or re-enabling) starts the counters at zero; disabling
+   discards them.  Returns 0 when out of memory, else 1.
+*/
+int r_pattern_collect_stats (void *pattern_as_void_ptr, int enable) {
+  Pattern *p = (Pattern *) pattern_as_void_ptr;
+  if (!enable) {
+    free(p->stats);
+    p->stats = NULL;
+    return 1;
+  }
+  if (!p->stats) {
+    p->stats = (struct rosie_matchstats *) malloc(sizeof(struct rosie_matchstats));
+    if (!p->stats) return 0;
+  }
+  memset(p->stats, 0, sizeof(struct rosie_matchstats));
+  return 1;
+}
+
+/* Returns NULL when statistics are not being collected */
+struct rosie_matchstats *r_pattern_stats (void *pattern_as_void_ptr) {
+  return ((Pattern *) pattern_as_void_ptr)->stats;
+}
+
+/* 
+   Like r_pattern_collect_stats(), but for the per-instruction
+   profile, which can only be created for a pattern that has been
+   compiled.  Returns 0 when out of memory or not compiled, else 1.
+*/
+int r_pattern_collect_profile (void *pattern_as_void_ptr, int enable) {
+  Pattern *p = (Pattern *) pattern_as_void_ptr;
+  if (!enable) {
+    profile_free(p->profile);
+    p->profile = NULL;
+    return 1;
+  }
+  if (!p->code) return 0;
+  if (!p->profile) {
+    p->profile = profile_new(p->codesize);
+    return (p->profile != NULL);
+  }
+  profile_reset(p->profile);
+  return 1;
+}
+
+/* 
+   Append the profile report for a pattern to 'output', optionally
+   resetting the counters afterwards.  Returns MATCH_OK, or an error
+   from the MatchErr enum.
+*/
+int r_pattern_profile_report (void *pattern_as_void_ptr, Buffer *output, int reset) {
+  int err;
+  Pattern *p = (Pattern *) pattern_as_void_ptr;
+  if (!p->profile) return MATCH_ERR_NULL_PATTERN; /* not profiling */
+  err = profile_report(p->profile, p->code, p->kt, output);
+  if (reset) profile_reset(p->profile);
+  return err;
+}
+
+/* 
+   Use 'arena' (or malloc, when it is NULL) for the transient memory
+   of subsequent matches of this pattern.  See arena.h.
+*/
+void r_pattern_set_arena (void *pattern_as_void_ptr, struct Arena *arena) {
+  ((Pattern *) pattern_as_void_ptr)->arena = arena;
+}
+
 /*
 ** {======================================================
 ** Library creation and functions not related to matching
@@ -1622,6 +2008,10 @@ int lp_gc (lua_State *L) {
   if (p->kt) {
     ktable_free(p->kt);		/* ktable */
   }
+  free(p->stats);		/* match statistics, if any */
+  profile_free(p->profile);	/* instruction profile, if any */
+  free(p->prefilter);		/* necessary literals, if any */
+  free(p->firstset);		/* first characters, if any */
   realloccode(L, p, 0);		/* delete code block */
   return 0;
 }
@@ -1645,6 +2035,7 @@ static struct luaL_Reg pattreg[] = {
   {"codegen", r_codegen_if_needed},
   {"rcap", r_capture},
   {"rconstcap", r_constcapture},
+  {"rset", r_set},
   {"Br", r_backref},
   {"rmatch", r_match_lua},
   {"newbuffer", r_lua_newbuffer},
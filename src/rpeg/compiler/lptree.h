@@ -21,6 +21,7 @@ static const byte numsiblings[] = {
   1, 1,	       /* capture, runtime capture */
   0,	       /* Rosie backreference */
   0, 0,	       /* Rosie halt, no tree */
+  1, 0,	       /* Rosie pattern set member, set end */
 };
 
 /*
@@ -42,6 +43,8 @@ typedef enum TTag {
   TBackref,  /* Rosie: match previously captured text */
   THalt,     /* Rosie: stop the vm (abend) */
   TNoTree,   /* Rosie: a compiled pattern restored from a file has no tree */
+  TSetMember,/* Rosie: like TAnd, but keeps captures, and never fails */
+  TSetEnd,   /* Rosie: fails unless a TSetMember before it matched */
 } TTag;
 
 /*
@@ -67,6 +70,26 @@ typedef struct TTree_type {
   } u;
 } TTree;
 
+/*
+ * Literals that every match of a pattern must contain, computed from
+ * the tree at compile time (see necessary_literals() in lpcode.c).
+ * When a pattern has any, r_match_C2() rejects input that lacks one
+ * of them without running the vm.  Longer literals come first, since
+ * they are more likely to be absent.
+ */
+#define MAXLITERALS	3
+#define MAXLITERALLEN	32
+
+typedef struct Literal {
+  int len;
+  byte s[MAXLITERALLEN];
+} Literal;
+
+typedef struct Prefilter {
+  int n;			/* number of literals */
+  Literal lit[MAXLITERALS];
+} Prefilter;
+
 /*
  * A pattern constructed by the compiler has a tree and a ktable. (The
  * ktable is a symbol table, and  a tree node that references a string
@@ -77,11 +100,21 @@ typedef struct TTree_type {
  * compiled pattern is saved to a file, and restored when loaded.
  *
  * A compiled pattern restored from a file has no tree.
+ *
+ * Match statistics and the per-instruction profile are accumulated
+ * (across calls to r_match_C2) only when the stats and profile fields,
+ * respectively, are non-NULL.  The arena, when set, belongs to the
+ * caller, who must detach it before freeing it.
  */
 typedef struct Pattern_type {
   union Instruction *code;
   int codesize;
   Ktable *kt;
+  struct rosie_matchstats *stats; /* NULL unless collecting stats */
+  struct Profile *profile;	  /* NULL unless profiling */
+  Prefilter *prefilter;		  /* NULL if no literal is known to be necessary */
+  struct Charset *firstset;	  /* NULL if not useful for skipping ahead */
+  struct Arena *arena;		  /* NULL unless matching with an arena (not owned) */
   TTree tree[1];		/* tree must be last, because it will grow */
 } Pattern;
 
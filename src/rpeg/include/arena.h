@@ -0,0 +1,56 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  arena.h  A bump allocator for the transient memory of a batch of matches */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(arena_h)
+#define arena_h
+
+#include <stddef.h>
+
+/*
+ * An arena hands out memory from a list of large blocks by bumping a
+ * pointer.  Individual allocations are never freed.  Instead,
+ * arena_reset() makes all of the memory available again in O(1),
+ * keeping the blocks, so that a batch of matches that has warmed up
+ * the arena does no further calls to malloc.
+ *
+ * The vm uses an arena (when given one) for its capture list and its
+ * backtrack and capture stacks, which otherwise are malloc'd whenever
+ * they outgrow their initial (stack allocated) storage.  A Buffer can
+ * use one via its sink, with arena_lalloc() as the 'alloc' function
+ * and the arena as 'ud'.
+ *
+ * An arena is not thread-safe.  Use one per thread (or per engine).
+ * Nothing allocated from an arena may be used after arena_reset().
+ */
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size;			/* bytes in data */
+  char data[];
+} ArenaBlock;
+
+typedef struct Arena {
+  ArenaBlock *first;
+  ArenaBlock *current;		/* block we are allocating from */
+  size_t used;			/* bytes used in current block */
+  size_t blocksize;		/* minimum size of a new block */
+  char *last;			/* most recent allocation, which can grow in place */
+  size_t total;			/* bytes in all blocks */
+} Arena;
+
+#define ARENA_DEFAULT_BLOCKSIZE (64 * 1024)
+
+Arena *arena_new (size_t blocksize);
+void *arena_alloc (Arena *a, size_t size);
+void *arena_realloc (Arena *a, void *ptr, size_t osize, size_t nsize);
+void arena_reset (Arena *a);
+void arena_free (Arena *a);
+
+void *arena_lalloc (void *ud, void *ptr, size_t osize, size_t nsize);
+
+#endif
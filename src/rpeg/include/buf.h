@@ -18,12 +18,40 @@ typedef enum BufErr {
   BUF_ERR_WRITE, BUF_ERR_READ,
 } BufErr;
 
+/* 
+ * Where the data goes.  By default, a buffer starts in its
+ * initialbuff and then grows using malloc/realloc.  A caller can
+ * instead supply:
+ *
+ *   region  storage to use first, e.g. part of a network send buffer.
+ *           A region is never freed, and without 'alloc' (or 'flush')
+ *           it is never outgrown: adding more data than fits fails.
+ *   alloc   an allocator with the same contract as lua_Alloc, used to
+ *           grow the buffer (and to free what it allocated).
+ *   flush   a function that receives the contents when the buffer is
+ *           full, after which the buffer is empty again.  It returns
+ *           0 on success.  See buf_flush() and buf_write_fd().
+ */
+typedef void *(*BufAlloc) (void *ud, void *ptr, size_t osize, size_t nsize);
+typedef int (*BufFlush) (void *ud, const char *data, size_t len);
+
+typedef struct BufSink {
+  char     *region;
+  size_t   size;		/* size of region */
+  BufAlloc alloc;
+  BufFlush flush;
+  void     *ud;			/* passed to alloc and flush */
+} BufSink;
+
 /* Our data, which will be freed by a call to buf_free(). */
 typedef struct Buffer {
   char   *data;
   size_t capacity;
   size_t n;			/* number of bytes in use */
   char   *initb;
+  BufSink sink;			/* all zero by default */
+  int    err;			/* set when an addition has failed since buf_reset() */
+  size_t flushed;		/* total bytes passed to sink.flush */
   char   initialbuff[INITIAL_BUFFER_SIZE];
 } Buffer;
 
@@ -46,11 +74,17 @@ typedef struct BufferLiteConst {
 int buf_info(Buffer *b);
 Buffer *buf_new(size_t minimum_size);
 Buffer *buf_from_const(const char *data, size_t size);
+int buf_rewrap(Buffer *b, const char *data, size_t size);
 
 char *buf_prepsize(Buffer *b, size_t additional);
 void buf_reset(Buffer *b);
 void buf_free(Buffer *b);
 
+void buf_set_sink(Buffer *b, const BufSink *sink);
+void buf_start(Buffer *b);
+int  buf_flush(Buffer *b);
+int  buf_write_fd(void *ud, const char *data, size_t len);
+
 Buffer *buf_addlstring (Buffer *b, const char *s, size_t len);
 char *buf_substring (Buffer *b, int j, int k, size_t *len);
 Buffer *buf_addint(Buffer *b, int i);
@@ -66,6 +100,40 @@ short buf_readshort (const char **s);
 #define buf_addlstring_UNSAFE(b, s, l) { memcpy(&((b)->data[(b)->n]), (s), (l) * sizeof(char)); (b)->n += (l); }
 #define buf_addchar_UNSAFE(b, c) buf_addlstring_UNSAFE((b), &(c), sizeof(char))
 
+/* 
+ * Decimal text.  buf_formatdecimal() writes the digits of 'value'
+ * (no terminating NUL) to 'dest', which must have room for
+ * BUF_MAXDECIMAL chars, and returns how many it wrote.
+ */
+#define BUF_MAXDECIMAL 20	/* digits in the largest 64-bit size_t */
+
+size_t buf_formatdecimal(char *dest, size_t value);
+Buffer *buf_adddecimal(Buffer *b, size_t value);
+
+/* 
+ * The _UNSAFE forms do no bounds checks.  An encoder calls
+ * buf_prepsize() once with the worst case size of everything it will
+ * write for a capture (e.g. BUF_MAXDECIMAL per position, plus labels),
+ * and then uses these to write it.
+ */
+#define buf_adddecimal_UNSAFE(b, v) ((b)->n += buf_formatdecimal(&((b)->data[(b)->n]), (v)))
+#define buf_addint_UNSAFE(b, i) do {					\
+    unsigned int iun_ = (unsigned int) (i);				\
+    char *dest_ = &((b)->data[(b)->n]);					\
+    dest_[0] = (char) (iun_ & 0xFF);					\
+    dest_[1] = (char) ((iun_ >> 8) & 0xFF);				\
+    dest_[2] = (char) ((iun_ >> 16) & 0xFF);				\
+    dest_[3] = (char) ((iun_ >> 24) & 0xFF);				\
+    (b)->n += 4;							\
+  } while (0)
+#define buf_addshort_UNSAFE(b, i) do {					\
+    unsigned short iun_ = (unsigned short) (i);				\
+    char *dest_ = &((b)->data[(b)->n]);					\
+    dest_[0] = (char) (iun_ & 0xFF);					\
+    dest_[1] = (char) ((iun_ >> 8) & 0xFF);				\
+    (b)->n += 2;							\
+  } while (0)
+
 int buf_writelen(FILE *file, Buffer *b);
 int buf_write(FILE *file, Buffer *b);
 int buf_readlen(FILE *file, size_t *len);
@@ -0,0 +1,55 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  captree.h  The captures of a match as an indexed tree                   */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(captree_h)
+#define captree_h
+
+#include "config.h"
+#include "buf.h"
+#include "vm.h"
+
+/*
+ * One node per capture, in the order of their Opens (i.e. pre-order),
+ * so the outermost capture is node 0.  Links are node indices, with
+ * -1 meaning none.  Positions are 1-based, as in the output encoders.
+ *
+ * IMPORTANT: CapNode must be kept in sync with struct rosie_capnode
+ * in librosie.h.
+ */
+typedef struct CapNode {
+  int32_t parent;
+  int32_t child;		/* first child */
+  int32_t sibling;		/* next sibling */
+  int32_t type;			/* ktable index of the capture name */
+  int32_t constant;		/* ktable index of the value of a constant capture, else 0 */
+  int32_t start;
+  int32_t end;
+  int32_t member;		/* index of the pattern set member it matched, else 0 */
+} CapNode;
+
+typedef struct CapTree {
+  CapNode *nodes;
+  uint32_t n;			/* number of nodes in use */
+  uint32_t size;		/* capacity of nodes array */
+  int32_t current;		/* innermost open capture */
+  int32_t prev;			/* last closed child of 'current' */
+} CapTree;
+
+#define CAPTREE_INIT_SIZE 64
+
+CapTree *captree_new (void);
+void captree_reset (CapTree *t);
+void captree_free (CapTree *t);
+uint32_t captree_nodes (CapTree *t, const CapNode **nodes);
+
+int captree_Close(CapState *cs, Buffer *buf, int count, const char *start);
+int captree_Open(CapState *cs, Buffer *buf, int count);
+
+void captree_encoder (CapTree *t, Encoder *encoder);
+
+#endif
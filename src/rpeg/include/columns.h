@@ -0,0 +1,60 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  columns.h  The columnar (struct of arrays) capture processor            */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(columns_h)
+#define columns_h
+
+#include "config.h"
+#include "buf.h"
+#include "vm.h"
+
+/*
+ * The captures of a batch of matches, one row per capture, in the
+ * order of their Opens (i.e. pre-order).  Each column is an array of
+ * int32_t in native byte order, held in a Buffer, so that it can be
+ * handed over as is to a columnar format.  Rows from successive
+ * matches are appended until columns_reset().
+ *
+ * The 'record' column holds the value that the caller put in the
+ * 'record' field before the match, e.g. the line number of the input.
+ * The ColumnId values are part of the librosie API (ROSIE_COLUMN_*
+ * in librosie.h), so they must not change.
+ * A capture's parent is the nearest preceding row of the same record
+ * with depth one less.
+ */
+typedef enum ColumnId {
+  COLUMN_TYPE,			/* ktable index of the capture name */
+  COLUMN_START,			/* 1-based start position */
+  COLUMN_END,			/* 1-based end position */
+  COLUMN_DEPTH,			/* nesting depth, 0 for the outermost capture */
+  COLUMN_RECORD,		/* record id */
+  COLUMN_SENTINEL
+} ColumnId;
+
+typedef struct Columns {
+  Buffer *col[COLUMN_SENTINEL];
+  uint32_t nrows;
+  int32_t record;		/* set by the caller before each match */
+  int32_t depth;		/* depth of the next capture Open */
+  Buffer *open;			/* rows waiting for their end position */
+} Columns;
+
+#define column_data(C, id) ((int32_t *) (C)->col[(id)]->data)
+
+Columns *columns_new (void);
+void columns_reset (Columns *c);
+void columns_truncate (Columns *c, uint32_t nrows);
+void columns_free (Columns *c);
+uint32_t columns_get (Columns *c, int id, const int32_t **data);
+
+int columns_Close(CapState *cs, Buffer *buf, int count, const char *start);
+int columns_Open(CapState *cs, Buffer *buf, int count);
+
+void columns_encoder (Columns *c, Encoder *encoder);
+
+#endif
@@ -33,6 +33,9 @@
 /* Index into ktable must fit in 24-bits (unsigned), see rplx.h */
 #define KTABLE_INDEX_T_MAX       16777215
 
+/* Index of a pattern set member is an instruction operand, also 24 bits */
+#define MAX_SET_MEMBERS          16777215
+
 /* 
  * Maximum number of rules in a grammar.
  * STACK ALLOCATED array of ints of this size in codegrammar() in lpcode.c
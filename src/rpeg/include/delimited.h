@@ -0,0 +1,65 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  delimited.h  The delimited (TSV/CSV) field extraction processor         */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(delimited_h)
+#define delimited_h
+
+#include "config.h"
+#include "buf.h"
+#include "ktable.h"
+#include "vm.h"
+
+/*
+ * Writes one row per match, with one field per configured capture
+ * name, holding the text of the first capture with that name (or the
+ * value of a constant capture).  A field whose capture did not occur
+ * is empty.  There is no row terminator, as with the 'line' encoder.
+ *
+ *   TSV  fields are separated by tabs, and tab, newline, carriage
+ *        return and backslash are written as \t, \n, \r and \\.
+ *   CSV  fields are separated by commas, and a field containing a
+ *        comma, double quote, newline or carriage return is quoted,
+ *        with its double quotes doubled (RFC 4180).
+ *
+ * The fields are given as names, which delimited_add() looks up in
+ * the ktable of the pattern that the Delimited will be used with.
+ * The DelimitedStyle values are part of the librosie API
+ * (ROSIE_DELIMITED_* in librosie.h), so they must not change.
+ */
+typedef enum DelimitedStyle {
+  DELIMITED_TSV,
+  DELIMITED_CSV,
+  DELIMITED_SENTINEL
+} DelimitedStyle;
+
+typedef struct DelimitedField {
+  int32_t found;		/* boolean: captured in this match */
+  int32_t constant;		/* ktable index of a constant capture's value, else 0 */
+  size_t start;			/* 0-based offsets into the input */
+  size_t end;
+} DelimitedField;
+
+typedef struct Delimited {
+  DelimitedStyle style;
+  int32_t nfields;
+  DelimitedField *fields;
+  int32_t *field;		/* for each ktable index: field number + 1, or 0 */
+  int32_t nindex;		/* size of 'field' */
+  Buffer *open;			/* per open capture: field number + 1 it claimed, or 0 */
+} Delimited;
+
+Delimited *delimited_new (int style);
+int delimited_add (Delimited *d, Ktable *kt, const char *name, size_t len);
+void delimited_free (Delimited *d);
+
+int delimited_Close(CapState *cs, Buffer *buf, int count, const char *start);
+int delimited_Open(CapState *cs, Buffer *buf, int count);
+
+void delimited_encoder (Delimited *d, Encoder *encoder);
+
+#endif
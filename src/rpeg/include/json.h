@@ -13,6 +13,7 @@
 //int json_Fullcapture(CapState *cs, Buffer *buf, int count);
 int json_Close(CapState *cs, Buffer *buf, int count, const char *start);
 int json_Open(CapState *cs, Buffer *buf, int count);
+int json_prepare_ktable(Ktable *kt);
 
 /* Some JSON literals */
 #define TYPE_LABEL ("{\"type\":\"")
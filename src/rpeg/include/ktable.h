@@ -22,6 +22,10 @@ typedef struct Ktable {
   Ktable_element *elements;
   int32_t size;			/* capacity of elements array */
   int32_t next;			/* next available ktable entry is elements[next] */
+  int32_t *hash;		/* optional index for ktable_lookup(), or NULL */
+  int32_t hashsize;		/* number of slots in hash (a power of 2) */
+  char *json;			/* optional cache for the json encoder, or NULL */
+  int32_t *jsonstart;		/* element i is json[jsonstart[i]] to json[jsonstart[i+1]] */
 } Ktable;
 
 /* Parameters that can be tuned for performance:
@@ -59,9 +63,10 @@ int ktable_add(Ktable *kt, const char *element, size_t len);
 int ktable_len(Ktable *kt);
 Ktable_element *ktable_element(Ktable *kt, int i);
 const char *ktable_element_name(Ktable *kt, int i, size_t *len);
-Ktable_element *ktable_sorted_index(Ktable *kt);
-Ktable *ktable_compact(Ktable *orig);
-int ktable_compact_search(Ktable *kt, const char *target, size_t len);
+int ktable_index(Ktable *kt);
+int ktable_lookup(Ktable *kt, const char *target, size_t len);
+Ktable *ktable_compact(Ktable *orig, int *mapping);
+void ktable_set_json(Ktable *kt, char *json, int32_t *jsonstart);
 int ktable_name_cmp(const char *a, size_t alen, const char *b, size_t blen);
 int ktable_entry_name_compare(Ktable *kt, const Ktable_element *k1, const Ktable_element *k2);
   
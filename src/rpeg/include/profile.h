@@ -0,0 +1,34 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  profile.h  Per-instruction profile of the matching vm                    */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(profile_h)
+#define profile_h
+
+#include "config.h"
+#include "rplx.h"
+#include "ktable.h"
+#include "buf.h"
+
+/*
+ * Counters are indexed by the offset of an instruction from the start
+ * of the code vector.  Only the first slot of a multi-slot instruction
+ * is ever counted.
+ */
+typedef struct Profile {
+  int codesize;			/* number of slots in the code vector */
+  uint64_t *execs;		/* times each instruction was executed */
+  uint64_t *fails;		/* times each instruction failed (backtracked) */
+} Profile;
+
+Profile *profile_new (int codesize);
+void profile_reset (Profile *prof);
+void profile_free (Profile *prof);
+
+int profile_report (Profile *prof, Instruction *code, Ktable *kt, Buffer *buf);
+
+#endif
@@ -23,13 +23,18 @@ typedef struct r_encoder_type {
 /* Code:
  *   Non-zero value => implemented in C
  *   Zero => implemented in Lua
- * The codes below must match what it is in common.lua.
+ * The codes below must match what it is in common.lua.  The text
+ * encoders (see text.h) are known only to librosie, so the Lua
+ * engine keeps using its own implementations of them.
  */
 #define ENCODE_JSON 1
 #define ENCODE_LINE 2
 #define ENCODE_BYTE 3
 #define ENCODE_DEBUG 4
 #define ENCODE_STATUS 5
+#define ENCODE_DATA 6
+#define ENCODE_SUBS 7
+#define ENCODE_COLOR 8
 
 /* These codes are returned in the length field of matchresult->data
  * (str) whose ptr is NULL as a cheap way to give the caller an
@@ -45,6 +50,7 @@ typedef struct r_encoder_type {
 #define ERR_BAD_STARTPOS   5   // start position out of range
 #define ERR_BAD_ENDPOS     6   // end position out of range
 #define ERR_INTERNAL       7   // bug in implementation (prob. encoder)
+#define ERR_SINK_ENCODER   8   // encoder in Lua, but output sink flushes
 
 __attribute__((unused))
 static const r_encoder_t r_encoders[] = { 
@@ -53,19 +59,83 @@ static const r_encoder_t r_encoders[] = {
      {"json",   ENCODE_JSON},
      {"line",   ENCODE_LINE},
      {"debug",  ENCODE_DEBUG},
+     {"data",   ENCODE_DATA},
+     {"matches", ENCODE_DATA},	/* old name for "data" */
+     {"subs",   ENCODE_SUBS},
+     {"color",  ENCODE_COLOR},
      {NULL, 0}
 };
 
+/* The color assignments built into the color encoder (see text.c), as
+   they appear in the engine's "colors" encoder parameter by default */
+#define DEFAULT_COLORS							\
+  "*=default;bold:net.*=red:net.ipv6=red;underline:"			\
+  "net.url_common=red;bold:net.path=red:net.MAC=underline;green:"	\
+  "num.*=underline:"							\
+  "word.*=yellow:all.identifier=cyan:id.*=bold;cyan:"			\
+  "os.path=green:date.*=blue:time.*=1;34:ts.*=underline;blue"
+
 int r_match_C (lua_State *L);
 void *extract_pattern (lua_State *L, int idx);
 
 /* Forward declarations */
 struct rosie_string;
 struct rosie_matchresult;
+struct rosie_matchstats;
+struct Columns;
+struct CapTree;
+struct CapNode;
+struct Delimited;
+struct Arena;
 
 int r_match_C2 (void *pattern_as_void_ptr,
 		struct rosie_string *input, uint32_t startpos, uint32_t endpos,
 		uint8_t etype, uint8_t collect_times,
 		Buffer *output, struct rosie_matchresult *match);
+int r_match_all (void *pattern_as_void_ptr,
+		 struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+		 uint8_t etype, Buffer *output, uint32_t *count,
+		 struct rosie_matchresult *match);
+int r_match_columns (void *pattern_as_void_ptr,
+		     struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+		     struct Columns *cols, int32_t record,
+		     Buffer *output, struct rosie_matchresult *match);
+int r_match_tree (void *pattern_as_void_ptr,
+		  struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+		  struct CapTree *tree,
+		  Buffer *output, struct rosie_matchresult *match);
+int r_match_delimited (void *pattern_as_void_ptr,
+		       struct rosie_string *input, uint32_t startpos, uint32_t endpos,
+		       struct Delimited *d,
+		       Buffer *output, struct rosie_matchresult *match);
+int r_delimited_add (void *pattern_as_void_ptr, struct Delimited *d, const char *name, size_t len);
+
+/* See columns.h */
+struct Columns *columns_new (void);
+void columns_reset (struct Columns *c);
+void columns_free (struct Columns *c);
+uint32_t columns_get (struct Columns *c, int id, const int32_t **data);
+
+/* See captree.h */
+struct CapTree *captree_new (void);
+void captree_free (struct CapTree *t);
+uint32_t captree_nodes (struct CapTree *t, const struct CapNode **nodes);
+
+/* See delimited.h */
+struct Delimited *delimited_new (int style);
+void delimited_free (struct Delimited *d);
+
+const char *r_pattern_capture_name (void *pattern_as_void_ptr, int idx, size_t *len);
+int r_pattern_collect_stats (void *pattern_as_void_ptr, int enable);
+struct rosie_matchstats *r_pattern_stats (void *pattern_as_void_ptr);
+int r_pattern_collect_profile (void *pattern_as_void_ptr, int enable);
+int r_pattern_profile_report (void *pattern_as_void_ptr, Buffer *output, int reset);
+void r_pattern_set_arena (void *pattern_as_void_ptr, struct Arena *arena);
+
+/* See arena.h */
+struct Arena *arena_new (size_t blocksize);
+void arena_reset (struct Arena *a);
+void arena_free (struct Arena *a);
+void *arena_lalloc (void *ud, void *ptr, size_t osize, size_t nsize);
 
 #endif
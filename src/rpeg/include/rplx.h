@@ -37,6 +37,19 @@ typedef struct Charset {
 #define ichar(pc) ((pc)->i.aux & 0xFF)
 #define setichar(pc, c) (pc)->i.aux = ((pc)->i.aux & 0xFFFF00) | (c & 0xFF)
 
+/*
+ * IDispatch selects one of 'aux' targets using the next input char.
+ * The 'offset' is taken when the map entry for the char is 0, or at
+ * the end of the input.  The map is DISPATCHMAPSIZE instructions
+ * holding a target number (1..aux) for each char, and it is followed
+ * by the offsets of the targets.
+ */
+#define DISPATCHMAPSIZE		(instsize(UCHAR_MAX + 1) - 1)
+#define DISPATCHSIZE(n)		(2 + (int) DISPATCHMAPSIZE + (n))
+#define MAXDISPATCH		UCHAR_MAX
+#define dispatchmap(pc)		(((pc) + 2)->buff)
+#define dispatchaddr(pc, k)	(((pc) + 2 + DISPATCHMAPSIZE + (k) - 1)->offset)
+
 typedef struct CodeAux {
   uint8_t code;		   /* opcode */
   unsigned int aux : 24;   /* [0 .. 16,777,215] ktable index, or chars */
@@ -109,6 +122,12 @@ typedef enum Opcode {
   ITestSet,                  /* if char not in buff, jump to 'offset' */
   /* Offset and aux and charset -------------------------------------------------- */
   /* none (so far) */
+  /* Offset and aux and dispatch table ------------------------------------------- */
+  IDispatch,                 /* jump to target number map[char], or to 'offset' */
+  /* Added later, and so out of order above, to keep the opcodes of
+     existing rplx files the same ------------------------------------------------ */
+  ISetCommit,		     /* pop choice, restore its position (keeping captures), jump to 'offset' */
+  ISetEnd,		     /* fail if no member of a pattern set matched */
 } Opcode;
 
 #define OPCODE_NAME(code) (OPCODE_NAMES[code])
@@ -138,6 +157,9 @@ static const char *const OPCODE_NAMES[] = {
   "opencapture",
   "testchar",
   "testset",
+  "dispatch",
+  "setcommit",
+  "setend",
 };
 
 typedef struct Chunk {
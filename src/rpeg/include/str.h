@@ -7,8 +7,9 @@
 /*  AUTHOR: Jamie A. Jennings                                                */
 
 /* 
-   IMPORTANT: byte_ptr, rosie_string, and str definitions must be kept
-   in sync with the same definitions in librosie.h.
+   IMPORTANT: byte_ptr, rosie_string, str, rosie_matchresult, and
+   rosie_matchstats definitions must be kept in sync with the same
+   definitions in librosie.h.
 */
 
 #if !defined(str_h)
@@ -34,6 +35,21 @@ typedef struct rosie_matchresult {
      int tmatch;
 } match;
 
+/* Counters aggregated across every match made with one pattern, when
+   statistics collection has been enabled for that pattern.  Times are
+   in nanoseconds, measured with a monotonic clock. */
+struct rosie_matchstats {
+     uint64_t matches;		/* calls that found a match */
+     uint64_t failures;		/* calls that did not find a match */
+     uint64_t insts;		/* vm instructions executed */
+     uint64_t encoder_bytes;	/* bytes of output written by the encoder */
+     uint64_t total_ns;		/* time spent matching and encoding */
+     uint64_t match_ns;		/* time spent in the vm only */
+     uint32_t max_backtrack;	/* high-water mark of the backtrack stack */
+     uint32_t max_caplist;	/* high-water mark of the capture list */
+     uint32_t max_capdepth;	/* high-water mark of capture nesting */
+};
+
 #endif
 
 
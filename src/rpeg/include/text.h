@@ -0,0 +1,52 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  text.h  The text output encoders: data, subs and color                   */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(text_h)
+#define text_h
+
+#include "config.h"
+#include "buf.h"
+#include "vm.h"
+
+/*
+ * These encoders produce text for people (e.g. the CLI's -o option)
+ * rather than for programs:
+ *
+ *   data   the text of the match
+ *   subs   the text of each sub-match (child of the outermost
+ *          capture), one per line, or "" when there are none
+ *   color  the entire input, with the matched parts colored using
+ *          ANSI escape sequences and the default color assignments
+ *
+ * They need a little state across the Opens and Closes of a match,
+ * which the caller provides through the Encoder's 'state' field after
+ * calling text_state_init().  The state resets itself at the first
+ * capture of each match, so one TextState can serve many matches of
+ * the same input.
+ */
+typedef struct TextState {
+  const char *end;		/* end of the input */
+  int32_t depth;		/* depth of the next Open */
+  int32_t count;		/* subs: sub-matches written */
+  int32_t span;			/* color: depth of the capture being colored, or -1 */
+  const char *code;		/* color: its ANSI SGR parameters */
+  const char *last;		/* color: the input before here has been written */
+} TextState;
+
+void text_state_init (TextState *ts, const char *input_end);
+
+int data_Close(CapState *cs, Buffer *buf, int count, const char *start);
+int data_Open(CapState *cs, Buffer *buf, int count);
+
+int subs_Close(CapState *cs, Buffer *buf, int count, const char *start);
+int subs_Open(CapState *cs, Buffer *buf, int count);
+
+int color_Close(CapState *cs, Buffer *buf, int count, const char *start);
+int color_Open(CapState *cs, Buffer *buf, int count);
+
+#endif
@@ -16,6 +16,8 @@
 #include "ktable.h"
 #include "rpeg.h"
 #include "str.h"
+#include "profile.h"
+#include "arena.h"
 
 typedef enum MatchErr {
   /* Match vm: */
@@ -53,7 +55,7 @@ static const char *MATCH_MESSAGES[] __attribute__ ((unused)) = {
   "input too large",
   "start position beyond end of input",
   "end position beyond end of input",
-  "insufficient memory for match data",
+  "insufficient memory (or output space) for match data",
   /* Capture processing: */
   "open capture error in rosie match",
   "close capture error in rosie match",
@@ -69,6 +71,9 @@ static const char *MATCH_MESSAGES[] __attribute__ ((unused)) = {
   "out of memory",
 };
 
+/* Per-match statistics.  The vm and walk_captures() fill in the
+   counters only when given a non-NULL Stats pointer, so collection
+   can be switched on and off at runtime (see vm_run() in vm.c). */
 typedef struct Stats {
   unsigned int total_time;
   unsigned int match_time;
@@ -95,6 +100,7 @@ typedef enum CapKind {
   Crosiecap, Crosieconst, Cbackref,  
   Cclose = 0x80,		/* high bit set */
   Cfinal, Ccloseconst,
+  Cclosemember,			/* idx is the index of a pattern set member */
 } CapKind; 
 
 /* N.B. The CAPTURE_NAME macro needs to be changed when new capture types are added. */
@@ -104,7 +110,7 @@ static const char *const OPEN_CAPTURE_NAMES[] = {
 };
 static const char *const CLOSE_CAPTURE_NAMES[] = {
   "Close",
-  "Final", "CloseConst",
+  "Final", "CloseConst", "CloseMember",
 };
 
 /* Capture 'kind' is 8 bits (unsigned), and 'idx' 24 bits (unsigned).  See rplx.h. */
@@ -113,16 +119,26 @@ static const char *const CLOSE_CAPTURE_NAMES[] = {
 #define capkind(cap) ((cap)->c.code) 
 #define setcapkind(cap, kind) (cap)->c.code = (kind)
 
+/* 
+ * A capture records its position as an offset from the start of the
+ * input, which fits in 32 bits because vm_match2() only accepts
+ * inputs whose length does too.  That makes a Capture 8 bytes instead
+ * of 16, halving the memory traffic for the capture list.  Use
+ * cappos() to get the position as a pointer into the input.
+ */
 typedef struct Capture {
-  byte_ptr s;	    /* subject position */
+  uint32_t pos;	    /* subject position, as an offset from the start */
   CodeAux c;	    /* .c.code is 'kind' and .c.aux is ktable index */
 } Capture;
 
+#define cappos(cs, cap) ((cs)->s + (cap)->pos)
+
 typedef struct CapState {
   Capture *cap;			/* current capture */
   Capture *ocap;		/* (original) capture list */
   byte_ptr s;			/* original string */
   Ktable *kt;			/* ktable */
+  void *state;			/* from the Encoder */
 } CapState;
 
 #define testchar(st,c)	(((int)(st)[((c) >> 3)] & (1 << ((c) & 7))))
@@ -134,6 +150,7 @@ typedef struct CapState {
 typedef struct {  
   int (*Open)(CapState *cs, Buffer *buf, int count);
   int (*Close)(CapState *cs, Buffer *buf, int count, byte_ptr start);
+  void *state;			/* for encoders that need their own, e.g. columns */
 } Encoder;
  
 int sizei (const Instruction *i);
@@ -145,6 +162,11 @@ int vm_match2 (/* inputs: */
 	       uint8_t collect_times,
 	       Buffer *output,
 	       /* output: */
-	       struct rosie_matchresult *match);
+	       struct rosie_matchresult *match,
+	       /* optional (NULL to disable) accumulators: */
+	       struct rosie_matchstats *matchstats,
+	       Profile *profile,
+	       /* optional (NULL to use malloc) transient storage: */
+	       Arena *arena);
 #endif
 
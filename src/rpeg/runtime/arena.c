@@ -0,0 +1,119 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  arena.c  A bump allocator for the transient memory of a batch of matches */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * The blocks of an arena form a list that only grows.  After
+ * arena_reset(), allocation starts over in the first block and moves
+ * on to the next existing block when one fills up, so a new block is
+ * malloc'd only when the batch needs more memory than any before it.
+ * A request that does not fit in the rest of the current block skips
+ * to the next block, wasting the rest, which is fine for the small
+ * number of large allocations that the vm makes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define align_up(n) (((n) + (ARENA_ALIGN - 1)) & ~((size_t) (ARENA_ALIGN - 1)))
+
+static ArenaBlock *new_block (Arena *a, size_t size) {
+  if (size < a->blocksize) size = a->blocksize;
+  if (size > SIZE_MAX - sizeof(ArenaBlock)) return NULL;
+  ArenaBlock *b = (ArenaBlock *) malloc(sizeof(ArenaBlock) + size);
+  if (!b) return NULL;
+  b->next = NULL;
+  b->size = size;
+  a->total += size;
+  return b;
+}
+
+Arena *arena_new (size_t blocksize) {
+  Arena *a = (Arena *) calloc(1, sizeof(Arena));
+  if (!a) return NULL;
+  a->blocksize = align_up(blocksize ? blocksize : ARENA_DEFAULT_BLOCKSIZE);
+  if (!(a->first = new_block(a, a->blocksize))) {
+    free(a);
+    return NULL;
+  }
+  a->current = a->first;
+  return a;
+}
+
+void *arena_alloc (Arena *a, size_t size) {
+  ArenaBlock *b = a->current;
+  size = align_up(size);
+  if (size == 0) size = ARENA_ALIGN;
+  while (size > b->size - a->used) {
+    /* Move to the next block, re-using one from an earlier batch if
+       it is big enough, else inserting a new one here */
+    if (b->next && (b->next->size >= size)) {
+      b = b->next;
+    } else {
+      ArenaBlock *nb = new_block(a, size);
+      if (!nb) return NULL;
+      nb->next = b->next;
+      b->next = nb;
+      b = nb;
+    }
+    a->current = b;
+    a->used = 0;
+  }
+  a->last = b->data + a->used;
+  a->used += size;
+  return a->last;
+}
+
+/*
+ * The most recent allocation grows (or shrinks) in place when the
+ * current block has room, which is the common case for a buffer or
+ * stack that keeps doubling.  Otherwise the contents are copied to a
+ * new allocation, and the old space is wasted until the next reset.
+ */
+void *arena_realloc (Arena *a, void *ptr, size_t osize, size_t nsize) {
+  if (!ptr) return arena_alloc(a, nsize);
+  if (((char *) ptr == a->last) &&
+      (align_up(nsize) <= a->current->size - (size_t) (a->last - a->current->data))) {
+    a->used = (size_t) (a->last - a->current->data) + align_up(nsize);
+    return ptr;
+  }
+  void *newptr = arena_alloc(a, nsize);
+  if (!newptr) return NULL;
+  memcpy(newptr, ptr, (osize < nsize) ? osize : nsize);
+  return newptr;
+}
+
+void arena_reset (Arena *a) {
+  a->current = a->first;
+  a->used = 0;
+  a->last = NULL;
+}
+
+void arena_free (Arena *a) {
+  ArenaBlock *b, *next;
+  if (!a) return;
+  for (b = a->first; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+  free(a);
+}
+
+/*
+ * An allocator with the contract of lua_Alloc, for a Buffer's sink
+ * (see buf.h).  Freeing does nothing, since the memory is reclaimed
+ * by arena_reset().
+ */
+void *arena_lalloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  Arena *a = (Arena *) ud;
+  if (nsize == 0) return NULL;
+  return arena_realloc(a, ptr, ptr ? osize : 0, nsize);
+}
@@ -18,11 +18,22 @@
  * Also supports wrapping an existing block of data to make it behave
  * like a buffer. A wrapped block will not be freed with buf_free().
  *
+ * A caller can attach a sink with buf_set_sink() to choose where the
+ * data goes instead: into a region it supplies, into storage from its
+ * own allocator, and/or (via a flush function) out to somewhere else
+ * each time the buffer fills.  When an addition fails (e.g. a fixed
+ * region is full, or a flush fails), the buffer's 'err' field is set,
+ * and all further additions fail until buf_reset().  Code that writes
+ * a whole result, like the output encoders, can therefore check 'err'
+ * once at the end.
+ *
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include "buf.h"
 
 #ifndef BUFDEBUG
@@ -63,6 +74,9 @@
 /* true when buffer is a "lite" buffer (a wrapper around existing immutable data) */
 #define bufferislite(B)	        ((B)->initb == NULL)
 
+/* true when buffer's data was allocated by the buffer, and must be freed by it */
+#define bufferisowned(B)	(bufferisdynamic(B) && !bufferislite(B) && ((B)->data != (B)->sink.region))
+
 int buf_info(Buffer *b) {
   int flags = 0;
   if (bufferislite(b)) flags = flags | BUF_IS_LITE;
@@ -71,25 +85,26 @@ int buf_info(Buffer *b) {
 }
 
 /* 
- * Dynamically allocate new storage, returning NULL if error.
+ * Dynamically allocate new storage, returning NULL if error.  On
+ * error, the buffer is unchanged.
  */
 static Buffer *buf_resize (Buffer *b, size_t newsize) {
   char *temp;
+  BufAlloc alloc = b->sink.alloc;
   if (bufferislite(b)) return NULL;
-  if (bufferisdynamic(b)) {
-    temp = realloc(b->data, newsize);
+  if (b->sink.region && !alloc) return NULL; /* caller's region has a fixed size */
+  if (bufferisowned(b)) {
+    temp = alloc ? alloc(b->sink.ud, b->data, b->capacity, newsize) : realloc(b->data, newsize);
   } else {
-    /* not dynamic means that data is in initb (static allocation) */
-    temp = malloc(newsize);
+    /* data is in initb (static allocation) or in the caller's region */
+    temp = alloc ? alloc(b->sink.ud, NULL, 0, newsize) : malloc(newsize);
     /* copy original content, or as much as will fit if newsize is smaller */ 
     if (temp)
-      memcpy(temp, b->initb, sizeof(char) * (newsize > b->n ? b->n : newsize));
+      memcpy(temp, b->data, sizeof(char) * (newsize > b->n ? b->n : newsize));
   }
   Announce_resize(b, temp);
-  if (temp == NULL && newsize > 0) {	     /* allocation error? */
-    if bufferisdynamic(b) free(b->data);
+  if (temp == NULL && newsize > 0)	     /* allocation error? */
     return NULL;
-  }
   b->data = temp;
   b->capacity = newsize;
   return b;
@@ -101,6 +116,9 @@ Buffer *buf_new (size_t minimum_size) {
   buf->data = buf->initb;        /* intially, data storage is statically allocated in initb  */
   buf->n = 0;			 /* contents length is 0 */
   buf->capacity = INITIAL_BUFFER_SIZE;	 /* size of initb */
+  memset(&buf->sink, 0, sizeof(BufSink));
+  buf->err = 0;
+  buf->flushed = 0;
   if (minimum_size > INITIAL_BUFFER_SIZE)
     buf = buf_resize(buf, minimum_size);
   return buf;
@@ -122,6 +140,18 @@ Buffer *buf_from_const (const char *data, size_t size) {
   buf->initb = NULL;         /* This marks a buffer that cannot be extended */
   return buf;
 }
+
+/* Point a buffer made by buf_from_const at other data, so that one
+   wrapper can be used for many inputs.  Returns 0 if 'b' is not such
+   a buffer.
+*/
+int buf_rewrap (Buffer *b, const char *data, size_t size) {
+  if (!bufferislite(b)) return 0;
+  b->data = (char *) data;
+  b->n = size;
+  b->capacity = size;
+  return 1;
+}
 #pragma GCC diagnostic pop
 
 /* Return a pointer to first unused byte, assuring at least
@@ -129,28 +159,98 @@ Buffer *buf_from_const (const char *data, size_t size) {
  */
 char *buf_prepsize (Buffer *b, size_t additional) {
   if (bufferislite(b)) return NULL; /* immutable */
+  if (b->err) return NULL;	    /* an earlier addition failed */
   if ((b->capacity - b->n) < additional) {
+    /* pass the contents on, if we can, before growing */
+    if (b->sink.flush && (b->n > 0)) {
+      if (buf_flush(b)) return NULL;
+      if (b->capacity >= additional) return b->data;
+    }
     /* double buffer size */
     size_t newsize = b->capacity * 2;
     /* still not big enough? increase buffer size just enough to fit 'additional' bytes */
     if (newsize - b->n < additional) newsize = b->n + additional;
     Announce_prepsize(b, additional);
-    if (!buf_resize(b, newsize)) return NULL;
+    if (!buf_resize(b, newsize)) {
+      b->err = 1;
+      return NULL;
+    }
   }
   return &b->data[b->n];
 }
 
 void buf_reset (Buffer *b) {
   b->n = 0;
+  b->err = 0;
+}
+
+/* Prepare the buffer to receive one more result.  A buffer with a
+ * flush function accumulates results, so that it is flushed only when
+ * full (or by an explicit call to buf_flush).  Any other buffer holds
+ * only the latest result.
+ */
+void buf_start (Buffer *b) {
+  if (b->sink.flush) b->err = 0;
+  else buf_reset(b);
 }
 
 void buf_free (Buffer *b) {
-  if (bufferisdynamic(b) && !bufferislite(b)) { 
+  if (bufferisowned(b)) { 
     Announce_free(b);
-    free(b->data);
+    if (b->sink.alloc) b->sink.alloc(b->sink.ud, b->data, b->capacity, 0);
+    else free(b->data);
   } 
 }
 
+/* Replace the buffer's sink with 'sink', or with the default
+ * (malloc'd storage, no flush function) when 'sink' is NULL.  The
+ * contents of the buffer are discarded, so call buf_flush() first to
+ * keep them.
+ */
+void buf_set_sink (Buffer *b, const BufSink *sink) {
+  if (bufferislite(b)) return;
+  buf_free(b);
+  if (sink) b->sink = *sink;
+  else memset(&b->sink, 0, sizeof(BufSink));
+  b->data = b->sink.region ? b->sink.region : b->initb;
+  b->capacity = b->sink.region ? b->sink.size : INITIAL_BUFFER_SIZE;
+  buf_reset(b);
+}
+
+/* Pass the contents of the buffer to its flush function, and empty
+ * it.  Returns 0 on success (or when there is no flush function), else
+ * the non-zero value returned by the flush function.
+ */
+int buf_flush (Buffer *b) {
+  int err;
+  if (!b->sink.flush || (b->n == 0)) return 0;
+  err = b->sink.flush(b->sink.ud, b->data, b->n);
+  if (err) {
+    b->err = 1;
+    return err;
+  }
+  b->flushed += b->n;
+  b->n = 0;
+  return 0;
+}
+
+/* A flush function that writes to a file descriptor.  The 'ud' field
+ * of the sink must point to an int containing the file descriptor.
+ */
+int buf_write_fd (void *ud, const char *data, size_t len) {
+  int fd = *(int *) ud;
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return errno ? errno : -1;
+    }
+    data += written;
+    len -= (size_t) written;
+  }
+  return 0;
+}
+
 Buffer *buf_addlstring (Buffer *b, const char *s, size_t len) {
   if (bufferislite(b)) return NULL; /* immutable */
   if (len > 0) {		    /* noop when 's' is an empty string */
@@ -193,10 +293,9 @@ static void int_to_string(int i, unsigned char str[]) {
 }
 
 Buffer *buf_addint (Buffer *b, int i) {
-  unsigned char str[4];
-  int_to_string(i, str);
-  if (buf_addlstring(b, (const char *)str, 4)) return b;
-  return NULL;
+  if (!buf_prepsize(b, 4)) return NULL;
+  buf_addint_UNSAFE(b, i);
+  return b;
 }
 
 static int string_to_int(const char *sun) {
@@ -220,13 +319,9 @@ int buf_readint (const char **s) {
 }
 
 Buffer *buf_addshort (Buffer *b, short i) {
-  char str[2];
-  short iun = (short) i;
-  str[1] = (iun >> 8) & 0xFF;
-  str[0] = iun & 0xFF;
-  if (buf_addlstring(b, str, 2))
-    return b;
-  return NULL;
+  if (!buf_prepsize(b, 2)) return NULL;
+  buf_addshort_UNSAFE(b, i);
+  return b;
 }
 
 /* Unsafe: caller to ensure that read will not pass end of buffer */
@@ -244,6 +339,61 @@ short buf_readshort (const char **s) {
 
 /* ---------------------------------------------------------------------------------------- */
 
+/* 
+ * Decimal formatting for the text encoders, two digits at a time.
+ * We count the digits first so that they can be written right to left
+ * in place, with no temporary buffer and no reversal.
+ */
+
+static const char digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static size_t decimal_length (size_t value) {
+  size_t len = 1;
+  while (value >= 10000) {
+    len += 4;
+    value /= 10000;
+  }
+  return len + (value >= 10) + (value >= 100) + (value >= 1000);
+}
+
+size_t buf_formatdecimal (char *dest, size_t value) {
+  size_t len = decimal_length(value);
+  char *p = dest + len;
+  size_t i;
+  while (value >= 100) {
+    i = (value % 100) * 2;
+    value /= 100;
+    *--p = digit_pairs[i + 1];
+    *--p = digit_pairs[i];
+  }
+  if (value >= 10) {
+    i = value * 2;
+    *--p = digit_pairs[i + 1];
+    *--p = digit_pairs[i];
+  } else {
+    *--p = (char) ('0' + value);
+  }
+  return len;
+}
+
+Buffer *buf_adddecimal (Buffer *b, size_t value) {
+  if (!buf_prepsize(b, BUF_MAXDECIMAL)) return NULL;
+  buf_adddecimal_UNSAFE(b, value);
+  return b;
+}
+
+/* ---------------------------------------------------------------------------------------- */
+
 int buf_writelen(FILE *file, Buffer *b) {
   unsigned char str[4];
   int_to_string((int) b->n, str);
@@ -0,0 +1,112 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  captree.c  The captures of a match as an indexed tree                   */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * For consumers that look at only a few captures, encoding a whole
+ * match (and then decoding it) is wasted effort.  Instead, this
+ * capture processor links the captures into a tree (see captree.h)
+ * that can be navigated directly.  It uses the Open/Close protocol of
+ * the output encoders, so that caploop() in vm.c does the work of
+ * pairing each Close with its Open (including the Closes synthesized
+ * after a halt), but it writes nothing to the output buffer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "config.h"
+#include "buf.h"
+#include "capture.h"
+#include "captree.h"
+
+CapTree *captree_new (void) {
+  CapTree *t = (CapTree *) malloc(sizeof(CapTree));
+  if (!t) return NULL;
+  t->nodes = (CapNode *) malloc(CAPTREE_INIT_SIZE * sizeof(CapNode));
+  if (!t->nodes) {
+    free(t);
+    return NULL;
+  }
+  t->size = CAPTREE_INIT_SIZE;
+  captree_reset(t);
+  return t;
+}
+
+void captree_reset (CapTree *t) {
+  t->n = 0;
+  t->current = -1;
+  t->prev = -1;
+}
+
+void captree_free (CapTree *t) {
+  if (!t) return;
+  free(t->nodes);
+  free(t);
+}
+
+/* Set 'nodes' to point to the nodes, and return how many there are */
+uint32_t captree_nodes (CapTree *t, const CapNode **nodes) {
+  *nodes = t->nodes;
+  return t->n;
+}
+
+static CapNode *new_node (CapTree *t) {
+  if (t->n == t->size) {
+    CapNode *temp = (CapNode *) realloc(t->nodes, 2 * t->size * sizeof(CapNode));
+    if (!temp) return NULL;
+    t->nodes = temp;
+    t->size *= 2;
+  }
+  return &t->nodes[t->n++];
+}
+
+int captree_Open(CapState *cs, Buffer *buf, int count) {
+  CapTree *t = (CapTree *) cs->state;
+  CapNode *node;
+  int32_t k;
+  UNUSED(buf); UNUSED(count);
+  if (!acceptable_capture(capkind(cs->cap))) return MATCH_OPEN_ERROR;
+  if (cs->cap == cs->ocap) captree_reset(t); /* first capture of a match */
+  k = (int32_t) t->n;
+  if (!(node = new_node(t))) return MATCH_OUT_OF_MEM;
+  node->parent = t->current;
+  node->child = -1;
+  node->sibling = -1;
+  node->type = (int32_t) capidx(cs->cap);
+  node->constant = 0;
+  node->start = (int32_t) (cs->cap->pos + 1);
+  node->end = 0;
+  node->member = 0;
+  if (t->prev >= 0) t->nodes[t->prev].sibling = k;
+  else if (t->current >= 0) t->nodes[t->current].child = k;
+  t->current = k;
+  t->prev = -1;
+  return MATCH_OK;
+}
+
+int captree_Close(CapState *cs, Buffer *buf, int count, const char *start) {
+  CapTree *t = (CapTree *) cs->state;
+  CapNode *node;
+  UNUSED(buf); UNUSED(count); UNUSED(start);
+  if (isopencap(cs->cap)) return MATCH_CLOSE_ERROR;
+  if (t->current < 0) return MATCH_CLOSE_ERROR;
+  node = &t->nodes[t->current];
+  node->end = (int32_t) (cs->cap->pos + 1);
+  if (capkind(cs->cap) == Ccloseconst) node->constant = (int32_t) capidx(cs->cap);
+  else if (capkind(cs->cap) == Cclosemember) node->member = (int32_t) capidx(cs->cap);
+  t->prev = t->current;
+  t->current = node->parent;
+  return MATCH_OK;
+}
+
+void captree_encoder (CapTree *t, Encoder *encoder) {
+  encoder->Open = captree_Open;
+  encoder->Close = captree_Close;
+  encoder->state = t;
+}
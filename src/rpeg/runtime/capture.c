@@ -35,7 +35,7 @@ static void print_capture(CapState *cs) {
   size_t len;
   Capture *c = cs->cap;
   printf("  kind = %s\n", CAPTURE_NAME(capkind(c)));
-  printf("  pos (1-based) = %lu\n", c->s ? (c->s - cs->s + 1) : 0);
+  printf("  pos (1-based) = %lu\n", (unsigned long) c->pos + 1);
   const char *name = ktable_element_name(cs->kt, capidx(c), &len);
   if (name) {
     printf("  idx = %u\n", capidx(c));
@@ -96,37 +96,44 @@ int debug_Open(CapState *cs, Buffer *buf, int count) {
  * ensure this. 
 */
 
-static void encode_pos(size_t pos, int negate, Buffer *buf) {
-  int intpos = (int) pos;
-  if (negate) intpos = - intpos;
-  buf_addint(buf, intpos);
+/* 
+ * Each call reserves space once for a position and, if needed, a
+ * name, and then writes them with unchecked stores.
+ */
+
+static size_t ktable_element_len(CapState *cs) {
+  size_t len = 0;
+  ktable_element_name(cs->kt, capidx(cs->cap), &len);
+  return len;
 }
 
-static void encode_string(const char *string, size_t len,
-			  int shortflag, int negflag, Buffer *buf) {
-  assert(string);
-  /* encode size as a short or an int */
-  if (shortflag) buf_addshort(buf, (short) (negflag ? -len : len));
-  else buf_addint(buf, (int) (negflag ? -len : len));
-  /* encode the string by copying it into the buffer */
-  buf_addlstring(buf, string, len); 
+static void encode_pos_UNSAFE(size_t pos, int negate, Buffer *buf) {
+  int intpos = (int) pos;
+  if (negate) intpos = - intpos;
+  buf_addint_UNSAFE(buf, intpos);
 }
 
-static void encode_ktable_element(CapState *cs, byte negflag, Buffer *buf) {
+/* encode the size as a short, then copy the string into the buffer */
+static void encode_ktable_element_UNSAFE(CapState *cs, byte negflag, Buffer *buf) {
   size_t len;
   const char *name = ktable_element_name(cs->kt, capidx(cs->cap), &len); 
   assert( name );
   //assert( len > 0 );  //len could be zero?
-  encode_string(name, len, 1, negflag, buf); /* shortflag is set */
+  buf_addshort_UNSAFE(buf, (short) (negflag ? -len : len));
+  buf_addlstring_UNSAFE(buf, name, len);
 }
 
 int byte_Close(CapState *cs, Buffer *buf, int count, const char *start) {
   size_t e;
+  int isconst;
   UNUSED(count); UNUSED(start);
   if (isopencap(cs->cap)) return MATCH_CLOSE_ERROR;
-  if (capkind(cs->cap) == Ccloseconst) encode_ktable_element(cs, 0, buf);
-  e = cs->cap->s - cs->s + 1;	/* 1-based end position */
-  encode_pos(e, 0, buf);
+  isconst = (capkind(cs->cap) == Ccloseconst);
+  if (!buf_prepsize(buf, 4 + (isconst ? 2 + ktable_element_len(cs) : 0)))
+    return MATCH_ERR_OUTPUT_MEM;
+  if (isconst) encode_ktable_element_UNSAFE(cs, 0, buf);
+  e = (size_t) cs->cap->pos + 1;	/* 1-based end position */
+  encode_pos_UNSAFE(e, 0, buf);
   return MATCH_OK;
 }
 
@@ -137,14 +144,15 @@ int byte_Open(CapState *cs, Buffer *buf, int count) {
     printf("byte_Open: capkind is %d (%s)\n", capkind(cs->cap), CAPTURE_NAME(capkind(cs->cap)));
     return MATCH_OPEN_ERROR;
   }
-  s = cs->cap->s - cs->s + 1;	/* 1-based start position */
+  s = (size_t) cs->cap->pos + 1;	/* 1-based start position */
   assert(capidx(cs->cap) >= 0);
-  encode_pos(s, 1, buf);
-  encode_ktable_element(cs, (capkind(cs->cap) == Crosieconst), buf);
+  if (!buf_prepsize(buf, 4 + 2 + ktable_element_len(cs))) return MATCH_ERR_OUTPUT_MEM;
+  encode_pos_UNSAFE(s, 1, buf);
+  encode_ktable_element_UNSAFE(cs, (capkind(cs->cap) == Crosieconst), buf);
   return MATCH_OK;
 }
 
 
-Encoder debug_encoder = { debug_Open, debug_Close };
-Encoder byte_encoder = { byte_Open, byte_Close };
+Encoder debug_encoder = { debug_Open, debug_Close, NULL };
+Encoder byte_encoder = { byte_Open, byte_Close, NULL };
 
@@ -0,0 +1,129 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  columns.c  The columnar (struct of arrays) capture processor            */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * Unlike the other output encoders, which write each match to the
+ * output buffer, the 'columns' encoder appends to the parallel arrays
+ * of a Columns structure (see columns.h), which the caller passes in
+ * through the 'state' field of the Encoder.  The output buffer is not
+ * used.
+ *
+ * The end position of a capture is known only at its Close, by which
+ * time the rows of its sub-captures have been appended.  So Open
+ * appends a row with a placeholder end position and pushes the row
+ * number on the 'open' stack, and Close pops it and fills in the end.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "config.h"
+#include "buf.h"
+#include "capture.h"
+#include "columns.h"
+
+Columns *columns_new (void) {
+  Columns *c = (Columns *) calloc(1, sizeof(Columns));
+  if (!c) return NULL;
+  for (int i = 0; i < COLUMN_SENTINEL; i++)
+    if (!(c->col[i] = buf_new(0))) goto fail;
+  if (!(c->open = buf_new(0))) goto fail;
+  return c;
+ fail:
+  columns_free(c);
+  return NULL;
+}
+
+void columns_reset (Columns *c) {
+  for (int i = 0; i < COLUMN_SENTINEL; i++) buf_reset(c->col[i]);
+  buf_reset(c->open);
+  c->nrows = 0;
+  c->depth = 0;
+}
+
+/* Discard the rows from 'nrows' on, e.g. those of a failed match */
+void columns_truncate (Columns *c, uint32_t nrows) {
+  if (nrows >= c->nrows) return;
+  for (int i = 0; i < COLUMN_SENTINEL; i++)
+    c->col[i]->n = nrows * sizeof(int32_t);
+  buf_reset(c->open);
+  c->nrows = nrows;
+  c->depth = 0;
+}
+
+static void free_buffer (Buffer *b) {
+  if (b) {
+    buf_free(b);
+    free(b);
+  }
+}
+
+void columns_free (Columns *c) {
+  if (!c) return;
+  for (int i = 0; i < COLUMN_SENTINEL; i++) free_buffer(c->col[i]);
+  free_buffer(c->open);
+  free(c);
+}
+
+/* Set 'data' to point to column 'id', and return the number of rows */
+uint32_t columns_get (Columns *c, int id, const int32_t **data) {
+  if ((id < 0) || (id >= COLUMN_SENTINEL)) {
+    *data = NULL;
+    return 0;
+  }
+  *data = column_data(c, id);
+  return c->nrows;
+}
+
+static int add_int32 (Buffer *b, int32_t value) {
+  return buf_addlstring(b, (const char *) &value, sizeof(int32_t)) != NULL;
+}
+
+int columns_Open(CapState *cs, Buffer *buf, int count) {
+  Columns *c = (Columns *) cs->state;
+  UNUSED(buf); UNUSED(count);
+  if (!acceptable_capture(capkind(cs->cap))) return MATCH_OPEN_ERROR;
+  if (cs->cap == cs->ocap) {
+    /* First capture of a match, so discard anything left open by an
+       earlier match that ended in an error */
+    buf_reset(c->open);
+    c->depth = 0;
+  }
+  if (!(add_int32(c->col[COLUMN_TYPE], (int32_t) capidx(cs->cap)) &&
+	add_int32(c->col[COLUMN_START], (int32_t) (cs->cap->pos + 1)) &&
+	add_int32(c->col[COLUMN_END], 0) &&
+	add_int32(c->col[COLUMN_DEPTH], c->depth) &&
+	add_int32(c->col[COLUMN_RECORD], c->record) &&
+	add_int32(c->open, (int32_t) c->nrows)))
+    return MATCH_ERR_OUTPUT_MEM;
+  c->nrows++;
+  c->depth++;
+  return MATCH_OK;
+}
+
+int columns_Close(CapState *cs, Buffer *buf, int count, const char *start) {
+  Columns *c = (Columns *) cs->state;
+  int32_t row, e;
+  UNUSED(buf); UNUSED(count); UNUSED(start);
+  if (isopencap(cs->cap)) return MATCH_CLOSE_ERROR;
+  if (c->open->n < sizeof(int32_t)) return MATCH_CLOSE_ERROR;
+  c->open->n -= sizeof(int32_t);
+  memcpy(&row, c->open->data + c->open->n, sizeof(int32_t));
+  assert((uint32_t) row < c->nrows);
+  e = (int32_t) (cs->cap->pos + 1); /* 1-based end position */
+  memcpy(c->col[COLUMN_END]->data + row * sizeof(int32_t), &e, sizeof(int32_t));
+  c->depth--;
+  return MATCH_OK;
+}
+
+void columns_encoder (Columns *c, Encoder *encoder) {
+  encoder->Open = columns_Open;
+  encoder->Close = columns_Close;
+  encoder->state = c;
+}
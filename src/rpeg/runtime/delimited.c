@@ -0,0 +1,208 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  delimited.c  The delimited (TSV/CSV) field extraction processor         */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * The 'delimited' encoder gets its configuration, a Delimited
+ * structure (see delimited.h), through the 'state' field of the
+ * Encoder.  Open and Close only note where each configured field was
+ * captured, and the row is written to the output buffer when the
+ * outermost capture closes, since the fields are in configuration
+ * order and not in the order they occur in the input.
+ *
+ * Only the first capture of each name is used.  An Open pushes the
+ * field it claimed (or 0) on the 'open' stack, so that the matching
+ * Close knows whether it completes a field.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "config.h"
+#include "buf.h"
+#include "ktable.h"
+#include "capture.h"
+#include "delimited.h"
+
+Delimited *delimited_new (int style) {
+  if ((style < 0) || (style >= DELIMITED_SENTINEL)) return NULL;
+  Delimited *d = (Delimited *) calloc(1, sizeof(Delimited));
+  if (!d) return NULL;
+  d->style = (DelimitedStyle) style;
+  if (!(d->open = buf_new(0))) {
+    free(d);
+    return NULL;
+  }
+  return d;
+}
+
+void delimited_free (Delimited *d) {
+  if (!d) return;
+  free(d->fields);
+  free(d->field);
+  buf_free(d->open);
+  free(d->open);
+  free(d);
+}
+
+/*
+ * Add a field for the capture called 'name' in 'kt'.  Returns the
+ * field number (1-based), or 0 if 'kt' has no such name or it is
+ * already a field, or -1 if out of memory.
+ */
+int delimited_add (Delimited *d, Ktable *kt, const char *name, size_t len) {
+  int idx = ktable_lookup(kt, name, len);
+  if (idx <= 0) return 0;
+  if (idx >= d->nindex) {
+    int32_t size = ktable_len(kt) + 1;
+    int32_t *field = (int32_t *) realloc(d->field, size * sizeof(int32_t));
+    if (!field) return -1;
+    memset(field + d->nindex, 0, (size - d->nindex) * sizeof(int32_t));
+    d->field = field;
+    d->nindex = size;
+  }
+  if (d->field[idx]) return 0;
+  DelimitedField *fields = (DelimitedField *) realloc(d->fields, (d->nfields + 1) * sizeof(DelimitedField));
+  if (!fields) return -1;
+  d->fields = fields;
+  memset(&d->fields[d->nfields], 0, sizeof(DelimitedField));
+  d->field[idx] = ++d->nfields;
+  return d->nfields;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Writing a row                                                                 */
+/* ----------------------------------------------------------------------------- */
+
+static int csv_needs_quotes (const char *s, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    if ((s[i] == ',') || (s[i] == '"') || (s[i] == '\n') || (s[i] == '\r')) return 1;
+  return 0;
+}
+
+static void add_field_UNSAFE (DelimitedStyle style, const char *s, size_t len, Buffer *buf) {
+  static const char dquote = '"';
+  char c;
+  if (style == DELIMITED_TSV) {
+    for (size_t i = 0; i < len; i++) {
+      c = s[i];
+      switch (c) {
+      case '\t': buf_addlstring_UNSAFE(buf, "\\t", 2); break;
+      case '\n': buf_addlstring_UNSAFE(buf, "\\n", 2); break;
+      case '\r': buf_addlstring_UNSAFE(buf, "\\r", 2); break;
+      case '\\': buf_addlstring_UNSAFE(buf, "\\\\", 2); break;
+      default: buf_addchar_UNSAFE(buf, c);
+      }
+    }
+    return;
+  }
+  if (!csv_needs_quotes(s, len)) {
+    buf_addlstring_UNSAFE(buf, s, len);
+    return;
+  }
+  buf_addchar_UNSAFE(buf, dquote);
+  for (size_t i = 0; i < len; i++) {
+    c = s[i];
+    if (c == '"') buf_addchar_UNSAFE(buf, dquote);
+    buf_addchar_UNSAFE(buf, c);
+  }
+  buf_addchar_UNSAFE(buf, dquote);
+}
+
+static const char *field_text (CapState *cs, DelimitedField *f, size_t *len) {
+  if (!f->found) {
+    *len = 0;
+    return "";
+  }
+  if (f->constant) {
+    const char *s = ktable_element_name(cs->kt, f->constant, len);
+    if (s) return s;
+    *len = 0;
+    return "";
+  }
+  *len = f->end - f->start;
+  return cs->s + f->start;
+}
+
+static int write_row (CapState *cs, Delimited *d, Buffer *buf) {
+  const char sep = (d->style == DELIMITED_TSV) ? '\t' : ',';
+  const char *s;
+  size_t len, total = 0;
+  int32_t i;
+  for (i = 0; i < d->nfields; i++) {
+    s = field_text(cs, &d->fields[i], &len);
+    /* worst case: separator, quotes, and every char escaped or doubled */
+    total += 3 + 2 * len;
+  }
+  if (!buf_prepsize(buf, total)) return MATCH_ERR_OUTPUT_MEM;
+  for (i = 0; i < d->nfields; i++) {
+    if (i > 0) buf_addchar_UNSAFE(buf, sep);
+    s = field_text(cs, &d->fields[i], &len);
+    add_field_UNSAFE(d->style, s, len, buf);
+  }
+  return MATCH_OK;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Encoder functions                                                             */
+/* ----------------------------------------------------------------------------- */
+
+static int push_field (Buffer *b, int32_t value) {
+  return buf_addlstring(b, (const char *) &value, sizeof(int32_t)) != NULL;
+}
+
+int delimited_Open(CapState *cs, Buffer *buf, int count) {
+  Delimited *d = (Delimited *) cs->state;
+  int idx = capidx(cs->cap);
+  int32_t f = 0;
+  UNUSED(buf); UNUSED(count);
+  if (!acceptable_capture(capkind(cs->cap))) return MATCH_OPEN_ERROR;
+  if (cs->cap == cs->ocap) {
+    /* First capture of a match, so forget the fields of the last
+       one, and anything left open by a match that ended in an error */
+    for (int32_t i = 0; i < d->nfields; i++) d->fields[i].found = 0;
+    buf_reset(d->open);
+  }
+  if ((idx > 0) && (idx < d->nindex) && (f = d->field[idx])) {
+    DelimitedField *field = &d->fields[f - 1];
+    if (field->found) {
+      f = 0;			/* only the first capture is used */
+    } else {
+      field->found = 1;
+      field->constant = 0;
+      field->start = field->end = cs->cap->pos;
+    }
+  }
+  if (!push_field(d->open, f)) return MATCH_ERR_OUTPUT_MEM;
+  return MATCH_OK;
+}
+
+int delimited_Close(CapState *cs, Buffer *buf, int count, const char *start) {
+  Delimited *d = (Delimited *) cs->state;
+  int32_t f;
+  UNUSED(count); UNUSED(start);
+  if (isopencap(cs->cap)) return MATCH_CLOSE_ERROR;
+  if (d->open->n < sizeof(int32_t)) return MATCH_CLOSE_ERROR;
+  d->open->n -= sizeof(int32_t);
+  memcpy(&f, d->open->data + d->open->n, sizeof(int32_t));
+  if (f) {
+    assert(f <= d->nfields);
+    DelimitedField *field = &d->fields[f - 1];
+    field->end = cs->cap->pos;
+    if (capkind(cs->cap) == Ccloseconst) field->constant = capidx(cs->cap);
+  }
+  /* The outermost capture has closed, so the row is complete */
+  if (d->open->n == 0) return write_row(cs, d, buf);
+  return MATCH_OK;
+}
+
+void delimited_encoder (Delimited *d, Encoder *encoder) {
+  encoder->Open = delimited_Open;
+  encoder->Close = delimited_Close;
+  encoder->state = d;
+}
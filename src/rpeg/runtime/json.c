@@ -8,6 +8,7 @@
 /*  AUTHOR: Jamie A. Jennings                                                */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -63,16 +64,16 @@ static const char *char2escape[256] = {
  * this space in advance, we gain 15-20% performance improvement.
  */
 
-static int addlstring_json(Buffer *buf, const char *string, size_t len)
+/* Escape 'string' into buf, without quotes, into space (6*len) that
+ * has been reserved by the caller.
+ */
+static void addlstring_json_UNSAFE(Buffer *buf, const char *string, size_t len)
 {
   assert( sizeof(char2escape) == 256 * sizeof(char *) );
-  static const char dquote = '\"';
   const char *escstr;
   size_t esclen;
   char c;
   size_t i;
-  buf_prepsize(buf, 2 + 6*len);
-  buf_addchar_UNSAFE(buf, dquote);
   for (i = 0; i < len; i++) { 
     c = string[i];
     /* this explicit test on c gives about a 5% speedup on typical data */
@@ -83,60 +84,143 @@ static int addlstring_json(Buffer *buf, const char *string, size_t len)
     }
     else buf_addchar_UNSAFE(buf, c);
   } 
-  buf_addchar(buf, dquote);
+}
+
+static int addlstring_json(Buffer *buf, const char *string, size_t len)
+{
+  static const char dquote = '\"';
+  if (!buf_prepsize(buf, 2 + 6*len)) return MATCH_ERR_OUTPUT_MEM;
+  buf_addchar_UNSAFE(buf, dquote);
+  addlstring_json_UNSAFE(buf, string, len);
+  buf_addchar_UNSAFE(buf, dquote);
   return MATCH_OK;
 }
 
-static void json_encode_pos(size_t pos, Buffer *buf) {
-  char nb[MAXNUMBER2STR];
+/* Write a fixed label, with space already reserved */
+#define addlabel_UNSAFE(buf, label) buf_addlstring_UNSAFE((buf), (label), sizeof(label) - 1)
+
+/* 
+ * Render every ktable element as the start of a capture object,
+ *   {"type":"<element>","s":
+ * with the element escaped, and cache these in the ktable.  Then
+ * json_Open emits the start of a capture with one copy, and json_Close
+ * can copy the (escaped, quoted) string of a constant capture from
+ * the middle of its entry.  Returns 0 if out of memory, in which case
+ * the encoder works without the cache.
+ */
+#define JSON_TYPE_PREFIX "{\"type\":"
+#define JSON_TYPE_SUFFIX START_LABEL
+
+int json_prepare_ktable(Ktable *kt) {
+  int n = ktable_len(kt);
   size_t len;
-  len = r_inttostring(nb, (int) pos);
-  buf_addlstring(buf, nb, len);
+  const char *name;
+  Buffer *b = buf_new(0);
+  int32_t *starts = (int32_t *) malloc((n + 2) * sizeof(int32_t));
+  char *json = NULL;
+  if (!b || !starts) goto done;
+  for (int i = 1; i <= n; i++) {
+    starts[i] = (int32_t) b->n;
+    name = ktable_element_name(kt, i, &len);
+    buf_addstring(b, JSON_TYPE_PREFIX);
+    if (addlstring_json(b, name, len) != MATCH_OK) goto done;
+    buf_addstring(b, JSON_TYPE_SUFFIX);
+  }
+  starts[n + 1] = (int32_t) b->n;
+  if (b->err || !(json = (char *) malloc(b->n ? b->n : 1))) goto done;
+  memcpy(json, b->data, b->n);
+  ktable_set_json(kt, json, starts);
+  starts = NULL;
+ done:
+  free(starts);
+  if (b) {
+    buf_free(b);
+    free(b);
+  }
+  return (kt->json != NULL);
 }
 
-static void json_encode_ktable_element(CapState *cs, Buffer *buf) {
-  size_t len;
-  const char *name = ktable_element_name(cs->kt, capidx(cs->cap), &len);
-  buf_addlstring(buf, name, len);
+/* 
+ * The encoder functions reserve the worst case space for everything
+ * but the matched text once per call, then write with unchecked
+ * stores.  A name or constant comes from the ktable's json cache when
+ * there is one; otherwise it is escaped here, which can take up to 6
+ * chars per byte.
+ */
+
+static size_t cached_json_len(Ktable *kt, int i) {
+  if (kt->json && (i > 0) && (i < kt->next))
+    return (size_t) (kt->jsonstart[i+1] - kt->jsonstart[i]);
+  return 0;
+}
+
+static void json_encode_name_UNSAFE(Ktable *kt, int i, Buffer *buf) {
+  size_t len = 0;
+  const char *name = ktable_element_name(kt, i, &len);
+  addlstring_json_UNSAFE(buf, name, len);
 }
 
 int json_Close(CapState *cs, Buffer *buf, int count, const char *start) {
-  size_t e;
+  Ktable *kt = cs->kt;
+  int i = capidx(cs->cap);
+  size_t cached, namelen = 0, skip = sizeof(JSON_TYPE_PREFIX) - 1;
+  int isconst;
   UNUSED(count);
   if (isopencap(cs->cap)) return MATCH_CLOSE_ERROR;
-  e = cs->cap->s - cs->s + 1;	/* 1-based end position */
-  if (!isopencap(cs->cap-1)) buf_addstring(buf, "]");
-  buf_addstring(buf,  END_LABEL);
-  json_encode_pos(e, buf);
-  if (capkind(cs->cap) == Ccloseconst) {
-      buf_addstring(buf, DATA_LABEL);
-      buf_addstring(buf, "\"");
-      json_encode_ktable_element(cs, buf);
-      buf_addstring(buf, "\"");
-  } else {
+  isconst = (capkind(cs->cap) == Ccloseconst);
+  cached = isconst ? cached_json_len(kt, i) : 0;
+  if (isconst && !cached) ktable_element_name(kt, i, &namelen);
+  if (!buf_prepsize(buf, sizeof("]") + sizeof(END_LABEL) + BUF_MAXDECIMAL
+		    + sizeof(DATA_LABEL) + cached + 6*namelen + sizeof("\"\"}")))
+    return MATCH_ERR_OUTPUT_MEM;
+  if (!isopencap(cs->cap-1)) addlabel_UNSAFE(buf, "]");
+  addlabel_UNSAFE(buf, END_LABEL);
+  buf_adddecimal_UNSAFE(buf, (size_t) cs->cap->pos + 1); /* 1-based end position */
+  addlabel_UNSAFE(buf, DATA_LABEL);
+  if (!isconst) {
     assert(start);
-    buf_addstring(buf, DATA_LABEL);
-    int err = addlstring_json(buf, start, cs->cap->s - start);
+    int err = addlstring_json(buf, start, cappos(cs, cs->cap) - start);
     if (err != MATCH_OK) return err;
+    buf_addstring(buf, "}");
+    return MATCH_OK;
+  }
+  if (cached) {
+    buf_addlstring_UNSAFE(buf, kt->json + kt->jsonstart[i] + skip,
+			  cached - skip - (sizeof(JSON_TYPE_SUFFIX) - 1));
+  } else {
+    addlabel_UNSAFE(buf, "\"");
+    json_encode_name_UNSAFE(kt, i, buf);
+    addlabel_UNSAFE(buf, "\"");
   }
-  buf_addstring(buf, "}");
+  addlabel_UNSAFE(buf, "}");
   return MATCH_OK;
 }
 
 int json_Open(CapState *cs, Buffer *buf, int count) {
-  size_t s;
+  Ktable *kt = cs->kt;
+  int i = capidx(cs->cap);
+  size_t cached, namelen = 0;
   if (!acceptable_capture(capkind(cs->cap))) {
     printf("%s:%d: capkind is %d\n", __FILE__, __LINE__, capkind(cs->cap));
     return MATCH_OPEN_ERROR;
   }
-  if (count) buf_addstring(buf, ",");
-  buf_addstring(buf, TYPE_LABEL);
-  json_encode_ktable_element(cs, buf);
-  buf_addstring(buf, "\"");
-  s = cs->cap->s - cs->s + 1;	/* 1-based start position */
-  buf_addstring(buf, START_LABEL);
-  json_encode_pos(s, buf);
+  cached = cached_json_len(kt, i);
+  if (!cached) ktable_element_name(kt, i, &namelen);
+  if (!buf_prepsize(buf, sizeof(",") + cached + sizeof(TYPE_LABEL) + 6*namelen
+		    + sizeof("\"") + sizeof(START_LABEL) + BUF_MAXDECIMAL
+		    + sizeof(COMPONENT_LABEL)))
+    return MATCH_ERR_OUTPUT_MEM;
+  if (count) addlabel_UNSAFE(buf, ",");
+  if (cached) {
+    buf_addlstring_UNSAFE(buf, kt->json + kt->jsonstart[i], cached);
+  } else {
+    addlabel_UNSAFE(buf, TYPE_LABEL);
+    json_encode_name_UNSAFE(kt, i, buf);
+    addlabel_UNSAFE(buf, "\"");
+    addlabel_UNSAFE(buf, START_LABEL);
+  }
+  buf_adddecimal_UNSAFE(buf, (size_t) cs->cap->pos + 1); /* 1-based start position */
   /* introduce subs array if needed */
-  if (isopencap(cs->cap+1)) buf_addstring(buf, COMPONENT_LABEL);
+  if (isopencap(cs->cap+1)) addlabel_UNSAFE(buf, COMPONENT_LABEL);
   return MATCH_OK;
 }
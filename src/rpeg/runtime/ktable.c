@@ -112,6 +112,10 @@ Ktable *ktable_new(int initial_size, size_t initial_blocksize) {
   kt->block = (char *) malloc(kt->blocksize);
   if (!kt->block) goto fail_kt_elements;
   kt->blocknext = 0;
+  kt->hash = NULL;
+  kt->hashsize = 0;
+  kt->json = NULL;
+  kt->jsonstart = NULL;
   return kt;
 
 fail_kt_elements:
@@ -126,6 +130,8 @@ void ktable_free(Ktable *kt) {
   if (kt) {
     if (kt->block) free(kt->block);
     if (kt->elements) free(kt->elements);
+    free(kt->hash);
+    ktable_set_json(kt, NULL, NULL);
     free(kt);
   }
 }
@@ -223,23 +229,102 @@ static int extend_ktable_block(Ktable *kt, size_t add_at_least) {
   return KTABLE_OK;
 }
 
+/* ----------------------------------------------------------------------------- */
+/* Hash index                                                                    */
+/* ----------------------------------------------------------------------------- */
+
+/*
+ * A ktable can have a hash index (an open addressing table of element
+ * indices, 0 marking an empty slot) that makes ktable_lookup() O(1).
+ * Once created by ktable_index(), it is maintained by ktable_add().
+ */
+
+static uint32_t ktable_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;	/* FNV-1a */
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void hash_insert(Ktable *kt, int i) {
+  Ktable_element *el = &(kt->elements[i]);
+  uint32_t mask = (uint32_t) kt->hashsize - 1;
+  uint32_t slot = ktable_hash(&(kt->block[el->start]), (size_t) el->len) & mask;
+  while (kt->hash[slot] != 0) slot = (slot + 1) & mask;
+  kt->hash[slot] = i;
+}
+
+/* Make the hash big enough for 'n' elements at a load factor of 1/2 */
+static int hash_reserve(Ktable *kt, int n) {
+  int32_t newsize = kt->hashsize ? kt->hashsize : 16;
+  while (newsize < 2 * n) newsize *= 2;
+  if (kt->hash && (newsize == kt->hashsize)) return KTABLE_OK;
+  int32_t *temp = calloc((size_t) newsize, sizeof(int32_t));
+  if (!temp) return KTABLE_ERR_MEM;
+  free(kt->hash);
+  kt->hash = temp;
+  kt->hashsize = newsize;
+  for (int i = 1; i < kt->next; i++) hash_insert(kt, i);
+  return KTABLE_OK;
+}
+
+int ktable_index(Ktable *kt) {
+  if (!kt) return KTABLE_ERR_NULL;
+  return hash_reserve(kt, kt->size);
+}
+
+/* Search for an element matching 'target', returning its index (the
+   first one, if there are duplicates) or 0 if not found.  Without a
+   hash index, this is a linear search.
+*/
+int ktable_lookup(Ktable *kt, const char *target, size_t target_len) {
+  Ktable_element *el;
+  if (!kt) return 0;
+  if (!kt->hash) {
+    for (int i = 1; i < kt->next; i++) {
+      el = &(kt->elements[i]);
+      if ((el->len == (int32_t) target_len) &&
+	  (memcmp(&(kt->block[el->start]), target, target_len) == 0))
+	return i;
+    }
+    return 0;
+  }
+  uint32_t mask = (uint32_t) kt->hashsize - 1;
+  uint32_t slot = ktable_hash(target, target_len) & mask;
+  int i;
+  while ((i = kt->hash[slot]) != 0) {
+    el = &(kt->elements[i]);
+    if ((el->len == (int32_t) target_len) &&
+	(memcmp(&(kt->block[el->start]), target, target_len) == 0))
+      return i;
+    slot = (slot + 1) & mask;
+  }
+  return 0;
+}
+
 /* 
- * Return index of new element (1-based).  If element's string value
+ * Return index of new element (1-based), or a negative error code
+ * (-KTABLE_ERR_MEM or -KTABLE_ERR_NULL).  If element's string value
  * is too long, it will be truncated.  Length limit should be checked
  * before we get here.
  */
 int ktable_add(Ktable *kt, const char *element, size_t len) {
   if (!kt) {
     LOG("null kt\n");
-    return KTABLE_ERR_NULL;
+    return -KTABLE_ERR_NULL;
   }
   assert( element != NULL );
   assert( kt->next > 0 );
 
   if (kt->next == kt->size)
-    if (extend_ktable_elements(kt) < 0) return KTABLE_ERR_MEM;
+    if (extend_ktable_elements(kt) != KTABLE_OK) return -KTABLE_ERR_MEM;
   if (blockspace(kt) < len)
-    if (extend_ktable_block(kt, len) < 0) return KTABLE_ERR_MEM;
+    if (extend_ktable_block(kt, len) != KTABLE_OK) return -KTABLE_ERR_MEM;
+  if (kt->hash && (2 * kt->next > kt->hashsize))
+    if (hash_reserve(kt, kt->next) != KTABLE_OK) return -KTABLE_ERR_MEM;
+  ktable_set_json(kt, NULL, NULL);	/* no longer valid */
   assert( kt->next < kt->size );
   assert( blockspace(kt) >= len );
 
@@ -251,6 +336,7 @@ int ktable_add(Ktable *kt, const char *element, size_t len) {
   el->entrypoint = 0;
   kt->blocknext += len;
   kt->next++;
+  if (kt->hash) hash_insert(kt, kt->next - 1);
   LOGf("new element '%.*s' added in position %d/%d\n", (int) len, element, kt->next - 1, kt->size - 1);
   return kt->next - 1;
 }
@@ -273,91 +359,69 @@ inline int ktable_entry_name_compare(Ktable *kt, const Ktable_element *k1, const
   return ktable_name_cmp(&(kt->block[start1]), len1, &(kt->block[start2]), len2);
 }
 
+/* Compare the elements of a ktable whose indices are at k1 and k2 */
 #if defined(__linux__)
-static inline int ktable_entry_cmp_internal(const void *k1, const void *k2, void *parm)
+static int ktable_index_cmp(const void *k1, const void *k2, void *parm)
 #else
-static inline int ktable_entry_cmp_internal(void *parm, const void *k1, const void *k2)
+static int ktable_index_cmp(void *parm, const void *k1, const void *k2)
 #endif
 {
-  return ktable_entry_name_compare((Ktable *) parm, (const Ktable_element *) k1, (const Ktable_element *) k2);
+  Ktable *kt = (Ktable *) parm;
+  return ktable_entry_name_compare(kt,
+				   &(kt->elements[*(const int *) k1]),
+				   &(kt->elements[*(const int *) k2]));
 }
 
-/* Create a new index to an existing ktable, where the elements are in
-   sorted order.  The new index will need to be freed by the caller.
+/* Create a new ktable from orig, where the new one has no duplicates,
+   its elements are in sorted order, and it has a hash index.  The
+   orig table is not modified or freed.  When 'mapping' is not NULL,
+   it must have room for ktable_len(orig)+1 entries, and mapping[i] is
+   set to the index in the new table of element i of the original
+   (mapping[0] is set to 0).  The mapping is filled in while walking
+   the sorted elements, so no search of the new table is needed.
 */
-Ktable_element *ktable_sorted_index(Ktable *kt) {
-  size_t sz = (ktable_len(kt)+1) * sizeof(Ktable_element);
-  Ktable_element *elements = (Ktable_element *)malloc(sz);
-  memcpy(&(elements[0]), &(kt->elements[0]), sz);
-  qsort_r_common(&elements[1], (size_t) ktable_len(kt), sizeof(Ktable_element),
-		 (void *)kt, &ktable_entry_cmp_internal);
-#if 0
-  /* DEBUGGING */
-  printf("ktable_len is %d\n", ktable_len(kt)); 
-  for(int i=1; i<=ktable_len(kt); i++) { 
-    size_t len = elements[i].len; 
-    const char *name = &(kt->block[elements[i].start]); 
-    printf("%4d. %.*s\n", i, (int) len, name); 
-  } 
-#endif
-  return elements;
-}
-
-/* Create a new ktable from orig, where the new one has no duplicates
-   and whose elements are in sorted order.  The orig table is not
-   modified or freed.
-*/
-Ktable *ktable_compact(Ktable *orig) {
+Ktable *ktable_compact(Ktable *orig, int *mapping) {
+  size_t len = 0, prev_len = 0;
+  const char *name, *prev = NULL;
+  int i, idx = 0;
   assert( orig != NULL );
   int orig_len = ktable_len(orig);
-  Ktable_element *index = ktable_sorted_index(orig);
-  Ktable *new = ktable_new(0, 0); /* use defaults */
-  if (orig_len == 0) goto done;
-  size_t prev_len = index[1].len;
-  const char *prev = &(orig->block[index[1].start]);
-  ktable_add(new, prev, prev_len);
-  //printf("First entry in new ktable: %.*s\n", (int) prev_len, prev);
-  for (int i = 2; i <= orig_len; i++) {
-    /* TODO:
-     - Create a ktable_add_with_entrypoint() to use in this loop below.
-    */
-    size_t len = index[i].len;
-    const char *name = &(orig->block[index[i].start]);
-    if (ktable_name_cmp(prev, prev_len, name, len) != 0) {
-      ktable_add(new, name, len);
-      //printf("Next entry in new ktable: %.*s\n", (int) len, name);
+  Ktable *new = ktable_new(orig_len, orig->blocknext);
+  if (!new) return NULL;
+  /* Original indices, in the sorted order of their elements */
+  int *order = (int *) malloc((orig_len + 1) * sizeof(int));
+  if (!order) goto fail;
+  for (i = 1; i <= orig_len; i++) order[i] = i;
+  qsort_r_common(&order[1], (size_t) orig_len, sizeof(int),
+		 (void *) orig, &ktable_index_cmp);
+  if (mapping) mapping[0] = 0;
+  for (i = 1; i <= orig_len; i++) {
+    name = ktable_element_name(orig, order[i], &len);
+    if (!prev || (ktable_name_cmp(prev, prev_len, name, len) != 0)) {
+      idx = ktable_add(new, name, len);
+      if (idx < 0) goto fail;
       prev = name;
       prev_len = len;
     }
+    if (mapping) mapping[order[i]] = idx;
   }
- done:
-  free(index);
+  if (ktable_index(new) != KTABLE_OK) goto fail;
+  free(order);
   return new;
+ fail:
+  free(order);
+  ktable_free(new);
+  return NULL;
 }
 
-/* Given a COMPACT, SORTED ktable, search for an element matching
-   'target', returning its index or 0 (if not found).
+/* Install (or, with NULLs, remove) the cache built by the json
+   encoder.  The ktable takes ownership of both arrays.
 */
-int ktable_compact_search(Ktable *kt, const char *target, size_t target_len) {
-  // bsearch does not have a bsearch_r variant in C99?  Argh.
-  // int *result = bsearch(target, &kt->elements[0], (size_t) ktable_len(kt), sizeof(int), &ktable_entry_cmp);
-  int len = ktable_len(kt);
-  if (len == 0) return 0;
-  int i = 1;
-  int j = len;
-  int mid, test;
-  const char *ptr;
-  size_t entry_len;
-  while (1) {
-    mid = i + ((j - i) / 2);
-    ptr = &(kt->block[kt->elements[mid].start]);
-    entry_len = kt->elements[mid].len;
-    test = ktable_name_cmp(target, target_len, ptr, entry_len);
-    if (test == 0) return mid;
-    if (i == j) return 0;	/* not found */
-    if (test < 0) j = mid - 1;
-    else { i = mid + 1; }
-  }
+void ktable_set_json(Ktable *kt, char *json, int32_t *jsonstart) {
+  free(kt->json);
+  free(kt->jsonstart);
+  kt->json = json;
+  kt->jsonstart = jsonstart;
 }
 
 void ktable_dump(Ktable *kt) {
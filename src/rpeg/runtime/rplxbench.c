@@ -0,0 +1,299 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  rplxbench.c  Benchmark the matching vm and the C output encoders         */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * Usage: rplxbench [-n passes] [-e encoders] [-s lines] [-w file] pattern.rplx [corpus ...]
+ *
+ *   -n passes    number of times to match every line of each corpus (default 5)
+ *   -e encoders  comma-separated list from byte,json,line,status (default: all)
+ *   -s lines     use a synthetic corpus of this many log lines (default 10000
+ *                when no corpus files are given)
+ *   -w file      write the synthetic corpus to 'file' and exit
+ *
+ * Each corpus file is matched line by line.  No Lua is involved: the
+ * compiled pattern is loaded from an RPLX file and run with
+ * vm_match2() using the C encoders, so the results measure vm.c,
+ * capture.c and json.c only.
+ *
+ * Output is one JSON object per line for each (corpus, encoder) pair,
+ * so that results can be collected and compared across builds.
+ */
+
+#if defined(__GNUC__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* clock_gettime() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "rplx.h"
+#include "buf.h"
+#include "vm.h"
+#include "capture.h"
+#include "json.h"
+#include "file.h"
+
+#define DEFAULT_PASSES 5
+#define DEFAULT_SYNTHETIC_LINES 10000
+
+typedef struct Corpus {
+  const char *name;
+  char *data;			/* all lines, newline separated */
+  size_t size;
+  str *lines;
+  size_t nlines;
+} Corpus;
+
+typedef struct BenchEncoder {
+  const char *name;
+  Encoder encoder;
+  int copy_input;		/* 'line' encoder: status, then copy input */
+} BenchEncoder;
+
+static const BenchEncoder bench_encoders[] = {
+  {"byte",   {byte_Open, byte_Close, NULL}, 0},
+  {"json",   {json_Open, json_Close, NULL}, 0},
+  {"line",   {NULL, NULL, NULL},      1},
+  {"status", {NULL, NULL, NULL},      0},
+  {NULL,     {NULL, NULL, NULL},      0}
+};
+
+static double now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Corpus                                                                        */
+/* ----------------------------------------------------------------------------- */
+
+static int split_lines (Corpus *c) {
+  size_t i, start = 0, n = 0;
+  for (i = 0; i < c->size; i++) if (c->data[i] == '\n') n++;
+  c->lines = (str *) malloc((n + 1) * sizeof(str));
+  if (!c->lines) return 0;
+  c->nlines = 0;
+  for (i = 0; i <= c->size; i++) {
+    if ((i == c->size) || (c->data[i] == '\n')) {
+      if ((i > start) || (i < c->size))
+	c->lines[c->nlines++] = (str) {.ptr = c->data + start, .len = (uint32_t) (i - start)};
+      start = i + 1;
+    }
+  }
+  return 1;
+}
+
+static int read_corpus (const char *filename, Corpus *c) {
+  FILE *in = fopen(filename, "rb");
+  if (!in) return 0;
+  fseek(in, 0, SEEK_END);
+  long size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  c->name = filename;
+  c->data = (char *) malloc(size > 0 ? (size_t) size : 1);
+  c->size = (size > 0) ? fread(c->data, 1, (size_t) size, in) : 0;
+  fclose(in);
+  if (!c->data) return 0;
+  return split_lines(c);
+}
+
+/* Deterministic, so that runs on different builds see the same input */
+static uint32_t xorshift (uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  return *state = x;
+}
+
+static const char *const words[] = {
+  "ERROR", "WARN", "INFO", "DEBUG", "sshd", "kernel", "cron", "nginx",
+  "connection", "closed", "accepted", "timeout", "user", "request", "failed", "ok",
+};
+
+static int synthesize_corpus (size_t nlines, Corpus *c) {
+  uint32_t seed = 2463534242u;
+  Buffer *b = buf_new(nlines * 100);
+  char line[256];
+  if (!b) return 0;
+  for (size_t i = 0; i < nlines; i++) {
+    uint32_t r = xorshift(&seed);
+    int n;
+    switch (r % 3) {
+    case 0:			/* syslog */
+      n = snprintf(line, sizeof(line),
+		   "Oct %2u %02u:%02u:%02u host%u %s[%u]: %s %s from %u.%u.%u.%u port %u\n",
+		   1 + r % 28, r % 24, (r >> 5) % 60, (r >> 11) % 60, (r >> 7) % 100,
+		   words[4 + (r >> 3) % 4], (r >> 9) % 65536,
+		   words[8 + (r >> 13) % 8], words[8 + (r >> 17) % 8],
+		   (r >> 2) % 256, (r >> 10) % 256, (r >> 18) % 256, (r >> 24) % 256,
+		   1024 + (r >> 4) % 60000);
+      break;
+    case 1:			/* web server access log */
+      n = snprintf(line, sizeof(line),
+		   "%u.%u.%u.%u - - [%02u/Oct/2021:%02u:%02u:%02u +0000] \"GET /%s/%u.html HTTP/1.1\" %u %u\n",
+		   (r >> 3) % 256, (r >> 11) % 256, (r >> 19) % 256, (r >> 25) % 256,
+		   1 + r % 28, r % 24, (r >> 5) % 60, (r >> 11) % 60,
+		   words[8 + (r >> 6) % 8], (r >> 8) % 1000,
+		   (r & 8) ? 200 : 404, (r >> 12) % 100000);
+      break;
+    default:			/* application log */
+      n = snprintf(line, sizeof(line),
+		   "2021-10-%02uT%02u:%02u:%02u.%03uZ %s worker-%u %s id=%08x took %ums\n",
+		   1 + r % 28, r % 24, (r >> 5) % 60, (r >> 11) % 60, (r >> 3) % 1000,
+		   words[r % 4], (r >> 7) % 16, words[8 + (r >> 14) % 8],
+		   xorshift(&seed), (r >> 20) % 5000);
+    }
+    if ((n < 0) || !buf_addlstring(b, line, (size_t) n)) { buf_free(b); return 0; }
+  }
+  c->name = "synthetic";
+  c->size = b->n;
+  c->data = (char *) malloc(b->n ? b->n : 1);
+  if (!c->data) { buf_free(b); return 0; }
+  memcpy(c->data, b->data, b->n);
+  buf_free(b);
+  return split_lines(c);
+}
+
+/* ----------------------------------------------------------------------------- */
+/* Benchmark                                                                     */
+/* ----------------------------------------------------------------------------- */
+
+static int selected (const char *list, const char *name) {
+  size_t len = strlen(name);
+  const char *p = list;
+  if (!list) return 1;
+  while ((p = strstr(p, name))) {
+    if (((p == list) || (p[-1] == ',')) && ((p[len] == ',') || (p[len] == '\0'))) return 1;
+    p += len;
+  }
+  return 0;
+}
+
+static int bench (const char *rplx_name, Chunk *chunk, Corpus *c,
+		  const BenchEncoder *be, int passes) {
+  Buffer *output = buf_new(0);
+  struct rosie_matchresult m;
+  uint64_t matches = 0, output_bytes = 0;
+  double t0, elapsed;
+  int err = MATCH_OK;
+  if (!output) return MATCH_OUT_OF_MEM;
+  t0 = now();
+  for (int pass = 0; pass < passes; pass++) {
+    for (size_t i = 0; i < c->nlines; i++) {
+      buf_reset(output);
+      m.ttotal = m.tmatch = 0;
+      err = vm_match2(chunk, &c->lines[i], 1, 0, be->encoder, 0, output, &m, NULL, NULL, NULL);
+      if (err != MATCH_OK) goto done;
+      if (m.data.ptr || (m.data.len == MATCH_WITHOUT_DATA)) {
+	matches++;
+	if (be->copy_input) buf_addlstring(output, c->lines[i].ptr, c->lines[i].len);
+	output_bytes += output->n;
+      }
+    }
+  }
+  elapsed = now() - t0;
+  printf("{\"bench\":\"match\",\"rplx\":\"%s\",\"corpus\":\"%s\",\"encoder\":\"%s\","
+	 "\"passes\":%d,\"lines\":%zu,\"bytes\":%zu,\"matches\":%llu,\"output_bytes\":%llu,"
+	 "\"seconds\":%.6f,\"mb_per_s\":%.3f,\"lines_per_s\":%.1f,\"matches_per_s\":%.1f}\n",
+	 rplx_name, c->name, be->name,
+	 passes, c->nlines, c->size, (unsigned long long) matches, (unsigned long long) output_bytes,
+	 elapsed,
+	 elapsed > 0 ? ((double) c->size * passes / (1024.0 * 1024.0)) / elapsed : 0.0,
+	 elapsed > 0 ? ((double) c->nlines * passes) / elapsed : 0.0,
+	 elapsed > 0 ? (double) matches / elapsed : 0.0);
+ done:
+  buf_free(output);
+  return err;
+}
+
+static int run_corpus (const char *progname, const char *rplx_name, Chunk *chunk,
+		       Corpus *c, const char *encoders, int passes) {
+  int err = MATCH_OK;
+  for (const BenchEncoder *be = bench_encoders; be->name; be++) {
+    if (!selected(encoders, be->name)) continue;
+    err = bench(rplx_name, chunk, c, be, passes);
+    if (err) {
+      fprintf(stderr, "%s: match failed: %s\n", progname, MATCH_MESSAGES[err]);
+      break;
+    }
+  }
+  free(c->lines);
+  free(c->data);
+  return err;
+}
+
+static void usage (const char *progname) {
+  fprintf(stderr, "Usage: %s [-n passes] [-e encoders] [-s lines] [-w file] pattern.rplx [corpus ...]\n", progname);
+  exit(1);
+}
+
+int main (int argc, char **argv) {
+  int opt, err;
+  int passes = DEFAULT_PASSES;
+  long nsynthetic = 0;
+  const char *encoders = NULL, *outfile = NULL;
+  Chunk chunk;
+  Corpus corpus;
+
+  while ((opt = getopt(argc, argv, "n:e:s:w:")) != -1) {
+    switch (opt) {
+    case 'n': passes = atoi(optarg); break;
+    case 'e': encoders = optarg; break;
+    case 's': nsynthetic = atol(optarg); break;
+    case 'w': outfile = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+
+  if (outfile) {
+    FILE *out = fopen(outfile, "wb");
+    if (!out || !synthesize_corpus(nsynthetic > 0 ? nsynthetic : DEFAULT_SYNTHETIC_LINES, &corpus)) {
+      fprintf(stderr, "%s: cannot write synthetic corpus to %s\n", argv[0], outfile);
+      return 1;
+    }
+    fwrite(corpus.data, 1, corpus.size, out);
+    fclose(out);
+    return 0;
+  }
+
+  if ((passes < 1) || (optind >= argc)) usage(argv[0]);
+
+  const char *rplx_name = argv[optind++];
+  err = file_load(rplx_name, &chunk);
+  if (err) {
+    fprintf(stderr, "%s: cannot load %s: %s\n", argv[0], rplx_name,
+	    ((err > 0) && (err < FILE_ERR_SENTINEL)) ? FILE_MESSAGES[err] : "unknown error");
+    return 1;
+  }
+  json_prepare_ktable(chunk.ktable);
+
+  if ((optind == argc) && (nsynthetic == 0)) nsynthetic = DEFAULT_SYNTHETIC_LINES;
+
+  if (nsynthetic > 0) {
+    if (!synthesize_corpus(nsynthetic, &corpus)) {
+      fprintf(stderr, "%s: out of memory for synthetic corpus\n", argv[0]);
+      return 1;
+    }
+    if (run_corpus(argv[0], rplx_name, &chunk, &corpus, encoders, passes)) return 1;
+  }
+
+  for (int i = optind; i < argc; i++) {
+    if (!read_corpus(argv[i], &corpus)) {
+      fprintf(stderr, "%s: cannot read corpus %s\n", argv[0], argv[i]);
+      return 1;
+    }
+    if (run_corpus(argv[0], rplx_name, &chunk, &corpus, encoders, passes)) return 1;
+  }
+
+  rplx_free(&chunk);
+  return 0;
+}
@@ -26,6 +26,11 @@
  * dynamically allocated it is then freed.  If the old space was the
  * initial (statically allocated) space, it is simply no longer used.
  *
+ * A stack may be given an Arena (see arena.h) when it is initialized,
+ * in which case the expanded arrays come from the arena instead of
+ * malloc.  They are never freed individually: the old array is left
+ * for the arena to reclaim when it is reset.
+ *
  * Because the values above are actual pointers, and not integer
  * indices into the array, the user of a stack MUST NOT store the
  * values of base, next, or limit.  These pointers will all CHANGE when
@@ -84,24 +89,26 @@
     /* base points either to initb or a malloc'd stack */		\
     entry_type *base;							\
     const char *name;							\
+    Arena *arena;			/* NULL to use malloc */	\
     int maxtop;								\
     entry_type init[(initial_size)];					\
   } STACK_TYPE(entry_type);
 
 #define STACK_INIT_FUNCTION(entry_type)					\
-  static void entry_type ## _stack_init(STACK_TYPE(entry_type) *stack) { \
+  static void entry_type ## _stack_init(STACK_TYPE(entry_type) *stack, Arena *arena) { \
     /* start off using statically allocated storage */			\
     stack->base = &stack->init[0];					\
     stack->next = stack->base;						\
     stack->limit = stack->base + (sizeof(stack->init) / sizeof(entry_type)); \
     stack->maxtop = 0;							\
     stack->name = #entry_type;						\
+    stack->arena = arena;						\
   }
 
 #define STACK_FREE_FUNCTION(entry_type)					\
   static void entry_type ## _stack_free(STACK_TYPE(entry_type) *stack) { \
     Announce_stack_free(stack);						\
-    if (stack->base != &stack->init[0]) free(stack->base);		\
+    if ((stack->base != &stack->init[0]) && !stack->arena) free(stack->base); \
   }
 
 #define STACK_EXPAND_FUNCTION(entry_type, maximum_size)			\
@@ -113,10 +120,13 @@
     if (n >= (maximum_size)) return 0;					\
     int newsize = 2 * n;						\
     if (newsize > (maximum_size)) newsize = (maximum_size);		\
-    newstack = (entry_type *)malloc(newsize * sizeof(entry_type));	\
+    if (stack->arena)							\
+      newstack = (entry_type *)arena_alloc(stack->arena, newsize * sizeof(entry_type)); \
+    else								\
+      newstack = (entry_type *)malloc(newsize * sizeof(entry_type));	\
     if (!newstack) return 0;						\
     memcpy(newstack, stack->base, n * sizeof(entry_type));		\
-    if (stack->base != stack->init) free(stack->base);			\
+    if ((stack->base != stack->init) && !stack->arena) free(stack->base); \
     stack->base = newstack;						\
     stack->limit = newstack + newsize;					\
     stack->next = newstack + n;						\
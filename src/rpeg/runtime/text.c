@@ -0,0 +1,215 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  text.c  The text output encoders: data, subs and color                   */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2021.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/*
+ * C versions of the Lua output encoders of the same names, so that
+ * rosie_match2() does not have to call into Lua for them.  See text.h.
+ *
+ * The color encoder follows color.lua: a capture whose name has a
+ * color assignment is colored as a whole.  Otherwise, a capture with
+ * sub-matches is not colored itself (its sub-matches are), and one
+ * without is colored by the assignment for its package ("pkg.*") or,
+ * failing that, the global default ("*").  The text between colored
+ * captures, and before and after the match, is written as is.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "config.h"
+#include "buf.h"
+#include "ktable.h"
+#include "capture.h"
+#include "text.h"
+
+void text_state_init (TextState *ts, const char *input_end) {
+  memset(ts, 0, sizeof(TextState));
+  ts->end = input_end;
+  ts->span = -1;
+}
+
+static void text_start_match (CapState *cs, TextState *ts) {
+  /* First capture of a match, so discard anything left by an earlier
+     match that ended in an error */
+  if (cs->cap == cs->ocap) {
+    ts->depth = 0;
+    ts->count = 0;
+    ts->span = -1;
+    ts->last = (const char *) cs->s;
+  }
+}
+
+/* ----------------------------------------------------------------------------- */
+/* data                                                                          */
+/* ----------------------------------------------------------------------------- */
+
+int data_Open(CapState *cs, Buffer *buf, int count) {
+  TextState *ts = (TextState *) cs->state;
+  UNUSED(buf); UNUSED(count);
+  if (!acceptable_capture(capkind(cs->cap))) return MATCH_OPEN_ERROR;
+  text_start_match(cs, ts);
+  ts->depth++;
+  return MATCH_OK;
+}
+
+int data_Close(CapState *cs, Buffer *buf, int count, const char *start) {
+  TextState *ts = (TextState *) cs->state;
+  UNUSED(count);
+  if (isopencap(cs->cap)) return MATCH_CLOSE_ERROR;
+  if (--ts->depth > 0) return MATCH_OK;
+  assert(start);
+  if (!buf_addlstring(buf, start, cappos(cs, cs->cap) - start)) return MATCH_ERR_OUTPUT_MEM;
+  return MATCH_OK;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* subs                                                                          */
+/* ----------------------------------------------------------------------------- */
+
+int subs_Open(CapState *cs, Buffer *buf, int count) {
+  TextState *ts = (TextState *) cs->state;
+  UNUSED(buf); UNUSED(count);
+  if (!acceptable_capture(capkind(cs->cap))) return MATCH_OPEN_ERROR;
+  text_start_match(cs, ts);
+  ts->depth++;
+  return MATCH_OK;
+}
+
+int subs_Close(CapState *cs, Buffer *buf, int count, const char *start) {
+  static const char newline = '\n';
+  TextState *ts = (TextState *) cs->state;
+  size_t len;
+  UNUSED(count);
+  if (isopencap(cs->cap)) return MATCH_CLOSE_ERROR;
+  if (--ts->depth != 1) return MATCH_OK;
+  assert(start);
+  len = cappos(cs, cs->cap) - start;
+  if (!buf_prepsize(buf, 1 + len)) return MATCH_ERR_OUTPUT_MEM;
+  if (ts->count++) buf_addchar_UNSAFE(buf, newline);
+  buf_addlstring_UNSAFE(buf, start, len);
+  return MATCH_OK;
+}
+
+/* ----------------------------------------------------------------------------- */
+/* color                                                                         */
+/* ----------------------------------------------------------------------------- */
+
+/*
+ * The default color assignments of the Lua engine (in init.lua, and
+ * DEFAULT_COLORS in rpeg.h), with each color spec already converted
+ * to its ANSI SGR parameters, e.g. "red;underline" => "31;4".  An
+ * engine configured with other colors uses the Lua color encoder
+ * instead (see rosie_match2()).
+ */
+typedef struct ColorAssignment {
+  const char *name;		/* "pkg.name", "pkg.*", or "*" */
+  const char *code;
+} ColorAssignment;
+
+static const ColorAssignment default_colors[] = {
+  {"*",              "39;1"},	/* default;bold */
+  {"net.*",          "31"},	/* red */
+  {"net.ipv6",       "31;4"},	/* red;underline */
+  {"net.url_common", "31;1"},	/* red;bold */
+  {"net.path",       "31"},	/* red */
+  {"net.MAC",        "4;32"},	/* underline;green */
+  {"num.*",          "4"},	/* underline */
+  {"word.*",         "33"},	/* yellow */
+  {"all.identifier", "36"},	/* cyan */
+  {"id.*",           "1;36"},	/* bold;cyan */
+  {"os.path",        "32"},	/* green */
+  {"date.*",         "34"},	/* blue */
+  {"time.*",         "1;34"},	/* 1;34 */
+  {"ts.*",           "4;34"},	/* underline;blue */
+  {NULL, NULL}
+};
+
+#define ESC_START "\033["
+#define ESC_END "m"
+#define ESC_RESET "\033[0m"
+#define ESC_LEN (sizeof(ESC_START) + sizeof(ESC_END) + sizeof(ESC_RESET)) /* with room to spare */
+
+static const char *color_lookup (const char *name, size_t len) {
+  for (const ColorAssignment *c = default_colors; c->name; c++)
+    if ((strlen(c->name) == len) && (memcmp(c->name, name, len) == 0)) return c->code;
+  return NULL;
+}
+
+/* The assignment for the package of 'name', else the global default */
+static const char *color_default (const char *name, size_t len) {
+  const char *dot = memchr(name, '.', len);
+  const char *code;
+  if (dot) {
+    size_t pkglen = dot - name;
+    for (const ColorAssignment *c = default_colors; c->name; c++)
+      if ((strlen(c->name) == pkglen + 2) && (memcmp(c->name, name, pkglen + 1) == 0)
+	  && (c->name[pkglen + 1] == '*'))
+	return c->code;
+  }
+  code = color_lookup("*", 1);
+  assert(code);
+  return code;
+}
+
+/* Write the input from ts->last up to 'upto', uncolored */
+static void add_gap_UNSAFE (TextState *ts, const char *upto, Buffer *buf) {
+  if (upto > ts->last) {
+    buf_addlstring_UNSAFE(buf, ts->last, (size_t) (upto - ts->last));
+    ts->last = upto;
+  }
+}
+
+int color_Open(CapState *cs, Buffer *buf, int count) {
+  TextState *ts = (TextState *) cs->state;
+  UNUSED(buf); UNUSED(count);
+  if (!acceptable_capture(capkind(cs->cap))) return MATCH_OPEN_ERROR;
+  text_start_match(cs, ts);
+  if (ts->span < 0) {
+    size_t len = 0;
+    const char *name = ktable_element_name(cs->kt, capidx(cs->cap), &len);
+    const char *code = name ? color_lookup(name, len) : NULL;
+    /* no sub-matches when the next capture is not an Open */
+    if (!code && !isopencap(cs->cap + 1)) code = color_default(name ? name : "", len);
+    if (code) {
+      ts->span = ts->depth;
+      ts->code = code;
+    }
+  }
+  ts->depth++;
+  return MATCH_OK;
+}
+
+int color_Close(CapState *cs, Buffer *buf, int count, const char *start) {
+  TextState *ts = (TextState *) cs->state;
+  const char *end = (const char *) cappos(cs, cs->cap);
+  UNUSED(count);
+  if (isopencap(cs->cap)) return MATCH_CLOSE_ERROR;
+  ts->depth--;
+  if (ts->span == ts->depth) {
+    assert(start);
+    ts->span = -1;
+    if (end > start) {
+      size_t codelen = strlen(ts->code);
+      if (!buf_prepsize(buf, (size_t) (end - ts->last) + codelen + ESC_LEN))
+	return MATCH_ERR_OUTPUT_MEM;
+      add_gap_UNSAFE(ts, start, buf);
+      buf_addlstring_UNSAFE(buf, ESC_START, sizeof(ESC_START) - 1);
+      buf_addlstring_UNSAFE(buf, ts->code, codelen);
+      buf_addlstring_UNSAFE(buf, ESC_END, sizeof(ESC_END) - 1);
+      buf_addlstring_UNSAFE(buf, start, (size_t) (end - start));
+      buf_addlstring_UNSAFE(buf, ESC_RESET, sizeof(ESC_RESET) - 1);
+      ts->last = end;
+    }
+  }
+  if (ts->depth == 0) {
+    /* The match is complete, so write the rest of the input */
+    if (!buf_prepsize(buf, (size_t) (ts->end - ts->last))) return MATCH_ERR_OUTPUT_MEM;
+    add_gap_UNSAFE(ts, ts->end, buf);
+  }
+  return MATCH_OK;
+}
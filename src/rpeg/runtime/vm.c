@@ -7,6 +7,10 @@
 /*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
 /*  AUTHOR: Jamie A. Jennings                                                */
 
+#if defined(__GNUC__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* clock_gettime() */
+#endif
+
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
@@ -54,12 +58,14 @@ int sizei (const Instruction *pc) {
   case IPartialCommit: case ITestAny: case IJmp:
   case ICall: case IOpenCall: case IChoice:
   case ICommit: case IBackCommit: case IOpenCapture:
-  case ITestChar: 
+  case ITestChar: case ISetCommit:
     return 2;
   case ISet: case ISpan:
     return CHARSETINSTSIZE;
   case ITestSet:
     return 1 + CHARSETINSTSIZE;
+  case IDispatch:
+    return DISPATCHSIZE(index(pc));
   default:
     return 1;
   }
@@ -75,17 +81,23 @@ STACK_PUSH_FUNCTION(BTEntry, RECORD_VMSTATS)
 STACK_POP_FUNCTION(BTEntry)
 
 /*
- * Double the size of the array of captures
+ * Double the size of the array of captures, using the arena if there
+ * is one (in which case the old array is left for the arena to
+ * reclaim).
  */
-static Capture *doublecap (Capture *cap, Capture *initial_capture, int captop) {
+static Capture *doublecap (Capture *cap, Capture *initial_capture, int captop, Arena *arena) {
   if (captop >= MAX_CAPLISTSIZE) return NULL;
   Announce_doublecap(captop);
   Capture *newc;
   int newcapsize = 2 * captop;
   if (newcapsize > MAX_CAPLISTSIZE) newcapsize = MAX_CAPLISTSIZE;
-  newc = (Capture *)malloc(newcapsize * sizeof(Capture));
+  if (arena)
+    newc = (Capture *)arena_alloc(arena, newcapsize * sizeof(Capture));
+  else
+    newc = (Capture *)malloc(newcapsize * sizeof(Capture));
+  if (!newc) return NULL;
   memcpy(newc, cap, captop * sizeof(Capture));
-  if (cap != initial_capture) free(cap); 
+  if ((cap != initial_capture) && !arena) free(cap); 
   return newc;
 }
 
@@ -101,153 +113,157 @@ static void BTEntry_stack_print (BTEntry_stack *stack, byte_ptr o, Instruction *
 	   top->caplevel);
 }
 
-#define BACKREF_DEBUG 0
+/*
+ * Backreferences
+ *
+ * IBackref matches the text of a prior capture with a given name.
+ * Which one is decided by scope, so that recursive patterns (like
+ * paired tags, where an element contains elements) refer to their own
+ * capture and not to one in a nested instance of themselves:
+ *
+ *   (1) The "outer" capture is the innermost open (unclosed) capture
+ *       that contains something already closed.  Opens at the very
+ *       end of the capture list, i.e. those just entered, are skipped.
+ *   (2) The reference is to the latest capture with the target name
+ *       inside outer, except one that is inside a nested capture
+ *       with the same name as outer.
+ *   (3) Failing that, it is to the latest capture with the target
+ *       name that starts at or before outer.
+ *
+ * The chosen capture must be closed, else the backreference fails.
+ *
+ * Finding these by scanning the capture list backwards makes patterns
+ * with many backreferences quadratic in the number of captures.  So
+ * the vm keeps an index (below) from each ktable index to the latest
+ * open capture with that name, with links from each capture to the
+ * previous one of that name, to its enclosing capture, and between
+ * matching opens and closes.  The index is built on the first
+ * IBackref of a match (most patterns have none, and pay nothing for
+ * it), and then kept up to date as captures are pushed.  When the vm
+ * backtracks, the entries for the discarded captures are undone in
+ * reverse order, which restores the index exactly, and costs no more
+ * than pushing them did.
+ */
 
-#if BACKREF_DEBUG
-static void print_caplist(Capture *capture, int captop, Ktable *kt) {
-  for(int i = 0; i < captop; i++) {
-    if (isopencap(&capture[i])) {
-      printf("(%d %s ", i, ktable_element(kt, capidx(&capture[i])));
-    } else {
-      if (isclosecap(&capture[i])) {
-	printf("%d) ", i);
-      } else {
-	printf("** %d ** ", i);
-      }
-    }
-  }      
-  printf("\n");
+typedef struct BackrefIndex {
+  int32_t *last;		/* per ktable index: latest open capture, or -1 */
+  int32_t nlast;		/* size of last */
+  int32_t *prev;		/* open: previous open with the same name, or -1 */
+  int32_t *link;		/* open: its close, or -1; close: its open, or -1 */
+  int32_t *parent;		/* open: enclosing open, or -1 */
+  int32_t size;			/* capacity of prev, link and parent */
+  int32_t n;			/* captures 0..n-1 are indexed */
+  int32_t cur;			/* innermost open capture, or -1 */
+  Arena *arena;
+} BackrefIndex;
+
+static void *backref_realloc (BackrefIndex *bi, void *ptr, size_t osize, size_t nsize) {
+  if (bi->arena) return arena_realloc(bi->arena, ptr, osize, nsize);
+  return realloc(ptr, nsize);
 }
-#endif
 
-static int find_prior_capture(Capture *capture, int captop, int target_idx,
-			      byte_ptr *s, byte_ptr *e, Ktable *kt) {
-  UNUSED(kt);
-  if (captop == 0) return 0;
+static void backref_free (BackrefIndex *bi) {
+  if (!bi->arena) {
+    free(bi->last);
+    free(bi->prev);
+    free(bi->link);
+    free(bi->parent);
+  }
+}
 
-#if BACKREF_DEBUG
-  print_caplist(capture, captop, kt);
-  printf("Target is [%d]%s, captop = %d\n", target_idx, ktable_element(kt, target_idx), captop);
-#endif
+static int backref_grow (BackrefIndex *bi, int32_t minsize) {
+  int32_t newsize = bi->size ? 2 * bi->size : INIT_CAPLISTSIZE;
+  size_t osize = bi->size * sizeof(int32_t);
+  int32_t *p;
+  while (newsize <= minsize) newsize *= 2;
+  size_t nsize = newsize * sizeof(int32_t);
+  if (!(p = backref_realloc(bi, bi->prev, osize, nsize))) return 0;
+  bi->prev = p;
+  if (!(p = backref_realloc(bi, bi->link, osize, nsize))) return 0;
+  bi->link = p;
+  if (!(p = backref_realloc(bi, bi->parent, osize, nsize))) return 0;
+  bi->parent = p;
+  bi->size = newsize;
+  return 1;
+}
 
-  /* Skip backwards past any immediate OPENs. */
-  int i;
-  for (i = captop - 1; i > 0; i--) {
-    if (!isopencap(&capture[i])) break;
-  }
-  int cap_end = i;
-#if BACKREF_DEBUG
-  printf("declaring this to be the end of the cap list: cap_end = %d\n", cap_end);
-#endif
-  /* Scan backwards for the first OPEN without a CLOSE. */
-  int outer_cap = 0;
-  int outer_capidx = 0;
-  int balance = 0;
-  /* Recall that capture[0] is always an OPEN for the outermost
-     capture, which cannot have a matching CLOSE. */
-  for (; i > 0; i--) {
-#if BACKREF_DEBUG
-    printf("looking for first unclosed open, i = %d\n", i);
-#endif
-    if (isopencap(&capture[i])) {
-      if (balance == 0) break;
-      balance += 1;
-    } else {
-      if (isclosecap(&capture[i])) {
-	balance -= 1;
-      } 
+/* Index capture[i], which must be the next one, i.e. i == bi->n */
+static int backref_add (BackrefIndex *bi, Capture *capture, int32_t i) {
+  assert(i == bi->n);
+  if ((i >= bi->size) && !backref_grow(bi, i)) return 0;
+  if (isopencap(&capture[i])) {
+    int32_t idx = capidx(&capture[i]);
+    if (idx >= bi->nlast) return 0; /* not in the ktable */
+    bi->prev[i] = bi->last[idx];
+    bi->last[idx] = i;
+    bi->parent[i] = bi->cur;
+    bi->link[i] = -1;
+    bi->cur = i;
+  } else {
+    int32_t open = bi->cur;
+    bi->link[i] = open;
+    if (open >= 0) {
+      bi->link[open] = i;
+      bi->cur = bi->parent[open];
     }
   }
-  outer_cap = i;
-  outer_capidx = capidx(&capture[i]);
-#if BACKREF_DEBUG
-  printf("Found FIRST unclosed open at %d: [%d]%s\n", outer_cap, outer_capidx, ktable_element(kt, outer_capidx));
-#endif
-  /* Now search backward from the end for the target, skipping any
-     other instances of outer_capidx */
+  bi->n++;
+  return 1;
+}
 
-  for (i = cap_end; i >= outer_cap; i--) {
-#if BACKREF_DEBUG
-    printf("looking for target at i=%d\n", i);
-#endif
-    if (isopencap(&capture[i]) && capidx(&capture[i]) == target_idx) {
-#if BACKREF_DEBUG
-      printf("found candidate target; now determining if it is inside [%d]%s\n",
-         outer_cap, ktable_element(kt, outer_capidx));
-#endif
-      balance = 0;
-      int j;
-      for (j = i - 1; j >= outer_cap; j--) {
-	if (isopencap(&capture[j])) {
-#if BACKREF_DEBUG
-	  printf("looking at open capture j = %d\n", j);
-#endif
-	  if ((balance >= 0) && capidx(&capture[j]) == outer_capidx) break;
-	  balance += 1;
-	} else {
-	  if (isclosecap(&capture[j])) {
-	    balance -= 1;
-	  }
-	}
-      }
-      if (j == outer_cap) {
-#if BACKREF_DEBUG
-	printf("No other instances of outer_cap to skip over\n");
-#endif
-	break; /* Nothing to skip over */
+/* Forget the captures from captop on, which the vm has discarded */
+static void backref_undo (BackrefIndex *bi, Capture *capture, int32_t captop) {
+  int32_t i, open;
+  for (i = bi->n - 1; i >= captop; i--) {
+    if (isopencap(&capture[i])) {
+      bi->last[capidx(&capture[i])] = bi->prev[i];
+      bi->cur = bi->parent[i];
+    } else {
+      open = bi->link[i];
+      if (open >= 0) {
+	bi->link[open] = -1;
+	bi->cur = open;
       }
     }
   }
-  if (i == outer_cap - 1) {
-#if BACKREF_DEBUG
-    printf("did not find target; continuing the backwards search\n");
-#endif
-    for (i = outer_cap; i >= 0; i--) {
-      if (isopencap(&capture[i]) && capidx(&capture[i]) == target_idx) break;
-    }
-    if (i < 0) return 0;
-    if (! (isopencap(&capture[i]) && capidx(&capture[i]) == target_idx)) {
-      return 0;
-    }
-  }
+  bi->n = captop;
+}
 
-  /* This the open capture we are looking for */
-/*   assert (isopencap(&capture[i]) && capidx(&capture[i]) == outer_capidx); */
-#if BACKREF_DEBUG
-  printf("FOUND open capture at i = %d, [%d]%s\n", i,
-    	 capidx(&capture[i]), ktable_element(kt, capidx(&capture[i])));
-#endif  
-  *s = capture[i].s;                      /* start position */
-  /* Now look for the matching close */
-  i++;
-  int j = 0;
-  while (i <= captop) {
-#if BACKREF_DEBUG
-    printf("looking at i = %d (captop = %d)\n", i, captop);
-#endif
-    if (isclosecap(&capture[i])) {
-      if (j == 0) {
-	/* This must be the matching close capture */
-#if BACKREF_DEBUG
-	printf("i = %d: found close capture\n", i);
-#endif
-	*e = capture[i].s;               /* end position */
-	return 1;	                 /* success */
-      } else {
-	j--;
-	assert( j >= 0 );
-      }
-    } else {
-      assert( isopencap(&capture[i]) );
-      j++;
-    }
-    i++;
-  } /* while looking for matching close*/
-  /* Did not find the matching close */
-#if BACKREF_DEBUG
-  printf("did not find matching close!\n");
-#endif
-  return 0;
+static int backref_start (BackrefIndex *bi, Capture *capture, int32_t captop, Ktable *kt) {
+  int32_t i;
+  bi->nlast = ktable_len(kt) + 1;
+  bi->last = (int32_t *) backref_realloc(bi, NULL, 0, bi->nlast * sizeof(int32_t));
+  if (!bi->last) return 0;
+  for (i = 0; i < bi->nlast; i++) bi->last[i] = -1;
+  bi->n = 0;
+  bi->cur = -1;
+  for (i = 0; i < captop; i++)
+    if (!backref_add(bi, capture, i)) return 0;
+  return 1;
+}
+
+/* The backreference to 'target' from the end of the capture list, as
+   a capture index, or -1 if there is none (see the rules above) */
+static int32_t backref_lookup (BackrefIndex *bi, Capture *capture, int32_t captop, int target) {
+  int32_t end, outer, outer_idx, t, a;
+  if ((captop == 0) || (target >= bi->nlast)) return -1;
+  /* (1) */
+  for (end = captop - 1; end > 0; end--)
+    if (!isopencap(&capture[end])) break;
+  for (outer = bi->cur; (outer > 0) && (outer > end); outer = bi->parent[outer]) ;
+  if (outer < 0) outer = 0;
+  outer_idx = capidx(&capture[outer]);
+  /* (2) */
+  for (t = bi->last[target]; t > outer; t = bi->prev[t]) {
+    if (t > end) continue;
+    for (a = bi->parent[t]; a > outer; a = bi->parent[a])
+      if (capidx(&capture[a]) == outer_idx) break;
+    if (a == outer) break;
+  }
+  /* (3) when t <= outer */
+  if (t < 0) return -1;
+  if (bi->link[t] < 0) return -1; /* not closed */
+  return t;
 }
 
 #if 0
@@ -265,34 +281,56 @@ static int find_prior_capture(Capture *capture, int captop, int target_idx,
 #define PRINT_VM_STATE UNUSED(BTEntry_stack_print)
 #endif
 
-#if (RECORD_VMSTATS)
+/* Statistics and profiling are kept only when the vm is given a Stats
+   or Profile, which is never the case in its uncounted copy (below) */
 #define INCR_STAT(action, var) if ((action)) (var)++
 #define UPDATE_STAT(action, var, value) if ((action)) (var) = (value)
-#define UPDATE_CAPSTATS(inst) capstats[opcode(inst)==IOpenCapture ? addr(inst) : Cclose]++
+#define MAX_STAT(action, var, value) if ((action) && ((value) > (var))) (var) = (value)
+#define PROFILE_COUNT(counts) if ((profile) && (pc != &giveup)) (profile)->counts[pc - op]++
+
+#if (RECORD_VMSTATS)
+#define UPDATE_CAPSTATS(inst) if ((stats)) capstats[opcode(inst)==IOpenCapture ? addr(inst) : Cclose]++
 #else
-#define INCR_STAT(action, var) UNUSED((stats))
-#define UPDATE_STAT(action, var, value) UNUSED((stats))
 #define UPDATE_CAPSTATS(inst) UNUSED(capstats)
 #endif
 
+#define BACKTRACK_STAT MAX_STAT(stats, stats->backtrack, (unsigned int) STACK_SIZE(stack))
+
 #define PUSH_CAPLIST						\
   if (++captop >= capsize) {					\
-    capture = doublecap(capture, initial_capture, captop);	\
+    capture = doublecap(capture, initial_capture, captop, arena); \
     if (!capture) {						\
       return MATCH_ERR_CAP;					\
     }								\
     *capturebase = capture;					\
     capsize = 2 * captop;					\
-  }
+  }								\
+  if (bref->last && !backref_add(bref, capture, captop - 1))	\
+    return MATCH_ERR_CAP;
+
+#define BACKTRACK_CAPLIST					\
+  if (bref->n > captop) backref_undo(bref, capture, captop)
 
 #define JUMPBY(delta) pc = pc + (delta)
 
-static int vm (byte_ptr *r,
-	       byte_ptr o, byte_ptr s, byte_ptr e,
-	       Instruction *op, Capture **capturebase,
-	       Stats *stats, int capstats[], Ktable *kt) {
+/* 
+ * The body of the vm is inlined twice, once with counting on and once
+ * with it off.  In the copy where 'counting' is the constant 0, stats
+ * and profile are known to be NULL, so the compiler drops the
+ * per-instruction statistics and profiling branches entirely.
+ */
+static inline __attribute__((always_inline))
+int vm_run (byte_ptr *r,
+	    byte_ptr o, byte_ptr s, byte_ptr e,
+	    Instruction *op, Capture **capturebase,
+	    Stats *stats, int capstats[], Profile *profile, Ktable *kt,
+	    Arena *arena, BackrefIndex *bref, const int counting) {
+  if (!counting) {
+    stats = NULL;
+    profile = NULL;
+  }
   BTEntry_stack stack;
-  BTEntry_stack_init(&stack);
+  BTEntry_stack_init(&stack, arena);
   Capture *initial_capture = *capturebase;
   Capture *capture = *capturebase;
   int capsize = INIT_CAPLISTSIZE;
@@ -303,9 +341,11 @@ static int vm (byte_ptr *r,
 
   const Instruction *pc = op;  /* current instruction */
   BTEntry_stack_push(&stack, (BTEntry) {s, &giveup, 0});
+  BACKTRACK_STAT;
   for (;;) {
     PRINT_VM_STATE;
     INCR_STAT(stats, stats->insts); 
+    PROFILE_COUNT(execs);
     switch (opcode(pc)) {
       /* Mark S. reports that 98% of executed instructions are
        * ITestSet, IAny, IPartialCommit (in that order).  So we put
@@ -320,6 +360,14 @@ static int vm (byte_ptr *r,
       else JUMPBY(addr(pc));
       continue;
     }
+    case IDispatch: {
+      assert(sizei(pc)==DISPATCHSIZE(index(pc)));
+      assert(addr(pc));
+      int k = (s < e) ? dispatchmap(pc)[(byte)*s] : 0;
+      if (k) JUMPBY(dispatchaddr(pc, k));
+      else JUMPBY(addr(pc));
+      continue;
+    }
     case IAny: {
       assert(sizei(pc)==1);
       if (s < e) { JUMPBY(1); s++; }
@@ -343,8 +391,8 @@ static int vm (byte_ptr *r,
        * then walk_captures will see it and not go any further.
        */
       setcapkind(&capture[captop], Cclose);
-      capture[captop].s = NULL;
-      UPDATE_STAT(stats, stats->backtrack, stack.maxtop);
+      setcapidx(&capture[captop], 0);
+      capture[captop].pos = (uint32_t) (s - o);
       BTEntry_stack_free(&stack);
       *r = s;
       return MATCH_OK;
@@ -352,7 +400,6 @@ static int vm (byte_ptr *r,
     case IGiveup: {
       assert(sizei(pc)==1);
       assert(stack.next == stack.base);
-      UPDATE_STAT(stats, stats->backtrack, stack.maxtop);
       BTEntry_stack_free(&stack);
       *r = NULL;
       return MATCH_OK;
@@ -420,6 +467,7 @@ static int vm (byte_ptr *r,
       assert(addr(pc));
       if (!BTEntry_stack_push(&stack, (BTEntry) {s, pc + addr(pc), captop}))
 	return MATCH_ERR_STACK;
+      BACKTRACK_STAT;
       JUMPBY(2);
       continue;
     }
@@ -428,6 +476,7 @@ static int vm (byte_ptr *r,
       assert(addr(pc));
       if (!BTEntry_stack_push(&stack, (BTEntry) {NULL, pc + 2, 0}))
 	return MATCH_ERR_STACK;
+      BACKTRACK_STAT;
       JUMPBY(addr(pc));
       continue;
     }
@@ -445,10 +494,34 @@ static int vm (byte_ptr *r,
       assert(stack.next > stack.base && TOP(stack)->s != NULL);
       s = TOP(stack)->s;
       captop = TOP(stack)->caplevel;
+      BACKTRACK_CAPLIST;
+      BTEntry_stack_pop(&stack);
+      JUMPBY(addr(pc));
+      continue;
+    }
+    case ISetCommit: {
+      /* A member of a pattern set matched: go back to where the set
+	 started, but keep the member's captures, and mark the Close of
+	 the member's own capture with its index */
+      assert(sizei(pc)==2);
+      assert(addr(pc));
+      assert(stack.next > stack.base && TOP(stack)->s != NULL);
+      assert((captop > 0) && isclosecap(&capture[captop - 1]));
+      setcapkind(&capture[captop - 1], Cclosemember);
+      setcapidx(&capture[captop - 1], index(pc));
+      s = TOP(stack)->s;
       BTEntry_stack_pop(&stack);
       JUMPBY(addr(pc));
       continue;
     }
+    case ISetEnd: {
+      /* When no member matched, the last capture is still the Open
+	 of the set itself */
+      assert(sizei(pc)==1);
+      if ((captop > 0) && isopencap(&capture[captop - 1])) goto fail;
+      JUMPBY(1);
+      continue;
+    }
     case IFailTwice:
       assert(stack.next > stack.base);
       BTEntry_stack_pop(&stack);
@@ -456,24 +529,28 @@ static int vm (byte_ptr *r,
     case IFail:
       assert(sizei(pc)==1);
     fail: { /* pattern failed: try to backtrack */
+	PROFILE_COUNT(fails);
         do {  /* remove pending calls */
           assert(stack.next > stack.base);
           s = TOP(stack)->s;
 	  BTEntry_stack_pop(&stack);
         } while (s == NULL);
         captop = PEEK(stack, 1)->caplevel;
+        BACKTRACK_CAPLIST;
         pc = PEEK(stack, 1)->p;
         continue;
       }
     case IBackref: {
       assert(sizei(pc)==1);
       /* Now find the prior capture that we want to reference */
-      byte_ptr startptr = NULL;
-      byte_ptr endptr = NULL;
-      int target = index(pc);
-      int have_prior = find_prior_capture(capture, captop, target, &startptr, &endptr, kt);
-      if (have_prior) {
-	assert( startptr && endptr );
+      if (!bref->last && !backref_start(bref, capture, captop, kt)) {
+	BTEntry_stack_free(&stack);
+	return MATCH_ERR_CAP;
+      }
+      int32_t prior = backref_lookup(bref, capture, captop, index(pc));
+      if (prior >= 0) {
+	byte_ptr startptr = o + capture[prior].pos;
+	byte_ptr endptr = o + capture[bref->link[prior]].pos;
 	assert( endptr >= startptr );
 	size_t prior_len = endptr - startptr;
 	/* And check to see if the input at the current position */
@@ -491,7 +568,7 @@ static int vm (byte_ptr *r,
       assert(sizei(pc)==1);
       assert(index(pc));
       assert(captop > 0);
-      capture[captop].s = s;
+      capture[captop].pos = (uint32_t) (s - o);
       setcapidx(&capture[captop], index(pc)); /* second ktable index */
       setcapkind(&capture[captop], Ccloseconst);
       goto pushcapture;
@@ -504,23 +581,23 @@ static int vm (byte_ptr *r,
 	 because we have removed full captures.  This makes the
 	 capture list 10-15% longer, but saves almost 2% in time.
       */
-      capture[captop].s = s;
+      capture[captop].pos = (uint32_t) (s - o);
       setcapkind(&capture[captop], Cclose);
       pushcapture:		/* push, jump by 1 */
       UPDATE_CAPSTATS(pc);
       PUSH_CAPLIST;
-      UPDATE_STAT(stats, stats->caplist, captop);
+      MAX_STAT(stats, stats->caplist, (unsigned int) captop);
       JUMPBY(1);
       continue;
     }
     case IOpenCapture: {
       assert(sizei(pc)==2);
-      capture[captop].s = s;
+      capture[captop].pos = (uint32_t) (s - o);
       setcapidx(&capture[captop], index(pc)); /* ktable index */
       setcapkind(&capture[captop], addr(pc)); /* kind of capture */
       UPDATE_CAPSTATS(pc);
       PUSH_CAPLIST;
-      UPDATE_STAT(stats, stats->caplist, captop);
+      MAX_STAT(stats, stats->caplist, (unsigned int) captop);
       JUMPBY(2);
       continue;
     }
@@ -532,9 +609,8 @@ static int vm (byte_ptr *r,
 	 is something we should be able to eliminate!)
       */
       setcapkind(&capture[captop], Cfinal);
-      capture[captop].s = s;
+      capture[captop].pos = (uint32_t) (s - o);
       *r = s;
-      UPDATE_STAT(stats, stats->backtrack, stack.maxtop);
       BTEntry_stack_free(&stack);
       return MATCH_OK;
     }
@@ -550,6 +626,18 @@ static int vm (byte_ptr *r,
   }
 }
 
+static int vm (byte_ptr *r,
+	       byte_ptr o, byte_ptr s, byte_ptr e,
+	       Instruction *op, Capture **capturebase,
+	       Stats *stats, int capstats[], Profile *profile, Ktable *kt,
+	       Arena *arena, BackrefIndex *bref) {
+  if (stats || profile)
+    return vm_run(r, o, s, e, op, capturebase, stats, capstats, profile, kt,
+		  arena, bref, 1);
+  return vm_run(r, o, s, e, op, capturebase, NULL, capstats, NULL, kt,
+		arena, bref, 0);
+}
+
 /* -------------------------------------------------------------------------- */
 
 typedef struct Cap {
@@ -587,18 +675,26 @@ STACK_POP_FUNCTION(Cap)
    7 in the patterns we are seeing.
  */
 
-#define capstart(cs) (capkind((cs)->cap)==Crosieconst ? NULL : (cs)->cap->s)
+#define capstart(cs) (capkind((cs)->cap)==Crosieconst ? NULL : cappos((cs), (cs)->cap))
 
-static int caploop (CapState *cs, Encoder encode, Buffer *buf, unsigned int *max_capdepth) {
+/* The depth is tracked here, not by the stack, so that it is
+   available whenever statistics are requested at runtime */
+#define CAPDEPTH_STAT							\
+  if ((max_capdepth) && ((unsigned int) STACK_SIZE(stack) > *(max_capdepth))) \
+    *(max_capdepth) = (unsigned int) STACK_SIZE(stack)
+
+static int caploop (CapState *cs, Encoder encode, Buffer *buf, unsigned int *max_capdepth,
+		    Arena *arena) {
   int err;
   byte_ptr start;
   int count = 0;
   Cap_stack stack;
-  Cap_stack_init(&stack);
+  Cap_stack_init(&stack, arena);
   if (!Cap_stack_push(&stack, (Cap) {capstart(cs), 0})) {
     Cap_stack_free(&stack);
     return MATCH_STACK_ERROR;
   }
+  CAPDEPTH_STAT;
   err = encode.Open(cs, buf, 0);
   if (err) { Cap_stack_free(&stack); return err; }
   cs->cap++;
@@ -609,6 +705,7 @@ static int caploop (CapState *cs, Encoder encode, Buffer *buf, unsigned int *max
 	Cap_stack_free(&stack);
 	return MATCH_STACK_ERROR;
       }
+      CAPDEPTH_STAT;
       err = encode.Open(cs, buf, count);
       if (err) { Cap_stack_free(&stack); return err; }
       count = 0;
@@ -633,7 +730,7 @@ static int caploop (CapState *cs, Encoder encode, Buffer *buf, unsigned int *max
      */
     if (isfinalcap(cs->cap)) {
       Capture synthetic;
-      synthetic.s = cs->cap->s;
+      synthetic.pos = cs->cap->pos;
       setcapidx(&synthetic, 0);
       setcapkind(&synthetic, Cclose);
       //      synthetic.siz = 1;	/* 1 means closed */
@@ -646,7 +743,6 @@ static int caploop (CapState *cs, Encoder encode, Buffer *buf, unsigned int *max
 	count = TOP(stack)->count;
 	start = TOP(stack)->start;
       }
-      *max_capdepth = stack.maxtop;
       Cap_stack_free(&stack);
       return MATCH_HALT;
     }
@@ -656,7 +752,6 @@ static int caploop (CapState *cs, Encoder encode, Buffer *buf, unsigned int *max
     cs->cap++;
     count++;
   }
-  *max_capdepth = stack.maxtop;
   Cap_stack_free(&stack);
   return MATCH_OK;
 }
@@ -670,7 +765,7 @@ static int caploop (CapState *cs, Encoder encode, Buffer *buf, unsigned int *max
 static int walk_captures (Capture *capture, byte_ptr s,
 			  Ktable *kt, Encoder encode,
 			  /* outputs: */
-			  Buffer *buf, int *abend, Stats *stats) {
+			  Buffer *buf, int *abend, Stats *stats, Arena *arena) {
   int err;
   *abend = 0;		       /* 0 => normal completion; 1 => halt/throw */
   if (isfinalcap(capture)) {
@@ -682,6 +777,7 @@ static int walk_captures (Capture *capture, byte_ptr s,
     cs.ocap = cs.cap = capture;
     cs.s = s;
     cs.kt = kt;
+    cs.state = encode.state;
     /* Rosie ensures that the pattern has an outer capture.  So
      * if we see a full capture, it is because the outermost
      * open/close was converted to a full capture.  And it must be the
@@ -689,7 +785,7 @@ static int walk_captures (Capture *capture, byte_ptr s,
      * Cclose put there by the IEnd instruction.
      */
     unsigned int max_capdepth = 0;
-    err = caploop(&cs, encode, buf, &max_capdepth);
+    err = caploop(&cs, encode, buf, (stats ? &max_capdepth : NULL), arena);
     UPDATE_STAT(stats, stats->capdepth, max_capdepth);
     if (err == MATCH_HALT) {
       *abend = 1;
@@ -702,6 +798,31 @@ static int walk_captures (Capture *capture, byte_ptr s,
   return MATCH_OK;
 }
 
+/* 
+ * Time in nanoseconds from a monotonic clock.  Unlike clock(), this
+ * is not process-wide CPU time (which counts every thread) and is
+ * cheap to read.
+ */
+static inline int64_t monotonic_ns (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void accumulate_matchstats (struct rosie_matchstats *ms, Stats *stats,
+				   int matched, size_t encoder_bytes,
+				   int64_t total_ns, int64_t match_ns) {
+  if (matched) ms->matches++;
+  else ms->failures++;
+  ms->insts += stats->insts;
+  ms->encoder_bytes += encoder_bytes;
+  ms->total_ns += total_ns;
+  ms->match_ns += match_ns;
+  if (stats->backtrack > ms->max_backtrack) ms->max_backtrack = stats->backtrack;
+  if (stats->caplist > ms->max_caplist) ms->max_caplist = stats->caplist;
+  if (stats->capdepth > ms->max_capdepth) ms->max_capdepth = stats->capdepth;
+}
+
 /* 
  * Wednesday, August 18, 2021: vm_match2() replaces the old vm_match(). 
  *
@@ -723,6 +844,21 @@ static int walk_captures (Capture *capture, byte_ptr s,
  * On successful exit from vm_match2, these fields in 'match' will be
  * set: data, leftover, abend.  If vm_match2 has collected timing
  * data, then the ttotal and tmatch fields will also be updated.
+ * Times are in microseconds.
+ *
+ * matchstats is optional.  When it is not NULL, the vm counts
+ * instructions, stack and capture list usage for this call, and adds
+ * the results (with timings in nanoseconds) to *matchstats.
+ *
+ * profile is optional.  When it is not NULL (and was created for a
+ * code vector of the same size as chunk->code), the vm adds its
+ * per-instruction execution and failure counts to it.
+ *
+ * arena is optional.  When it is not NULL, the capture list and the
+ * vm's stacks are allocated from it (instead of with malloc) if they
+ * outgrow their initial storage.  Nothing is left in the arena that
+ * is needed after vm_match2 returns, so the caller may reset it
+ * between calls, e.g. after each batch of inputs.
 
  * RETURN VALUES
  *
@@ -745,6 +881,12 @@ static int walk_captures (Capture *capture, byte_ptr s,
  * manipulate the Buffer.  The consumer of a matchresult should only
  * be able to look at the buffer contents.  They can copy it if they
  * need to access the data beyond the next call to vm_match2.
+ *
+ * The encoder output is appended to 'output'.  When 'output' has a
+ * sink with a flush function (see buf.h), some of it may have been
+ * flushed already, and match->data holds only the part that remains
+ * in the buffer.  If the output cannot be stored or flushed,
+ * vm_match2 returns MATCH_ERR_OUTPUT_MEM.
 
  */
 int vm_match2 (/* inputs: */
@@ -754,14 +896,23 @@ int vm_match2 (/* inputs: */
 	       uint8_t collect_times,
 	       Buffer *output,
 	       /* output: */
-	       struct rosie_matchresult *match_result) {
+	       struct rosie_matchresult *match_result,
+	       /* optional (NULL to disable) accumulators: */
+	       struct rosie_matchstats *matchstats,
+	       Profile *profile,
+	       /* optional (NULL to use malloc) transient storage: */
+	       Arena *arena) {
   Capture initial_capture[INIT_CAPLISTSIZE];
   Capture *capture = initial_capture;
+  BackrefIndex bref = {0};
   int err, abend;
-  int t0 = 0, tmatch = 0;
+  int64_t t0 = 0, tmatch = 0, tend = 0;
   byte_ptr r;
   Stats stats;
+  Stats *vmstats = matchstats ? &stats : NULL;
+  uint8_t timed = collect_times || matchstats;
   int capstats[256] = {0};
+  size_t outstart = output->n, flushed = output->flushed, outbytes = 0;
   
   if (input->len > UINT_MAX) return MATCH_ERR_INPUT_LEN;
 
@@ -777,15 +928,21 @@ int vm_match2 (/* inputs: */
   if (startpos > input->len) return MATCH_ERR_STARTPOS;
   if (endpos < startpos) return MATCH_ERR_ENDPOS;
 
-  stats = (Stats) {match_result->ttotal, match_result->tmatch, 0, 0, 0, 0};
-  if (collect_times) t0 = clock();
+  if (profile && (profile->codesize != (int) chunk->codesize)) profile = NULL;
+  bref.arena = arena;
+
+  stats = (Stats) {0, 0, 0, 0, 0, 0};
+  if (timed) t0 = monotonic_ns();
 
   err = vm(&r, input->ptr, input->ptr + startpos, input->ptr + endpos,
 	   chunk->code,
 	   &capture,
-	   collect_times ? &stats : NULL,
+	   vmstats,
 	   capstats,
-	   chunk->ktable);
+	   profile,
+	   chunk->ktable,
+	   arena,
+	   &bref);
 
 #if (VMDEBUG) 
   fprintf(stderr, "*** vm() completed with err code %d, r as position = %ld\n",
@@ -801,33 +958,41 @@ int vm_match2 (/* inputs: */
 
   if (err != MATCH_OK) goto done;
 
-  if (collect_times) {
-    tmatch = clock();
-    match_result->tmatch += tmatch - t0;
-  }
+  if (timed) tmatch = monotonic_ns();
+  /* The matchresult fields are in microseconds; matchstats gets the
+     raw nanosecond durations, so short matches are not rounded to 0. */
+  if (collect_times) match_result->tmatch += (tmatch - t0) / 1000;
 
   if (r == NULL) {
     match_result->data.ptr = NULL;	  /* no match */
     match_result->data.len = 0;	  /* no error */
     match_result->leftover = endpos - startpos;
     match_result->abend = 0;
-    if (collect_times) match_result->ttotal += tmatch - t0;
+    if (collect_times) match_result->ttotal += (tmatch - t0) / 1000;
+    if (matchstats)
+      accumulate_matchstats(matchstats, &stats, 0, 0, tmatch - t0, tmatch - t0);
     goto done;
   }
 
   if (encode.Open) {
     /* If need to do capture processing */
     err = walk_captures(capture, input->ptr, chunk->ktable, encode,
-			output, &abend, &stats);
+			output, &abend, vmstats, arena);
     /* If capture stack was realloc'd then we must free it */
     if (err != MATCH_OK) goto done;
+    if (output->err) {
+      err = MATCH_ERR_OUTPUT_MEM;
+      goto done;
+    }
     /* 
        Copy pointer/len of the output buffer into the match struct, so
        that the match struct can be returned to a librosie caller while
        we keep the Buffer object private.
     */
-    match_result->data.ptr = output->data;
-    match_result->data.len = output->n;
+    outbytes = (output->flushed - flushed) + (output->n - outstart);
+    if (output->flushed != flushed) outstart = 0;
+    match_result->data.ptr = output->data + outstart;
+    match_result->data.len = output->n - outstart;
   } else {
     /* Must be 'status' output encoder, which does no capture processing */
     match_result->data.ptr = NULL;
@@ -835,12 +1000,17 @@ int vm_match2 (/* inputs: */
     abend = 0;			/* TODO: How to set this w/o walking captures? */
   }
 
-  if (collect_times) match_result->ttotal += clock() - t0;
+  if (timed) tend = monotonic_ns();
+  if (collect_times) match_result->ttotal += (tend - t0) / 1000;
+  if (matchstats)
+    accumulate_matchstats(matchstats, &stats, 1, outbytes,
+			  tend - t0, tmatch - t0);
   match_result->leftover = endpos - (r - input->ptr);
   match_result->abend = abend;
 
  done:
-  if (capture != initial_capture) free(capture);
+  if ((capture != initial_capture) && !arena) free(capture);
+  backref_free(&bref);
   return err;
 }
 